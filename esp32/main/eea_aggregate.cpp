@@ -0,0 +1,493 @@
+/**
+ * Native windowed aggregation. See eea_aggregate.h.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_aggregate.h"
+#include "eea_bindings.h"
+#include "eea_memory.h"
+
+static const char *TAG = "EEA_AGGREGATE";
+
+// Sequence numbers are rebased before they can wrap.
+#define EEA_WINDOW_REBASE_THRESHOLD 0x80000000u
+
+/**
+ * Sums values and their squares. Four independent accumulators let the
+ * compiler keep the FPU pipeline full (or vectorise the loop on targets
+ * with SIMD). Partial sums are folded into the double totals every block,
+ * which bounds the single-precision rounding error.
+ */
+static void eea_window_sums(const float *values, uint32_t count, double *sum, double *sum_squares)
+{
+  double total = 0;
+  double total_squares = 0;
+
+  uint32_t i = 0;
+  while(i < count) {
+    uint32_t block_end = std::min(count, i + 64);
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    float q0 = 0, q1 = 0, q2 = 0, q3 = 0;
+
+    for(; i + 4 <= block_end; i += 4) {
+      float v0 = values[i], v1 = values[i + 1], v2 = values[i + 2], v3 = values[i + 3];
+      s0 += v0; s1 += v1; s2 += v2; s3 += v3;
+      q0 += v0 * v0; q1 += v1 * v1; q2 += v2 * v2; q3 += v3 * v3;
+    }
+    for(; i < block_end; i++) {
+      s0 += values[i];
+      q0 += values[i] * values[i];
+    }
+
+    total += (double)((s0 + s1) + (s2 + s3));
+    total_squares += (double)((q0 + q1) + (q2 + q3));
+  }
+
+  *sum = total;
+  *sum_squares = total_squares;
+}
+
+static uint32_t eea_window_now()
+{
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+EEA_Window *EEA_Aggregate::get(int32_t handle)
+{
+  if(handle < 0 || handle >= EEA_AGGREGATE_MAX_WINDOWS) {
+    return NULL;
+  }
+  return this->windows[handle];
+}
+
+int32_t EEA_Aggregate::create(const char *name, uint32_t name_length, EEA_Window_Type type, uint32_t span)
+{
+  if(name_length >= EEA_AGGREGATE_NAME_SIZE || span == 0 ||
+    (type != EEA_WINDOW_COUNT && type != EEA_WINDOW_TIME)) {
+    ESP_LOGI(TAG, "Invalid window. Name: %u bytes, type: %d, span: %u.", name_length, type, span);
+    return -1;
+  }
+
+  int32_t free_handle = -1;
+  for(int32_t i = 0; i < EEA_AGGREGATE_MAX_WINDOWS; i++) {
+    EEA_Window *window = this->windows[i];
+    if(window == NULL) {
+      if(free_handle < 0) {
+        free_handle = i;
+      }
+    } else if(strlen(window->name) == name_length && memcmp(window->name, name, name_length) == 0) {
+      return i;
+    }
+  }
+
+  if(free_handle < 0) {
+    ESP_LOGI(TAG, "Too many windows. The maximum is %d.", EEA_AGGREGATE_MAX_WINDOWS);
+    return -1;
+  }
+
+  uint32_t capacity = EEA_AGGREGATE_MAX_SAMPLES;
+  if(type == EEA_WINDOW_COUNT && span < capacity) {
+    capacity = span;
+  }
+
+  // The window and its rings share one allocation.
+  uint8_t *block = (uint8_t*)eea_malloc(EEA_MEM_AGGREGATE,
+    sizeof(EEA_Window) + capacity * (sizeof(float) + 3 * sizeof(uint32_t)), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(block == NULL) {
+    return -1;
+  }
+
+  EEA_Window *window = (EEA_Window*)block;
+  memset(window, 0, sizeof(EEA_Window));
+  memcpy(window->name, name, name_length);
+  window->name[name_length] = '\0';
+  window->type = type;
+  window->span = span;
+  window->capacity = capacity;
+  window->values = (float*)(block + sizeof(EEA_Window));
+  window->times = (uint32_t*)(window->values + capacity);
+  window->min_queue = window->times + capacity;
+  window->max_queue = window->min_queue + capacity;
+
+  this->windows[free_handle] = window;
+  return free_handle;
+}
+
+int32_t EEA_Aggregate::destroy(int32_t handle)
+{
+  EEA_Window *window = this->get(handle);
+  if(window == NULL) {
+    return 1;
+  }
+
+  eea_free(window);
+  this->windows[handle] = NULL;
+  return 0;
+}
+
+int32_t EEA_Aggregate::reset(int32_t handle)
+{
+  EEA_Window *window = this->get(handle);
+  if(window == NULL) {
+    return 1;
+  }
+
+  window->first = 0;
+  window->next = 0;
+  window->sum = 0;
+  window->sum_squares = 0;
+  window->evictions = 0;
+  window->min_head = window->min_tail = 0;
+  window->max_head = window->max_tail = 0;
+  return 0;
+}
+
+/**
+ * Removes the oldest sample.
+ */
+void EEA_Aggregate::evict(EEA_Window *window)
+{
+  float value = window->values[window->first % window->capacity];
+  window->sum -= value;
+  window->sum_squares -= (double)value * value;
+
+  if(window->min_head != window->min_tail && window->min_queue[window->min_head % window->capacity] == window->first) {
+    window->min_head++;
+  }
+  if(window->max_head != window->max_tail && window->max_queue[window->max_head % window->capacity] == window->first) {
+    window->max_head++;
+  }
+  window->first++;
+
+  // Subtracting evicted samples accumulates rounding error,
+  // so the sums are recomputed once per window's worth of evictions.
+  if(++window->evictions >= window->capacity) {
+    window->evictions = 0;
+
+    uint32_t count = window->next - window->first;
+    uint32_t start = window->first % window->capacity;
+    uint32_t head = std::min(count, window->capacity - start);
+    double sum, sum_squares;
+
+    eea_window_sums(window->values + start, head, &(window->sum), &(window->sum_squares));
+    eea_window_sums(window->values, count - head, &sum, &sum_squares);
+    window->sum += sum;
+    window->sum_squares += sum_squares;
+  }
+}
+
+/**
+ * Evicts samples older than a time window's span.
+ */
+void EEA_Aggregate::expire(EEA_Window *window, uint32_t now)
+{
+  if(window->type != EEA_WINDOW_TIME) {
+    return;
+  }
+
+  while(window->first != window->next &&
+    now - window->times[window->first % window->capacity] > window->span) {
+    this->evict(window);
+  }
+}
+
+void EEA_Aggregate::add(EEA_Window *window, float value, uint32_t now)
+{
+  uint32_t capacity = window->capacity;
+
+  if(window->next - window->first == capacity) {
+    this->evict(window);
+  }
+
+  uint32_t seq = window->next;
+  window->values[seq % capacity] = value;
+  window->times[seq % capacity] = now;
+  window->sum += value;
+  window->sum_squares += (double)value * value;
+
+  // Samples that can no longer be the minimum (or maximum) are dropped
+  // from the back of the queue, so the front is always the answer.
+  while(window->min_head != window->min_tail &&
+    window->values[window->min_queue[(window->min_tail - 1) % capacity] % capacity] >= value) {
+    window->min_tail--;
+  }
+  window->min_queue[window->min_tail++ % capacity] = seq;
+
+  while(window->max_head != window->max_tail &&
+    window->values[window->max_queue[(window->max_tail - 1) % capacity] % capacity] <= value) {
+    window->max_tail--;
+  }
+  window->max_queue[window->max_tail++ % capacity] = seq;
+
+  window->next++;
+
+  // Ring positions are taken modulo the capacity, so sequence numbers and
+  // queue counters are rebased by a multiple of it.
+  if(window->next >= EEA_WINDOW_REBASE_THRESHOLD) {
+    uint32_t offset = window->first - (window->first % capacity);
+    window->first -= offset;
+    window->next -= offset;
+    for(uint32_t i = window->min_head; i != window->min_tail; i++) {
+      window->min_queue[i % capacity] -= offset;
+    }
+    for(uint32_t i = window->max_head; i != window->max_tail; i++) {
+      window->max_queue[i % capacity] -= offset;
+    }
+
+    uint32_t min_offset = window->min_head - (window->min_head % capacity);
+    window->min_head -= min_offset;
+    window->min_tail -= min_offset;
+    uint32_t max_offset = window->max_head - (window->max_head % capacity);
+    window->max_head -= max_offset;
+    window->max_tail -= max_offset;
+  }
+}
+
+int32_t EEA_Aggregate::push(int32_t handle, const float *samples, uint32_t count)
+{
+  EEA_Window *window = this->get(handle);
+  if(window == NULL) {
+    return 1;
+  }
+
+  uint32_t now = eea_window_now();
+  this->expire(window, now);
+
+  // Only the newest capacity samples of a batch can remain in the window.
+  if(count >= window->capacity) {
+    this->reset(handle);
+    samples += count - window->capacity;
+    count = window->capacity;
+  }
+
+  for(uint32_t i = 0; i < count; i++) {
+    this->add(window, samples[i], now);
+  }
+  return 0;
+}
+
+/**
+ * Returns the linearly interpolated percentile of a non-empty window.
+ */
+float EEA_Aggregate::percentile(EEA_Window *window, float percent)
+{
+  if(this->scratch == NULL) {
+    this->scratch = (float*)eea_malloc(EEA_MEM_AGGREGATE, EEA_AGGREGATE_MAX_SAMPLES * sizeof(float), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if(this->scratch == NULL) {
+      return NAN;
+    }
+  }
+
+  uint32_t count = window->next - window->first;
+  for(uint32_t i = 0; i < count; i++) {
+    this->scratch[i] = window->values[(window->first + i) % window->capacity];
+  }
+
+  percent = std::max(0.0f, std::min(100.0f, percent));
+  float position = percent / 100.0f * (count - 1);
+  uint32_t lower = (uint32_t)position;
+  float fraction = position - lower;
+
+  std::nth_element(this->scratch, this->scratch + lower, this->scratch + count);
+  float value = this->scratch[lower];
+  if(fraction > 0 && lower + 1 < count) {
+    float upper = *std::min_element(this->scratch + lower + 1, this->scratch + count);
+    value += fraction * (upper - value);
+  }
+  return value;
+}
+
+int32_t EEA_Aggregate::query(int32_t handle, EEA_Window_Statistic statistic, float argument, float *result)
+{
+  EEA_Window *window = this->get(handle);
+  if(window == NULL) {
+    return 1;
+  }
+
+  this->expire(window, eea_window_now());
+
+  uint32_t count = window->next - window->first;
+  if(statistic == EEA_STAT_COUNT) {
+    *result = (float)count;
+    return 0;
+  }
+
+  *result = NAN;
+  if(count == 0) {
+    return statistic >= 0 && statistic <= EEA_STAT_RATE ? 0 : 1;
+  }
+
+  uint32_t capacity = window->capacity;
+  double mean = window->sum / count;
+
+  switch(statistic) {
+    case EEA_STAT_MEAN:
+      *result = (float)mean;
+      break;
+    case EEA_STAT_MIN:
+      *result = window->values[window->min_queue[window->min_head % capacity] % capacity];
+      break;
+    case EEA_STAT_MAX:
+      *result = window->values[window->max_queue[window->max_head % capacity] % capacity];
+      break;
+    case EEA_STAT_STDDEV: {
+      double variance = window->sum_squares / count - mean * mean;
+      *result = (float)sqrt(variance > 0 ? variance : 0);
+      break;
+    }
+    case EEA_STAT_RMS: {
+      double mean_square = window->sum_squares / count;
+      *result = (float)sqrt(mean_square > 0 ? mean_square : 0);
+      break;
+    }
+    case EEA_STAT_PERCENTILE:
+      *result = this->percentile(window, argument);
+      break;
+    case EEA_STAT_RATE: {
+      uint32_t oldest = window->first % capacity;
+      uint32_t newest = (window->next - 1) % capacity;
+      uint32_t elapsed = window->times[newest] - window->times[oldest];
+      if(elapsed > 0) {
+        *result = (window->values[newest] - window->values[oldest]) * 1000.0f / elapsed;
+      }
+      break;
+    }
+    default:
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Creates a named window, or finds the existing window with that name.
+ * Inputs:
+ *   name (String): the window name.
+ *   name_length (Int32): the length of the name.
+ *   type (Int32): the window type.
+ *     EEA_WINDOW_COUNT = 0 (span is a number of samples)
+ *     EEA_WINDOW_TIME = 1 (span is in milliseconds)
+ *   span (Int32): the window span.
+ *
+ * Returns the window handle, or -1 on failure.
+ */
+static int32_t eea_fn_window_create(EEA_Host_Context ctx, EEA_Span<char> name, int32_t type, uint32_t span)
+{
+  EEA_Aggregate *aggregate = (EEA_Aggregate*)ctx.userdata;
+  return aggregate->create(name.data, name.count, (EEA_Window_Type)type, span);
+}
+
+/**
+ * Frees a window.
+ * Inputs:
+ *   window (Int32): the window handle.
+ *
+ * Returns 0 for success, 1 for an unknown window.
+ */
+static int32_t eea_fn_window_destroy(EEA_Host_Context ctx, int32_t window)
+{
+  EEA_Aggregate *aggregate = (EEA_Aggregate*)ctx.userdata;
+  return aggregate->destroy(window);
+}
+
+/**
+ * Removes every sample from a window.
+ * Inputs:
+ *   window (Int32): the window handle.
+ *
+ * Returns 0 for success, 1 for an unknown window.
+ */
+static int32_t eea_fn_window_reset(EEA_Host_Context ctx, int32_t window)
+{
+  EEA_Aggregate *aggregate = (EEA_Aggregate*)ctx.userdata;
+  return aggregate->reset(window);
+}
+
+/**
+ * Pushes a batch of samples into a window.
+ * Inputs:
+ *   window (Int32): the window handle.
+ *   samples (Pointer): an array of Float32 samples.
+ *   count (Int32): the number of samples.
+ *
+ * Returns 0 for success, 1 for an unknown window.
+ */
+static int32_t eea_fn_window_push(EEA_Host_Context ctx, int32_t window, EEA_Span<float> samples)
+{
+  EEA_Aggregate *aggregate = (EEA_Aggregate*)ctx.userdata;
+
+  // Linear memory offsets may be unaligned, so samples are copied out in chunks.
+  float chunk[32];
+  uint32_t chunk_size = sizeof(chunk) / sizeof(chunk[0]);
+
+  int32_t result = 0;
+  for(uint32_t i = 0; i < samples.count && result == 0; i += chunk_size) {
+    uint32_t n = std::min(chunk_size, samples.count - i);
+    memcpy(chunk, samples.data + i * sizeof(float), n * sizeof(float));
+    result = aggregate->push(window, chunk, n);
+  }
+  return result;
+}
+
+/**
+ * Computes a statistic over a window.
+ * Inputs:
+ *   window (Int32): the window handle.
+ *   statistic (Int32): the statistic.
+ *     EEA_STAT_COUNT = 0
+ *     EEA_STAT_MEAN = 1
+ *     EEA_STAT_MIN = 2
+ *     EEA_STAT_MAX = 3
+ *     EEA_STAT_STDDEV = 4
+ *     EEA_STAT_RMS = 5
+ *     EEA_STAT_PERCENTILE = 6 (argument is the percentile, 0 to 100)
+ *     EEA_STAT_RATE = 7 (change per second)
+ *   argument (Float32): the statistic's argument, if any.
+ *
+ * Outputs:
+ *   value (Float32): the statistic. NaN if the window is empty.
+ *
+ * Returns 0 for success, 1 for an unknown window or statistic.
+ */
+static int32_t eea_fn_window_query(EEA_Host_Context ctx, int32_t window, int32_t statistic, float argument, EEA_Out<float> value)
+{
+  EEA_Aggregate *aggregate = (EEA_Aggregate*)ctx.userdata;
+
+  float result = NAN;
+  int32_t status = aggregate->query(window, (EEA_Window_Statistic)statistic, argument, &result);
+  value.set(result);
+
+  return status;
+}
+
+static const EEA_Host_Function eea_aggregate_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_window_create),
+  EEA_HOST_FUNCTION(eea_fn_window_destroy),
+  EEA_HOST_FUNCTION(eea_fn_window_reset),
+  EEA_HOST_FUNCTION(eea_fn_window_push),
+  EEA_HOST_FUNCTION(eea_fn_window_query)
+};
+
+EEA_Aggregate::EEA_Aggregate(EEA_Engine *engine)
+{
+  memset(this->windows, 0, sizeof(this->windows));
+  this->scratch = NULL;
+
+  engine->add_host_functions("env", eea_aggregate_functions,
+    sizeof(eea_aggregate_functions) / sizeof(eea_aggregate_functions[0]), this);
+}
+
+EEA_Aggregate::~EEA_Aggregate()
+{
+  for(int32_t i = 0; i < EEA_AGGREGATE_MAX_WINDOWS; i++) {
+    eea_free(this->windows[i]);
+  }
+  eea_free(this->scratch);
+}
@@ -0,0 +1,118 @@
+#ifndef EEA_AGGREGATE_H
+#define EEA_AGGREGATE_H
+
+#include <stdint.h>
+
+#include "eea_config.h"
+#include "eea_engine.h"
+
+/**
+ * How a window decides which samples it holds.
+ */
+enum EEA_Window_Type {
+  EEA_WINDOW_COUNT = 0, // The last `span` samples.
+  EEA_WINDOW_TIME = 1   // Samples pushed in the last `span` milliseconds.
+};
+
+/**
+ * Statistics that can be queried from a window.
+ */
+enum EEA_Window_Statistic {
+  EEA_STAT_COUNT = 0,
+  EEA_STAT_MEAN = 1,
+  EEA_STAT_MIN = 2,
+  EEA_STAT_MAX = 3,
+  EEA_STAT_STDDEV = 4,
+  EEA_STAT_RMS = 5,
+  EEA_STAT_PERCENTILE = 6, // The argument is the percentile, 0 to 100.
+  EEA_STAT_RATE = 7        // Change per second from the oldest to the newest sample.
+};
+
+/**
+ * A sliding window of samples. Samples are kept in a ring buffer with a
+ * running sum and sum of squares, and min/max are tracked with monotonic
+ * queues of sample sequence numbers, so pushing a sample and querying
+ * count, mean, min, max, stddev, RMS and rate are amortised O(1).
+ * Percentiles select from a copy of the window, O(n).
+ */
+struct EEA_Window {
+  char name[EEA_AGGREGATE_NAME_SIZE];
+  EEA_Window_Type type;
+  uint32_t span;
+  uint32_t capacity;
+
+  float *values;
+  uint32_t *times;
+
+  // Sequence number of the oldest sample in the window, and of the next sample.
+  uint32_t first;
+  uint32_t next;
+
+  double sum;
+  double sum_squares;
+  uint32_t evictions;
+
+  // Monotonic queues of sequence numbers, each a ring of capacity entries.
+  uint32_t *min_queue;
+  uint32_t min_head;
+  uint32_t min_tail;
+  uint32_t *max_queue;
+  uint32_t max_head;
+  uint32_t max_tail;
+};
+
+/**
+ * Native windowed aggregation for workflows, exposed as registered
+ * functions (see eea_aggregate.cpp). Workflows push sensor readings into
+ * named windows and query statistics, instead of computing them in WASM on
+ * every eea_loop. Windows are freed when the bundle is unloaded.
+ */
+class EEA_Aggregate {
+  public:
+    EEA_Aggregate(EEA_Engine *engine);
+    ~EEA_Aggregate();
+
+    /**
+     * Creates a window, or returns the existing window with the same name.
+     * Time windows hold at most EEA_AGGREGATE_MAX_SAMPLES samples.
+     * Returns the window's handle, or -1 on failure.
+     */
+    int32_t create(const char *name, uint32_t name_length, EEA_Window_Type type, uint32_t span);
+
+    /**
+     * Frees a window. Its handle can be reused by a later create.
+     */
+    int32_t destroy(int32_t handle);
+
+    /**
+     * Removes every sample from a window.
+     */
+    int32_t reset(int32_t handle);
+
+    /**
+     * Pushes samples into a window. Samples pushed to a time window
+     * together are given the same timestamp.
+     */
+    int32_t push(int32_t handle, const float *samples, uint32_t count);
+
+    /**
+     * Computes a statistic over the samples in a window. The result is NAN
+     * if the window is empty (0 for EEA_STAT_COUNT).
+     * Returns 0 on success, or 1 for an unknown window or statistic.
+     */
+    int32_t query(int32_t handle, EEA_Window_Statistic statistic, float argument, float *result);
+
+  private:
+    EEA_Window *get(int32_t handle);
+    void expire(EEA_Window *window, uint32_t now);
+    void evict(EEA_Window *window);
+    void add(EEA_Window *window, float value, uint32_t now);
+    float percentile(EEA_Window *window, float percent);
+
+    EEA_Window *windows[EEA_AGGREGATE_MAX_WINDOWS];
+
+    // Scratch space for percentile selection.
+    float *scratch;
+};
+
+#endif
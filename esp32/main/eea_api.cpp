@@ -3,206 +3,152 @@
  */
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "eea_api.h"
+#include "eea_bindings.h"
 #include "eea_config.h"
+#include "eea_memory.h"
 #include "eea_queue_msg.h"
 #include "eea_runtime.h"
 
-#include <wasm3.h>
-#include <m3_env.h>
 
 static const char *TAG = "EEA_API";
 
-m3ApiRawFunction(eea_trace)
+static int32_t eea_trace(EEA_Host_Context ctx, EEA_Span<char> message, uint32_t level)
 {
-    ESP_LOGI(TAG, "eea_trace");
-
-    m3ApiReturnType  (int32_t)
-
-    m3ApiGetArgMem(const char*, buf);
-    m3ApiGetArg(uint32_t, length);
-
-    char *log = (char*)malloc(length + 1);
-    strncpy(log, buf, length);
-    log[length] = '\0';
-
-    ESP_LOGI(TAG, "%s", log);
-
-    free(log);
-
-    m3ApiReturn(0)
+  EEA_API *eea_api = (EEA_API*)ctx.userdata;
+  eea_api->eea_runtime->trace->append(message.data, message.count, level);
+  return 0;
 }
 
-m3ApiRawFunction(eea_set_message_buffers)
+static int32_t eea_set_message_buffers(EEA_Host_Context ctx,
+  EEA_Span<char> message_buffer_topic, EEA_Span<char> message_buffer_payload)
 {
-    ESP_LOGI(TAG, "eea_set_message_buffers");
-    m3ApiReturnType  (int32_t)
+  EEA_API *eea_api = (EEA_API*)ctx.userdata;
+  EEA_Runtime *eea_runtime = eea_api->eea_runtime;
 
-    m3ApiGetArgMem(char*, message_buffer_topic);
-    m3ApiGetArg(uint16_t, message_buffer_topic_length);
-    m3ApiGetArgMem(char*, message_buffer_payload);
-    m3ApiGetArg(uint32_t, message_buffer_payload_length);
+  eea_runtime->message_buffer_topic = message_buffer_topic.data;
+  eea_runtime->message_buffer_topic_length = message_buffer_topic.count;
+  eea_runtime->message_buffer_payload = message_buffer_payload.data;
+  eea_runtime->message_buffer_payload_length = message_buffer_payload.count;
 
-    EEA_API *eea_api = (EEA_API*)(_ctx->userdata);
-    EEA_Runtime *eea_runtime = eea_api->eea_runtime;
-
-    eea_runtime->message_buffer_topic = message_buffer_topic;
-    eea_runtime->message_buffer_topic_length = message_buffer_topic_length;
-    eea_runtime->message_buffer_payload = message_buffer_payload;
-    eea_runtime->message_buffer_payload_length = message_buffer_payload_length;
-
-    m3ApiReturn(0)
+  return 0;
 }
 
-m3ApiRawFunction(eea_send_message)
+static int32_t eea_send_message(EEA_Host_Context ctx,
+  EEA_Span<char> topic_buffer, EEA_Span<char> payload_buffer, uint32_t qos)
 {
-    ESP_LOGI(TAG, "eea_send_message");
-    m3ApiReturnType  (int32_t)
-
-    EEA_API *eea_api = (EEA_API*)(_ctx->userdata);
-
-    m3ApiGetArgMem(const char*, topic_buffer);
-    m3ApiGetArg(uint16_t, topic_length);
-    m3ApiGetArgMem(const char*, payload_buffer);
-    m3ApiGetArg(uint32_t, payload_length);
-    m3ApiGetArg(uint8_t, qos);
-
-    char *topic = (char*)malloc(topic_length + 1);
-    strncpy(topic, topic_buffer, topic_length);
-    topic[topic_length] = '\0';
-
-    char *payload = (char*)malloc(payload_length + 1);
-    strncpy(payload, payload_buffer, payload_length);
-    payload[payload_length] = '\0';
-
-    ESP_LOGI(TAG, "%s", topic);
-    ESP_LOGI(TAG, "%s", payload);
-
-    EEA_Queue_Msg *queue_msg = (EEA_Queue_Msg*)malloc(sizeof(EEA_Queue_Msg));
-    strcpy(queue_msg->topic, topic);
-    strcpy(queue_msg->payload, payload);
-    queue_msg->qos = qos;
-
-    queue_msg->topic_length = topic_length;
-    queue_msg->payload_length = payload_length;
+  EEA_API *eea_api = (EEA_API*)ctx.userdata;
+  uint32_t topic_length = topic_buffer.count;
+  uint32_t payload_length = payload_buffer.count;
+
+  // Leave room for the null terminators the MQTT task logs with.
+  if(topic_length >= EEA_TOPIC_SIZE_BYTES || payload_length >= EEA_PAYLOAD_SIZE_BYTES) {
+    ESP_LOGI(TAG, "eea_send_message dropped. Topic: %u bytes, payload: %u bytes.", topic_length, payload_length);
+    return 1;
+  }
 
+  // The queue copies the message, so the same buffer is reused for every send.
+  EEA_Queue_Msg *queue_msg = eea_api->send_buffer;
+  memcpy(queue_msg->topic, topic_buffer.data, topic_length);
+  queue_msg->topic[topic_length] = '\0';
+  memcpy(queue_msg->payload, payload_buffer.data, payload_length);
+  queue_msg->payload[payload_length] = '\0';
+  queue_msg->topic_length = topic_length;
+  queue_msg->payload_length = payload_length;
+  queue_msg->qos = qos;
+
+  // Correlates the message with the handler call that sent it, if any.
+  queue_msg->received_at = eea_api->eea_runtime->handling_received_at;
+  queue_msg->queued_at = esp_timer_get_time();
+
+  ESP_LOGD(TAG, "%s", queue_msg->topic);
+  ESP_LOGD(TAG, "%s", queue_msg->payload);
+
+  // Messages to the agent's own toAgent topics go straight to the inbound
+  // path. The queue copies the message before deliver stamps it.
+  EEA_Loopback *loopback = eea_api->eea_runtime->loopback;
+  bool local = loopback->matches(queue_msg->topic, topic_length);
+  if(!local || EEA_LOOPBACK_PUBLISH) {
     xQueueSend(eea_api->xQueueMQTT, queue_msg, 0);
+  }
+  if(local) {
+    loopback->deliver(queue_msg);
+  }
 
-    free(topic);
-    free(payload);
-    free(queue_msg);
-
-    m3ApiReturn(0)
+  return 0;
 }
 
-m3ApiRawFunction(eea_storage_save)
+static int32_t eea_storage_save(EEA_Span<char> values_buffer)
 {
-    ESP_LOGI(TAG, "eea_storage_save");
-    m3ApiReturnType  (int32_t)
-    m3ApiReturn(0)
+  return 0;
 }
 
-m3ApiRawFunction(eea_storage_read)
+static int32_t eea_storage_read(EEA_Span<char> values_buffer, EEA_Out<uint32_t> bytes_read_buffer)
 {
-    ESP_LOGI(TAG, "eea_storage_read");
-    m3ApiReturnType  (int32_t)
-    m3ApiReturn(0)
+  return 0;
 }
 
-m3ApiRawFunction(eea_sleep)
+static int32_t eea_sleep(uint32_t milliseconds)
 {
-    ESP_LOGI(TAG, "eea_sleep");
-    m3ApiReturnType  (int32_t)
-
-    m3ApiGetArg(uint32_t, milliseconds);
-
-    const TickType_t xDelay = milliseconds / portTICK_PERIOD_MS;
-    vTaskDelay(xDelay);
+  const TickType_t xDelay = milliseconds / portTICK_PERIOD_MS;
+  vTaskDelay(xDelay);
 
-    m3ApiReturn(0)
+  return 0;
 }
 
-m3ApiRawFunction(eea_get_device_id)
+static int32_t eea_get_device_id(EEA_Span<char> device_id_buffer, EEA_Out<uint8_t> bytes_written_buffer)
 {
-    ESP_LOGI(TAG, "eea_get_device_id");
-    m3ApiReturnType  (int32_t)
+  strncpy(device_id_buffer.data, LOSANT_DEVICE_ID, device_id_buffer.count);
+  uint8_t device_id_length = strlen(LOSANT_DEVICE_ID);
 
-    m3ApiGetArgMem(char*, device_id_buffer);
-    m3ApiGetArg(uint8_t, buffer_length);
-    m3ApiGetArgMem(char*, bytes_written_buffer);
+  bytes_written_buffer.set(device_id_length);
 
-    strncpy(device_id_buffer, LOSANT_DEVICE_ID, buffer_length);
-    uint8_t device_id_length = strlen(LOSANT_DEVICE_ID);
-
-    memcpy(bytes_written_buffer, &device_id_length, sizeof(device_id_length));
-
-    m3ApiReturn(0)
+  return 0;
 }
 
-m3ApiRawFunction(eea_get_time)
+static int32_t eea_get_time(EEA_Out<uint64_t> time_buffer)
 {
-    ESP_LOGI(TAG, "eea_get_time");
-    m3ApiReturnType  (int32_t)
-
-    m3ApiGetArgMem(char*, time_buffer);
+  // Since this is using time-since-boot when calling
+  // eea_loop, this should output 0 to indicate
+  // we do not have time-since-epoch.
+  uint64_t time = 0;
 
-    // Since this is using time-since-boot when calling
-    // eea_loop, this should output 0 to indicate
-    // we do not have time-since-epoch.
-    uint64_t time = 0;
+  time_buffer.set(time);
 
-    memcpy(time_buffer, &time, sizeof(time));
-
-    m3ApiReturn(0)
+  return 0;
 }
 
-EEA_API::EEA_API(EEA_Runtime *eea_runtime, IM3Module wasm_module, QueueHandle_t xQueueMQTT)
+static const EEA_Host_Function eea_api_functions[] = {
+  EEA_HOST_FUNCTION(eea_trace),
+  EEA_HOST_FUNCTION(eea_set_message_buffers),
+  EEA_HOST_FUNCTION(eea_send_message),
+  EEA_HOST_FUNCTION(eea_storage_save),
+  EEA_HOST_FUNCTION(eea_storage_read),
+  EEA_HOST_FUNCTION(eea_sleep),
+  EEA_HOST_FUNCTION(eea_get_device_id),
+  EEA_HOST_FUNCTION(eea_get_time)
+};
+
+EEA_API::EEA_API(EEA_Runtime *eea_runtime, EEA_Engine *engine, QueueHandle_t xQueueMQTT)
 {
   this->xQueueMQTT = xQueueMQTT;
   this->eea_runtime = eea_runtime;
 
-  const char* module_name = "env";
-
-  M3Result result = m3Err_none;
-
-  result = m3_LinkRawFunction(wasm_module, module_name, "eea_trace", "i(*ii)", &eea_trace);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_trace link %s", result);
-  }
-
-  result = m3_LinkRawFunctionEx(wasm_module, module_name, "eea_set_message_buffers", "i(*i*i)", &eea_set_message_buffers, this);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_set_message_buffers link %s", result);
-  }
-
-  result = m3_LinkRawFunctionEx(wasm_module, module_name, "eea_send_message", "i(*i*ii)", &eea_send_message, this);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_send_message link %s", result);
+  // Scratch message for eea_send_message. Allocated from PSRAM.
+  // If it can't be allocated, the functions aren't linked and load_wasm
+  // fails the load.
+  this->send_buffer = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_API, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(this->send_buffer == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate the send buffer.");
+    return;
   }
 
-  result = m3_LinkRawFunction(wasm_module, module_name, "eea_storage_save", "i(*i)", &eea_storage_save);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_storage_save link %s", result);
-  }
-
-  result = m3_LinkRawFunction(wasm_module, module_name, "eea_storage_read", "i(*i*)", &eea_storage_read);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_storage_read link %s", result);
-  }
-
-  result = m3_LinkRawFunction(wasm_module, module_name, "eea_sleep", "i(i)", &eea_sleep);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_sleep link %s", result);
-  }   
-
-  result = m3_LinkRawFunction(wasm_module, module_name, "eea_get_device_id", "i(*i*)", &eea_get_device_id);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_get_device_id link %s", result);
-  }
+  engine->add_host_functions("env", eea_api_functions, sizeof(eea_api_functions) / sizeof(eea_api_functions[0]), this);
+}
 
-  result = m3_LinkRawFunction(wasm_module, module_name, "eea_get_time", "i(*)", &eea_get_time);
-  if(result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_get_time link %s", result);
-  }
-}
\ No newline at end of file
+EEA_API::~EEA_API()
+{
+  eea_free(this->send_buffer);
+}
@@ -4,16 +4,19 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 
-#include <wasm3.h>
-#include <m3_env.h>
+#include "eea_queue_msg.h"
+
+#include "eea_engine.h"
 
 class EEA_Runtime;
 
 class EEA_API {
   public:
-    EEA_API(EEA_Runtime *eea_runtime, IM3Module wasm_module, QueueHandle_t xQueueMQTT);
+    EEA_API(EEA_Runtime *eea_runtime, EEA_Engine *engine, QueueHandle_t xQueueMQTT);
+    ~EEA_API();
     QueueHandle_t xQueueMQTT;
     EEA_Runtime *eea_runtime;
+    EEA_Queue_Msg *send_buffer;
 };
 
 #endif
\ No newline at end of file
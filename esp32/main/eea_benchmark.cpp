@@ -0,0 +1,90 @@
+/**
+ * Benchmarks for the EEA host code and the WASM engines.
+ * Results are logged to the console.
+ * Enabled with EEA_BENCHMARK_ENABLED in eea_config.h.
+ *
+ * Each subsystem's benchmarks are in their own eea_benchmark_*.cpp, run in
+ * order by eea_benchmark_run. The helpers they share are defined here.
+ */
+
+#include "esp_log.h"
+
+#include "eea_benchmark.h"
+#include "eea_benchmark_common.h"
+
+// Describes the wasm3 build. Set by main/CMakeLists.txt.
+#ifndef EEA_BENCHMARK_VARIANT
+#define EEA_BENCHMARK_VARIANT "default"
+#endif
+
+static const char *TAG = "EEA_BENCHMARK";
+
+// Bounds of the code placed in IRAM (from the IDF linker script).
+extern int _iram_text_start;
+extern int _iram_text_end;
+
+EEA_Engine *eea_benchmark_load(EEA_Engine_Kind kind, const char *label, const uint8_t *wasm, uint32_t size,
+  const EEA_Host_Function *functions, size_t count, const char *export_name, EEA_Engine_Function *function)
+{
+  EEA_Engine *engine = eea_engine_create(kind);
+  if(engine == NULL) {
+    return NULL;
+  }
+
+  if(functions != NULL) {
+    engine->add_host_functions("env", functions, count, NULL);
+  }
+
+  EEA_Engine_Result result = engine->load(wasm, size, EEA_BENCHMARK_WASM_STACK);
+  if(result == NULL) {
+    result = engine->find(function, export_name);
+  }
+
+  if(result != NULL) {
+    ESP_LOGI(TAG, "Load %s (%s): %s", label, engine->name, result);
+    delete engine;
+    return NULL;
+  }
+
+  return engine;
+}
+
+const char *eea_benchmark_verified(bool verified)
+{
+  return verified ? "output verified" : "OUTPUT MISMATCH";
+}
+
+void eea_benchmark_compare(const char *label, EEA_Engine *engine, int64_t wasm_us, int64_t native_us, bool verified)
+{
+  ESP_LOGI(TAG, "%s (%s): WASM %lld us, native %lld us (%.1fx), %s",
+    label, engine->name, wasm_us, native_us, native_us > 0 ? (double)wasm_us / native_us : 0.0,
+    eea_benchmark_verified(verified));
+}
+
+void eea_benchmark_run()
+{
+  ESP_LOGI(TAG, "Running benchmarks...");
+  ESP_LOGI(TAG, "Variant: %s, IRAM text: %d bytes", EEA_BENCHMARK_VARIANT,
+    (int)((uint8_t*)&_iram_text_end - (uint8_t*)&_iram_text_start));
+
+  eea_benchmark_bindings();
+  eea_benchmark_inflate();
+  eea_benchmark_bus();
+
+  // Every engine that is built in runs the same workloads.
+  const EEA_Engine_Kind kinds[] = { EEA_ENGINE_KIND_WASM3, EEA_ENGINE_KIND_WAMR };
+  for(size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    EEA_Engine *engine = eea_engine_create(kinds[i]);
+    if(engine == NULL) {
+      continue;
+    }
+    delete engine;
+
+    eea_benchmark_engine(kinds[i]);
+    eea_benchmark_aggregate(kinds[i]);
+    eea_benchmark_json(kinds[i]);
+    eea_benchmark_dsp(kinds[i]);
+  }
+
+  ESP_LOGI(TAG, "Benchmarks complete.");
+}
@@ -0,0 +1,20 @@
+#ifndef EEA_BENCHMARK_H
+#define EEA_BENCHMARK_H
+
+/**
+ * Runs the benchmark suite and logs the results.
+ * Enabled with EEA_BENCHMARK_ENABLED in eea_config.h.
+ */
+void eea_benchmark_run();
+
+class EEA_Runtime;
+
+/**
+ * Loads and destroys bundles repeatedly through the runtime's deploy path
+ * (start_bundle and destroy_wasm), and logs the time of each phase, the
+ * arena high-water mark and any memory that isn't released. Called from
+ * the runtime task before it receives the first bundle.
+ */
+void eea_benchmark_lifecycle(EEA_Runtime *eea_runtime);
+
+#endif
\ No newline at end of file
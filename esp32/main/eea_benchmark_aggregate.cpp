@@ -0,0 +1,128 @@
+/**
+ * Benchmarks of the aggregation windows (eea_aggregate.h).
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eea_aggregate.h"
+#include "eea_benchmark_common.h"
+
+#define EEA_BENCHMARK_WINDOW_SAMPLES 1000
+#define EEA_BENCHMARK_WINDOW_SIZE 64
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * Moving statistics computed in WASM, the way a workflow does without the
+ * aggregation registered functions, as WAT:
+ *
+ * (module
+ *   (memory (export "memory") 1)
+ *   ;; Pushes n samples into a 64-sample ring at offset 0, rescanning it
+ *   ;; for the mean, min and max after each push. Returns the sum of
+ *   ;; mean + (min + max) over all pushes.
+ *   (func (export "window") (param $n i32) (result f32)
+ *     (local $i i32) (local $j i32) (local $v f32) (local $sum f32) (local $min f32) (local $max f32) (local $acc f32)
+ *     (block (loop
+ *       (br_if 1 (i32.ge_u (local.get $i) (local.get $n)))
+ *       (f32.store (i32.shl (i32.and (local.get $i) (i32.const 63)) (i32.const 2))
+ *         (f32.convert_i32_u (i32.rem_u (i32.mul (local.get $i) (i32.const 7)) (i32.const 100))))
+ *       (local.set $sum (f32.const 0))
+ *       (local.set $min (f32.const inf))
+ *       (local.set $max (f32.const -inf))
+ *       (local.set $j (i32.const 0))
+ *       (block (loop
+ *         (br_if 1 (i32.ge_u (local.get $j) (i32.const 256)))
+ *         (local.set $v (f32.load (local.get $j)))
+ *         (local.set $sum (f32.add (local.get $sum) (local.get $v)))
+ *         (local.set $min (f32.min (local.get $min) (local.get $v)))
+ *         (local.set $max (f32.max (local.get $max) (local.get $v)))
+ *         (local.set $j (i32.add (local.get $j) (i32.const 4)))
+ *         (br 0)))
+ *       (local.set $acc (f32.add (local.get $acc)
+ *         (f32.add (f32.div (local.get $sum) (f32.const 64)) (f32.add (local.get $min) (local.get $max)))))
+ *       (local.set $i (i32.add (local.get $i) (i32.const 1)))
+ *       (br 0)))
+ *     (local.get $acc)))
+ */
+static const uint8_t bench_window_wasm[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+  0x01, 0x7f, 0x01, 0x7d, 0x03, 0x02, 0x01, 0x00, 0x05, 0x03, 0x01, 0x00,
+  0x01, 0x07, 0x13, 0x02, 0x06, 0x6d, 0x65, 0x6d, 0x6f, 0x72, 0x79, 0x02,
+  0x00, 0x06, 0x77, 0x69, 0x6e, 0x64, 0x6f, 0x77, 0x00, 0x00, 0x0a, 0x95,
+  0x01, 0x01, 0x92, 0x01, 0x02, 0x02, 0x7f, 0x05, 0x7d, 0x02, 0x40, 0x03,
+  0x40, 0x20, 0x01, 0x20, 0x00, 0x4f, 0x0d, 0x01, 0x20, 0x01, 0x41, 0x3f,
+  0x71, 0x41, 0x02, 0x74, 0x20, 0x01, 0x41, 0x07, 0x6c, 0x41, 0xe4, 0x00,
+  0x70, 0xb3, 0x38, 0x02, 0x00, 0x43, 0x00, 0x00, 0x00, 0x00, 0x21, 0x04,
+  0x43, 0x00, 0x00, 0x80, 0x7f, 0x21, 0x05, 0x43, 0x00, 0x00, 0x80, 0xff,
+  0x21, 0x06, 0x41, 0x00, 0x21, 0x02, 0x02, 0x40, 0x03, 0x40, 0x20, 0x02,
+  0x41, 0x80, 0x02, 0x4f, 0x0d, 0x01, 0x20, 0x02, 0x2a, 0x02, 0x00, 0x21,
+  0x03, 0x20, 0x04, 0x20, 0x03, 0x92, 0x21, 0x04, 0x20, 0x05, 0x20, 0x03,
+  0x96, 0x21, 0x05, 0x20, 0x06, 0x20, 0x03, 0x97, 0x21, 0x06, 0x20, 0x02,
+  0x41, 0x04, 0x6a, 0x21, 0x02, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x07, 0x20,
+  0x04, 0x43, 0x00, 0x00, 0x80, 0x42, 0x95, 0x20, 0x05, 0x20, 0x06, 0x92,
+  0x92, 0x92, 0x21, 0x07, 0x20, 0x01, 0x41, 0x01, 0x6a, 0x21, 0x01, 0x0c,
+  0x00, 0x0b, 0x0b, 0x20, 0x07, 0x0b
+};
+
+/**
+ * Compares moving statistics computed in WASM with the native aggregation
+ * window (eea_aggregate.h) fed the same samples. The native time excludes
+ * the host call overhead, which is measured by eea_benchmark_bindings.cpp.
+ */
+void eea_benchmark_aggregate(EEA_Engine_Kind kind)
+{
+  EEA_Engine_Function window_function;
+  EEA_Engine *engine = eea_benchmark_load(kind, "window", bench_window_wasm, sizeof(bench_window_wasm),
+    NULL, 0, "window", &window_function);
+  if(engine == NULL) {
+    return;
+  }
+
+  uint64_t samples = EEA_BENCHMARK_WINDOW_SAMPLES;
+  uint64_t wasm_result = 0;
+  int64_t start = esp_timer_get_time();
+  EEA_Engine_Result result = engine->call(window_function, 1, &samples, &wasm_result);
+  int64_t wasm_elapsed = esp_timer_get_time() - start;
+
+  if(result != NULL) {
+    ESP_LOGI(TAG, "Window (%s): %s", engine->name, result);
+    delete engine;
+    return;
+  }
+
+  // The WASM ring starts out full of zeros, so the native window does too.
+  EEA_Aggregate *aggregate = new EEA_Aggregate(engine);
+  int32_t window = aggregate->create("bench", 5, EEA_WINDOW_COUNT, EEA_BENCHMARK_WINDOW_SIZE);
+  float zeros[EEA_BENCHMARK_WINDOW_SIZE] = { 0 };
+  aggregate->push(window, zeros, EEA_BENCHMARK_WINDOW_SIZE);
+
+  float native_result = 0;
+  start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_WINDOW_SAMPLES; i++) {
+    float sample = (float)((i * 7) % 100);
+    float mean, min, max;
+    aggregate->push(window, &sample, 1);
+    aggregate->query(window, EEA_STAT_MEAN, 0, &mean);
+    aggregate->query(window, EEA_STAT_MIN, 0, &min);
+    aggregate->query(window, EEA_STAT_MAX, 0, &max);
+    native_result += mean + (min + max);
+  }
+  int64_t native_elapsed = esp_timer_get_time() - start;
+
+  float wasm_value;
+  memcpy(&wasm_value, &wasm_result, sizeof(wasm_value));
+
+  char label[48];
+  snprintf(label, sizeof(label), "Window of %d, %u samples", EEA_BENCHMARK_WINDOW_SIZE, EEA_BENCHMARK_WINDOW_SAMPLES);
+  eea_benchmark_compare(label, engine, wasm_elapsed, native_elapsed,
+    fabsf(wasm_value - native_result) <= 0.001f * fabsf(wasm_value));
+
+  delete aggregate;
+  delete engine;
+}
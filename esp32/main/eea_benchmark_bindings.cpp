@@ -0,0 +1,98 @@
+/**
+ * Benchmarks of the host function bindings (eea_bindings.h).
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eea_benchmark_common.h"
+#include "eea_engine_wasm3.h"
+
+#include <wasm3.h>
+#include <m3_env.h>
+
+#define EEA_BENCHMARK_HOST_CALL_ITERATIONS 100000
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * The same host function written both ways: as a hand-written
+ * m3ApiRawFunction (the style used before eea_bindings.h) and as a plain
+ * function bound through EEA_HOST_FUNCTION.
+ */
+m3ApiRawFunction(bench_get_level_raw)
+{
+  m3ApiReturnType(int32_t)
+
+  m3ApiGetArg(int32_t, pin);
+  m3ApiGetArgMem(int32_t*, value);
+
+  int32_t level = pin & 1;
+  memcpy(value, &level, sizeof(level));
+
+  m3ApiReturn(0);
+}
+
+static int32_t bench_get_level(int32_t pin, EEA_Out<int32_t> value)
+{
+  int32_t level = pin & 1;
+  value.set(level);
+
+  return 0;
+}
+
+static const EEA_Host_Function bench_functions[] = {
+  EEA_HOST_FUNCTION(bench_get_level)
+};
+
+/**
+ * A module with one page of memory and nothing else, as WAT:
+ *
+ * (module (memory 1))
+ */
+static const uint8_t bench_memory_wasm[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x05, 0x03, 0x01, 0x00,
+  0x01
+};
+
+/**
+ * Calls a raw host function through a function pointer, the same way the
+ * interpreter does, and returns the average time per call in nanoseconds.
+ * Both wrappers check the output pointer against the runtime's linear
+ * memory, so the calls are made with a loaded runtime.
+ */
+static uint32_t bench_host_call(IM3Runtime runtime, uint8_t *memory, M3RawCall call)
+{
+  uint64_t stack[3];
+
+  int64_t start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_HOST_CALL_ITERATIONS; i++) {
+    stack[1] = i;
+    stack[2] = 4;
+    call(runtime, NULL, stack, memory);
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  return (uint32_t)((elapsed * 1000) / EEA_BENCHMARK_HOST_CALL_ITERATIONS);
+}
+
+void eea_benchmark_bindings()
+{
+  EEA_Engine_Wasm3 engine;
+  EEA_Engine_Result result = engine.load(bench_memory_wasm, sizeof(bench_memory_wasm), EEA_BENCHMARK_WASM_STACK);
+  uint32_t memory_size = 0;
+  uint8_t *memory = engine.memory(&memory_size);
+  if(result != NULL || memory == NULL) {
+    ESP_LOGI(TAG, "Host call: %s", result != NULL ? result : "no linear memory");
+    return;
+  }
+
+  // Volatile so the compiler can't see through the calls.
+  M3RawCall volatile raw = &bench_get_level_raw;
+  M3RawCall volatile bound = bench_functions[0].call;
+
+  ESP_LOGI(TAG, "Host call, hand-written wrapper: %u ns/call", bench_host_call(engine.runtime, memory, raw));
+  ESP_LOGI(TAG, "Host call, generated binding (%s): %u ns/call", bench_functions[0].signature, bench_host_call(engine.runtime, memory, bound));
+}
@@ -0,0 +1,83 @@
+/**
+ * Benchmarks of bundle decompression (eea_bundle.h).
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp32/rom/miniz.h"
+
+#include "eea_benchmark_common.h"
+#include "eea_bundle.h"
+#include "eea_memory.h"
+
+#define EEA_BENCHMARK_INFLATE_SIZE (128 * 1024)
+
+static const char *TAG = "EEA_BENCHMARK";
+
+struct bench_buffer
+{
+  uint8_t *data;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+static int bench_deflate_output(const void *data, int length, void *user)
+{
+  bench_buffer *buffer = (bench_buffer*)user;
+  if(buffer->size + length > buffer->capacity) {
+    return 0;
+  }
+  memcpy(buffer->data + buffer->size, data, length);
+  buffer->size += length;
+  return 1;
+}
+
+/**
+ * Measures bundle decompression throughput. The input is synthetic,
+ * moderately compressible data (similar in ratio to a WASM bundle),
+ * compressed on the device with the ROM deflate implementation.
+ */
+void eea_benchmark_inflate()
+{
+  uint8_t *original = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, EEA_BENCHMARK_INFLATE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  uint8_t *output = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, EEA_BENCHMARK_INFLATE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  tdefl_compressor *compressor = (tdefl_compressor*)eea_malloc(EEA_MEM_RUNTIME, sizeof(tdefl_compressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  bench_buffer compressed = { NULL, 0, EEA_BENCHMARK_INFLATE_SIZE };
+  compressed.data = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, EEA_BENCHMARK_INFLATE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  if(original == NULL || output == NULL || compressor == NULL || compressed.data == NULL) {
+    ESP_LOGI(TAG, "Inflate: not enough memory.");
+  } else {
+    // Short runs of a small alphabet with occasional random bytes.
+    uint32_t seed = 1;
+    for(uint32_t i = 0; i < EEA_BENCHMARK_INFLATE_SIZE; i++) {
+      seed = seed * 1103515245 + 12345;
+      original[i] = (seed >> 16) % 8 == 0 ? (uint8_t)(seed >> 8) : (uint8_t)("\x20\x01\x41\x00\x6a\x21\x02\x0b"[i % 8]);
+    }
+
+    size_t in_size = EEA_BENCHMARK_INFLATE_SIZE;
+    tdefl_init(compressor, bench_deflate_output, &compressed, TDEFL_WRITE_ZLIB_HEADER | TDEFL_DEFAULT_MAX_PROBES);
+    tdefl_compress(compressor, original, &in_size, NULL, NULL, TDEFL_FINISH);
+
+    uint32_t output_size = 0;
+    int64_t start = esp_timer_get_time();
+    int result = eea_bundle_decompress(compressed.data, compressed.size, output, EEA_BENCHMARK_INFLATE_SIZE, &output_size);
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    bool valid = result == 0 && output_size == EEA_BENCHMARK_INFLATE_SIZE &&
+      memcmp(original, output, EEA_BENCHMARK_INFLATE_SIZE) == 0;
+
+    ESP_LOGI(TAG, "Inflate: %u -> %u bytes in %lld us (%lld KB/s), %s.",
+      compressed.size, output_size, elapsed,
+      elapsed > 0 ? (output_size * 1000000LL / 1024) / elapsed : 0,
+      eea_benchmark_verified(valid));
+  }
+
+  eea_free(original);
+  eea_free(output);
+  eea_free(compressor);
+  eea_free(compressed.data);
+}
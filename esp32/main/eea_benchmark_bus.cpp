@@ -0,0 +1,79 @@
+/**
+ * Benchmarks of SPI and I2C transactions (eea_bus.h).
+ */
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_benchmark_common.h"
+#include "eea_bus.h"
+#include "eea_memory.h"
+
+#define EEA_BENCHMARK_BUS_ITERATIONS 10000
+#define EEA_BENCHMARK_BUS_FIFO_SIZE 1024
+#define EEA_BENCHMARK_BUS_BULK_ITERATIONS 100
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * Measures the host side of SPI and I2C transactions (eea_bus.h) on a mock
+ * device that answers instantly: validation, locking and the bounce buffer
+ * copies, which add to the bus time of a real device. Reading a sensor FIFO
+ * in one transaction is compared with reading it one byte per call.
+ */
+void eea_benchmark_bus()
+{
+  EEA_Bus *bus = new EEA_Bus();
+  int32_t device = bus->add_mock_device();
+  uint8_t *fifo = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, EEA_BENCHMARK_BUS_FIFO_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  if(device < 0 || fifo == NULL) {
+    ESP_LOGI(TAG, "Bus: not enough memory.");
+    eea_free(fifo);
+    delete bus;
+    return;
+  }
+
+  // A register read, as for a single accelerometer axis.
+  const uint8_t address = 0x3B;
+  uint8_t value[2];
+  esp_err_t result = ESP_OK;
+  int64_t start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_BUS_ITERATIONS; i++) {
+    result |= bus->transfer(device, &address, 1, value, sizeof(value));
+  }
+  int64_t register_elapsed = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_BUS_BULK_ITERATIONS; i++) {
+    result |= bus->transfer(device, &address, 1, fifo, EEA_BENCHMARK_BUS_FIFO_SIZE);
+  }
+  int64_t bulk_elapsed = esp_timer_get_time() - start;
+
+  // The mock device counts up across transactions.
+  bool verified = result == ESP_OK;
+  for(uint32_t i = 1; i < EEA_BENCHMARK_BUS_FIFO_SIZE; i++) {
+    verified = verified && fifo[i] == (uint8_t)(fifo[0] + i);
+  }
+
+  start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_BUS_FIFO_SIZE; i++) {
+    result |= bus->transfer(device, &address, 1, fifo + i, 1);
+  }
+  int64_t bytewise_elapsed = esp_timer_get_time() - start;
+
+  for(uint32_t i = 1; i < EEA_BENCHMARK_BUS_FIFO_SIZE; i++) {
+    verified = verified && fifo[i] == (uint8_t)(fifo[0] + i);
+  }
+
+  ESP_LOGI(TAG, "Bus transaction (mock device): %lld ns per register read, %u byte FIFO in %lld us (%lld KB/s), "
+    "one byte per call %lld us, %s.",
+    (register_elapsed * 1000) / EEA_BENCHMARK_BUS_ITERATIONS, EEA_BENCHMARK_BUS_FIFO_SIZE,
+    bulk_elapsed / EEA_BENCHMARK_BUS_BULK_ITERATIONS,
+    bulk_elapsed > 0 ? (EEA_BENCHMARK_BUS_FIFO_SIZE * EEA_BENCHMARK_BUS_BULK_ITERATIONS * 1000000LL / 1024) / bulk_elapsed : 0,
+    bytewise_elapsed, eea_benchmark_verified(verified));
+
+  eea_free(fifo);
+  delete bus;
+}
@@ -0,0 +1,55 @@
+#ifndef EEA_BENCHMARK_COMMON_H
+#define EEA_BENCHMARK_COMMON_H
+
+#include <stdint.h>
+
+#include "eea_bindings.h"
+#include "eea_engine.h"
+
+// Stack given to the engines that run the benchmark modules.
+#define EEA_BENCHMARK_WASM_STACK (64 * 1024)
+
+/**
+ * Helpers shared by the benchmark files (eea_benchmark_*.cpp), one per
+ * subsystem. eea_benchmark.cpp runs them in order.
+ */
+
+#if EEA_BENCHMARK_BUNDLES
+// The walkthrough bundles, embedded by the project CMakeLists.txt
+// when built with -DEEA_BENCHMARK=ON.
+extern const uint8_t hello_world_wasm_start[] asm("_binary_hello_world_memory_export_wasm_start");
+extern const uint8_t hello_world_wasm_end[] asm("_binary_hello_world_memory_export_wasm_end");
+extern const uint8_t eea_api_wasm_start[] asm("_binary_eea_api_memory_export_wasm_start");
+extern const uint8_t eea_api_wasm_end[] asm("_binary_eea_api_memory_export_wasm_end");
+#endif
+
+/**
+ * Loads a module on a new engine and finds its export. Load times are
+ * measured phase by phase by the lifecycle benchmark, so only failures
+ * are logged here. Returns NULL on failure.
+ */
+EEA_Engine *eea_benchmark_load(EEA_Engine_Kind kind, const char *label, const uint8_t *wasm, uint32_t size,
+  const EEA_Host_Function *functions, size_t count, const char *export_name, EEA_Engine_Function *function);
+
+/**
+ * "output verified", or "OUTPUT MISMATCH".
+ */
+const char *eea_benchmark_verified(bool verified);
+
+/**
+ * Logs a workload computed in WASM against the native host functions that
+ * replace it, as "<label> (<engine>): WASM <us> us, native <us> us
+ * (<n>x), output verified".
+ */
+void eea_benchmark_compare(const char *label, EEA_Engine *engine, int64_t wasm_us, int64_t native_us, bool verified);
+
+// The benchmarks, by subsystem.
+void eea_benchmark_bindings();                       // eea_benchmark_bindings.cpp
+void eea_benchmark_inflate();                        // eea_benchmark_bundle.cpp
+void eea_benchmark_bus();                            // eea_benchmark_bus.cpp
+void eea_benchmark_engine(EEA_Engine_Kind kind);     // eea_benchmark_engine.cpp
+void eea_benchmark_aggregate(EEA_Engine_Kind kind);  // eea_benchmark_aggregate.cpp
+void eea_benchmark_json(EEA_Engine_Kind kind);       // eea_benchmark_json.cpp
+void eea_benchmark_dsp(EEA_Engine_Kind kind);        // eea_benchmark_dsp.cpp
+
+#endif
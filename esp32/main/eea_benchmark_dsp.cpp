@@ -0,0 +1,251 @@
+/**
+ * Benchmarks of the DSP functions (eea_dsp.h).
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_benchmark_common.h"
+#include "eea_dsp.h"
+#include "eea_memory.h"
+
+#define EEA_BENCHMARK_FFT_SIZE 1024
+#define EEA_BENCHMARK_FFT_ITERATIONS 10
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * A radix-2 FFT computed in WASM, the way a workflow does without the DSP
+ * registered functions, as WAT:
+ *
+ * (module
+ *   (memory (export "memory") 1)
+ *   ;; In-place complex FFT of the n interleaved complex values at offset 0,
+ *   ;; with the n/2 twiddle factors written after them by the host.
+ *   ;; Returns the sum of the magnitudes of bins 0 to n/2.
+ *   (func (export "fft") (param $n i32) (result f32)
+ *     (local $i i32) (local $j i32) (local $m i32) (local $size i32) (local $half i32) (local $step i32)
+ *     (local $start i32) (local $k i32) (local $a i32) (local $b i32) (local $w i32)
+ *     (local $wr f32) (local $wi f32) (local $tr f32) (local $ti f32) (local $sum f32)
+ *     ;; Bit-reversal permutation.
+ *     (local.set $i (i32.const 1))
+ *     (local.set $j (i32.const 0))
+ *     (block (loop
+ *       (br_if 1 (i32.ge_u (local.get $i) (local.get $n)))
+ *       (local.set $m (i32.shr_u (local.get $n) (i32.const 1)))
+ *       (block (loop
+ *         (br_if 1 (i32.eqz (i32.and (local.get $j) (local.get $m))))
+ *         (local.set $j (i32.xor (local.get $j) (local.get $m)))
+ *         (local.set $m (i32.shr_u (local.get $m) (i32.const 1)))
+ *         (br 0)))
+ *       (local.set $j (i32.or (local.get $j) (local.get $m)))
+ *       (if (i32.lt_u (local.get $i) (local.get $j))
+ *         (then
+ *           (local.set $a (i32.shl (local.get $i) (i32.const 3)))
+ *           (local.set $b (i32.shl (local.get $j) (i32.const 3)))
+ *           (local.set $tr (f32.load (local.get $a)))
+ *           (local.set $ti (f32.load offset=4 (local.get $a)))
+ *           (f32.store (local.get $a) (f32.load (local.get $b)))
+ *           (f32.store offset=4 (local.get $a) (f32.load offset=4 (local.get $b)))
+ *           (f32.store (local.get $b) (local.get $tr))
+ *           (f32.store offset=4 (local.get $b) (local.get $ti))))
+ *       (local.set $i (i32.add (local.get $i) (i32.const 1)))
+ *       (br 0)))
+ *     ;; Butterflies.
+ *     (local.set $size (i32.const 2))
+ *     (block (loop
+ *       (br_if 1 (i32.gt_u (local.get $size) (local.get $n)))
+ *       (local.set $half (i32.shr_u (local.get $size) (i32.const 1)))
+ *       (local.set $step (i32.div_u (local.get $n) (local.get $size)))
+ *       (local.set $start (i32.const 0))
+ *       (block (loop
+ *         (br_if 1 (i32.ge_u (local.get $start) (local.get $n)))
+ *         (local.set $k (i32.const 0))
+ *         (block (loop
+ *           (br_if 1 (i32.ge_u (local.get $k) (local.get $half)))
+ *           (local.set $w (i32.shl (i32.add (local.get $n) (i32.mul (local.get $k) (local.get $step))) (i32.const 3)))
+ *           (local.set $wr (f32.load (local.get $w)))
+ *           (local.set $wi (f32.load offset=4 (local.get $w)))
+ *           (local.set $b (i32.add (local.tee $a (i32.shl (i32.add (local.get $start) (local.get $k)) (i32.const 3)))
+ *             (i32.shl (local.get $half) (i32.const 3))))
+ *           (local.set $tr (f32.sub (f32.mul (local.get $wr) (f32.load (local.get $b)))
+ *             (f32.mul (local.get $wi) (f32.load offset=4 (local.get $b)))))
+ *           (local.set $ti (f32.add (f32.mul (local.get $wr) (f32.load offset=4 (local.get $b)))
+ *             (f32.mul (local.get $wi) (f32.load (local.get $b)))))
+ *           (f32.store (local.get $b) (f32.sub (f32.load (local.get $a)) (local.get $tr)))
+ *           (f32.store offset=4 (local.get $b) (f32.sub (f32.load offset=4 (local.get $a)) (local.get $ti)))
+ *           (f32.store (local.get $a) (f32.add (f32.load (local.get $a)) (local.get $tr)))
+ *           (f32.store offset=4 (local.get $a) (f32.add (f32.load offset=4 (local.get $a)) (local.get $ti)))
+ *           (local.set $k (i32.add (local.get $k) (i32.const 1)))
+ *           (br 0)))
+ *         (local.set $start (i32.add (local.get $start) (local.get $size)))
+ *         (br 0)))
+ *       (local.set $size (i32.shl (local.get $size) (i32.const 1)))
+ *       (br 0)))
+ *     ;; Magnitudes.
+ *     (local.set $k (i32.const 0))
+ *     (block (loop
+ *       (br_if 1 (i32.gt_u (local.get $k) (i32.shr_u (local.get $n) (i32.const 1))))
+ *       (local.set $a (i32.shl (local.get $k) (i32.const 3)))
+ *       (local.set $sum (f32.add (local.get $sum) (f32.sqrt (f32.add
+ *         (f32.mul (local.tee $tr (f32.load (local.get $a))) (local.get $tr))
+ *         (f32.mul (local.tee $ti (f32.load offset=4 (local.get $a))) (local.get $ti))))))
+ *       (local.set $k (i32.add (local.get $k) (i32.const 1)))
+ *       (br 0)))
+ *     (local.get $sum)))
+ */
+static const uint8_t bench_fft_wasm[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+  0x01, 0x7f, 0x01, 0x7d, 0x03, 0x02, 0x01, 0x00, 0x05, 0x03, 0x01, 0x00,
+  0x01, 0x07, 0x10, 0x02, 0x06, 0x6d, 0x65, 0x6d, 0x6f, 0x72, 0x79, 0x02,
+  0x00, 0x03, 0x66, 0x66, 0x74, 0x00, 0x00, 0x0a, 0xbd, 0x03, 0x01, 0xba,
+  0x03, 0x02, 0x0b, 0x7f, 0x05, 0x7d, 0x41, 0x01, 0x21, 0x01, 0x41, 0x00,
+  0x21, 0x02, 0x02, 0x40, 0x03, 0x40, 0x20, 0x01, 0x20, 0x00, 0x4f, 0x0d,
+  0x01, 0x20, 0x00, 0x41, 0x01, 0x76, 0x21, 0x03, 0x02, 0x40, 0x03, 0x40,
+  0x20, 0x02, 0x20, 0x03, 0x71, 0x45, 0x0d, 0x01, 0x20, 0x02, 0x20, 0x03,
+  0x73, 0x21, 0x02, 0x20, 0x03, 0x41, 0x01, 0x76, 0x21, 0x03, 0x0c, 0x00,
+  0x0b, 0x0b, 0x20, 0x02, 0x20, 0x03, 0x72, 0x21, 0x02, 0x20, 0x01, 0x20,
+  0x02, 0x49, 0x04, 0x40, 0x20, 0x01, 0x41, 0x03, 0x74, 0x21, 0x09, 0x20,
+  0x02, 0x41, 0x03, 0x74, 0x21, 0x0a, 0x20, 0x09, 0x2a, 0x02, 0x00, 0x21,
+  0x0e, 0x20, 0x09, 0x2a, 0x02, 0x04, 0x21, 0x0f, 0x20, 0x09, 0x20, 0x0a,
+  0x2a, 0x02, 0x00, 0x38, 0x02, 0x00, 0x20, 0x09, 0x20, 0x0a, 0x2a, 0x02,
+  0x04, 0x38, 0x02, 0x04, 0x20, 0x0a, 0x20, 0x0e, 0x38, 0x02, 0x00, 0x20,
+  0x0a, 0x20, 0x0f, 0x38, 0x02, 0x04, 0x0b, 0x20, 0x01, 0x41, 0x01, 0x6a,
+  0x21, 0x01, 0x0c, 0x00, 0x0b, 0x0b, 0x41, 0x02, 0x21, 0x04, 0x02, 0x40,
+  0x03, 0x40, 0x20, 0x04, 0x20, 0x00, 0x4b, 0x0d, 0x01, 0x20, 0x04, 0x41,
+  0x01, 0x76, 0x21, 0x05, 0x20, 0x00, 0x20, 0x04, 0x6e, 0x21, 0x06, 0x41,
+  0x00, 0x21, 0x07, 0x02, 0x40, 0x03, 0x40, 0x20, 0x07, 0x20, 0x00, 0x4f,
+  0x0d, 0x01, 0x41, 0x00, 0x21, 0x08, 0x02, 0x40, 0x03, 0x40, 0x20, 0x08,
+  0x20, 0x05, 0x4f, 0x0d, 0x01, 0x20, 0x00, 0x20, 0x08, 0x20, 0x06, 0x6c,
+  0x6a, 0x41, 0x03, 0x74, 0x21, 0x0b, 0x20, 0x0b, 0x2a, 0x02, 0x00, 0x21,
+  0x0c, 0x20, 0x0b, 0x2a, 0x02, 0x04, 0x21, 0x0d, 0x20, 0x07, 0x20, 0x08,
+  0x6a, 0x41, 0x03, 0x74, 0x22, 0x09, 0x20, 0x05, 0x41, 0x03, 0x74, 0x6a,
+  0x21, 0x0a, 0x20, 0x0c, 0x20, 0x0a, 0x2a, 0x02, 0x00, 0x94, 0x20, 0x0d,
+  0x20, 0x0a, 0x2a, 0x02, 0x04, 0x94, 0x93, 0x21, 0x0e, 0x20, 0x0c, 0x20,
+  0x0a, 0x2a, 0x02, 0x04, 0x94, 0x20, 0x0d, 0x20, 0x0a, 0x2a, 0x02, 0x00,
+  0x94, 0x92, 0x21, 0x0f, 0x20, 0x0a, 0x20, 0x09, 0x2a, 0x02, 0x00, 0x20,
+  0x0e, 0x93, 0x38, 0x02, 0x00, 0x20, 0x0a, 0x20, 0x09, 0x2a, 0x02, 0x04,
+  0x20, 0x0f, 0x93, 0x38, 0x02, 0x04, 0x20, 0x09, 0x20, 0x09, 0x2a, 0x02,
+  0x00, 0x20, 0x0e, 0x92, 0x38, 0x02, 0x00, 0x20, 0x09, 0x20, 0x09, 0x2a,
+  0x02, 0x04, 0x20, 0x0f, 0x92, 0x38, 0x02, 0x04, 0x20, 0x08, 0x41, 0x01,
+  0x6a, 0x21, 0x08, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x07, 0x20, 0x04, 0x6a,
+  0x21, 0x07, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x04, 0x41, 0x01, 0x74, 0x21,
+  0x04, 0x0c, 0x00, 0x0b, 0x0b, 0x41, 0x00, 0x21, 0x08, 0x02, 0x40, 0x03,
+  0x40, 0x20, 0x08, 0x20, 0x00, 0x41, 0x01, 0x76, 0x4b, 0x0d, 0x01, 0x20,
+  0x08, 0x41, 0x03, 0x74, 0x21, 0x09, 0x20, 0x10, 0x20, 0x09, 0x2a, 0x02,
+  0x00, 0x22, 0x0e, 0x20, 0x0e, 0x94, 0x20, 0x09, 0x2a, 0x02, 0x04, 0x22,
+  0x0f, 0x20, 0x0f, 0x94, 0x92, 0x91, 0x92, 0x21, 0x10, 0x20, 0x08, 0x41,
+  0x01, 0x6a, 0x21, 0x08, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x10, 0x0b
+};
+
+/**
+ * Compares a 1024-point FFT of accelerometer-like samples computed in WASM
+ * with the native DSP functions (eea_dsp.h). The WASM kernel computes a
+ * complex FFT of the real samples; the native side windows the samples,
+ * computes a real FFT and converts it to amplitudes, as a workflow would.
+ * Both spectra are checked against each other.
+ */
+void eea_benchmark_dsp(EEA_Engine_Kind kind)
+{
+  EEA_Engine_Function fft_function;
+  EEA_Engine *engine = eea_benchmark_load(kind, "fft", bench_fft_wasm, sizeof(bench_fft_wasm),
+    NULL, 0, "fft", &fft_function);
+  if(engine == NULL) {
+    return;
+  }
+
+  // 50 Hz and 123.4 Hz vibrations sampled at 1 kHz.
+  const uint32_t n = EEA_BENCHMARK_FFT_SIZE;
+  const float sample_rate = 1000;
+  float *samples = (float*)eea_malloc(EEA_MEM_RUNTIME, n * sizeof(float), MALLOC_CAP_8BIT);
+  if(samples == NULL) {
+    delete engine;
+    return;
+  }
+  for(uint32_t i = 0; i < n; i++) {
+    samples[i] = 2.0f * sinf(2 * (float)M_PI * 50.0f * i / sample_rate) +
+      0.7f * sinf(2 * (float)M_PI * 123.4f * i / sample_rate);
+  }
+
+  // The samples as complex values, followed by the twiddle factors.
+  uint32_t memory_size = 0;
+  float *memory = (float*)engine->memory(&memory_size);
+  uint64_t size = n;
+  uint64_t wasm_result = 0;
+  EEA_Engine_Result result = NULL;
+  int64_t wasm_elapsed = 0;
+  for(uint32_t iteration = 0; iteration <= EEA_BENCHMARK_FFT_ITERATIONS && result == NULL; iteration++) {
+    for(uint32_t i = 0; i < n; i++) {
+      memory[2 * i] = samples[i];
+      memory[2 * i + 1] = 0;
+    }
+    for(uint32_t k = 0; k < n / 2; k++) {
+      memory[2 * n + 2 * k] = cosf(2 * (float)M_PI * k / n);
+      memory[2 * n + 2 * k + 1] = -sinf(2 * (float)M_PI * k / n);
+    }
+
+    // The first call includes wasm3's lazy compilation and isn't timed.
+    int64_t start = esp_timer_get_time();
+    result = engine->call(fft_function, 1, &size, &wasm_result);
+    if(iteration > 0) {
+      wasm_elapsed += esp_timer_get_time() - start;
+    }
+  }
+
+  if(result != NULL) {
+    ESP_LOGI(TAG, "FFT (%s): %s", engine->name, result);
+    eea_free(samples);
+    delete engine;
+    return;
+  }
+
+  EEA_Dsp *dsp = new EEA_Dsp(engine);
+  if(dsp->work == NULL) {
+    delete dsp;
+    eea_free(samples);
+    delete engine;
+    return;
+  }
+
+  // The sum of the unscaled magnitudes, as the WASM kernel computes it.
+  memcpy(dsp->work, samples, n * sizeof(float));
+  dsp->rfft(dsp->work, n);
+  float native_result = fabsf(dsp->work[0]) + fabsf(dsp->work[1]);
+  for(uint32_t k = 1; k < n / 2; k++) {
+    native_result += sqrtf(dsp->work[2 * k] * dsp->work[2 * k] + dsp->work[2 * k + 1] * dsp->work[2 * k + 1]);
+  }
+
+  float frequencies[2];
+  float amplitudes[2];
+  uint32_t found = 0;
+  int64_t start = esp_timer_get_time();
+  for(uint32_t iteration = 0; iteration < EEA_BENCHMARK_FFT_ITERATIONS; iteration++) {
+    memcpy(dsp->work, samples, n * sizeof(float));
+    dsp->window(dsp->work, n, EEA_DSP_WINDOW_HANN);
+    dsp->rfft(dsp->work, n);
+    dsp->amplitude(dsp->work, n);
+    found = dsp->peaks(dsp->work, n / 2 + 1, sample_rate, 0.1f, 2, frequencies, amplitudes);
+  }
+  int64_t native_elapsed = esp_timer_get_time() - start;
+
+  float wasm_value;
+  memcpy(&wasm_value, &wasm_result, sizeof(wasm_value));
+
+  char label[32];
+  snprintf(label, sizeof(label), "FFT of %u", n);
+  eea_benchmark_compare(label, engine, wasm_elapsed / EEA_BENCHMARK_FFT_ITERATIONS,
+    native_elapsed / EEA_BENCHMARK_FFT_ITERATIONS, fabsf(wasm_value - native_result) <= 0.001f * fabsf(native_result));
+  if(found == 2) {
+    ESP_LOGI(TAG, "FFT peaks: %.1f Hz (%.2f), %.1f Hz (%.2f)",
+      frequencies[0], amplitudes[0], frequencies[1], amplitudes[1]);
+  }
+
+  delete dsp;
+  eea_free(samples);
+  delete engine;
+}
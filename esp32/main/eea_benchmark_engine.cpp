@@ -0,0 +1,174 @@
+/**
+ * Benchmarks of the WASM engines themselves (eea_engine.h): interpreter
+ * throughput, interrupting a call, and the eea_loop call rate of a bundle.
+ */
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eea_benchmark_common.h"
+#include "eea_budget.h"
+
+#define EEA_BENCHMARK_COMPUTE_ITERATIONS 1000000
+#define EEA_BENCHMARK_LOOP_ITERATIONS 1000
+#define EEA_BENCHMARK_INTERRUPT_BUDGET_MS 100
+
+// Wasm instructions executed per iteration of the compute kernel's loop.
+#define EEA_BENCHMARK_COMPUTE_OPS_PER_ITERATION 21
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * A synthetic kernel, as WAT:
+ *
+ * (module
+ *   ;; An integer hash, iterated n times. 21 instructions per iteration.
+ *   (func (export "compute") (param $n i32) (result i32) (local $x i32) (local $i i32)
+ *     (local.set $x (i32.const 1))
+ *     (block (loop
+ *       (br_if 1 (i32.ge_u (local.get $i) (local.get $n)))
+ *       (local.set $x (i32.add (i32.mul (local.get $x) (i32.const 1103515245)) (i32.const 12345)))
+ *       (local.set $x (i32.xor (local.get $x) (i32.shr_u (local.get $x) (i32.const 16))))
+ *       (local.set $i (i32.add (local.get $i) (i32.const 1)))
+ *       (br 0)))
+ *     (local.get $x)))
+ */
+static const uint8_t bench_compute_wasm[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+  0x01, 0x7f, 0x01, 0x7f, 0x03, 0x02, 0x01, 0x00, 0x07, 0x0b, 0x01, 0x07,
+  0x63, 0x6f, 0x6d, 0x70, 0x75, 0x74, 0x65, 0x00, 0x00, 0x0a, 0x3c, 0x01,
+  0x3a, 0x01, 0x02, 0x7f, 0x41, 0x01, 0x21, 0x01, 0x02, 0x40, 0x03, 0x40,
+  0x20, 0x02, 0x20, 0x00, 0x4f, 0x0d, 0x01, 0x20, 0x01, 0x41, 0xed, 0x9c,
+  0x99, 0x8e, 0x04, 0x6c, 0x41, 0xb9, 0xe0, 0x00, 0x6a, 0x21, 0x01, 0x20,
+  0x01, 0x20, 0x01, 0x41, 0x10, 0x76, 0x73, 0x21, 0x01, 0x20, 0x02, 0x41,
+  0x01, 0x6a, 0x21, 0x02, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x01, 0x0b
+};
+
+/**
+ * Measures interpreter throughput on the compute kernel. The first call
+ * includes wasm3's lazy compilation, so the kernel is called once before
+ * it is timed.
+ */
+static void bench_compute(EEA_Engine_Kind kind)
+{
+  EEA_Engine_Function compute;
+  EEA_Engine *engine = eea_benchmark_load(kind, "compute", bench_compute_wasm, sizeof(bench_compute_wasm),
+    NULL, 0, "compute", &compute);
+  if(engine == NULL) {
+    return;
+  }
+
+  engine->call(compute, 1);
+
+  int64_t start = esp_timer_get_time();
+  EEA_Engine_Result result = engine->call(compute, EEA_BENCHMARK_COMPUTE_ITERATIONS);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  if(result == NULL && elapsed > 0) {
+    uint64_t instructions = (uint64_t)EEA_BENCHMARK_COMPUTE_ITERATIONS * EEA_BENCHMARK_COMPUTE_OPS_PER_ITERATION;
+    ESP_LOGI(TAG, "Compute kernel (%s): %llu instructions in %lld us, %llu instructions/s",
+      engine->name, instructions, elapsed, instructions * 1000000ULL / elapsed);
+  } else {
+    ESP_LOGI(TAG, "Compute kernel (%s): %s", engine->name, result);
+  }
+
+  delete engine;
+}
+
+/**
+ * An infinite loop that never calls a function, as WAT:
+ *
+ * (module
+ *   (func (export "spin") (loop (br 0))))
+ */
+static const uint8_t bench_spin_wasm[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x04, 0x01, 0x60,
+  0x00, 0x00, 0x03, 0x02, 0x01, 0x00, 0x07, 0x08, 0x01, 0x04, 0x73, 0x70,
+  0x69, 0x6e, 0x00, 0x00, 0x0a, 0x09, 0x01, 0x07, 0x00, 0x03, 0x40, 0x0c,
+  0x00, 0x0b, 0x0b
+};
+
+/**
+ * Checks that the execution budget stops a call-free infinite loop, and
+ * how long after the budget expired the call returned. An engine that
+ * can't interrupt the loop never returns from this check.
+ */
+static void bench_interrupt(EEA_Engine_Kind kind)
+{
+  EEA_Engine_Function spin;
+  EEA_Engine *engine = eea_benchmark_load(kind, "spin", bench_spin_wasm, sizeof(bench_spin_wasm),
+    NULL, 0, "spin", &spin);
+  if(engine == NULL) {
+    return;
+  }
+
+  EEA_Budget budget(EEA_BENCHMARK_INTERRUPT_BUDGET_MS);
+  int64_t start = esp_timer_get_time();
+  EEA_Engine_Result result = budget.call(engine, spin, 0, NULL);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  ESP_LOGI(TAG, "Interrupt (%s): call-free loop returned after %lld us (budget %u ms), %s",
+    engine->name, elapsed, EEA_BENCHMARK_INTERRUPT_BUDGET_MS,
+    result == eea_err_budget_exceeded ? "interrupted" : "NOT INTERRUPTED");
+
+  delete engine;
+}
+
+#if EEA_BENCHMARK_BUNDLES
+static int32_t eea_trace(EEA_Span<char> message, uint32_t level)
+{
+  return 0;
+}
+
+// The walkthrough hello-world bundle only imports eea_trace. Tracing is
+// a no-op so the console doesn't dominate the loop time.
+static const EEA_Host_Function bench_bundle_functions[] = {
+  EEA_HOST_FUNCTION(eea_trace)
+};
+
+/**
+ * Measures the eea_loop call rate of the walkthrough hello-world bundle.
+ * Its load time is measured by the lifecycle benchmark.
+ */
+static void bench_bundle_loop(EEA_Engine_Kind kind)
+{
+  EEA_Engine_Function eea_init;
+  EEA_Engine *engine = eea_benchmark_load(kind, "hello-world", hello_world_wasm_start,
+    hello_world_wasm_end - hello_world_wasm_start,
+    bench_bundle_functions, sizeof(bench_bundle_functions) / sizeof(bench_bundle_functions[0]),
+    "eea_init", &eea_init);
+  if(engine == NULL) {
+    return;
+  }
+
+  EEA_Engine_Function eea_loop;
+  EEA_Engine_Result result = engine->find(&eea_loop, "eea_loop");
+  if(result == NULL) {
+    result = engine->call(eea_init);
+  }
+
+  int64_t start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_LOOP_ITERATIONS && result == NULL; i++) {
+    result = engine->call(eea_loop, i);
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  if(result == NULL && elapsed > 0) {
+    ESP_LOGI(TAG, "hello-world eea_loop (%s): %u calls in %lld us, %lld ns/call",
+      engine->name, EEA_BENCHMARK_LOOP_ITERATIONS, elapsed, elapsed * 1000 / EEA_BENCHMARK_LOOP_ITERATIONS);
+  } else {
+    ESP_LOGI(TAG, "hello-world eea_loop (%s): %s", engine->name, result);
+  }
+
+  delete engine;
+}
+#endif
+
+void eea_benchmark_engine(EEA_Engine_Kind kind)
+{
+  bench_compute(kind);
+  bench_interrupt(kind);
+#if EEA_BENCHMARK_BUNDLES
+  bench_bundle_loop(kind);
+#endif
+}
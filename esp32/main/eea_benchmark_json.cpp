@@ -0,0 +1,135 @@
+/**
+ * Benchmarks of the JSON functions (eea_json.h).
+ */
+
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eea_benchmark_common.h"
+#include "eea_config.h"
+#include "eea_json.h"
+
+#define EEA_BENCHMARK_JSON_ITERATIONS 100
+#define EEA_BENCHMARK_JSON_SETPOINTS 512
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * A message handler, as WAT:
+ *
+ * (module
+ *   (memory (export "memory") 1)
+ *   ;; Sums the decimal numbers in the first len bytes of memory,
+ *   ;; like a message handler extracting values from a JSON payload.
+ *   (func (export "handle") (param $len i32) (result i32) (local $i i32) (local $sum i32) (local $value i32) (local $c i32)
+ *     (block (loop
+ *       (br_if 1 (i32.ge_u (local.get $i) (local.get $len)))
+ *       (local.set $c (i32.load8_u (local.get $i)))
+ *       (if (i32.lt_u (i32.sub (local.get $c) (i32.const 48)) (i32.const 10))
+ *         (then (local.set $value (i32.sub (i32.add (i32.mul (local.get $value) (i32.const 10)) (local.get $c)) (i32.const 48))))
+ *         (else
+ *           (local.set $sum (i32.add (local.get $sum) (local.get $value)))
+ *           (local.set $value (i32.const 0))))
+ *       (local.set $i (i32.add (local.get $i) (i32.const 1)))
+ *       (br 0)))
+ *     (i32.add (local.get $sum) (local.get $value))))
+ */
+static const uint8_t bench_handle_wasm[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+  0x01, 0x7f, 0x01, 0x7f, 0x03, 0x02, 0x01, 0x00, 0x05, 0x03, 0x01, 0x00,
+  0x01, 0x07, 0x13, 0x02, 0x06, 0x6d, 0x65, 0x6d, 0x6f, 0x72, 0x79, 0x02,
+  0x00, 0x06, 0x68, 0x61, 0x6e, 0x64, 0x6c, 0x65, 0x00, 0x00, 0x0a, 0x4c,
+  0x01, 0x4a, 0x01, 0x04, 0x7f, 0x02, 0x40, 0x03, 0x40, 0x20, 0x01, 0x20,
+  0x00, 0x4f, 0x0d, 0x01, 0x20, 0x01, 0x2d, 0x00, 0x00, 0x21, 0x04, 0x20,
+  0x04, 0x41, 0x30, 0x6b, 0x41, 0x0a, 0x49, 0x04, 0x40, 0x20, 0x03, 0x41,
+  0x0a, 0x6c, 0x20, 0x04, 0x6a, 0x41, 0x30, 0x6b, 0x21, 0x03, 0x05, 0x20,
+  0x02, 0x20, 0x03, 0x6a, 0x21, 0x02, 0x41, 0x00, 0x21, 0x03, 0x0b, 0x20,
+  0x01, 0x41, 0x01, 0x6a, 0x21, 0x01, 0x0c, 0x00, 0x0b, 0x0b, 0x20, 0x02,
+  0x20, 0x03, 0x6a, 0x0b
+};
+
+/**
+ * Compares extracting fields from a multi-KB command payload in WASM with
+ * the native JSON functions (eea_json.h). The WASM side is the message
+ * handler's byte scan, a lower bound for any parser written in WASM. The
+ * native side parses the payload and fetches four fields, without the
+ * host call overhead.
+ */
+void eea_benchmark_json(EEA_Engine_Kind kind)
+{
+  EEA_Engine_Function handle;
+  EEA_Engine *engine = eea_benchmark_load(kind, "handle", bench_handle_wasm, sizeof(bench_handle_wasm),
+    NULL, 0, "handle", &handle);
+  if(engine == NULL) {
+    return;
+  }
+
+  // A command as it arrives on toAgent/command, built in linear memory.
+  uint32_t memory_size = 0;
+  char *payload = (char*)engine->memory(&memory_size);
+  uint32_t length = snprintf(payload, EEA_PAYLOAD_SIZE_BYTES,
+    "{\"name\":\"setpoints\",\"time\":{\"$date\":\"2022-04-15T12:00:00.000Z\"},"
+    "\"payload\":{\"mode\":\"auto\",\"zone\":{\"id\":12,\"target\":2150},\"setpoints\":[");
+  for(uint32_t i = 0; i < EEA_BENCHMARK_JSON_SETPOINTS; i++) {
+    length += snprintf(payload + length, EEA_PAYLOAD_SIZE_BYTES - length, "%s%u", i == 0 ? "" : ",", 1000 + i);
+  }
+  length += snprintf(payload + length, EEA_PAYLOAD_SIZE_BYTES - length, "]}}");
+
+  // The sum of the decimal numbers in the payload, as the kernel computes it.
+  uint32_t expected = 0;
+  uint32_t value = 0;
+  for(uint32_t i = 0; i < length; i++) {
+    if(payload[i] >= '0' && payload[i] <= '9') {
+      value = value * 10 + (payload[i] - '0');
+    } else {
+      expected += value;
+      value = 0;
+    }
+  }
+  expected += value;
+
+  uint64_t wasm_length = length;
+  uint64_t wasm_result = 0;
+  EEA_Engine_Result result = engine->call(handle, 1, &wasm_length, &wasm_result);
+  int64_t start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_JSON_ITERATIONS && result == NULL; i++) {
+    result = engine->call(handle, 1, &wasm_length, &wasm_result);
+  }
+  int64_t wasm_elapsed = esp_timer_get_time() - start;
+
+  if(result != NULL) {
+    ESP_LOGI(TAG, "JSON (%s): %s", engine->name, result);
+    delete engine;
+    return;
+  }
+
+  EEA_Json *json = new EEA_Json(engine);
+  double native_result = 0;
+  int32_t tokens = 0;
+  start = esp_timer_get_time();
+  for(uint32_t i = 0; i < EEA_BENCHMARK_JSON_ITERATIONS && tokens >= 0; i++) {
+    tokens = json->parse(payload, length);
+    const EEA_Json_Token *id = json->find("payload.zone.id", 15);
+    const EEA_Json_Token *target = json->find("payload.zone.target", 19);
+    const EEA_Json_Token *setpoints = json->find("payload.setpoints", 17);
+    const EEA_Json_Token *last = json->find("payload.setpoints[511]", 22);
+    if(id == NULL || target == NULL || setpoints == NULL || last == NULL) {
+      tokens = -1;
+      break;
+    }
+    native_result = json->number(id) + json->number(target) + json->count(setpoints) + json->number(last);
+  }
+  int64_t native_elapsed = esp_timer_get_time() - start;
+
+  bool verified = (uint32_t)wasm_result == expected &&
+    native_result == 12 + 2150 + EEA_BENCHMARK_JSON_SETPOINTS + (1000 + EEA_BENCHMARK_JSON_SETPOINTS - 1);
+  char label[64];
+  snprintf(label, sizeof(label), "JSON payload of %u bytes, %d tokens, %u parses",
+    length, tokens, EEA_BENCHMARK_JSON_ITERATIONS);
+  eea_benchmark_compare(label, engine, wasm_elapsed, native_elapsed, verified);
+
+  delete json;
+  delete engine;
+}
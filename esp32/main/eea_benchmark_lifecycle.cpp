@@ -0,0 +1,318 @@
+/**
+ * The bundle lifecycle benchmark: loading and destroying bundles through
+ * the runtime's deploy path. See eea_benchmark.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_benchmark.h"
+#include "eea_benchmark_common.h"
+#include "eea_memory.h"
+#include "eea_runtime.h"
+
+#define EEA_BENCHMARK_LIFECYCLE_CYCLES 20
+#define EEA_BENCHMARK_SYNTHETIC_OPS 24
+
+static const char *TAG = "EEA_BENCHMARK";
+
+/**
+ * Writes a WASM module, with a 5-byte LEB128 placeholder for each size
+ * that is only known once its contents are written.
+ */
+struct bench_writer
+{
+  uint8_t *data;
+  uint32_t length;
+
+  void byte(uint8_t value)
+  {
+    data[length++] = value;
+  }
+
+  void leb(uint32_t value)
+  {
+    do {
+      uint8_t b = value & 0x7F;
+      value >>= 7;
+      byte(value != 0 ? b | 0x80 : b);
+    } while(value != 0);
+  }
+
+  void name(const char *value)
+  {
+    uint32_t size = strlen(value);
+    leb(size);
+    memcpy(data + length, value, size);
+    length += size;
+  }
+
+  uint32_t begin_size()
+  {
+    uint32_t at = length;
+    length += 5;
+    return at;
+  }
+
+  void end_size(uint32_t at)
+  {
+    uint32_t size = length - at - 5;
+    for(uint32_t i = 0; i < 5; i++) {
+      data[at + i] = ((size >> (7 * i)) & 0x7F) | (i < 4 ? 0x80 : 0);
+    }
+  }
+};
+
+/**
+ * Writes a bundle with the exports the runtime requires and a number of
+ * generated functions, each a run of integer arithmetic. eea_init calls
+ * every one of them, so larger bundles spend longer in parsing, in wasm3's
+ * compilation and in eea_init. eea_init also calls the eea_trace import.
+ * Returns the size of the module.
+ */
+static uint32_t bench_synthetic_bundle(uint8_t *out, uint32_t functions, const char *bundle_id)
+{
+  bench_writer w = { out, 0 };
+  const uint8_t header[] = { 0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00 };
+  memcpy(w.data, header, sizeof(header));
+  w.length = sizeof(header);
+
+  // Types: () -> i32, (i64) -> (), (i32) -> (), (i32, i32, i32) -> i32.
+  const uint8_t types[] = { 0x04, 0x60, 0x00, 0x01, 0x7F, 0x60, 0x01, 0x7E, 0x00, 0x60, 0x01, 0x7F, 0x00,
+    0x60, 0x03, 0x7F, 0x7F, 0x7F, 0x01, 0x7F };
+  w.byte(0x01);
+  w.leb(sizeof(types));
+  memcpy(w.data + w.length, types, sizeof(types));
+  w.length += sizeof(types);
+
+  // Function 0 is the eea_trace import.
+  w.byte(0x02);
+  uint32_t section = w.begin_size();
+  w.leb(1);
+  w.name("env");
+  w.name("eea_trace");
+  w.byte(0x00);
+  w.leb(3);
+  w.end_size(section);
+
+  // The generated functions are 1 to functions, followed by eea_init,
+  // eea_loop, eea_message_received and eea_set_connection_status.
+  uint32_t eea_init = functions + 1;
+  w.byte(0x03);
+  section = w.begin_size();
+  w.leb(functions + 4);
+  for(uint32_t i = 0; i <= functions; i++) {
+    w.leb(0);
+  }
+  w.leb(1);
+  w.leb(2);
+  w.leb(2);
+  w.end_size(section);
+
+  // One page of memory.
+  const uint8_t memory[] = { 0x05, 0x03, 0x01, 0x00, 0x01 };
+  memcpy(w.data + w.length, memory, sizeof(memory));
+  w.length += sizeof(memory);
+
+  // BUNDLE_IDENTIFIER_LENGTH and BUNDLE_IDENTIFIER are the addresses of
+  // the length byte and the identifier in the data section.
+  const uint8_t globals[] = { 0x06, 0x0B, 0x02, 0x7F, 0x00, 0x41, 0x08, 0x0B, 0x7F, 0x00, 0x41, 0x10, 0x0B };
+  memcpy(w.data + w.length, globals, sizeof(globals));
+  w.length += sizeof(globals);
+
+  w.byte(0x07);
+  section = w.begin_size();
+  w.leb(7);
+  w.name("memory");
+  w.byte(0x02);
+  w.leb(0);
+  const char *exports[] = { "eea_init", "eea_loop", "eea_message_received", "eea_set_connection_status" };
+  for(uint32_t i = 0; i < 4; i++) {
+    w.name(exports[i]);
+    w.byte(0x00);
+    w.leb(eea_init + i);
+  }
+  w.name("BUNDLE_IDENTIFIER_LENGTH");
+  w.byte(0x03);
+  w.leb(0);
+  w.name("BUNDLE_IDENTIFIER");
+  w.byte(0x03);
+  w.leb(1);
+  w.end_size(section);
+
+  w.byte(0x0A);
+  section = w.begin_size();
+  w.leb(functions + 4);
+  for(uint32_t i = 1; i <= functions; i++) {
+    uint32_t body = w.begin_size();
+    w.leb(0);
+    w.byte(0x41);
+    w.leb(i & 0x3F);
+    for(uint32_t op = 0; op < EEA_BENCHMARK_SYNTHETIC_OPS; op++) {
+      w.byte(0x41);
+      w.leb((i * 31 + op) & 0x3F);
+      w.byte(op & 1 ? 0x6A : 0x73);  // i32.add, i32.xor
+    }
+    w.byte(0x0B);
+    w.end_size(body);
+  }
+
+  uint32_t id_length = strlen(bundle_id);
+  uint32_t body = w.begin_size();
+  w.leb(0);
+  for(uint32_t i = 1; i <= functions; i++) {
+    w.byte(0x10);
+    w.leb(i);
+    w.byte(0x1A);
+  }
+  w.byte(0x41);
+  w.leb(16);
+  w.byte(0x41);
+  w.leb(id_length);
+  w.byte(0x41);
+  w.leb(0);
+  w.byte(0x10);
+  w.leb(0);
+  w.byte(0x1A);
+  w.byte(0x41);
+  w.leb(0);
+  w.byte(0x0B);
+  w.end_size(body);
+
+  // eea_loop, eea_message_received and eea_set_connection_status do nothing.
+  for(uint32_t i = 0; i < 3; i++) {
+    const uint8_t empty[] = { 0x02, 0x00, 0x0B };
+    memcpy(w.data + w.length, empty, sizeof(empty));
+    w.length += sizeof(empty);
+  }
+  w.end_size(section);
+
+  // The identifier's length byte at 8, and the identifier at 16.
+  w.byte(0x0B);
+  section = w.begin_size();
+  w.leb(1);
+  const uint8_t offset[] = { 0x00, 0x41, 0x08, 0x0B };
+  memcpy(w.data + w.length, offset, sizeof(offset));
+  w.length += sizeof(offset);
+  w.leb(8 + id_length);
+  w.byte(id_length);
+  memset(w.data + w.length, 0, 7);
+  w.length += 7;
+  memcpy(w.data + w.length, bundle_id, id_length);
+  w.length += id_length;
+  w.end_size(section);
+
+  return w.length;
+}
+
+/**
+ * Loads the bundle in the staging slot and destroys it
+ * EEA_BENCHMARK_LIFECYCLE_CYCLES times, and logs the mean of each phase.
+ * The first cycle includes one-time initialization, so memory is compared
+ * from the end of the first cycle to the end of the last.
+ */
+static void bench_lifecycle(EEA_Runtime *eea_runtime, const char *label)
+{
+  EEA_Lifecycle_Timing sum;
+  memset(&sum, 0, sizeof(sum));
+  uint32_t module_size = eea_runtime->staging->bundle_size;
+  const char *engine_name = "";
+  int64_t load_us = 0;
+  int64_t max_load_us = 0;
+  int64_t destroy_us = 0;
+  uint32_t arena_peak = 0;
+  uint32_t live_bytes = 0;
+  size_t heap_free = 0;
+
+  // Logging is slow enough to dominate some phases.
+  esp_log_level_set("*", ESP_LOG_WARN);
+
+  uint32_t cycle;
+  for(cycle = 0; cycle < EEA_BENCHMARK_LIFECYCLE_CYCLES; cycle++) {
+    int64_t start = esp_timer_get_time();
+    if(start_bundle(eea_runtime, false) != 0) {
+      break;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    engine_name = eea_runtime->engine->name;
+
+    start = esp_timer_get_time();
+    destroy_wasm(eea_runtime);
+    destroy_us += esp_timer_get_time() - start;
+
+    load_us += elapsed;
+    max_load_us = elapsed > max_load_us ? elapsed : max_load_us;
+
+    const EEA_Lifecycle_Timing *timing = &(eea_runtime->lifecycle);
+    sum.create_us += timing->create_us;
+    sum.link_us += timing->link_us;
+    sum.load.setup_us += timing->load.setup_us;
+    sum.load.parse_us += timing->load.parse_us;
+    sum.load.instantiate_us += timing->load.instantiate_us;
+    sum.load.link_us += timing->load.link_us;
+    sum.find_us += timing->find_us;
+    sum.config_us += timing->config_us;
+    sum.init_us += timing->init_us;
+    sum.hello_us += timing->hello_us;
+    sum.shutdown_us += timing->shutdown_us;
+    sum.free_us += timing->free_us;
+    sum.reset_us += timing->reset_us;
+    arena_peak = timing->arena_high_water > arena_peak ? timing->arena_high_water : arena_peak;
+    sum.arena_residual = timing->arena_residual;
+
+    if(cycle == 0) {
+      live_bytes = eea_memory_live_bytes();
+      heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    }
+  }
+
+  esp_log_level_set("*", ESP_LOG_INFO);
+
+  if(cycle == 0) {
+    ESP_LOGI(TAG, "Lifecycle %s (%u bytes): failed to load.", label, module_size);
+    return;
+  }
+
+  int32_t leaked = (int32_t)(eea_memory_live_bytes() - live_bytes);
+  int32_t heap_lost = (int32_t)(heap_free - heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  ESP_LOGI(TAG, "Lifecycle %s (%u bytes, %s, %u cycles): load %lld us (max %lld): create %lld, link %lld, "
+    "setup %lld, parse %lld, instantiate %lld, import %lld, find %lld, config %lld, eea_init %lld, hello %lld. "
+    "Destroy %lld us: shutdown %lld, free %lld, reset %lld.",
+    label, module_size, engine_name, cycle, load_us / cycle, max_load_us, sum.create_us / cycle,
+    sum.link_us / cycle, sum.load.setup_us / cycle, sum.load.parse_us / cycle, sum.load.instantiate_us / cycle,
+    sum.load.link_us / cycle, sum.find_us / cycle, sum.config_us / cycle, sum.init_us / cycle,
+    sum.hello_us / cycle, destroy_us / cycle, sum.shutdown_us / cycle, sum.free_us / cycle, sum.reset_us / cycle);
+  ESP_LOGI(TAG, "Lifecycle %s: arena peak %u bytes, %u bytes left to the reset, %s (%d bytes tagged, %d bytes heap).",
+    label, arena_peak, sum.arena_residual, leaked == 0 && heap_lost <= 0 ? "no leaks" : "MEMORY LEAKED",
+    leaked, heap_lost);
+}
+
+void eea_benchmark_lifecycle(EEA_Runtime *eea_runtime)
+{
+  ESP_LOGI(TAG, "Running the bundle lifecycle benchmark...");
+  EEA_Bundle_Slot *staging = eea_runtime->staging;
+
+#if EEA_BENCHMARK_BUNDLES
+  staging->bundle_size = hello_world_wasm_end - hello_world_wasm_start;
+  memcpy(staging->bundle, hello_world_wasm_start, staging->bundle_size);
+  bench_lifecycle(eea_runtime, "hello-world");
+
+  staging->bundle_size = eea_api_wasm_end - eea_api_wasm_start;
+  memcpy(staging->bundle, eea_api_wasm_start, staging->bundle_size);
+  bench_lifecycle(eea_runtime, "eea-api");
+#endif
+
+  const uint32_t sizes[] = { 16, 128, 1024 };
+  for(uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char label[32];
+    snprintf(label, sizeof(label), "synthetic-%u", sizes[i]);
+    staging->bundle_size = bench_synthetic_bundle((uint8_t*)staging->bundle, sizes[i], label);
+    bench_lifecycle(eea_runtime, label);
+  }
+
+  ESP_LOGI(TAG, "Bundle lifecycle benchmark complete.");
+}
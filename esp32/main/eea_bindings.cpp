@@ -0,0 +1,35 @@
+/**
+ * Links tables of host functions generated by eea_bindings.h.
+ */
+
+#include "esp_log.h"
+
+#include "eea_bindings.h"
+
+#include <wasm3.h>
+#include <m3_env.h>
+
+static const char *TAG = "EEA_BINDINGS";
+
+int eea_link_host_functions(IM3Module wasm_module, const char *module_name,
+  const EEA_Host_Function *functions, size_t count, void *userdata)
+{
+  int failures = 0;
+
+  for(size_t i = 0; i < count; i++) {
+    M3Result result = m3_LinkRawFunctionEx(wasm_module, module_name,
+      functions[i].name, functions[i].signature, functions[i].call, userdata);
+
+    // Bundles only import the functions their workflows use.
+    if(result == m3Err_functionLookupFailed) {
+      continue;
+    }
+
+    if(result != m3Err_none) {
+      ESP_LOGI(TAG, "%s link %s", functions[i].name, result);
+      failures++;
+    }
+  }
+
+  return failures;
+}
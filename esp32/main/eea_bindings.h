@@ -0,0 +1,473 @@
+#ifndef EEA_BINDINGS_H
+#define EEA_BINDINGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#include <wasm3.h>
+#include <m3_env.h>
+
+/**
+ * Compile-time host function bindings.
+ *
+ * Host functions (EEA API imports and registered functions) are written as
+ * plain C++ functions. The wasm3 signature string and the argument
+ * marshalling are derived from the function type, so a mismatch between the
+ * C++ declaration and the signature string is no longer possible.
+ *
+ * Type mapping:
+ *   integers up to 32 bits (and bool) -> i
+ *   64-bit integers                   -> I
+ *   float                             -> f
+ *   double                            -> F
+ *   EEA_Span<T>                       -> *i (offset and count in linear memory)
+ *   EEA_Array<T, N>                   -> *  (offset, count in argument N)
+ *   EEA_Out<T>                        -> *  (offset in linear memory)
+ *   void return                       -> v
+ *
+ * Guest memory is only reached through these types. Before the
+ * host function runs, the binding checks that every span and output lies
+ * inside linear memory, and traps with an out of bounds memory access
+ * otherwise, so a bad offset or length from a bundle can't reach the arena
+ * or the runtime around linear memory.
+ *
+ * A host function that needs per-link state declares EEA_Host_Context as its
+ * first parameter. It receives the userdata passed to eea_link_host_functions
+ * and does not appear in the wasm signature.
+ *
+ * The generated trampolines do not allocate or log. When the WAMR engine is
+ * built in (EEA_ENGINE_WAMR), each entry also gets a WAMR raw native
+ * trampoline, so the same tables link into either engine.
+ */
+struct EEA_Host_Context
+{
+  void *userdata;
+};
+
+/**
+ * count values of T in linear memory, passed as two i32 arguments: the
+ * offset and count. data is not aligned for T, so values are copied with
+ * memcpy.
+ */
+template <typename T>
+struct EEA_Span
+{
+  char *data;
+  uint32_t count;
+};
+
+/**
+ * Like EEA_Span, for an array whose count is not the next argument: it is
+ * wasm argument N (counting from 0, with each span taking two).
+ */
+template <typename T, size_t N>
+struct EEA_Array
+{
+  char *data;
+  uint32_t count;
+};
+
+/**
+ * A T the host function writes to linear memory, passed as an i32 offset.
+ */
+template <typename T>
+struct EEA_Out
+{
+  char *data;
+
+  void set(T value) const
+  {
+    memcpy(this->data, &value, sizeof(value));
+  }
+};
+
+#if EEA_ENGINE_WAMR
+/**
+ * A WAMR raw native function. Arguments are read from args and the
+ * return value is written to args[0].
+ */
+typedef void (*EEA_Native_Call)(void *exec_env, uint64_t *args);
+
+// Implemented by the WAMR engine (eea_engine_wamr.cpp).
+void *eea_wamr_memory(void *exec_env, uint32_t *size);
+void *eea_wamr_userdata(void *exec_env);
+void eea_wamr_trap(void *exec_env, const char *message);
+#endif
+
+/**
+ * One entry in a table of host functions. Build entries with EEA_HOST_FUNCTION.
+ */
+struct EEA_Host_Function
+{
+  const char *name;
+  const char *signature;
+  M3RawCall call;
+#if EEA_ENGINE_WAMR
+  const char *native_signature;
+  EEA_Native_Call native_call;
+#endif
+};
+
+namespace eea_bindings {
+
+template <size_t... I> struct index_sequence {};
+template <size_t N, size_t... I> struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+template <size_t... I> struct make_index_sequence<0, I...> { typedef index_sequence<I...> type; };
+
+/**
+ * Signature characters, joined at compile time into a string.
+ */
+template <char... C> struct chars {};
+
+template <typename A, typename B> struct concat;
+template <char... A, char... B> struct concat<chars<A...>, chars<B...> > { typedef chars<A..., B...> type; };
+
+template <typename... L> struct join { typedef chars<> type; };
+template <typename H, typename... T> struct join<H, T...> { typedef typename concat<H, typename join<T...>::type>::type type; };
+
+/**
+ * Signature characters, stack slots and conversion for each supported type.
+ * Pointers are passed to WAMR raw natives as plain offsets, so they are
+ * checked by WAMR as i32 (native_codes) and by the binding itself (check).
+ */
+template <typename T, typename Enable = void> struct value;
+
+struct scalar
+{
+  static const size_t slots = 1;
+  static bool check(uint64_t *, size_t, uint32_t) { return true; }
+};
+
+template <typename T>
+struct value<T, typename std::enable_if<std::is_integral<T>::value && sizeof(T) <= 4>::type> : scalar
+{
+  typedef chars<'i'> codes;
+  typedef chars<'i'> native_codes;
+  static T get(uint64_t *args, size_t slot, void *) { return (T)(*(uint32_t*)(args + slot)); }
+  static void set(uint64_t *slot, T v) { *(int32_t*)slot = (int32_t)v; }
+};
+
+template <typename T>
+struct value<T, typename std::enable_if<std::is_integral<T>::value && sizeof(T) == 8>::type> : scalar
+{
+  typedef chars<'I'> codes;
+  typedef chars<'I'> native_codes;
+  static T get(uint64_t *args, size_t slot, void *) { return (T)(args[slot]); }
+  static void set(uint64_t *slot, T v) { *(int64_t*)slot = (int64_t)v; }
+};
+
+template <>
+struct value<float, void> : scalar
+{
+  typedef chars<'f'> codes;
+  typedef chars<'f'> native_codes;
+  static float get(uint64_t *args, size_t slot, void *) { return *(float*)(args + slot); }
+  static void set(uint64_t *slot, float v) { *(float*)slot = v; }
+};
+
+template <>
+struct value<double, void> : scalar
+{
+  typedef chars<'F'> codes;
+  typedef chars<'F'> native_codes;
+  static double get(uint64_t *args, size_t slot, void *) { return *(double*)(args + slot); }
+  static void set(uint64_t *slot, double v) { *(double*)slot = v; }
+};
+
+template <typename T>
+struct value<EEA_Span<T>, void>
+{
+  typedef chars<'*', 'i'> codes;
+  typedef chars<'i', 'i'> native_codes;
+  static const size_t slots = 2;
+
+  // 64-bit, so neither the sum nor the product can wrap.
+  static bool check(uint64_t *args, size_t slot, uint32_t memory_size)
+  {
+    return (uint64_t)*(uint32_t*)(args + slot) + (uint64_t)*(uint32_t*)(args + slot + 1) * sizeof(T) <= memory_size;
+  }
+
+  static EEA_Span<T> get(uint64_t *args, size_t slot, void *mem)
+  {
+    EEA_Span<T> span = { (char*)mem + *(uint32_t*)(args + slot), *(uint32_t*)(args + slot + 1) };
+    return span;
+  }
+};
+
+template <typename T, size_t N>
+struct value<EEA_Array<T, N>, void>
+{
+  typedef chars<'*'> codes;
+  typedef chars<'i'> native_codes;
+  static const size_t slots = 1;
+
+  static bool check(uint64_t *args, size_t slot, uint32_t memory_size)
+  {
+    return (uint64_t)*(uint32_t*)(args + slot) + (uint64_t)*(uint32_t*)(args + N) * sizeof(T) <= memory_size;
+  }
+
+  static EEA_Array<T, N> get(uint64_t *args, size_t slot, void *mem)
+  {
+    EEA_Array<T, N> array = { (char*)mem + *(uint32_t*)(args + slot), *(uint32_t*)(args + N) };
+    return array;
+  }
+};
+
+template <typename T>
+struct value<EEA_Out<T>, void>
+{
+  typedef chars<'*'> codes;
+  typedef chars<'i'> native_codes;
+  static const size_t slots = 1;
+
+  static bool check(uint64_t *args, size_t slot, uint32_t memory_size)
+  {
+    return (uint64_t)*(uint32_t*)(args + slot) + sizeof(T) <= memory_size;
+  }
+
+  static EEA_Out<T> get(uint64_t *args, size_t slot, void *mem)
+  {
+    EEA_Out<T> out = { (char*)mem + *(uint32_t*)(args + slot) };
+    return out;
+  }
+};
+
+template <typename R> struct result
+{
+  typedef typename value<R>::codes codes;
+  typedef typename value<R>::native_codes native_codes;
+};
+
+template <> struct result<void>
+{
+  typedef chars<'v'> codes;
+  typedef chars<> native_codes;
+};
+
+/**
+ * The stack slot of argument I, counting the slots of the ones before it.
+ */
+template <size_t I, typename... Args> struct slot_of;
+
+template <typename H, typename... T>
+struct slot_of<0, H, T...>
+{
+  static const size_t offset = 0;
+};
+
+template <size_t I, typename H, typename... T>
+struct slot_of<I, H, T...>
+{
+  static const size_t offset = value<H>::slots + slot_of<I - 1, T...>::offset;
+};
+
+/**
+ * Returns false if any pointer argument lies outside linear memory.
+ */
+template <typename... Args, size_t... I>
+bool check(uint64_t *args, uint32_t memory_size, index_sequence<I...>)
+{
+  const bool checks[] = { true, value<Args>::check(args, slot_of<I, Args...>::offset, memory_size)... };
+  for(size_t i = 1; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    if(!checks[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename C> struct text;
+template <char... C> struct text<chars<C...> >
+{
+  static const char value[];
+};
+template <char... C> const char text<chars<C...> >::value[] = { C..., '\0' };
+
+/**
+ * The wasm3 signature string, e.g. "i(*i*ii)".
+ */
+template <typename R, typename... Args>
+struct signature : text<typename join<typename result<R>::codes, chars<'('>,
+  typename value<Args>::codes..., chars<')'> >::type>
+{
+};
+
+#if EEA_ENGINE_WAMR
+/**
+ * The WAMR signature string, e.g. "(iiii)i".
+ */
+template <typename R, typename... Args>
+struct native_signature : text<typename join<chars<'('>, typename value<Args>::native_codes..., chars<')'>,
+  typename result<R>::native_codes>::type>
+{
+};
+#endif
+
+/**
+ * Reads the arguments from the wasm3 stack, invokes the host function and
+ * writes the return value. The return slot (if any) precedes the arguments.
+ */
+template <typename R, typename... Args>
+struct dispatch
+{
+  static const size_t first = 1;
+
+  template <R (*fn)(Args...), size_t... I>
+  static void call(uint64_t *sp, void *mem, index_sequence<I...>)
+  {
+    value<R>::set(sp, fn(value<Args>::get(sp + first, slot_of<I, Args...>::offset, mem)...));
+  }
+
+  template <R (*fn)(EEA_Host_Context, Args...), size_t... I>
+  static void call_with_context(EEA_Host_Context ctx, uint64_t *sp, void *mem, index_sequence<I...>)
+  {
+    value<R>::set(sp, fn(ctx, value<Args>::get(sp + first, slot_of<I, Args...>::offset, mem)...));
+  }
+
+  // WAMR raw natives have no return slot before the arguments.
+  template <R (*fn)(Args...), size_t... I>
+  static void call_native(uint64_t *args, void *mem, index_sequence<I...>)
+  {
+    value<R>::set(args, fn(value<Args>::get(args, slot_of<I, Args...>::offset, mem)...));
+  }
+
+  template <R (*fn)(EEA_Host_Context, Args...), size_t... I>
+  static void call_native_with_context(EEA_Host_Context ctx, uint64_t *args, void *mem, index_sequence<I...>)
+  {
+    value<R>::set(args, fn(ctx, value<Args>::get(args, slot_of<I, Args...>::offset, mem)...));
+  }
+};
+
+template <typename... Args>
+struct dispatch<void, Args...>
+{
+  static const size_t first = 0;
+
+  template <void (*fn)(Args...), size_t... I>
+  static void call(uint64_t *sp, void *mem, index_sequence<I...>)
+  {
+    fn(value<Args>::get(sp, slot_of<I, Args...>::offset, mem)...);
+  }
+
+  template <void (*fn)(EEA_Host_Context, Args...), size_t... I>
+  static void call_with_context(EEA_Host_Context ctx, uint64_t *sp, void *mem, index_sequence<I...>)
+  {
+    fn(ctx, value<Args>::get(sp, slot_of<I, Args...>::offset, mem)...);
+  }
+
+  template <void (*fn)(Args...), size_t... I>
+  static void call_native(uint64_t *args, void *mem, index_sequence<I...>)
+  {
+    fn(value<Args>::get(args, slot_of<I, Args...>::offset, mem)...);
+  }
+
+  template <void (*fn)(EEA_Host_Context, Args...), size_t... I>
+  static void call_native_with_context(EEA_Host_Context ctx, uint64_t *args, void *mem, index_sequence<I...>)
+  {
+    fn(ctx, value<Args>::get(args, slot_of<I, Args...>::offset, mem)...);
+  }
+};
+
+template <typename F, F fn> struct binding;
+
+template <typename R, typename... Args, R (*fn)(Args...)>
+struct binding<R (*)(Args...), fn>
+{
+  typedef eea_bindings::signature<R, Args...> signature;
+  typedef typename make_index_sequence<sizeof...(Args)>::type indices;
+
+  static const void *call(IM3Runtime runtime, IM3ImportContext _ctx, uint64_t *_sp, void *_mem)
+  {
+    if(!check<Args...>(_sp + dispatch<R, Args...>::first, m3_GetMemorySize(runtime), indices())) {
+      return m3Err_trapOutOfBoundsMemoryAccess;
+    }
+    dispatch<R, Args...>::template call<fn>(_sp, _mem, indices());
+    return m3Err_none;
+  }
+
+#if EEA_ENGINE_WAMR
+  typedef eea_bindings::native_signature<R, Args...> native_signature;
+
+  static void native_call(void *exec_env, uint64_t *args)
+  {
+    uint32_t memory_size = 0;
+    void *mem = eea_wamr_memory(exec_env, &memory_size);
+    if(!check<Args...>(args, memory_size, indices())) {
+      eea_wamr_trap(exec_env, "out of bounds memory access");
+      return;
+    }
+    dispatch<R, Args...>::template call_native<fn>(args, mem, indices());
+  }
+#endif
+};
+
+template <typename R, typename... Args, R (*fn)(EEA_Host_Context, Args...)>
+struct binding<R (*)(EEA_Host_Context, Args...), fn>
+{
+  typedef eea_bindings::signature<R, Args...> signature;
+  typedef typename make_index_sequence<sizeof...(Args)>::type indices;
+
+  static const void *call(IM3Runtime runtime, IM3ImportContext _ctx, uint64_t *_sp, void *_mem)
+  {
+    if(!check<Args...>(_sp + dispatch<R, Args...>::first, m3_GetMemorySize(runtime), indices())) {
+      return m3Err_trapOutOfBoundsMemoryAccess;
+    }
+    EEA_Host_Context ctx = { _ctx->userdata };
+    dispatch<R, Args...>::template call_with_context<fn>(ctx, _sp, _mem, indices());
+    return m3Err_none;
+  }
+
+#if EEA_ENGINE_WAMR
+  typedef eea_bindings::native_signature<R, Args...> native_signature;
+
+  static void native_call(void *exec_env, uint64_t *args)
+  {
+    uint32_t memory_size = 0;
+    void *mem = eea_wamr_memory(exec_env, &memory_size);
+    if(!check<Args...>(args, memory_size, indices())) {
+      eea_wamr_trap(exec_env, "out of bounds memory access");
+      return;
+    }
+    EEA_Host_Context ctx = { eea_wamr_userdata(exec_env) };
+    dispatch<R, Args...>::template call_native_with_context<fn>(ctx, args, mem, indices());
+  }
+#endif
+};
+
+} // namespace eea_bindings
+
+/**
+ * Builds an EEA_Host_Function table entry. The import name is the C++ function name.
+ */
+#if EEA_ENGINE_WAMR
+#define EEA_HOST_FUNCTION(fn) \
+  { #fn, \
+    eea_bindings::binding<decltype(&fn), &fn>::signature::value, \
+    &eea_bindings::binding<decltype(&fn), &fn>::call, \
+    eea_bindings::binding<decltype(&fn), &fn>::native_signature::value, \
+    &eea_bindings::binding<decltype(&fn), &fn>::native_call }
+#else
+#define EEA_HOST_FUNCTION(fn) \
+  { #fn, \
+    eea_bindings::binding<decltype(&fn), &fn>::signature::value, \
+    &eea_bindings::binding<decltype(&fn), &fn>::call }
+#endif
+
+/**
+ * Links every function in the table into the module.
+ * Functions the module does not import are skipped.
+ * Returns the number of functions that failed to link.
+ */
+int eea_link_host_functions(IM3Module wasm_module, const char *module_name,
+  const EEA_Host_Function *functions, size_t count, void *userdata);
+
+template <size_t N>
+int eea_link_host_functions(IM3Module wasm_module, const char *module_name,
+  const EEA_Host_Function (&functions)[N], void *userdata)
+{
+  return eea_link_host_functions(wasm_module, module_name, functions, N, userdata);
+}
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * Per-call execution budget. See eea_budget.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "eea_budget.h"
+
+static const char *TAG = "EEA_BUDGET";
+
+const char * const eea_err_budget_exceeded = "execution budget exceeded";
+
+void EEA_Budget::timer_callback(void *arg)
+{
+  EEA_Budget *budget = (EEA_Budget*)arg;
+
+  budget->expired = true;
+  EEA_Engine *engine = budget->engine;
+  if(engine != NULL) {
+    engine->interrupt();
+  }
+}
+
+EEA_Budget::EEA_Budget(uint32_t budget_ms)
+{
+  this->budget_ms = budget_ms;
+  this->timer = NULL;
+  this->engine = NULL;
+  this->expired = false;
+  memset(this->overruns, 0, sizeof(this->overruns));
+
+  esp_timer_create_args_t timer_args = {};
+  timer_args.callback = timer_callback;
+  timer_args.arg = this;
+  timer_args.name = "eea_budget";
+
+  if(esp_timer_create(&timer_args, &(this->timer)) != ESP_OK) {
+    ESP_LOGI(TAG, "Failed to create budget timer. Calls are not bounded.");
+    this->timer = NULL;
+  }
+}
+
+EEA_Budget::~EEA_Budget()
+{
+  if(this->timer != NULL) {
+    esp_timer_stop(this->timer);
+    esp_timer_delete(this->timer);
+  }
+}
+
+EEA_Engine_Result EEA_Budget::call(EEA_Engine *engine, EEA_Engine_Function function, uint32_t argc, const uint64_t *argv)
+{
+  bool armed = this->timer != NULL && this->budget_ms > 0;
+
+  this->expired = false;
+  this->engine = engine;
+  if(armed) {
+    esp_timer_start_once(this->timer, this->budget_ms * 1000ULL);
+  }
+
+  EEA_Engine_Result result = engine->call(function, argc, argv, NULL);
+
+  if(armed) {
+    esp_timer_stop(this->timer);
+  }
+  this->engine = NULL;
+
+  // The engine reports the interruption in its own words.
+  if(result != NULL && this->expired) {
+    result = eea_err_budget_exceeded;
+  }
+  this->expired = false;
+
+  if(result == eea_err_budget_exceeded) {
+    const char *name = engine->function_name(function);
+    for(int i = 0; i < EEA_BUDGET_MAX_EXPORTS; i++) {
+      Overruns *entry = &(this->overruns[i]);
+      if(entry->name[0] == '\0') {
+        strncpy(entry->name, name, sizeof(entry->name) - 1);
+      }
+
+      if(strncmp(entry->name, name, sizeof(entry->name) - 1) == 0) {
+        entry->count++;
+        ESP_LOGI(TAG, "%s exceeded its %u ms budget (%u times).", name, this->budget_ms, entry->count);
+        break;
+      }
+    }
+  }
+
+  return result;
+}
+
+void EEA_Budget::report()
+{
+  for(int i = 0; i < EEA_BUDGET_MAX_EXPORTS && this->overruns[i].name[0] != '\0'; i++) {
+    ESP_LOGI(TAG, "%s: %u budget overruns.", this->overruns[i].name, this->overruns[i].count);
+  }
+}
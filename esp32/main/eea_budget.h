@@ -0,0 +1,60 @@
+#ifndef EEA_BUDGET_H
+#define EEA_BUDGET_H
+
+#include <stdint.h>
+
+#include "esp_timer.h"
+
+#include "eea_engine.h"
+
+#define EEA_BUDGET_MAX_EXPORTS 8
+
+/**
+ * Returned by EEA_Budget::call when a call runs past its budget.
+ */
+extern const char * const eea_err_budget_exceeded;
+
+/**
+ * Bounds how long a single call into the bundle may run.
+ *
+ * A one-shot esp_timer is armed for the budget before each call. When it
+ * fires it interrupts the engine (see EEA_Engine::interrupt), and the call
+ * returns eea_err_budget_exceeded. On wasm3, the call stops at its next
+ * loop iteration or function call (eea_interrupt_checks.h).
+ *
+ * Overruns are counted per export.
+ */
+class EEA_Budget {
+  public:
+    EEA_Budget(uint32_t budget_ms);
+    ~EEA_Budget();
+
+    /**
+     * engine->call with the execution budget applied.
+     */
+    EEA_Engine_Result call(EEA_Engine *engine, EEA_Engine_Function function, uint32_t argc, const uint64_t *argv);
+
+    /**
+     * Logs the overrun count of each export that has overrun.
+     */
+    void report();
+
+    uint32_t budget_ms;
+
+  private:
+    esp_timer_handle_t timer;
+
+    // Set while a call is running, for the timer callback.
+    EEA_Engine * volatile engine;
+    volatile bool expired;
+
+    static void timer_callback(void *arg);
+
+    // Keyed by export name, since functions are freed with their bundle.
+    struct Overruns {
+      char name[32];
+      uint32_t count;
+    } overruns[EEA_BUDGET_MAX_EXPORTS];
+};
+
+#endif
@@ -0,0 +1,224 @@
+/**
+ * Bundle format detection and decompression.
+ * Uses the miniz inflater in the ESP32 ROM.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp32/rom/miniz.h"
+#include "mbedtls/sha256.h"
+
+#include "eea_bundle.h"
+#include "eea_memory.h"
+
+// Compressed bundles are fed to the inflater in chunks of this size.
+#define EEA_BUNDLE_INFLATE_CHUNK_SIZE 4096
+
+static const char *TAG = "EEA_BUNDLE";
+
+EEA_Bundle_Format eea_bundle_format(const uint8_t *data, uint32_t size)
+{
+  if(size >= 4 && memcmp(data, "\0asm", 4) == 0) {
+    return EEA_BUNDLE_FORMAT_WASM;
+  }
+
+  if(size >= 4 && memcmp(data, "\0aot", 4) == 0) {
+    return EEA_BUNDLE_FORMAT_AOT;
+  }
+
+  // zlib header: deflate method, 32kb window, header checksum.
+  if(size >= 2 && data[0] == 0x78 && ((data[0] << 8) | data[1]) % 31 == 0) {
+    return EEA_BUNDLE_FORMAT_ZLIB;
+  }
+
+  if(size >= 4 && memcmp(data, EEA_BUNDLE_DELTA_MAGIC, 4) == 0) {
+    return EEA_BUNDLE_FORMAT_DELTA;
+  }
+
+  return EEA_BUNDLE_FORMAT_UNKNOWN;
+}
+
+static uint32_t read_u32(const uint8_t *data)
+{
+  return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+EEA_Bundle_Delta_Result eea_bundle_apply_delta(const uint8_t *delta, uint32_t delta_size,
+  const char *base_id, const uint8_t *base, uint32_t base_size,
+  uint8_t *output, uint32_t output_capacity, uint32_t *output_size)
+{
+  *output_size = 0;
+
+  // Header.
+  if(delta_size < 6 || delta[4] != EEA_BUNDLE_DELTA_VERSION) {
+    ESP_LOGI(TAG, "Unsupported delta bundle.");
+    return EEA_BUNDLE_DELTA_CORRUPT;
+  }
+
+  uint8_t base_id_length = delta[5];
+  uint32_t pos = 6 + base_id_length;
+  if(pos + 4 + 32 > delta_size) {
+    return EEA_BUNDLE_DELTA_CORRUPT;
+  }
+
+  if(base_id == NULL || strlen(base_id) != base_id_length || memcmp(delta + 6, base_id, base_id_length) != 0) {
+    ESP_LOGI(TAG, "Delta bundle base is %.*s, running %s.", base_id_length, delta + 6, base_id ? base_id : "nothing");
+    return EEA_BUNDLE_DELTA_BASE_MISMATCH;
+  }
+
+  uint32_t target_size = read_u32(delta + pos);
+  const uint8_t *target_hash = delta + pos + 4;
+  pos += 4 + 32;
+
+  if(target_size == 0 || target_size > output_capacity) {
+    ESP_LOGI(TAG, "Delta target of %u bytes is empty or too large.", target_size);
+    return EEA_BUNDLE_DELTA_CORRUPT;
+  }
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+
+  // Operations.
+  uint32_t written = 0;
+  EEA_Bundle_Delta_Result result = EEA_BUNDLE_DELTA_OK;
+
+  while(pos < delta_size && result == EEA_BUNDLE_DELTA_OK) {
+    uint8_t op = delta[pos++];
+    const uint8_t *source = NULL;
+    uint32_t length = 0;
+
+    if(op == 0x01 && pos + 8 <= delta_size) {
+      uint32_t offset = read_u32(delta + pos);
+      length = read_u32(delta + pos + 4);
+      pos += 8;
+      if(offset > base_size || length > base_size - offset) {
+        result = EEA_BUNDLE_DELTA_CORRUPT;
+        break;
+      }
+      source = base + offset;
+    } else if(op == 0x02 && pos + 4 <= delta_size) {
+      length = read_u32(delta + pos);
+      pos += 4;
+      if(length > delta_size - pos) {
+        result = EEA_BUNDLE_DELTA_CORRUPT;
+        break;
+      }
+      source = delta + pos;
+      pos += length;
+    } else {
+      result = EEA_BUNDLE_DELTA_CORRUPT;
+      break;
+    }
+
+    if(length > target_size - written) {
+      result = EEA_BUNDLE_DELTA_CORRUPT;
+      break;
+    }
+
+    memcpy(output + written, source, length);
+    mbedtls_sha256_update_ret(&sha, output + written, length);
+    written += length;
+  }
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish_ret(&sha, hash);
+  mbedtls_sha256_free(&sha);
+
+  if(result != EEA_BUNDLE_DELTA_OK) {
+    ESP_LOGI(TAG, "Corrupt delta bundle at offset %u.", pos);
+    return result;
+  }
+
+  if(written != target_size || memcmp(hash, target_hash, sizeof(hash)) != 0) {
+    ESP_LOGI(TAG, "Delta bundle hash mismatch.");
+    return EEA_BUNDLE_DELTA_HASH_MISMATCH;
+  }
+
+  *output_size = written;
+  return EEA_BUNDLE_DELTA_OK;
+}
+
+EEA_Bundle_Inflater::EEA_Bundle_Inflater(uint8_t *output, uint32_t output_capacity)
+{
+  this->output = output;
+  this->output_capacity = output_capacity;
+  this->output_size = 0;
+
+  this->decompressor = eea_malloc(EEA_MEM_RUNTIME, sizeof(tinfl_decompressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(this->decompressor != NULL) {
+    tinfl_init((tinfl_decompressor*)this->decompressor);
+  }
+}
+
+EEA_Bundle_Inflater::~EEA_Bundle_Inflater()
+{
+  eea_free(this->decompressor);
+}
+
+int EEA_Bundle_Inflater::feed(const uint8_t *data, uint32_t length, bool final)
+{
+  if(this->decompressor == NULL) {
+    return -1;
+  }
+
+  // The output buffer is never wrapped, so back-references are read
+  // from the decompressed module itself.
+  mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 |
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+  if(!final) {
+    flags |= TINFL_FLAG_HAS_MORE_INPUT;
+  }
+
+  size_t in_bytes = length;
+  size_t out_bytes = this->output_capacity - this->output_size;
+
+  tinfl_status status = tinfl_decompress((tinfl_decompressor*)this->decompressor,
+    data, &in_bytes, this->output, this->output + this->output_size, &out_bytes, flags);
+
+  this->output_size += out_bytes;
+
+  if(status == TINFL_STATUS_DONE) {
+    return 1;
+  }
+
+  if(status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+    ESP_LOGI(TAG, "Decompressed bundle exceeds %u bytes.", this->output_capacity);
+    return -1;
+  }
+
+  if(status < TINFL_STATUS_DONE) {
+    ESP_LOGI(TAG, "Bundle decompression failed. Status: %d", status);
+    return -1;
+  }
+
+  // The inflater consumes all of the input before asking for more.
+  if(final) {
+    ESP_LOGI(TAG, "Compressed bundle is truncated.");
+    return -1;
+  }
+  return 0;
+}
+
+int eea_bundle_decompress(const uint8_t *input, uint32_t input_size,
+  uint8_t *output, uint32_t output_capacity, uint32_t *output_size)
+{
+  EEA_Bundle_Inflater inflater(output, output_capacity);
+
+  int status = 0;
+  uint32_t offset = 0;
+  while(status == 0) {
+    uint32_t chunk = input_size - offset;
+    if(chunk > EEA_BUNDLE_INFLATE_CHUNK_SIZE) {
+      chunk = EEA_BUNDLE_INFLATE_CHUNK_SIZE;
+    }
+
+    status = inflater.feed(input + offset, chunk, offset + chunk == input_size);
+    offset += chunk;
+  }
+
+  *output_size = inflater.output_size;
+  return status == 1 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#ifndef EEA_BUNDLE_H
+#define EEA_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bundle formats, detected from the first bytes of the bundle.
+ */
+enum EEA_Bundle_Format {
+  EEA_BUNDLE_FORMAT_UNKNOWN,
+  EEA_BUNDLE_FORMAT_WASM,   // Uncompressed WASM module ("\0asm").
+  EEA_BUNDLE_FORMAT_ZLIB,   // zlib (RFC 1950) compressed WASM module.
+  EEA_BUNDLE_FORMAT_DELTA,  // Binary delta against the running bundle.
+  EEA_BUNDLE_FORMAT_AOT     // WAMR AOT-compiled module ("\0aot"), built with wamrc.
+};
+
+EEA_Bundle_Format eea_bundle_format(const uint8_t *data, uint32_t size);
+
+/**
+ * Streaming zlib decompressor for bundles.
+ *
+ * Compressed data can be fed in chunks of any size as it becomes available.
+ * Decompressed bytes are written straight into the output buffer given to
+ * the constructor, which holds the whole module, so the inflater reads
+ * back-references from it instead of keeping a separate 32kb dictionary
+ * window. Besides the output, it uses only the ~11kb decompressor state.
+ */
+class EEA_Bundle_Inflater {
+  public:
+    EEA_Bundle_Inflater(uint8_t *output, uint32_t output_capacity);
+    ~EEA_Bundle_Inflater();
+
+    /**
+     * Decompresses a chunk of input. final is true for the last chunk.
+     * Returns:
+     *  0 if more input is needed.
+     *  1 if the stream is complete.
+     *  -1 on a corrupt stream, or if the output buffer is full.
+     */
+    int feed(const uint8_t *data, uint32_t length, bool final);
+
+    uint32_t output_size;
+
+  private:
+    void *decompressor;
+    uint8_t *output;
+    uint32_t output_capacity;
+};
+
+/**
+ * Delta bundles rebuild a WASM module from the module that is currently
+ * running (the base) plus the bytes that changed. All integers are
+ * little-endian. esp32/tools/make_delta.py creates them.
+ *
+ *   "EEAD"          magic
+ *   u8              format version (1)
+ *   u8              base BUNDLE_IDENTIFIER length (N)
+ *   N bytes         base BUNDLE_IDENTIFIER
+ *   u32             target size
+ *   32 bytes        SHA-256 of the target
+ *   operations, until the end of the delta:
+ *     0x01 u32 offset u32 length   copy length bytes from the base at offset
+ *     0x02 u32 length bytes        insert the following length bytes
+ *
+ * The target must be between 1 and output_capacity bytes.
+ */
+#define EEA_BUNDLE_DELTA_MAGIC "EEAD"
+#define EEA_BUNDLE_DELTA_VERSION 1
+
+enum EEA_Bundle_Delta_Result {
+  EEA_BUNDLE_DELTA_OK,
+  EEA_BUNDLE_DELTA_BASE_MISMATCH,   // The delta was made against a different bundle.
+  EEA_BUNDLE_DELTA_CORRUPT,         // Malformed delta or the target does not fit.
+  EEA_BUNDLE_DELTA_HASH_MISMATCH    // The rebuilt module does not match the target hash.
+};
+
+/**
+ * Applies a delta bundle to the base module, writing the rebuilt module to
+ * output as each operation is read. The SHA-256 of the output is computed
+ * as it is written and compared to the target hash.
+ */
+EEA_Bundle_Delta_Result eea_bundle_apply_delta(const uint8_t *delta, uint32_t delta_size,
+  const char *base_id, const uint8_t *base, uint32_t base_size,
+  uint8_t *output, uint32_t output_capacity, uint32_t *output_size);
+
+/**
+ * Decompresses a complete zlib bundle in EEA_BUNDLE_INFLATE_CHUNK_SIZE chunks.
+ * Returns 0 on success and sets output_size.
+ */
+int eea_bundle_decompress(const uint8_t *input, uint32_t input_size,
+  uint8_t *output, uint32_t output_capacity, uint32_t *output_size);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,575 @@
+/**
+ * SPI and I2C transactions. See eea_bus.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "eea_bus.h"
+#include "eea_bindings.h"
+#include "eea_memory.h"
+
+#define EEA_BUS_TASK_SIZE 3072
+#define EEA_BUS_TASK_PRIORITY 6
+#define EEA_BUS_CORE 0
+
+// Transactions up to this size busy-wait for the DMA to complete instead of
+// blocking on the SPI interrupt, which costs more than the transfer itself.
+#define EEA_BUS_POLLING_MAX 32
+
+#define EEA_BUS_I2C_TIMEOUT_MS 100
+
+static const char *TAG = "EEA_BUS";
+
+int32_t EEA_Bus::add_device(EEA_Bus_Device_Type type, uint32_t port)
+{
+  for(uint32_t i = 0; i < EEA_BUS_MAX_DEVICES; i++) {
+    if(this->devices[i].type == EEA_BUS_DEVICE_NONE) {
+      memset(&(this->devices[i]), 0, sizeof(EEA_Bus_Device));
+      this->devices[i].type = type;
+      this->devices[i].port = port;
+      return i;
+    }
+  }
+  return -1;
+}
+
+esp_err_t EEA_Bus::spi_init(uint32_t host, int32_t mosi, int32_t miso, int32_t sclk)
+{
+  // SPI1 is the flash bus.
+  if(host == SPI1_HOST || host >= SPI_HOST_MAX || this->tx == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if(this->spi_initialized[host]) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  spi_bus_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.mosi_io_num = mosi;
+  config.miso_io_num = miso;
+  config.sclk_io_num = sclk;
+  config.quadwp_io_num = -1;
+  config.quadhd_io_num = -1;
+  config.max_transfer_sz = EEA_BUS_MAX_TRANSFER;
+
+  esp_err_t result = spi_bus_initialize((spi_host_device_t)host, &config, SPI_DMA_CH_AUTO);
+  this->spi_initialized[host] = result == ESP_OK;
+  return result;
+}
+
+esp_err_t EEA_Bus::spi_add_device(uint32_t host, int32_t cs, uint32_t clock_hz, uint32_t mode, int32_t *device)
+{
+  if(host >= SPI_HOST_MAX || !this->spi_initialized[host] || mode > 3) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  int32_t index = this->add_device(EEA_BUS_DEVICE_SPI, host);
+  if(index < 0) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  spi_device_interface_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.mode = mode;
+  config.clock_speed_hz = clock_hz;
+  config.spics_io_num = cs;
+  config.queue_size = 1;
+
+  esp_err_t result = spi_bus_add_device((spi_host_device_t)host, &config, &(this->devices[index].spi));
+  if(result != ESP_OK) {
+    this->devices[index].type = EEA_BUS_DEVICE_NONE;
+    return result;
+  }
+
+  *device = index;
+  return ESP_OK;
+}
+
+esp_err_t EEA_Bus::i2c_init(uint32_t port, int32_t sda, int32_t scl, uint32_t clock_hz)
+{
+  if(port >= I2C_NUM_MAX || this->tx == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if(this->i2c_installed[port]) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  i2c_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.mode = I2C_MODE_MASTER;
+  config.sda_io_num = sda;
+  config.scl_io_num = scl;
+  config.sda_pullup_en = GPIO_PULLUP_ENABLE;
+  config.scl_pullup_en = GPIO_PULLUP_ENABLE;
+  config.master.clk_speed = clock_hz;
+
+  esp_err_t result = i2c_param_config(port, &config);
+  if(result != ESP_OK) {
+    return result;
+  }
+  result = i2c_driver_install(port, I2C_MODE_MASTER, 0, 0, 0);
+  this->i2c_installed[port] = result == ESP_OK;
+  return result;
+}
+
+esp_err_t EEA_Bus::i2c_add_device(uint32_t port, uint32_t address, int32_t *device)
+{
+  if(port >= I2C_NUM_MAX || !this->i2c_installed[port] || address > 0x7F) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  int32_t index = this->add_device(EEA_BUS_DEVICE_I2C, port);
+  if(index < 0) {
+    return ESP_ERR_NO_MEM;
+  }
+  this->devices[index].address = address;
+
+  *device = index;
+  return ESP_OK;
+}
+
+int32_t EEA_Bus::add_mock_device()
+{
+  if(this->tx == NULL) {
+    return -1;
+  }
+  return this->add_device(EEA_BUS_DEVICE_MOCK, 0);
+}
+
+esp_err_t EEA_Bus::execute(uint32_t device, const uint8_t *write, uint32_t write_length, uint32_t read_length)
+{
+  EEA_Bus_Device *bus_device = &(this->devices[device]);
+  uint32_t total = write_length + read_length;
+
+  memcpy(this->tx, write, write_length);
+  uint8_t *read = this->rx + write_length;
+
+  switch(bus_device->type) {
+    case EEA_BUS_DEVICE_SPI: {
+      // The bytes sent while reading are zeros.
+      memset(this->tx + write_length, 0, read_length);
+
+      spi_transaction_t transaction;
+      memset(&transaction, 0, sizeof(transaction));
+      transaction.length = total * 8;
+      transaction.tx_buffer = this->tx;
+      transaction.rx_buffer = read_length > 0 ? this->rx : NULL;
+
+      if(total <= EEA_BUS_POLLING_MAX) {
+        return spi_device_polling_transmit(bus_device->spi, &transaction);
+      }
+      return spi_device_transmit(bus_device->spi, &transaction);
+    }
+    case EEA_BUS_DEVICE_I2C: {
+      TickType_t timeout = pdMS_TO_TICKS(EEA_BUS_I2C_TIMEOUT_MS);
+      if(read_length == 0) {
+        return i2c_master_write_to_device(bus_device->port, bus_device->address, this->tx, write_length, timeout);
+      }
+      if(write_length == 0) {
+        return i2c_master_read_from_device(bus_device->port, bus_device->address, read, read_length, timeout);
+      }
+      return i2c_master_write_read_device(bus_device->port, bus_device->address, this->tx, write_length,
+        read, read_length, timeout);
+    }
+    case EEA_BUS_DEVICE_MOCK:
+      for(uint32_t i = 0; i < read_length; i++) {
+        read[i] = (uint8_t)(this->mock_counter++);
+      }
+      return ESP_OK;
+    default:
+      return ESP_ERR_INVALID_ARG;
+  }
+}
+
+esp_err_t EEA_Bus::transfer(uint32_t device, const uint8_t *write, uint32_t write_length,
+  uint8_t *read, uint32_t read_length)
+{
+  if(device >= EEA_BUS_MAX_DEVICES || write_length + read_length > EEA_BUS_MAX_TRANSFER ||
+      write_length + read_length == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  esp_err_t result = this->execute(device, write, write_length, read_length);
+  if(result == ESP_OK) {
+    memcpy(read, this->rx + write_length, read_length);
+  }
+  xSemaphoreGive(this->lock);
+
+  return result;
+}
+
+void EEA_Bus::periodic_sample()
+{
+  EEA_Bus_Periodic *periodic = &(this->periodic);
+
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+
+  // Stopped (or released) while the task was waiting for the lock.
+  if(!periodic->active) {
+    xSemaphoreGive(this->lock);
+    return;
+  }
+  esp_err_t result = this->execute(periodic->device, periodic->write, periodic->write_length, periodic->read_length);
+
+  xSemaphoreTake(this->periodic_lock, portMAX_DELAY);
+  uint32_t half = periodic->filling;
+  if(result != ESP_OK || periodic->lengths[half] + periodic->read_length > EEA_BUS_PERIODIC_BUFFER_SIZE) {
+    periodic->overruns++;
+  } else {
+    memcpy(periodic->halves[half] + periodic->lengths[half], this->rx + periodic->write_length, periodic->read_length);
+    periodic->lengths[half] += periodic->read_length;
+  }
+  xSemaphoreGive(this->periodic_lock);
+
+  xSemaphoreGive(this->lock);
+}
+
+/**
+ * Runs the periodic transaction, and waits to be notified while there is none.
+ */
+static void eea_bus_task(void *pvParameters)
+{
+  EEA_Bus *bus = (EEA_Bus*)pvParameters;
+  TickType_t last_wake = xTaskGetTickCount();
+
+  while(true) {
+    if(!bus->periodic.active) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      last_wake = xTaskGetTickCount();
+      continue;
+    }
+
+    bus->periodic_sample();
+
+    TickType_t interval = pdMS_TO_TICKS(bus->periodic.interval_ms);
+    vTaskDelayUntil(&last_wake, interval > 0 ? interval : 1);
+  }
+}
+
+esp_err_t EEA_Bus::periodic_start(uint32_t device, const uint8_t *write, uint32_t write_length,
+  uint32_t read_length, uint32_t interval_ms)
+{
+  if(device >= EEA_BUS_MAX_DEVICES || this->devices[device].type == EEA_BUS_DEVICE_NONE ||
+      write_length > EEA_BUS_PERIODIC_MAX_WRITE || read_length == 0 ||
+      read_length > EEA_BUS_PERIODIC_BUFFER_SIZE || write_length + read_length > EEA_BUS_MAX_TRANSFER) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  EEA_Bus_Periodic *periodic = &(this->periodic);
+  if(periodic->halves[0] == NULL) {
+    periodic->halves[0] = (uint8_t*)eea_malloc(EEA_MEM_API, 2 * EEA_BUS_PERIODIC_BUFFER_SIZE,
+      MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if(periodic->halves[0] == NULL) {
+      return ESP_ERR_NO_MEM;
+    }
+    periodic->halves[1] = periodic->halves[0] + EEA_BUS_PERIODIC_BUFFER_SIZE;
+  }
+
+  // Wait for a transaction in progress before replacing it.
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  xSemaphoreTake(this->periodic_lock, portMAX_DELAY);
+  periodic->device = device;
+  memcpy(periodic->write, write, write_length);
+  periodic->write_length = write_length;
+  periodic->read_length = read_length;
+  periodic->interval_ms = interval_ms;
+  periodic->lengths[0] = 0;
+  periodic->lengths[1] = 0;
+  periodic->filling = 0;
+  periodic->overruns = 0;
+  periodic->active = true;
+  xSemaphoreGive(this->periodic_lock);
+  xSemaphoreGive(this->lock);
+
+  if(this->xTaskHandle == NULL) {
+    xTaskCreatePinnedToCore(eea_bus_task, "eea_bus_task", EEA_BUS_TASK_SIZE, this,
+      EEA_BUS_TASK_PRIORITY, &(this->xTaskHandle), EEA_BUS_CORE);
+    eea_memory_register_task(this->xTaskHandle, EEA_BUS_TASK_SIZE);
+  } else {
+    xTaskNotifyGive(this->xTaskHandle);
+  }
+
+  return ESP_OK;
+}
+
+void EEA_Bus::periodic_stop()
+{
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  this->periodic.active = false;
+  xSemaphoreGive(this->lock);
+}
+
+int32_t EEA_Bus::periodic_read(uint8_t *buffer, uint32_t buffer_size, uint32_t *length, uint32_t *overruns)
+{
+  EEA_Bus_Periodic *periodic = &(this->periodic);
+  if(periodic->halves[0] == NULL || periodic->read_length == 0) {
+    *length = 0;
+    *overruns = 0;
+    return 0;
+  }
+
+  xSemaphoreTake(this->periodic_lock, portMAX_DELAY);
+  uint32_t half = periodic->filling;
+  *length = periodic->lengths[half];
+  if(*length > buffer_size) {
+    xSemaphoreGive(this->periodic_lock);
+    return -1;
+  }
+  *overruns = periodic->overruns;
+  periodic->overruns = 0;
+  periodic->filling = 1 - half;
+  periodic->lengths[periodic->filling] = 0;
+  xSemaphoreGive(this->periodic_lock);
+
+  // The task only appends to the other half now.
+  memcpy(buffer, periodic->halves[half], *length);
+  return *length / periodic->read_length;
+}
+
+void EEA_Bus::release()
+{
+  this->periodic_stop();
+
+  // The next bundle doesn't see this bundle's reads.
+  xSemaphoreTake(this->periodic_lock, portMAX_DELAY);
+  this->periodic.read_length = 0;
+  this->periodic.lengths[0] = 0;
+  this->periodic.lengths[1] = 0;
+  xSemaphoreGive(this->periodic_lock);
+
+  for(uint32_t i = 0; i < EEA_BUS_MAX_DEVICES; i++) {
+    if(this->devices[i].type == EEA_BUS_DEVICE_SPI) {
+      spi_bus_remove_device(this->devices[i].spi);
+    }
+    this->devices[i].type = EEA_BUS_DEVICE_NONE;
+  }
+  for(uint32_t i = 0; i < SPI_HOST_MAX; i++) {
+    if(this->spi_initialized[i]) {
+      spi_bus_free((spi_host_device_t)i);
+      this->spi_initialized[i] = false;
+    }
+  }
+  for(uint32_t i = 0; i < I2C_NUM_MAX; i++) {
+    if(this->i2c_installed[i]) {
+      i2c_driver_delete(i);
+      this->i2c_installed[i] = false;
+    }
+  }
+}
+
+/**
+ * Wraps the ESP IDF spi_bus_initialize function.
+ * Initializes an SPI bus, with DMA.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/spi_master.html#_CPPv418spi_bus_initialize17spi_host_device_tPK16spi_bus_config_t14spi_dma_chan_t
+ * Inputs:
+ *   host (Int32): the SPI peripheral. SPI2_HOST (HSPI) = 1, SPI3_HOST (VSPI) = 2.
+ *   mosi (Int32): the MOSI pin, or -1.
+ *   miso (Int32): the MISO pin, or -1.
+ *   sclk (Int32): the clock pin.
+ *
+ * Returns the result of spi_bus_initialize(). ESP_OK (0) for success.
+ */
+static int32_t eea_fn_spi_bus_init(EEA_Host_Context ctx, uint32_t host, int32_t mosi, int32_t miso, int32_t sclk)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  return bus->spi_init(host, mosi, miso, sclk);
+}
+
+/**
+ * Wraps the ESP IDF spi_bus_add_device function.
+ * Adds a device with its own chip select to an initialized SPI bus.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/spi_master.html#_CPPv418spi_bus_add_device17spi_host_device_tPK29spi_device_interface_config_tP19spi_device_handle_t
+ * Inputs:
+ *   host (Int32): the SPI peripheral.
+ *   cs (Int32): the chip select pin.
+ *   clock_hz (Int32): the clock speed.
+ *   mode (Int32): the SPI mode, 0 to 3.
+ *
+ * Outputs:
+ *   device (Int32): the device, for eea_fn_bus_transfer.
+ *
+ * Returns the result of spi_bus_add_device(). ESP_OK (0) for success.
+ */
+static int32_t eea_fn_spi_add_device(EEA_Host_Context ctx, uint32_t host, int32_t cs, uint32_t clock_hz, uint32_t mode,
+  EEA_Out<int32_t> device)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  int32_t index = -1;
+  esp_err_t result = bus->spi_add_device(host, cs, clock_hz, mode, &index);
+  device.set(index);
+  return result;
+}
+
+/**
+ * Wraps the ESP IDF i2c_param_config and i2c_driver_install functions.
+ * Installs an I2C port as a master.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/i2c.html#_CPPv418i2c_driver_install10i2c_port_t10i2c_mode_t6size_t6size_ti
+ * Inputs:
+ *   port (Int32): the I2C port, 0 or 1.
+ *   sda (Int32): the data pin.
+ *   scl (Int32): the clock pin.
+ *   clock_hz (Int32): the clock speed, e.g. 400000.
+ *
+ * Returns the result of i2c_driver_install(). ESP_OK (0) for success.
+ */
+static int32_t eea_fn_i2c_init(EEA_Host_Context ctx, uint32_t port, int32_t sda, int32_t scl, uint32_t clock_hz)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  return bus->i2c_init(port, sda, scl, clock_hz);
+}
+
+/**
+ * Adds a device on an installed I2C port.
+ * Inputs:
+ *   port (Int32): the I2C port.
+ *   address (Int32): the 7-bit device address.
+ *
+ * Outputs:
+ *   device (Int32): the device, for eea_fn_bus_transfer.
+ *
+ * Returns ESP_OK (0) for success.
+ */
+static int32_t eea_fn_i2c_add_device(EEA_Host_Context ctx, uint32_t port, uint32_t address, EEA_Out<int32_t> device)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  int32_t index = -1;
+  esp_err_t result = bus->i2c_add_device(port, address, &index);
+  device.set(index);
+  return result;
+}
+
+/**
+ * Writes a buffer to a device and then reads from it, in one transaction.
+ * SPI transactions are full duplex; the bytes received while writing are
+ * discarded. I2C transactions use a repeated start between the two.
+ * Inputs:
+ *   device (Int32): the device.
+ *   write (Byte array): the bytes to write, e.g. a register address.
+ *   write_length (Int32): the number of bytes to write. Can be 0.
+ *   read_length (Int32): the number of bytes to read. Can be 0.
+ *     Together with write_length, at most EEA_BUS_MAX_TRANSFER.
+ *
+ * Outputs:
+ *   read (Byte array): the bytes read.
+ *
+ * Returns ESP_OK (0) for success.
+ */
+static int32_t eea_fn_bus_transfer(EEA_Host_Context ctx, uint32_t device, EEA_Span<uint8_t> write,
+  EEA_Span<uint8_t> read)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  return bus->transfer(device, (const uint8_t*)write.data, write.count, (uint8_t*)read.data, read.count);
+}
+
+/**
+ * Runs a transaction in the background every interval_ms, collecting the
+ * bytes read for eea_fn_bus_periodic_read. Replaces the periodic
+ * transaction in progress.
+ * Inputs:
+ *   device (Int32): the device.
+ *   write (Byte array): the bytes to write, at most EEA_BUS_PERIODIC_MAX_WRITE.
+ *   write_length (Int32): the number of bytes to write.
+ *   read_length (Int32): the number of bytes to read each time.
+ *   interval_ms (Int32): the interval between transactions.
+ *
+ * Returns ESP_OK (0) for success.
+ */
+static int32_t eea_fn_bus_periodic_start(EEA_Host_Context ctx, uint32_t device, EEA_Span<uint8_t> write,
+  uint32_t read_length, uint32_t interval_ms)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  return bus->periodic_start(device, (const uint8_t*)write.data, write.count, read_length, interval_ms);
+}
+
+/**
+ * Copies the bytes read by the periodic transaction since the last call,
+ * back to back. Make the buffer EEA_BUS_PERIODIC_BUFFER_SIZE bytes to
+ * always fit them.
+ * Inputs:
+ *   buffer (Byte array): where to copy the reads.
+ *   buffer_size (Int32): the size of the buffer.
+ *
+ * Outputs:
+ *   length (Int32): the number of bytes copied.
+ *   overruns (Int32): the number of reads lost since the last call, because
+ *     they failed or the buffer was full.
+ *
+ * Returns the number of reads, or -1 if they don't fit in the buffer
+ * (length is still set, and the reads are kept).
+ */
+static int32_t eea_fn_bus_periodic_read(EEA_Host_Context ctx, EEA_Span<uint8_t> buffer,
+  EEA_Out<uint32_t> length, EEA_Out<uint32_t> overruns)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  uint32_t read_bytes = 0;
+  uint32_t lost = 0;
+  int32_t result = bus->periodic_read((uint8_t*)buffer.data, buffer.count, &read_bytes, &lost);
+  length.set(read_bytes);
+  overruns.set(lost);
+  return result;
+}
+
+/**
+ * Stops the periodic transaction.
+ *
+ * Returns ESP_OK (0).
+ */
+static int32_t eea_fn_bus_periodic_stop(EEA_Host_Context ctx)
+{
+  EEA_Bus *bus = (EEA_Bus*)ctx.userdata;
+  bus->periodic_stop();
+  return ESP_OK;
+}
+
+static const EEA_Host_Function eea_bus_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_spi_bus_init),
+  EEA_HOST_FUNCTION(eea_fn_spi_add_device),
+  EEA_HOST_FUNCTION(eea_fn_i2c_init),
+  EEA_HOST_FUNCTION(eea_fn_i2c_add_device),
+  EEA_HOST_FUNCTION(eea_fn_bus_transfer),
+  EEA_HOST_FUNCTION(eea_fn_bus_periodic_start),
+  EEA_HOST_FUNCTION(eea_fn_bus_periodic_read),
+  EEA_HOST_FUNCTION(eea_fn_bus_periodic_stop)
+};
+
+EEA_Bus::EEA_Bus()
+{
+  this->lock = xSemaphoreCreateMutex();
+  this->periodic_lock = xSemaphoreCreateMutex();
+  this->xTaskHandle = NULL;
+  this->mock_counter = 0;
+  memset(&(this->periodic), 0, sizeof(this->periodic));
+  memset(this->devices, 0, sizeof(this->devices));
+  memset(this->spi_initialized, 0, sizeof(this->spi_initialized));
+  memset(this->i2c_installed, 0, sizeof(this->i2c_installed));
+
+  this->tx = (uint8_t*)eea_malloc(EEA_MEM_API, EEA_BUS_MAX_TRANSFER, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+  this->rx = (uint8_t*)eea_malloc(EEA_MEM_API, EEA_BUS_MAX_TRANSFER, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+  if(this->tx == NULL || this->rx == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate the DMA bounce buffers.");
+    eea_free(this->tx);
+    eea_free(this->rx);
+    this->tx = NULL;
+    this->rx = NULL;
+  }
+}
+
+EEA_Bus::~EEA_Bus()
+{
+  this->release();
+  eea_free(this->tx);
+  eea_free(this->rx);
+  eea_free(this->periodic.halves[0]);
+  vSemaphoreDelete(this->lock);
+  vSemaphoreDelete(this->periodic_lock);
+}
+
+void EEA_Bus::add_host_functions(EEA_Engine *engine)
+{
+  engine->add_host_functions("env", eea_bus_functions,
+    sizeof(eea_bus_functions) / sizeof(eea_bus_functions[0]), this);
+}
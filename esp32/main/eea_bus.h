@@ -0,0 +1,148 @@
+#ifndef EEA_BUS_H
+#define EEA_BUS_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/spi_master.h"
+#include "driver/i2c.h"
+
+#include "eea_config.h"
+#include "eea_engine.h"
+
+enum EEA_Bus_Device_Type {
+  EEA_BUS_DEVICE_NONE = 0,
+  EEA_BUS_DEVICE_SPI = 1,
+  EEA_BUS_DEVICE_I2C = 2,
+  EEA_BUS_DEVICE_MOCK = 3   // Answers every read with a counter, for benchmarks.
+};
+
+struct EEA_Bus_Device {
+  EEA_Bus_Device_Type type;
+  uint32_t port;
+  uint8_t address;
+  spi_device_handle_t spi;
+};
+
+/**
+ * The periodic transaction and its double buffer. The background task
+ * appends each read to the half being filled. Reading swaps the halves.
+ */
+struct EEA_Bus_Periodic {
+  bool active;
+  uint32_t device;
+  uint8_t write[EEA_BUS_PERIODIC_MAX_WRITE];
+  uint32_t write_length;
+  uint32_t read_length;
+  uint32_t interval_ms;
+
+  uint8_t *halves[2];
+  uint32_t lengths[2];
+  uint32_t filling;
+
+  // Reads that didn't fit in the half being filled, or that failed,
+  // since the last swap.
+  uint32_t overruns;
+};
+
+/**
+ * SPI and I2C transactions for workflows, exposed as registered functions
+ * (see eea_bus.cpp). A transaction writes a buffer and then reads a number
+ * of bytes, e.g. a register address followed by a sensor's FIFO, in one
+ * host call instead of one GPIO call per clock edge.
+ *
+ * SPI transactions are full duplex and run on the SPI DMA channel, through
+ * bounce buffers in DMA-capable internal RAM since linear memory is in
+ * SPIRAM. The bytes clocked in while the write buffer is sent are
+ * discarded. I2C transactions use the I2C driver's command links.
+ *
+ * One transaction can also run periodically on a background task, filling
+ * a double buffer in SPIRAM that the workflow drains from eea_loop.
+ *
+ * Owned by the runtime. Drivers, devices and the periodic transaction are
+ * released when the bundle that set them up is unloaded.
+ */
+class EEA_Bus {
+  public:
+    EEA_Bus();
+
+    /**
+     * Releases the buses and frees the buffers. The background task isn't
+     * deleted, so only a bus that never ran a periodic transaction (like
+     * the benchmark's) should be deleted.
+     */
+    ~EEA_Bus();
+
+    /**
+     * Links the bus registered functions to a bundle's engine.
+     */
+    void add_host_functions(EEA_Engine *engine);
+
+    esp_err_t spi_init(uint32_t host, int32_t mosi, int32_t miso, int32_t sclk);
+    esp_err_t spi_add_device(uint32_t host, int32_t cs, uint32_t clock_hz, uint32_t mode, int32_t *device);
+    esp_err_t i2c_init(uint32_t port, int32_t sda, int32_t scl, uint32_t clock_hz);
+    esp_err_t i2c_add_device(uint32_t port, uint32_t address, int32_t *device);
+    int32_t add_mock_device();
+
+    /**
+     * Writes write_length bytes and then reads read_length bytes. Together
+     * they can be at most EEA_BUS_MAX_TRANSFER bytes.
+     */
+    esp_err_t transfer(uint32_t device, const uint8_t *write, uint32_t write_length,
+      uint8_t *read, uint32_t read_length);
+
+    /**
+     * Runs a transaction every interval_ms in the background, replacing the
+     * periodic transaction in progress.
+     */
+    esp_err_t periodic_start(uint32_t device, const uint8_t *write, uint32_t write_length,
+      uint32_t read_length, uint32_t interval_ms);
+    void periodic_stop();
+
+    /**
+     * Copies the reads collected since the last call into buffer, back to
+     * back, and starts filling the other half. Returns the number of reads,
+     * or -1 if buffer_size is too small (the reads are kept).
+     */
+    int32_t periodic_read(uint8_t *buffer, uint32_t buffer_size, uint32_t *length, uint32_t *overruns);
+
+    /**
+     * Runs one periodic transaction. Called by the background task.
+     */
+    void periodic_sample();
+
+    /**
+     * Stops the periodic transaction, and removes the devices and drivers.
+     */
+    void release();
+
+    EEA_Bus_Periodic periodic;
+
+    // The background task, created when the first periodic transaction starts.
+    TaskHandle_t xTaskHandle;
+
+  private:
+    esp_err_t execute(uint32_t device, const uint8_t *write, uint32_t write_length, uint32_t read_length);
+    int32_t add_device(EEA_Bus_Device_Type type, uint32_t port);
+
+    // Held for a transaction, since the bounce buffers are shared.
+    SemaphoreHandle_t lock;
+
+    // Guards the double buffer.
+    SemaphoreHandle_t periodic_lock;
+
+    EEA_Bus_Device devices[EEA_BUS_MAX_DEVICES];
+    bool spi_initialized[SPI_HOST_MAX];
+    bool i2c_installed[I2C_NUM_MAX];
+
+    // DMA-capable bounce buffers. After a transaction, the bytes read are
+    // at rx + write_length.
+    uint8_t *tx;
+    uint8_t *rx;
+
+    uint32_t mock_counter;
+};
+
+#endif
@@ -14,8 +14,148 @@
 #define EEA_BROKER_URL "mqtts://broker.losant.com"
 #define EEA_BROKER_PORT 8883
 
-// The maximum wasm bundle size is 256kb.
-// Most bundles are a little over 100kb.
+// Set to 1 to use a persistent MQTT session (clean session off). The broker
+// keeps the subscriptions and queues QoS 1 messages while the device is
+// offline, and subscribes are skipped when the session is resumed.
+#define EEA_MQTT_PERSISTENT_SESSION 0
+
+// How long the MQTT client waits before reconnecting.
+#define EEA_MQTT_RECONNECT_TIMEOUT_MS 2000
+
+// The maximum wasm bundle size is 256kb, as sent over MQTT and
+// stored in NVS. Most bundles are a little over 100kb.
 #define EEA_MAX_WASM_BUNDLE_SIZE 262144
 
+// The largest WASM module a bundle can carry, whether it is sent whole,
+// zlib compressed or as a delta. Compressed and delta bundles can carry a
+// module larger than the bundle itself. The runtime's bundle slots
+// (EEA_Bundle_Slot in eea_runtime.h) hold a module of this size.
+#define EEA_MAX_WASM_MODULE_SIZE 524288
+
+// Every allocation for a bundle comes from one PSRAM arena
+// (eea_wasm_arena.h), sized at startup for the largest module: the bundle
+// slot, the decompressed module, wasm3's copy of the module with interrupt
+// checks (eea_interrupt_checks.h), EEA_WASM_ARENA_CODE_FACTOR times the
+// module size for the parsed module and compiled code,
+// EEA_WASM_ARENA_LINEAR_MEMORY bytes of linear memory, and the engine's
+// stack (the wasmStackSlots setting). Compare with the arena high-water
+// mark logged when a bundle is destroyed.
+#define EEA_WASM_ARENA_CODE_FACTOR 2
+#define EEA_WASM_ARENA_LINEAR_MEMORY (256 * 1024)
+
+// How often memory usage and task stack high-water marks
+// are logged (eea_memory.h). 0 disables the report.
+#define EEA_MEMORY_REPORT_INTERVAL_MS 60000
+
+// Set to 1 to persist the bundle's linear memory and mutable globals
+// (eea_snapshot.h), and restore them when the same bundle is loaded after
+// a restart. Changed pages are written at most every
+// EEA_SNAPSHOT_INTERVAL_MS. Writes rotate through the partition's
+// sectors, but each still erases flash, so keep the interval long enough
+// for the flash's erase endurance (see README).
+#define EEA_SNAPSHOT_ENABLED 0
+#define EEA_SNAPSHOT_INTERVAL_MS 60000
+
+// A bundle that traps is restarted after EEA_TRAP_BACKOFF_MS, doubling
+// with each consecutive trap up to EEA_TRAP_BACKOFF_MAX_MS. After
+// EEA_TRAP_FALLBACK_THRESHOLD consecutive traps, the last bundle that ran
+// for EEA_BUNDLE_STABLE_MS without trapping is loaded from NVS. Bundles
+// are persisted to NVS once they are stable.
+#define EEA_TRAP_BACKOFF_MS 500
+#define EEA_TRAP_BACKOFF_MAX_MS 30000
+#define EEA_TRAP_FALLBACK_THRESHOLD 3
+#define EEA_BUNDLE_STABLE_MS 60000
+
+// Depth of the inbound and outbound message queues (the queueLength
+// setting). Each message is a little over 8kb of PSRAM, and there are two
+// queues, so the setting is capped at EEA_QUEUE_LENGTH_MAX.
+#define EEA_QUEUE_LENGTH 10
+#define EEA_QUEUE_LENGTH_MAX 16
+
+// The longest a single call to eea_loop or a message handler may run.
+// Longer calls are aborted with "execution budget exceeded" and the
+// bundle is restarted as if it had trapped. 0 disables the budget.
+#define EEA_EXECUTION_BUDGET_MS 1000
+
+// eea_trace output is buffered in a PSRAM ring of EEA_TRACE_BUFFER_SIZE
+// bytes and published to fromAgent/debug in batches, at most one every
+// EEA_TRACE_FLUSH_INTERVAL_MS (eea_trace.h). Longer lines are truncated
+// to EEA_TRACE_MAX_LINE bytes. Set EEA_TRACE_CONSOLE to 1 to also print
+// each line to the console.
+#define EEA_TRACE_BUFFER_SIZE (16 * 1024)
+#define EEA_TRACE_FLUSH_INTERVAL_MS 5000
+#define EEA_TRACE_MAX_LINE 512
+#define EEA_TRACE_CONSOLE 0
+
+// Inbound topics containing any of these strings carry state, and only
+// their latest pending message is kept (eea_conflate.h). None of the
+// topics Losant publishes to the agent are state topics, so the list is
+// empty by default. Add the topics your own publishers (or bundles, through
+// the loopback) use for state, ending with NULL, e.g.
+// { "toAgent/setpoint", NULL }. At most EEA_CONFLATE_MAX_TOPICS state
+// topics are conflated at once; messages on further topics are queued as
+// usual.
+#define EEA_CONFLATE_TOPICS { NULL }
+#define EEA_CONFLATE_MAX_TOPICS 8
+
+// Messages a bundle sends to its own device's toAgent topics are delivered
+// to the bundle locally instead of through the broker (eea_loopback.h).
+// Set EEA_LOOPBACK_PUBLISH to 1 to also publish them upstream.
+#define EEA_LOOPBACK_ENABLED 1
+#define EEA_LOOPBACK_PUBLISH 0
+
+// Limits for the windowed aggregation registered functions (eea_aggregate.h).
+// Each window holds at most EEA_AGGREGATE_MAX_SAMPLES samples and uses
+// 16 bytes of SPIRAM per sample.
+#define EEA_AGGREGATE_MAX_WINDOWS 8
+#define EEA_AGGREGATE_MAX_SAMPLES 1024
+#define EEA_AGGREGATE_NAME_SIZE 32
+
+// Limits for the JSON field extraction registered functions (eea_json.h).
+// Payloads are at most EEA_PAYLOAD_SIZE_BYTES. Each token uses 16 bytes
+// of SPIRAM.
+#define EEA_JSON_MAX_TOKENS 1024
+#define EEA_JSON_MAX_DEPTH 32
+
+// Limits for the DSP registered functions (eea_dsp.h). The FFT work buffer
+// and twiddle table each use EEA_DSP_MAX_FFT_SIZE floats of internal RAM.
+#define EEA_DSP_MAX_FFT_SIZE 2048
+#define EEA_DSP_MAX_PEAKS 16
+
+// Serial sensor ingestion (eea_uart.h). Set EEA_UART_ENABLED to 1 to read
+// records from EEA_UART_PORT. EEA_UART_FRAMING is 0 for newline-terminated
+// records or 1 for records preceded by a 16-bit big-endian length. The
+// latest EEA_UART_RECORDS records of at most EEA_UART_MAX_RECORD bytes are
+// kept in SPIRAM.
+#define EEA_UART_ENABLED 0
+#define EEA_UART_PORT 2
+#define EEA_UART_BAUD_RATE 115200
+#define EEA_UART_RX_PIN 16
+#define EEA_UART_TX_PIN 17
+#define EEA_UART_FRAMING 0
+#define EEA_UART_MAX_RECORD 8192
+#define EEA_UART_RECORDS 4
+#define EEA_UART_RX_BUFFER_SIZE 16384
+
+// Limits for the SPI and I2C registered functions (eea_bus.h). A transaction
+// writes and reads at most EEA_BUS_MAX_TRANSFER bytes, through two bounce
+// buffers of that size in DMA-capable internal RAM. The periodic
+// transaction's double buffer uses two halves of EEA_BUS_PERIODIC_BUFFER_SIZE
+// bytes in SPIRAM.
+#define EEA_BUS_MAX_DEVICES 8
+#define EEA_BUS_MAX_TRANSFER 2048
+#define EEA_BUS_PERIODIC_MAX_WRITE 16
+#define EEA_BUS_PERIODIC_BUFFER_SIZE 8192
+
+// Set to 1 to run WASM bundles on WAMR instead of wasm3. Requires a build
+// with -DEEA_ENGINE_WAMR=ON (main/CMakeLists.txt). AOT bundles always run
+// on WAMR. The profiler and state snapshots are only available on wasm3.
+#define EEA_WAMR_DEFAULT 0
+
+// Set to 1 to run the benchmark suite (eea_benchmark*.cpp) at startup.
+// Building with -DEEA_BENCHMARK=ON also sets it (main/CMakeLists.txt).
+#ifndef EEA_BENCHMARK_ENABLED
+#define EEA_BENCHMARK_ENABLED 0
+#endif
+
 #endif
\ No newline at end of file
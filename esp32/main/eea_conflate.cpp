@@ -0,0 +1,161 @@
+/**
+ * Latest-value conflation for inbound state topics. See eea_conflate.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "eea_conflate.h"
+#include "eea_memory.h"
+
+static const char *TAG = "EEA_CONFLATE";
+
+static const char *state_topics[] = EEA_CONFLATE_TOPICS;
+
+static bool is_state_topic(const char *topic, uint32_t topic_length)
+{
+  for(size_t i = 0; state_topics[i] != NULL; i++) {
+    if(strnstr(topic, state_topics[i], topic_length) != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+EEA_Conflator::EEA_Conflator()
+{
+  memset(this->slots, 0, sizeof(this->slots));
+  this->lock = xSemaphoreCreateMutex();
+  this->sequence = 0;
+  this->num_pending = 0;
+  this->num_dropped = 0;
+}
+
+bool EEA_Conflator::offer(const char *topic, uint32_t topic_length, const char *payload, uint32_t payload_length,
+  int64_t received_at)
+{
+  if(!is_state_topic(topic, topic_length) ||
+    topic_length >= EEA_TOPIC_SIZE_BYTES || payload_length >= EEA_PAYLOAD_SIZE_BYTES) {
+    return false;
+  }
+
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+
+  // The topic's own slot, or else a free slot, or else a slot whose
+  // message has already been delivered.
+  Slot *slot = NULL;
+  Slot *unused = NULL;
+  Slot *delivered = NULL;
+  for(int i = 0; i < EEA_CONFLATE_MAX_TOPICS; i++) {
+    Slot *candidate = &(this->slots[i]);
+    if(candidate->msg == NULL) {
+      if(unused == NULL) {
+        unused = candidate;
+      }
+    } else if(candidate->msg->topic_length == topic_length &&
+      memcmp(candidate->msg->topic, topic, topic_length) == 0) {
+      slot = candidate;
+      break;
+    } else if(!candidate->pending && delivered == NULL) {
+      delivered = candidate;
+    }
+  }
+
+  if(slot == NULL && unused != NULL) {
+    unused->msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_QUEUE, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if(unused->msg != NULL) {
+      slot = unused;
+    }
+  }
+  if(slot == NULL && delivered != NULL) {
+    slot = delivered;
+    slot->conflated = 0;
+  }
+
+  if(slot == NULL) {
+    xSemaphoreGive(this->lock);
+    return false;
+  }
+
+  if(slot->pending) {
+    slot->conflated++;
+  } else {
+    slot->pending = true;
+    slot->sequence = this->sequence++;
+    this->num_pending++;
+  }
+
+  memcpy(slot->msg->topic, topic, topic_length);
+  slot->msg->topic[topic_length] = '\0';
+  memcpy(slot->msg->payload, payload, payload_length);
+  slot->msg->payload[payload_length] = '\0';
+  slot->msg->topic_length = topic_length;
+  slot->msg->payload_length = payload_length;
+  slot->msg->qos = 0;
+  slot->msg->received_at = received_at;
+  slot->msg->queued_at = 0;
+
+  xSemaphoreGive(this->lock);
+  return true;
+}
+
+bool EEA_Conflator::take(EEA_Queue_Msg *msg)
+{
+  if(this->num_pending == 0) {
+    return false;
+  }
+
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+
+  Slot *oldest = NULL;
+  for(int i = 0; i < EEA_CONFLATE_MAX_TOPICS; i++) {
+    Slot *slot = &(this->slots[i]);
+    // Sequence numbers are compared by difference, so they can wrap.
+    if(slot->pending && (oldest == NULL || (int32_t)(slot->sequence - oldest->sequence) < 0)) {
+      oldest = slot;
+    }
+  }
+
+  if(oldest != NULL) {
+    memcpy(msg, oldest->msg, sizeof(EEA_Queue_Msg));
+    oldest->pending = false;
+    this->num_pending--;
+  }
+
+  xSemaphoreGive(this->lock);
+  return oldest != NULL;
+}
+
+bool EEA_Conflator::pending()
+{
+  return this->num_pending > 0;
+}
+
+void EEA_Conflator::dropped()
+{
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  uint32_t num_dropped = ++this->num_dropped;
+  xSemaphoreGive(this->lock);
+
+  ESP_LOGI(TAG, "EEA queue full. %u messages dropped.", num_dropped);
+}
+
+void EEA_Conflator::report()
+{
+  // The MQTT task updates the counters while this runs on another task.
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  for(int i = 0; i < EEA_CONFLATE_MAX_TOPICS; i++) {
+    Slot *slot = &(this->slots[i]);
+    if(slot->msg != NULL && slot->conflated > 0) {
+      ESP_LOGI(TAG, "%s: %u messages conflated.", slot->msg->topic, slot->conflated);
+    }
+  }
+  uint32_t num_dropped = this->num_dropped;
+  xSemaphoreGive(this->lock);
+
+  if(num_dropped > 0) {
+    ESP_LOGI(TAG, "%u messages dropped with the EEA queue full.", num_dropped);
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef EEA_CONFLATE_H
+#define EEA_CONFLATE_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "eea_config.h"
+#include "eea_queue_msg.h"
+
+/**
+ * Latest-value conflation for inbound state topics.
+ *
+ * Messages on topics that match EEA_CONFLATE_TOPICS (eea_config.h) carry
+ * state, such as a dashboard switch or setpoint, where only the newest
+ * value matters. Instead of going through xQueueEEA, the MQTT task offers
+ * them here. Each topic holds at most one pending message, and a newer
+ * message replaces the pending one (which is counted as conflated). The
+ * runtime takes pending state messages before queued messages, so a backlog
+ * of commands can't delay or push out the latest state.
+ *
+ * Offered by the MQTT task and taken by the runtime task.
+ */
+class EEA_Conflator {
+  public:
+    EEA_Conflator();
+
+    /**
+     * Holds a message if its topic is a state topic. received_at is the
+     * message's latency tracing stamp (see EEA_Queue_Msg). Returns false if the
+     * message should be queued as usual: the topic isn't a state topic,
+     * the message is too large, or every slot has a different pending topic.
+     */
+    bool offer(const char *topic, uint32_t topic_length, const char *payload, uint32_t payload_length,
+      int64_t received_at);
+
+    /**
+     * Copies the oldest pending state message into msg and releases it.
+     * Returns false if no message is pending.
+     */
+    bool take(EEA_Queue_Msg *msg);
+
+    /**
+     * Whether any state message is pending.
+     */
+    bool pending();
+
+    /**
+     * Counts an inbound message dropped because xQueueEEA was full.
+     */
+    void dropped();
+
+    /**
+     * Logs the conflated message count of each state topic, and the
+     * number of messages dropped because xQueueEEA was full.
+     */
+    void report();
+
+  private:
+    struct Slot {
+      EEA_Queue_Msg *msg;
+      bool pending;
+
+      // Orders pending slots by when they became pending.
+      uint32_t sequence;
+      uint32_t conflated;
+    } slots[EEA_CONFLATE_MAX_TOPICS];
+
+    SemaphoreHandle_t lock;
+    uint32_t sequence;
+    volatile uint32_t num_pending;
+    uint32_t num_dropped;
+};
+
+#endif
@@ -0,0 +1,374 @@
+/**
+ * Native signal processing. See eea_dsp.h.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#if EEA_DSP_ESP_DSP
+#include "esp_dsp.h"
+#endif
+
+#include "eea_dsp.h"
+#include "eea_bindings.h"
+#include "eea_memory.h"
+
+static const char *TAG = "EEA_DSP";
+
+void EEA_Dsp::window(float *samples, uint32_t count, EEA_Dsp_Window type)
+{
+  // Hann is 0.5 - 0.5cos, Hamming is 0.54 - 0.46cos.
+  float a0 = type == EEA_DSP_WINDOW_HAMMING ? 0.54f : 0.5f;
+  float a1 = 1.0f - a0;
+
+  for(uint32_t i = 0; i < count; i++) {
+    samples[i] *= a0 - a1 * cosf(2.0f * (float)M_PI * i / count);
+  }
+}
+
+/**
+ * In-place radix-2 complex FFT of count interleaved complex values.
+ */
+void EEA_Dsp::fft(float *data, uint32_t count)
+{
+#if EEA_DSP_ESP_DSP
+  dsps_fft2r_fc32(data, count);
+  dsps_bit_rev_fc32(data, count);
+#else
+  // Bit-reversal permutation.
+  for(uint32_t i = 1, j = 0; i < count; i++) {
+    uint32_t bit = count >> 1;
+    for(; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j |= bit;
+
+    if(i < j) {
+      std::swap(data[2 * i], data[2 * j]);
+      std::swap(data[2 * i + 1], data[2 * j + 1]);
+    }
+  }
+
+  for(uint32_t size = 2; size <= count; size <<= 1) {
+    uint32_t half = size >> 1;
+    uint32_t stride = EEA_DSP_MAX_FFT_SIZE / size;
+
+    for(uint32_t start = 0; start < count; start += size) {
+      for(uint32_t k = 0; k < half; k++) {
+        float wr = this->twiddles[2 * k * stride];
+        float wi = this->twiddles[2 * k * stride + 1];
+        float *a = data + 2 * (start + k);
+        float *b = a + 2 * half;
+
+        float tr = wr * b[0] - wi * b[1];
+        float ti = wr * b[1] + wi * b[0];
+        b[0] = a[0] - tr;
+        b[1] = a[1] - ti;
+        a[0] += tr;
+        a[1] += ti;
+      }
+    }
+  }
+#endif
+}
+
+int32_t EEA_Dsp::rfft(float *data, uint32_t count)
+{
+  if(count < 4 || count > EEA_DSP_MAX_FFT_SIZE || (count & (count - 1)) != 0) {
+    return 1;
+  }
+
+  // The even and odd samples are the real and imaginary parts of a complex
+  // FFT of half the size, whose spectrum is then split into the real one.
+  uint32_t half = count / 2;
+  this->fft(data, half);
+
+  float dc = data[0];
+  data[0] = dc + data[1];
+  data[1] = dc - data[1];
+
+  uint32_t stride = EEA_DSP_MAX_FFT_SIZE / count;
+  for(uint32_t k = 1; k <= half / 2; k++) {
+    float *x = data + 2 * k;
+    float *y = data + 2 * (half - k);
+
+    // E and O are the spectra of the even and odd samples.
+    float er = 0.5f * (x[0] + y[0]);
+    float ei = 0.5f * (x[1] - y[1]);
+    float or_ = 0.5f * (x[1] + y[1]);
+    float oi = -0.5f * (x[0] - y[0]);
+
+    float wr = this->twiddles[2 * k * stride];
+    float wi = this->twiddles[2 * k * stride + 1];
+    float tr = wr * or_ - wi * oi;
+    float ti = wr * oi + wi * or_;
+
+    // X[k] = E + WO and X[half - k] = conj(E - WO).
+    x[0] = er + tr;
+    x[1] = ei + ti;
+    if(k != half - k) {
+      y[0] = er - tr;
+      y[1] = ti - ei;
+    }
+  }
+
+  return 0;
+}
+
+void EEA_Dsp::amplitude(float *data, uint32_t count)
+{
+  uint32_t half = count / 2;
+  float scale = 2.0f / count;
+  float nyquist = data[1];
+
+  data[0] = fabsf(data[0]) / count;
+  for(uint32_t k = 1; k < half; k++) {
+    float re = data[2 * k];
+    float im = data[2 * k + 1];
+    data[k] = sqrtf(re * re + im * im) * scale;
+  }
+  data[half] = fabsf(nyquist) / count;
+}
+
+float EEA_Dsp::band_energy(const float *amplitudes, uint32_t bins, float sample_rate, float low_hz, float high_hz)
+{
+  if(bins < 2) {
+    return 0;
+  }
+
+  float resolution = sample_rate / (2 * (bins - 1));
+  uint32_t first = (uint32_t)std::max(0.0f, ceilf(low_hz / resolution));
+  uint32_t last = (uint32_t)std::min((float)(bins - 1), floorf(high_hz / resolution));
+
+  float energy = 0;
+  for(uint32_t k = first; k <= last; k++) {
+    energy += amplitudes[k] * amplitudes[k];
+  }
+  return energy;
+}
+
+uint32_t EEA_Dsp::peaks(const float *amplitudes, uint32_t bins, float sample_rate, float threshold,
+  uint32_t max_peaks, float *frequencies, float *peak_amplitudes)
+{
+  float resolution = bins < 2 ? 0 : sample_rate / (2 * (bins - 1));
+  uint32_t found = 0;
+
+  for(uint32_t k = 1; k + 1 < bins; k++) {
+    float a = amplitudes[k - 1];
+    float b = amplitudes[k];
+    float c = amplitudes[k + 1];
+    if(b < threshold || b <= a || b < c) {
+      continue;
+    }
+
+    float curvature = a - 2 * b + c;
+    float offset = curvature == 0 ? 0 : 0.5f * (a - c) / curvature;
+    float amplitude = b - 0.25f * (a - c) * offset;
+
+    // Insertion into the peaks found so far, largest first.
+    uint32_t i = found < max_peaks ? found++ : max_peaks;
+    for(; i > 0 && peak_amplitudes[i - 1] < amplitude; i--) {
+      if(i < max_peaks) {
+        frequencies[i] = frequencies[i - 1];
+        peak_amplitudes[i] = peak_amplitudes[i - 1];
+      }
+    }
+    if(i < max_peaks) {
+      frequencies[i] = (k + offset) * resolution;
+      peak_amplitudes[i] = amplitude;
+    }
+  }
+
+  return found;
+}
+
+/**
+ * Applies a window function to samples, in place.
+ * Inputs:
+ *   samples (Float32 array): the samples.
+ *   count (Int32): the number of samples, at most EEA_DSP_MAX_FFT_SIZE.
+ *   type (Int32): the window function.
+ *     EEA_DSP_WINDOW_HANN = 0
+ *     EEA_DSP_WINDOW_HAMMING = 1
+ *
+ * Returns 0 for success, 1 for an unsupported count or window.
+ */
+static int32_t eea_fn_dsp_window(EEA_Host_Context ctx, EEA_Span<float> samples, uint32_t type)
+{
+  EEA_Dsp *dsp = (EEA_Dsp*)ctx.userdata;
+  uint32_t count = samples.count;
+  if(count > EEA_DSP_MAX_FFT_SIZE || type > EEA_DSP_WINDOW_HAMMING || dsp->work == NULL) {
+    return 1;
+  }
+
+  memcpy(dsp->work, samples.data, count * sizeof(float));
+  dsp->window(dsp->work, count, (EEA_Dsp_Window)type);
+  memcpy(samples.data, dsp->work, count * sizeof(float));
+  return 0;
+}
+
+/**
+ * Real FFT, in place. The spectrum is packed into the same count values:
+ * the real parts of the DC and Nyquist bins, followed by the real and
+ * imaginary parts of bins 1 to count/2 - 1.
+ * Inputs:
+ *   samples (Float32 array): the samples.
+ *   count (Int32): the number of samples, a power of two from 4 to
+ *     EEA_DSP_MAX_FFT_SIZE.
+ *
+ * Returns 0 for success, 1 for an unsupported count.
+ */
+static int32_t eea_fn_dsp_rfft(EEA_Host_Context ctx, EEA_Span<float> samples)
+{
+  EEA_Dsp *dsp = (EEA_Dsp*)ctx.userdata;
+  uint32_t count = samples.count;
+  if(count > EEA_DSP_MAX_FFT_SIZE || dsp->work == NULL) {
+    return 1;
+  }
+
+  memcpy(dsp->work, samples.data, count * sizeof(float));
+  int32_t result = dsp->rfft(dsp->work, count);
+  if(result == 0) {
+    memcpy(samples.data, dsp->work, count * sizeof(float));
+  }
+  return result;
+}
+
+/**
+ * Converts the packed spectrum from eea_fn_dsp_rfft into count/2 + 1 bin
+ * amplitudes, in place. Bin k is at k * sample rate / count Hz.
+ * Inputs:
+ *   spectrum (Float32 array): the spectrum.
+ *   count (Int32): the number of samples the FFT was computed on.
+ *
+ * Returns 0 for success, 1 for an unsupported count.
+ */
+static int32_t eea_fn_dsp_amplitude(EEA_Host_Context ctx, EEA_Span<float> spectrum)
+{
+  EEA_Dsp *dsp = (EEA_Dsp*)ctx.userdata;
+  uint32_t count = spectrum.count;
+  if(count < 4 || count > EEA_DSP_MAX_FFT_SIZE || dsp->work == NULL) {
+    return 1;
+  }
+
+  memcpy(dsp->work, spectrum.data, count * sizeof(float));
+  dsp->amplitude(dsp->work, count);
+  memcpy(spectrum.data, dsp->work, (count / 2 + 1) * sizeof(float));
+  return 0;
+}
+
+/**
+ * Sums the energy (squared amplitude) of a frequency band.
+ * Inputs:
+ *   amplitudes (Float32 array): the bin amplitudes from eea_fn_dsp_amplitude.
+ *   bins (Int32): the number of bins, count/2 + 1.
+ *   sample_rate (Float32): the sample rate in Hz.
+ *   low_hz (Float32): the lowest frequency in the band.
+ *   high_hz (Float32): the highest frequency in the band.
+ *
+ * Outputs:
+ *   value (Float32): the band energy.
+ *
+ * Returns 0 for success, 1 for an unsupported number of bins.
+ */
+static int32_t eea_fn_dsp_band_energy(EEA_Host_Context ctx, EEA_Span<float> amplitudes,
+  float sample_rate, float low_hz, float high_hz, EEA_Out<float> value)
+{
+  EEA_Dsp *dsp = (EEA_Dsp*)ctx.userdata;
+  uint32_t bins = amplitudes.count;
+  if(bins > EEA_DSP_MAX_FFT_SIZE / 2 + 1 || dsp->work == NULL) {
+    return 1;
+  }
+
+  memcpy(dsp->work, amplitudes.data, bins * sizeof(float));
+  float energy = dsp->band_energy(dsp->work, bins, sample_rate, low_hz, high_hz);
+  value.set(energy);
+  return 0;
+}
+
+/**
+ * Finds the largest spectral peaks.
+ * Inputs:
+ *   amplitudes (Float32 array): the bin amplitudes from eea_fn_dsp_amplitude.
+ *   bins (Int32): the number of bins, count/2 + 1.
+ *   sample_rate (Float32): the sample rate in Hz.
+ *   threshold (Float32): the smallest amplitude of a peak.
+ *   max_peaks (Int32): the size of the output arrays, at most EEA_DSP_MAX_PEAKS.
+ *
+ * Outputs:
+ *   frequencies (Float32 array): the frequencies of the peaks in Hz.
+ *   peak_amplitudes (Float32 array): the amplitudes of the peaks.
+ *
+ * Returns the number of peaks found, largest first, or -1 for an
+ * unsupported number of bins or peaks.
+ */
+static int32_t eea_fn_dsp_peaks(EEA_Host_Context ctx, EEA_Span<float> amplitudes,
+  float sample_rate, float threshold, uint32_t max_peaks,
+  EEA_Array<float, 4> frequencies, EEA_Array<float, 4> peak_amplitudes)
+{
+  EEA_Dsp *dsp = (EEA_Dsp*)ctx.userdata;
+  uint32_t bins = amplitudes.count;
+  if(bins > EEA_DSP_MAX_FFT_SIZE / 2 + 1 || max_peaks > EEA_DSP_MAX_PEAKS || dsp->work == NULL) {
+    return -1;
+  }
+
+  float peak_frequencies[EEA_DSP_MAX_PEAKS];
+  float peak_values[EEA_DSP_MAX_PEAKS];
+
+  memcpy(dsp->work, amplitudes.data, bins * sizeof(float));
+  uint32_t found = dsp->peaks(dsp->work, bins, sample_rate, threshold, max_peaks, peak_frequencies, peak_values);
+  memcpy(frequencies.data, peak_frequencies, found * sizeof(float));
+  memcpy(peak_amplitudes.data, peak_values, found * sizeof(float));
+  return found;
+}
+
+static const EEA_Host_Function eea_dsp_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_dsp_window),
+  EEA_HOST_FUNCTION(eea_fn_dsp_rfft),
+  EEA_HOST_FUNCTION(eea_fn_dsp_amplitude),
+  EEA_HOST_FUNCTION(eea_fn_dsp_band_energy),
+  EEA_HOST_FUNCTION(eea_fn_dsp_peaks)
+};
+
+EEA_Dsp::EEA_Dsp(EEA_Engine *engine)
+{
+  // Internal RAM, so the FFT doesn't run from PSRAM.
+  this->work = (float*)eea_malloc(EEA_MEM_API, EEA_DSP_MAX_FFT_SIZE * sizeof(float), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  this->twiddles = (float*)eea_malloc(EEA_MEM_API, EEA_DSP_MAX_FFT_SIZE * sizeof(float), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+
+  if(this->work == NULL || this->twiddles == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate DSP buffers.");
+    eea_free(this->work);
+    this->work = NULL;
+  } else {
+    for(uint32_t k = 0; k < EEA_DSP_MAX_FFT_SIZE / 2; k++) {
+      double angle = 2.0 * M_PI * k / EEA_DSP_MAX_FFT_SIZE;
+      this->twiddles[2 * k] = (float)cos(angle);
+      this->twiddles[2 * k + 1] = (float)-sin(angle);
+    }
+  }
+
+#if EEA_DSP_ESP_DSP
+  // esp-dsp's tables are global, so they are shared by every instance and never freed.
+  static bool esp_dsp_initialized = false;
+  if(!esp_dsp_initialized) {
+    esp_dsp_initialized = dsps_fft2r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE) == ESP_OK;
+    if(!esp_dsp_initialized) {
+      ESP_LOGE(TAG, "Failed to initialize esp-dsp.");
+    }
+  }
+#endif
+
+  engine->add_host_functions("env", eea_dsp_functions,
+    sizeof(eea_dsp_functions) / sizeof(eea_dsp_functions[0]), this);
+}
+
+EEA_Dsp::~EEA_Dsp()
+{
+  eea_free(this->work);
+  eea_free(this->twiddles);
+}
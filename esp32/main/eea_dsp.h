@@ -0,0 +1,81 @@
+#ifndef EEA_DSP_H
+#define EEA_DSP_H
+
+#include <stdint.h>
+
+#include "eea_config.h"
+#include "eea_engine.h"
+
+/**
+ * Window functions applied before an FFT.
+ */
+enum EEA_Dsp_Window {
+  EEA_DSP_WINDOW_HANN = 0,
+  EEA_DSP_WINDOW_HAMMING = 1
+};
+
+/**
+ * Native signal processing for workflows, exposed as registered functions
+ * (see eea_dsp.cpp), for vibration analysis of accelerometer windows that
+ * would be far too slow as interpreted WASM math.
+ *
+ * The registered functions copy the workflow's buffer into an internal RAM
+ * work buffer, process it there and copy the result back, so buffers in
+ * linear memory (in PSRAM, and possibly unaligned) are processed in place
+ * from the workflow's point of view.
+ *
+ * The complex FFT at the core of rfft uses esp-dsp's optimised kernels in
+ * builds with -DEEA_DSP_ESP_DSP=ON (main/CMakeLists.txt), and a portable
+ * radix-2 implementation otherwise.
+ */
+class EEA_Dsp {
+  public:
+    EEA_Dsp(EEA_Engine *engine);
+    ~EEA_Dsp();
+
+    /**
+     * Multiplies count samples by a periodic window function.
+     */
+    void window(float *samples, uint32_t count, EEA_Dsp_Window type);
+
+    /**
+     * Real FFT of count samples, in place. count must be a power of two from
+     * 4 to EEA_DSP_MAX_FFT_SIZE. The spectrum is packed into the same count
+     * values: the real parts of the DC and Nyquist bins, followed by the
+     * real and imaginary parts of bins 1 to count/2 - 1.
+     * Returns 0 on success, or 1 for an unsupported count.
+     */
+    int32_t rfft(float *data, uint32_t count);
+
+    /**
+     * Converts a packed spectrum of an FFT of count samples into the
+     * count/2 + 1 bin amplitudes, in place. Amplitudes are scaled so a
+     * sinusoid's bin holds its amplitude.
+     */
+    void amplitude(float *data, uint32_t count);
+
+    /**
+     * The sum of the squared amplitudes of the bins from low_hz to high_hz.
+     */
+    float band_energy(const float *amplitudes, uint32_t bins, float sample_rate, float low_hz, float high_hz);
+
+    /**
+     * Finds the largest local maxima of at least threshold, up to
+     * max_peaks, in descending order of amplitude. Frequencies and
+     * amplitudes are refined by parabolic interpolation between bins.
+     * Returns the number of peaks found.
+     */
+    uint32_t peaks(const float *amplitudes, uint32_t bins, float sample_rate, float threshold,
+      uint32_t max_peaks, float *frequencies, float *peak_amplitudes);
+
+    // Work buffer of EEA_DSP_MAX_FFT_SIZE floats in internal RAM.
+    float *work;
+
+  private:
+    void fft(float *data, uint32_t count);
+
+    // e^(-2*pi*i*k/EEA_DSP_MAX_FFT_SIZE) for k < EEA_DSP_MAX_FFT_SIZE / 2, interleaved.
+    float *twiddles;
+};
+
+#endif
@@ -0,0 +1,23 @@
+/**
+ * Engine factory. See eea_engine.h.
+ */
+
+#include "eea_engine.h"
+#include "eea_engine_wasm3.h"
+#include "eea_engine_wamr.h"
+
+EEA_Engine *eea_engine_create(EEA_Engine_Kind kind)
+{
+  switch(kind) {
+    case EEA_ENGINE_KIND_WASM3:
+      return new EEA_Engine_Wasm3();
+
+#if EEA_ENGINE_WAMR
+    case EEA_ENGINE_KIND_WAMR:
+      return new EEA_Engine_Wamr();
+#endif
+
+    default:
+      return NULL;
+  }
+}
@@ -0,0 +1,126 @@
+#ifndef EEA_ENGINE_H
+#define EEA_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eea_bindings.h"
+
+/**
+ * NULL on success, otherwise an error message. The same convention as
+ * wasm3's M3Result, so wasm3 errors pass through unchanged.
+ */
+typedef const char *EEA_Engine_Result;
+
+/**
+ * An exported function, found with EEA_Engine::find. Valid until the
+ * engine is deleted.
+ */
+typedef void *EEA_Engine_Function;
+
+enum EEA_Engine_Kind {
+  EEA_ENGINE_KIND_WASM3,  // wasm3 interpreter (eea_engine_wasm3.h).
+  EEA_ENGINE_KIND_WAMR    // WebAssembly Micro Runtime, with AOT support (eea_engine_wamr.h).
+};
+
+/**
+ * Time spent in each phase of EEA_Engine::load, in microseconds. A phase
+ * an engine doesn't have separately is 0.
+ */
+struct EEA_Engine_Load_Timing {
+  int64_t setup_us;        // Engine environment and runtime.
+  int64_t parse_us;        // Decoding the module (WAMR also resolves imports here).
+  int64_t instantiate_us;  // Loading the module into the runtime.
+  int64_t link_us;         // Resolving imports to host functions.
+};
+
+/**
+ * A WASM engine running one bundle.
+ *
+ * The runtime, the EEA API and the benchmarks only use this interface, so
+ * the same host functions and runtime loop run on any engine. One engine
+ * instance is created per bundle and deleted when the bundle is destroyed.
+ *
+ * Host functions must be added before load(), since some engines resolve
+ * imports when the module is loaded. Arguments and results are passed as
+ * 64-bit slots; each is read or written as the type of the wasm parameter.
+ */
+class EEA_Engine {
+  public:
+    virtual ~EEA_Engine() {}
+
+    /**
+     * Makes a table of host functions available to the bundle's imports
+     * from module_name. The table must outlive the engine.
+     */
+    virtual void add_host_functions(const char *module_name,
+      const EEA_Host_Function *functions, size_t count, void *userdata) = 0;
+
+    /**
+     * Loads and instantiates a module. The bytes must outlive the engine.
+     */
+    virtual EEA_Engine_Result load(const uint8_t *module, uint32_t size, uint32_t stack_size) = 0;
+
+    virtual EEA_Engine_Result find(EEA_Engine_Function *function, const char *name) = 0;
+
+    /**
+     * Calls a function. result may be NULL if the function returns nothing.
+     */
+    virtual EEA_Engine_Result call(EEA_Engine_Function function, uint32_t argc, const uint64_t *argv, uint64_t *result) = 0;
+
+    /**
+     * Makes the running call return with an error as soon as possible.
+     * Safe to call from a timer callback while the runtime task is in call().
+     */
+    virtual void interrupt() = 0;
+
+    /**
+     * Reads an exported global.
+     */
+    virtual EEA_Engine_Result get_global(const char *name, uint64_t *value) = 0;
+
+    /**
+     * The base and size of the module's linear memory.
+     */
+    virtual uint8_t *memory(uint32_t *size) = 0;
+
+    /**
+     * The name of a function returned by find().
+     */
+    virtual const char *function_name(EEA_Engine_Function function) = 0;
+
+    /**
+     * Logs the wasm call stack of the last failed call, if the engine recorded one.
+     */
+    virtual void print_backtrace() = 0;
+
+    EEA_Engine_Result call(EEA_Engine_Function function)
+    {
+      return call(function, 0, NULL, NULL);
+    }
+
+    EEA_Engine_Result call(EEA_Engine_Function function, uint64_t arg)
+    {
+      return call(function, 1, &arg, NULL);
+    }
+
+    EEA_Engine_Result call(EEA_Engine_Function function, uint64_t arg0, uint64_t arg1)
+    {
+      uint64_t argv[2] = { arg0, arg1 };
+      return call(function, 2, argv, NULL);
+    }
+
+    EEA_Engine_Kind kind;
+    const char *name;
+
+    // Set by load().
+    EEA_Engine_Load_Timing load_timing;
+};
+
+/**
+ * Creates an engine, or returns NULL if it wasn't built in
+ * (see EEA_ENGINE_WAMR in main/CMakeLists.txt).
+ */
+EEA_Engine *eea_engine_create(EEA_Engine_Kind kind);
+
+#endif
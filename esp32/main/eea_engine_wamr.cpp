@@ -0,0 +1,406 @@
+/**
+ * WAMR engine. See eea_engine_wamr.h.
+ */
+
+#if EEA_ENGINE_WAMR
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_engine_wamr.h"
+#include "eea_memory.h"
+#include "eea_wasm_arena.h"
+
+static const char *TAG = "EEA_ENGINE_WAMR";
+
+static bool wamr_initialized = false;
+
+// Set while load() runs, when WAMR's allocations belong to the bundle.
+static bool wamr_arena_allocations = false;
+
+/**
+ * A host function table registered with WAMR, and the number of engines
+ * that added it.
+ */
+struct Wamr_Registration {
+  const char *module_name;
+  const EEA_Host_Function *functions;
+  NativeSymbol *symbols;
+  uint32_t references;
+};
+
+static Wamr_Registration registrations[EEA_ENGINE_WAMR_MAX_REGISTRATIONS];
+
+/**
+ * WAMR's allocator. Only allocations made while a module is loaded come
+ * from the bundle arena; everything else is WAMR's own state and comes
+ * from SPIRAM. Reallocs and frees are routed by address by the
+ * eea_wasm_* hooks, so either kind is released correctly.
+ */
+static void *wamr_malloc(unsigned int size)
+{
+  if(wamr_arena_allocations) {
+    return eea_wasm_malloc(size);
+  }
+  return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+static void *wamr_realloc(void *ptr, unsigned int size)
+{
+  if(ptr == NULL) {
+    return wamr_malloc(size);
+  }
+  return eea_wasm_realloc(ptr, size);
+}
+
+static void wamr_free(void *ptr)
+{
+  eea_wasm_free(ptr);
+}
+
+/**
+ * WAMR is initialized once, and never on an arena.
+ */
+static bool wamr_init()
+{
+  if(wamr_initialized) {
+    return true;
+  }
+
+  RuntimeInitArgs init_args;
+  memset(&init_args, 0, sizeof(init_args));
+  init_args.mem_alloc_type = Alloc_With_Allocator;
+  init_args.mem_alloc_option.allocator.malloc_func = (void*)wamr_malloc;
+  init_args.mem_alloc_option.allocator.realloc_func = (void*)wamr_realloc;
+  init_args.mem_alloc_option.allocator.free_func = (void*)wamr_free;
+
+  wamr_initialized = wasm_runtime_full_init(&init_args);
+  if(!wamr_initialized) {
+    ESP_LOGI(TAG, "Failed to initialize WAMR.");
+  }
+  return wamr_initialized;
+}
+
+/**
+ * Registers a host function table with WAMR, or adds a reference to its
+ * registration. The table itself is the attachment, so a native call can
+ * find the calling engine's userdata for it.
+ */
+static bool wamr_register(const char *module_name, const EEA_Host_Function *functions, size_t count)
+{
+  Wamr_Registration *slot = NULL;
+  for(uint32_t i = 0; i < EEA_ENGINE_WAMR_MAX_REGISTRATIONS; i++) {
+    if(registrations[i].functions == functions) {
+      registrations[i].references++;
+      return true;
+    }
+    if(slot == NULL && registrations[i].functions == NULL) {
+      slot = &registrations[i];
+    }
+  }
+
+  if(slot == NULL) {
+    ESP_LOGI(TAG, "Too many host function tables.");
+    return false;
+  }
+
+  // WAMR keeps (and sorts) the array until it is unregistered.
+  NativeSymbol *symbols = (NativeSymbol*)eea_malloc(EEA_MEM_RUNTIME, count * sizeof(NativeSymbol), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(symbols == NULL) {
+    ESP_LOGI(TAG, "Failed to allocate host function table.");
+    return false;
+  }
+
+  for(size_t i = 0; i < count; i++) {
+    symbols[i].symbol = functions[i].name;
+    symbols[i].func_ptr = (void*)functions[i].native_call;
+    symbols[i].signature = functions[i].native_signature;
+    symbols[i].attachment = (void*)functions;
+  }
+
+  if(!wasm_runtime_register_natives_raw(module_name, symbols, count)) {
+    ESP_LOGI(TAG, "Failed to register host functions for %s.", module_name);
+    eea_free(symbols);
+    return false;
+  }
+
+  slot->module_name = module_name;
+  slot->functions = functions;
+  slot->symbols = symbols;
+  slot->references = 1;
+  return true;
+}
+
+/**
+ * Drops a reference to a table's registration, and unregisters it when
+ * no engine uses it. A later table with the same import names (such as
+ * the benchmarks' eea_trace) can then be resolved instead.
+ */
+static void wamr_release(const EEA_Host_Function *functions)
+{
+  for(uint32_t i = 0; i < EEA_ENGINE_WAMR_MAX_REGISTRATIONS; i++) {
+    Wamr_Registration *registration = &registrations[i];
+    if(registration->functions != functions) {
+      continue;
+    }
+
+    if(--registration->references == 0) {
+      wasm_runtime_unregister_natives(registration->module_name, registration->symbols);
+      eea_free(registration->symbols);
+      memset(registration, 0, sizeof(*registration));
+    }
+    return;
+  }
+}
+
+void *eea_wamr_memory(void *exec_env, uint32_t *size)
+{
+  wasm_module_inst_t instance = wasm_runtime_get_module_inst((wasm_exec_env_t)exec_env);
+  wasm_memory_inst_t memory = wasm_runtime_get_default_memory(instance);
+  if(memory == NULL) {
+    *size = 0;
+    return NULL;
+  }
+
+  *size = (uint32_t)(wasm_memory_get_cur_page_count(memory) * wasm_memory_get_bytes_per_page(memory));
+  return wasm_memory_get_base_address(memory);
+}
+
+void eea_wamr_trap(void *exec_env, const char *message)
+{
+  wasm_runtime_set_exception(wasm_runtime_get_module_inst((wasm_exec_env_t)exec_env), message);
+}
+
+void *eea_wamr_userdata(void *exec_env)
+{
+  EEA_Engine_Wamr *engine = (EEA_Engine_Wamr*)wasm_runtime_get_user_data((wasm_exec_env_t)exec_env);
+  const EEA_Host_Function *functions =
+    (const EEA_Host_Function*)wasm_runtime_get_function_attachment((wasm_exec_env_t)exec_env);
+  return engine->host_userdata(functions);
+}
+
+EEA_Engine_Wamr::EEA_Engine_Wamr()
+{
+  this->kind = EEA_ENGINE_KIND_WAMR;
+  this->name = "wamr";
+  this->module = NULL;
+  this->instance = NULL;
+  this->exec_env = NULL;
+  this->num_host_tables = 0;
+  this->num_functions = 0;
+  this->error[0] = '\0';
+}
+
+EEA_Engine_Wamr::~EEA_Engine_Wamr()
+{
+  if(this->exec_env != NULL) {
+    wasm_runtime_destroy_exec_env(this->exec_env);
+  }
+  if(this->instance != NULL) {
+    wasm_runtime_deinstantiate(this->instance);
+  }
+  if(this->module != NULL) {
+    wasm_runtime_unload(this->module);
+  }
+
+  for(uint32_t i = 0; i < this->num_host_tables; i++) {
+    wamr_release(this->host_tables[i].functions);
+  }
+}
+
+void EEA_Engine_Wamr::add_host_functions(const char *module_name,
+  const EEA_Host_Function *functions, size_t count, void *userdata)
+{
+  if(!wamr_init()) {
+    return;
+  }
+
+  if(this->num_host_tables >= EEA_ENGINE_WAMR_MAX_HOST_TABLES) {
+    ESP_LOGI(TAG, "Too many host function tables.");
+    return;
+  }
+
+  if(!wamr_register(module_name, functions, count)) {
+    return;
+  }
+
+  this->host_tables[this->num_host_tables].functions = functions;
+  this->host_tables[this->num_host_tables].userdata = userdata;
+  this->num_host_tables++;
+}
+
+void *EEA_Engine_Wamr::host_userdata(const EEA_Host_Function *functions)
+{
+  for(uint32_t i = 0; i < this->num_host_tables; i++) {
+    if(this->host_tables[i].functions == functions) {
+      return this->host_tables[i].userdata;
+    }
+  }
+  return NULL;
+}
+
+EEA_Engine_Result EEA_Engine_Wamr::load(const uint8_t *module, uint32_t size, uint32_t stack_size)
+{
+  memset(&(this->load_timing), 0, sizeof(this->load_timing));
+  int64_t start = esp_timer_get_time();
+
+  if(!wamr_init()) {
+    return "WAMR initialization failed";
+  }
+
+  this->load_timing.setup_us = esp_timer_get_time() - start;
+
+  wamr_arena_allocations = true;
+  EEA_Engine_Result result = this->load_module(module, size, stack_size);
+  wamr_arena_allocations = false;
+  return result;
+}
+
+/**
+ * The part of load() whose allocations belong to the bundle.
+ */
+EEA_Engine_Result EEA_Engine_Wamr::load_module(const uint8_t *module, uint32_t size, uint32_t stack_size)
+{
+  int64_t start = esp_timer_get_time();
+
+  // Imports are resolved while loading.
+  this->module = wasm_runtime_load((uint8_t*)module, size, this->error, sizeof(this->error));
+  if(this->module == NULL) {
+    return this->error;
+  }
+
+  int64_t now = esp_timer_get_time();
+  this->load_timing.parse_us = now - start;
+  start = now;
+
+  // Bundles manage their own heap inside linear memory.
+  this->instance = wasm_runtime_instantiate(this->module, stack_size, 0, this->error, sizeof(this->error));
+  if(this->instance == NULL) {
+    return this->error;
+  }
+
+  this->exec_env = wasm_runtime_create_exec_env(this->instance, stack_size);
+  if(this->exec_env == NULL) {
+    return "failed to create execution environment";
+  }
+
+  // Host functions find the engine's userdata through the execution environment.
+  wasm_runtime_set_user_data(this->exec_env, this);
+
+  this->load_timing.instantiate_us = esp_timer_get_time() - start;
+  return NULL;
+}
+
+EEA_Engine_Result EEA_Engine_Wamr::find(EEA_Engine_Function *function, const char *name)
+{
+  wasm_function_inst_t wamr_function = wasm_runtime_lookup_function(this->instance, name);
+  *function = wamr_function;
+
+  if(wamr_function == NULL) {
+    return "function lookup failed";
+  }
+
+  if(this->num_functions < EEA_ENGINE_WAMR_MAX_FUNCTIONS) {
+    this->functions[this->num_functions].function = wamr_function;
+    this->functions[this->num_functions].name = name;
+    this->num_functions++;
+  }
+  return NULL;
+}
+
+EEA_Engine_Result EEA_Engine_Wamr::call(EEA_Engine_Function function, uint32_t argc, const uint64_t *argv, uint64_t *result)
+{
+  wasm_function_inst_t wamr_function = (wasm_function_inst_t)function;
+
+  // WAMR passes arguments and results in 32-bit cells; 64-bit values take two.
+  wasm_valkind_t types[8];
+  uint32_t cells[16];
+
+  uint32_t param_count = wasm_func_get_param_count(wamr_function, this->instance);
+  if(param_count != argc || argc > sizeof(types) / sizeof(types[0])) {
+    return "argument count mismatch";
+  }
+  wasm_func_get_param_types(wamr_function, this->instance, types);
+
+  uint32_t num_cells = 0;
+  for(uint32_t i = 0; i < argc; i++) {
+    memcpy(&(cells[num_cells]), &(argv[i]), sizeof(uint32_t));
+    num_cells++;
+    if(types[i] == WASM_I64 || types[i] == WASM_F64) {
+      memcpy(&(cells[num_cells]), (const uint8_t*)&(argv[i]) + 4, sizeof(uint32_t));
+      num_cells++;
+    }
+  }
+
+  // A budget timer can terminate the instance just after a call returns.
+  wasm_runtime_clear_exception(this->instance);
+
+  if(!wasm_runtime_call_wasm(this->exec_env, wamr_function, num_cells, cells)) {
+    strncpy(this->error, wasm_runtime_get_exception(this->instance), sizeof(this->error) - 1);
+    this->error[sizeof(this->error) - 1] = '\0';
+    wasm_runtime_clear_exception(this->instance);
+    return this->error;
+  }
+
+  if(result != NULL && wasm_func_get_result_count(wamr_function, this->instance) > 0) {
+    wasm_valkind_t result_type;
+    wasm_func_get_result_types(wamr_function, this->instance, &result_type);
+
+    *result = 0;
+    memcpy(result, cells, (result_type == WASM_I64 || result_type == WASM_F64) ? 8 : 4);
+  }
+
+  return NULL;
+}
+
+void EEA_Engine_Wamr::interrupt()
+{
+  if(this->instance != NULL) {
+    wasm_runtime_terminate(this->instance);
+  }
+}
+
+EEA_Engine_Result EEA_Engine_Wamr::get_global(const char *name, uint64_t *value)
+{
+  wasm_global_inst_t global;
+  if(!wasm_runtime_get_export_global_inst(this->instance, name, &global)) {
+    return "global lookup failed";
+  }
+
+  *value = 0;
+  memcpy(value, global.global_data, (global.kind == WASM_I64 || global.kind == WASM_F64) ? 8 : 4);
+  return NULL;
+}
+
+uint8_t *EEA_Engine_Wamr::memory(uint32_t *size)
+{
+  wasm_memory_inst_t memory = wasm_runtime_get_default_memory(this->instance);
+  if(memory == NULL) {
+    *size = 0;
+    return NULL;
+  }
+
+  *size = (uint32_t)(wasm_memory_get_cur_page_count(memory) * wasm_memory_get_bytes_per_page(memory));
+  return (uint8_t*)wasm_memory_get_base_address(memory);
+}
+
+const char *EEA_Engine_Wamr::function_name(EEA_Engine_Function function)
+{
+  for(uint32_t i = 0; i < this->num_functions; i++) {
+    if(this->functions[i].function == function) {
+      return this->functions[i].name;
+    }
+  }
+  return "<unknown>";
+}
+
+void EEA_Engine_Wamr::print_backtrace()
+{
+  // Printed when WAMR is built with WAMR_BUILD_DUMP_CALL_STACK.
+  wasm_runtime_dump_call_stack(this->exec_env);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef EEA_ENGINE_WAMR_H
+#define EEA_ENGINE_WAMR_H
+
+#if EEA_ENGINE_WAMR
+
+#include "eea_engine.h"
+
+#include "wasm_export.h"
+
+#define EEA_ENGINE_WAMR_MAX_HOST_TABLES 8
+#define EEA_ENGINE_WAMR_MAX_REGISTRATIONS 16
+#define EEA_ENGINE_WAMR_MAX_FUNCTIONS 16
+#define EEA_ENGINE_WAMR_ERROR_SIZE 128
+
+/**
+ * The WebAssembly Micro Runtime. Loads both WASM modules and AOT modules
+ * compiled ahead of time with wamrc, e.g.:
+ *
+ *   wamrc --target=xtensa -o bundle.aot bundle.wasm
+ *
+ * Built in with -DEEA_ENGINE_WAMR=ON (main/CMakeLists.txt). WAMR's global
+ * state (its native symbol registry and runtime-wide lists) outlives every
+ * bundle, so it is allocated from the general SPIRAM heap. Only what load()
+ * allocates (the module, the instance, linear memory and the execution
+ * environment) comes from the bundle arena through the eea_wasm_* hooks,
+ * so resetting the arena never frees state WAMR still uses.
+ *
+ * Host functions are registered as WAMR raw natives, which are resolved
+ * when the module is loaded. WAMR's registry is global, so each table is
+ * registered once, while any engine uses it, with the table as the
+ * attachment. The engine that is calling is found from the execution
+ * environment, which gives each engine its own userdata for the same
+ * table. interrupt() terminates the module instance, which WAMR checks at
+ * loop back-edges as well as calls.
+ */
+class EEA_Engine_Wamr : public EEA_Engine {
+  public:
+    EEA_Engine_Wamr();
+    ~EEA_Engine_Wamr();
+
+    void add_host_functions(const char *module_name,
+      const EEA_Host_Function *functions, size_t count, void *userdata);
+    EEA_Engine_Result load(const uint8_t *module, uint32_t size, uint32_t stack_size);
+    EEA_Engine_Result find(EEA_Engine_Function *function, const char *name);
+    EEA_Engine_Result call(EEA_Engine_Function function, uint32_t argc, const uint64_t *argv, uint64_t *result);
+    void interrupt();
+    EEA_Engine_Result get_global(const char *name, uint64_t *value);
+    uint8_t *memory(uint32_t *size);
+    const char *function_name(EEA_Engine_Function function);
+    void print_backtrace();
+
+    using EEA_Engine::call;
+
+    /**
+     * The userdata this engine added a host function table with.
+     */
+    void *host_userdata(const EEA_Host_Function *functions);
+
+  private:
+    EEA_Engine_Result load_module(const uint8_t *module, uint32_t size, uint32_t stack_size);
+
+    wasm_module_t module;
+    wasm_module_inst_t instance;
+    wasm_exec_env_t exec_env;
+
+    // The host function tables added to this engine. Each holds a
+    // reference to the table's registration (eea_engine_wamr.cpp).
+    struct Host_Table {
+      const EEA_Host_Function *functions;
+      void *userdata;
+    } host_tables[EEA_ENGINE_WAMR_MAX_HOST_TABLES];
+    uint32_t num_host_tables;
+
+    // WAMR function instances don't carry their export name.
+    struct Function_Name {
+      wasm_function_inst_t function;
+      const char *name;
+    } functions[EEA_ENGINE_WAMR_MAX_FUNCTIONS];
+    uint32_t num_functions;
+
+    char error[EEA_ENGINE_WAMR_ERROR_SIZE];
+};
+
+#endif
+
+#endif
@@ -0,0 +1,236 @@
+/**
+ * wasm3 engine. See eea_engine_wasm3.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eea_engine_wasm3.h"
+#include "eea_interrupt_checks.h"
+#include "eea_wasm_arena.h"
+
+static const char *TAG = "EEA_ENGINE_WASM3";
+
+static const char * const eea_err_interrupted = "interrupted";
+
+EEA_Engine_Wasm3::EEA_Engine_Wasm3()
+{
+  this->kind = EEA_ENGINE_KIND_WASM3;
+  this->name = "wasm3";
+  this->env = NULL;
+  this->runtime = NULL;
+  this->module = NULL;
+  this->num_host_tables = 0;
+  this->instrumented = NULL;
+  this->interrupt_global = NULL;
+  this->interrupted = false;
+}
+
+EEA_Engine_Wasm3::~EEA_Engine_Wasm3()
+{
+  // The runtime owns the loaded module.
+  if(this->runtime != NULL) {
+    m3_FreeRuntime(this->runtime);
+  }
+  if(this->env != NULL) {
+    m3_FreeEnvironment(this->env);
+  }
+  eea_wasm_free(this->instrumented);
+}
+
+void EEA_Engine_Wasm3::add_host_functions(const char *module_name,
+  const EEA_Host_Function *functions, size_t count, void *userdata)
+{
+  if(this->num_host_tables >= EEA_ENGINE_WASM3_MAX_HOST_TABLES) {
+    ESP_LOGI(TAG, "Too many host function tables.");
+    return;
+  }
+
+  Host_Table *table = &(this->host_tables[this->num_host_tables++]);
+  table->module_name = module_name;
+  table->functions = functions;
+  table->count = count;
+  table->userdata = userdata;
+}
+
+EEA_Engine_Result EEA_Engine_Wasm3::load(const uint8_t *module, uint32_t size, uint32_t stack_size)
+{
+  memset(&(this->load_timing), 0, sizeof(this->load_timing));
+  int64_t start = esp_timer_get_time();
+
+  this->env = m3_NewEnvironment();
+  if(this->env == NULL) {
+    return m3Err_mallocFailed;
+  }
+
+  this->runtime = m3_NewRuntime(this->env, stack_size, NULL);
+  if(this->runtime == NULL) {
+    return m3Err_mallocFailed;
+  }
+
+  int64_t now = esp_timer_get_time();
+  this->load_timing.setup_us = now - start;
+  start = now;
+
+  // The checks are the only way to interrupt code that loops without
+  // calling a function. The module is parsed from the rewritten copy,
+  // which wasm3 reads from for as long as the module is loaded.
+  uint32_t checked_size = 0;
+  uint32_t global_index = 0;
+  if(eea_interrupt_checks_add(module, size, NULL, &checked_size, &global_index) == 0) {
+    this->instrumented = (uint8_t*)eea_wasm_malloc(checked_size);
+    if(this->instrumented == NULL) {
+      return m3Err_mallocFailed;
+    }
+    eea_interrupt_checks_add(module, size, this->instrumented, &checked_size, &global_index);
+    module = this->instrumented;
+    size = checked_size;
+  } else {
+    ESP_LOGI(TAG, "Failed to add interrupt checks. Calls can only be interrupted when they call a function.");
+  }
+
+  M3Result result = m3_ParseModule(this->env, &(this->module), module, size);
+  if(result != m3Err_none) {
+    return result;
+  }
+
+  now = esp_timer_get_time();
+  this->load_timing.parse_us = now - start;
+  start = now;
+
+  result = m3_LoadModule(this->runtime, this->module);
+  if(result != m3Err_none) {
+    m3_FreeModule(this->module);
+    this->module = NULL;
+    return result;
+  }
+
+  if(this->instrumented != NULL && global_index < this->module->numGlobals) {
+    this->interrupt_global = &(this->module->globals[global_index].i64Value);
+  }
+
+  now = esp_timer_get_time();
+  this->load_timing.instantiate_us = now - start;
+  start = now;
+
+  for(uint32_t i = 0; i < this->num_host_tables; i++) {
+    Host_Table *table = &(this->host_tables[i]);
+    int failures = eea_link_host_functions(this->module, table->module_name,
+      table->functions, table->count, table->userdata);
+    if(failures > 0) {
+      ESP_LOGI(TAG, "%d host functions failed to link.", failures);
+    }
+  }
+
+  this->load_timing.link_us = esp_timer_get_time() - start;
+  return m3Err_none;
+}
+
+EEA_Engine_Result EEA_Engine_Wasm3::find(EEA_Engine_Function *function, const char *name)
+{
+  IM3Function m3_function = NULL;
+  M3Result result = m3_FindFunction(&m3_function, this->runtime, name);
+  *function = m3_function;
+
+  if(result != m3Err_none && this->runtime->error_message[0] != '\0') {
+    ESP_LOGI(TAG, "%s: %s", name, this->runtime->error_message);
+  }
+  return result;
+}
+
+EEA_Engine_Result EEA_Engine_Wasm3::call(EEA_Engine_Function function, uint32_t argc, const uint64_t *argv, uint64_t *result)
+{
+  IM3Function m3_function = (IM3Function)function;
+
+  // wasm3 reads each argument as its parameter type, from the start of its slot.
+  const void *args[8];
+  if(argc > sizeof(args) / sizeof(args[0])) {
+    return m3Err_argumentCountMismatch;
+  }
+  for(uint32_t i = 0; i < argc; i++) {
+    args[i] = &(argv[i]);
+  }
+
+  this->clear_interrupt();
+  M3Result call_result = m3_Call(m3_function, argc, args);
+  if(call_result != m3Err_none && this->interrupted) {
+    // The check traps as unreachable.
+    call_result = eea_err_interrupted;
+  }
+  this->clear_interrupt();
+
+  if(call_result == m3Err_none && result != NULL && m3_GetRetCount(m3_function) > 0) {
+    *result = 0;
+    const void *results[1] = { result };
+    call_result = m3_GetResults(m3_function, 1, results);
+  }
+
+  return call_result;
+}
+
+void EEA_Engine_Wasm3::interrupt()
+{
+  this->interrupted = true;
+  if(this->interrupt_global != NULL) {
+    *(this->interrupt_global) = 1;
+  }
+}
+
+void EEA_Engine_Wasm3::clear_interrupt()
+{
+  if(this->interrupt_global != NULL) {
+    *(this->interrupt_global) = 0;
+  }
+  this->interrupted = false;
+}
+
+EEA_Engine_Result EEA_Engine_Wasm3::get_global(const char *name, uint64_t *value)
+{
+  IM3Global global = m3_FindGlobal(this->module, name);
+  if(global == NULL) {
+    return m3Err_globalLookupFailed;
+  }
+
+  M3TaggedValue tagged;
+  M3Result result = m3_GetGlobal(global, &tagged);
+  if(result != m3Err_none) {
+    return result;
+  }
+
+  *value = tagged.type == c_m3Type_i32 ? (uint64_t)(uint32_t)tagged.value.i32 : tagged.value.i64;
+  return m3Err_none;
+}
+
+uint8_t *EEA_Engine_Wasm3::memory(uint32_t *size)
+{
+  *size = 0;
+  return m3_GetMemory(this->runtime, size, 0);
+}
+
+const char *EEA_Engine_Wasm3::function_name(EEA_Engine_Function function)
+{
+  return m3_GetFunctionName((IM3Function)function);
+}
+
+void EEA_Engine_Wasm3::print_backtrace()
+{
+  IM3BacktraceInfo info = m3_GetBacktrace(this->runtime);
+
+  if (info) {
+    ESP_LOGI(TAG, "==== wasm backtrace:");
+
+    int frameCount = 0;
+    IM3BacktraceFrame curr = info->frames;
+    while (curr)
+    {
+      ESP_LOGI(TAG, "\n  %d: 0x%06x - %s!%s",
+        frameCount, curr->moduleOffset,
+        m3_GetModuleName (m3_GetFunctionModule(curr->function)),
+        m3_GetFunctionName (curr->function));
+      curr = curr->next;
+      frameCount++;
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef EEA_ENGINE_WASM3_H
+#define EEA_ENGINE_WASM3_H
+
+#include "eea_engine.h"
+
+#include <wasm3.h>
+#include <m3_env.h>
+
+#define EEA_ENGINE_WASM3_MAX_HOST_TABLES 4
+
+/**
+ * The wasm3 interpreter.
+ *
+ * Host function tables are linked after the module is loaded. wasm3 has
+ * no interrupt check of its own on loops, so the module is loaded from a
+ * copy with a check at the start of every function and loop
+ * (eea_interrupt_checks.h). interrupt() sets the global the checks read,
+ * and the running call traps at its next loop iteration or call.
+ *
+ * The profiler and state snapshots read wasm3's internals through the
+ * public runtime and module.
+ */
+class EEA_Engine_Wasm3 : public EEA_Engine {
+  public:
+    EEA_Engine_Wasm3();
+    ~EEA_Engine_Wasm3();
+
+    void add_host_functions(const char *module_name,
+      const EEA_Host_Function *functions, size_t count, void *userdata);
+    EEA_Engine_Result load(const uint8_t *module, uint32_t size, uint32_t stack_size);
+    EEA_Engine_Result find(EEA_Engine_Function *function, const char *name);
+    EEA_Engine_Result call(EEA_Engine_Function function, uint32_t argc, const uint64_t *argv, uint64_t *result);
+    void interrupt();
+    EEA_Engine_Result get_global(const char *name, uint64_t *value);
+    uint8_t *memory(uint32_t *size);
+    const char *function_name(EEA_Engine_Function function);
+    void print_backtrace();
+
+    using EEA_Engine::call;
+
+    IM3Environment env;
+    IM3Runtime runtime;
+    IM3Module module;
+
+  private:
+    struct Host_Table {
+      const char *module_name;
+      const EEA_Host_Function *functions;
+      size_t count;
+      void *userdata;
+    } host_tables[EEA_ENGINE_WASM3_MAX_HOST_TABLES];
+    uint32_t num_host_tables;
+
+    // The module with interrupt checks added, from the bundle arena.
+    uint8_t *instrumented;
+
+    // The value of the global the checks read. NULL if the checks
+    // couldn't be added.
+    volatile int64_t *interrupt_global;
+
+    // Set by interrupt() until the call returns.
+    volatile bool interrupted;
+
+    void clear_interrupt();
+};
+
+#endif
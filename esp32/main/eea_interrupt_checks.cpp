@@ -0,0 +1,420 @@
+/**
+ * Interrupt checks for WASM modules. See eea_interrupt_checks.h.
+ */
+
+#include <string.h>
+
+#include "eea_interrupt_checks.h"
+
+// Section ids (WebAssembly core spec, 5.5.2).
+#define WASM_SECTION_IMPORT 2
+#define WASM_SECTION_GLOBAL 6
+#define WASM_SECTION_CODE 10
+
+// Import kinds.
+#define WASM_IMPORT_FUNC 0
+#define WASM_IMPORT_TABLE 1
+#define WASM_IMPORT_MEMORY 2
+#define WASM_IMPORT_GLOBAL 3
+
+/**
+ * Reads from [p, end). A read past end sets failed instead.
+ */
+struct Reader {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool failed;
+};
+
+/**
+ * Appends to out, or only counts the bytes when out is NULL.
+ */
+struct Writer {
+  uint8_t *out;
+  uint32_t size;
+};
+
+static uint8_t read_byte(Reader *r)
+{
+  if(r->p >= r->end) {
+    r->failed = true;
+    return 0;
+  }
+  return *(r->p++);
+}
+
+static uint32_t read_u32(Reader *r)
+{
+  uint32_t value = 0;
+  for(uint32_t shift = 0; shift < 35; shift += 7) {
+    uint8_t byte = read_byte(r);
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    if((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  r->failed = true;
+  return 0;
+}
+
+/**
+ * Skips a signed or unsigned LEB128 of up to 64 bits.
+ */
+static void skip_leb(Reader *r)
+{
+  for(int i = 0; i < 10; i++) {
+    if((read_byte(r) & 0x80) == 0) {
+      return;
+    }
+  }
+  r->failed = true;
+}
+
+static void skip_bytes(Reader *r, uint32_t length)
+{
+  if(length > (uint32_t)(r->end - r->p)) {
+    r->failed = true;
+    r->p = r->end;
+    return;
+  }
+  r->p += length;
+}
+
+static void write_bytes(Writer *w, const uint8_t *data, uint32_t length)
+{
+  if(w->out != NULL && length > 0) {
+    memcpy(w->out + w->size, data, length);
+  }
+  w->size += length;
+}
+
+static void write_byte(Writer *w, uint8_t byte)
+{
+  write_bytes(w, &byte, 1);
+}
+
+static void write_u32(Writer *w, uint32_t value)
+{
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    write_byte(w, value != 0 ? byte | 0x80 : byte);
+  } while(value != 0);
+}
+
+/**
+ * Reserves 5 bytes for a size that is only known after its contents are
+ * written. Returns the offset to pass to patch_u32.
+ */
+static uint32_t reserve_u32(Writer *w)
+{
+  uint32_t offset = w->size;
+  const uint8_t placeholder[5] = { 0x80, 0x80, 0x80, 0x80, 0x00 };
+  write_bytes(w, placeholder, sizeof(placeholder));
+  return offset;
+}
+
+/**
+ * Writes value as a 5-byte LEB128, which the format allows for any u32.
+ */
+static void patch_u32(Writer *w, uint32_t offset, uint32_t value)
+{
+  if(w->out == NULL) {
+    return;
+  }
+  for(int i = 0; i < 5; i++) {
+    w->out[offset + i] = (value & 0x7f) | (i < 4 ? 0x80 : 0);
+    value >>= 7;
+  }
+}
+
+/**
+ * (if (global.get $interrupt) (then unreachable))
+ */
+static void write_check(Writer *w, uint32_t global_index)
+{
+  write_byte(w, 0x23);
+  write_u32(w, global_index);
+  const uint8_t check[] = { 0x04, 0x40, 0x00, 0x0b };
+  write_bytes(w, check, sizeof(check));
+}
+
+/**
+ * Skips the immediates of the instruction whose opcode was just read.
+ * Returns false for an opcode this decoder doesn't know.
+ */
+static bool skip_immediates(Reader *r, uint8_t opcode)
+{
+  if(opcode >= 0x45 && opcode <= 0xc4) {
+    // Numeric instructions, including sign extension.
+    return true;
+  }
+  if(opcode >= 0x28 && opcode <= 0x3e) {
+    // Loads and stores: alignment and offset.
+    skip_leb(r);
+    skip_leb(r);
+    return true;
+  }
+
+  switch(opcode) {
+    case 0x00: case 0x01: case 0x05: case 0x0b: case 0x0f:
+    case 0x1a: case 0x1b: case 0xd1:
+      return true;
+
+    case 0x02: case 0x03: case 0x04:  // Block type.
+    case 0x0c: case 0x0d:             // br, br_if
+    case 0x10: case 0x12:             // call, return_call
+    case 0x20: case 0x21: case 0x22: case 0x23: case 0x24:
+    case 0x25: case 0x26:             // table.get, table.set
+    case 0x3f: case 0x40:             // memory.size, memory.grow
+    case 0x41: case 0x42:             // i32.const, i64.const
+    case 0xd0: case 0xd2:             // ref.null, ref.func
+      skip_leb(r);
+      return true;
+
+    case 0x11: case 0x13:             // call_indirect, return_call_indirect
+      skip_leb(r);
+      skip_leb(r);
+      return true;
+
+    case 0x0e: {                      // br_table
+      uint32_t count = read_u32(r);
+      for(uint32_t i = 0; i <= count && !r->failed; i++) {
+        skip_leb(r);
+      }
+      return true;
+    }
+
+    case 0x1c: {                      // select with types
+      uint32_t count = read_u32(r);
+      skip_bytes(r, count);
+      return true;
+    }
+
+    case 0x43:
+      skip_bytes(r, 4);
+      return true;
+
+    case 0x44:
+      skip_bytes(r, 8);
+      return true;
+
+    case 0xfc: {
+      uint32_t sub = read_u32(r);
+      if(sub <= 7) {
+        // Saturating truncation.
+        return true;
+      }
+      if(sub == 9 || sub == 11 || sub == 13 || (sub >= 15 && sub <= 17)) {
+        skip_leb(r);
+        return true;
+      }
+      if(sub == 8 || sub == 10 || sub == 12 || sub == 14) {
+        skip_leb(r);
+        skip_leb(r);
+        return true;
+      }
+      return false;
+    }
+
+    default:
+      return false;
+  }
+}
+
+/**
+ * Copies a function body (locals and code), adding a check at its start
+ * and at the start of each loop.
+ */
+static bool rewrite_body(Reader *r, Writer *w, uint32_t global_index)
+{
+  const uint8_t *copied = r->p;
+
+  uint32_t local_groups = read_u32(r);
+  for(uint32_t i = 0; i < local_groups && !r->failed; i++) {
+    skip_leb(r);
+    read_byte(r);
+  }
+  if(r->failed) {
+    return false;
+  }
+
+  write_bytes(w, copied, r->p - copied);
+  write_check(w, global_index);
+  copied = r->p;
+
+  while(r->p < r->end) {
+    uint8_t opcode = read_byte(r);
+    if(!skip_immediates(r, opcode) || r->failed) {
+      return false;
+    }
+
+    if(opcode == 0x03) {
+      write_bytes(w, copied, r->p - copied);
+      write_check(w, global_index);
+      copied = r->p;
+    }
+  }
+
+  write_bytes(w, copied, r->p - copied);
+  return true;
+}
+
+static bool rewrite_code(Reader *r, Writer *w, uint32_t global_index)
+{
+  uint32_t count = read_u32(r);
+  write_u32(w, count);
+
+  for(uint32_t i = 0; i < count && !r->failed; i++) {
+    uint32_t body_size = read_u32(r);
+    if(r->failed || body_size > (uint32_t)(r->end - r->p)) {
+      return false;
+    }
+
+    Reader body = { r->p, r->p + body_size, false };
+    uint32_t size_offset = reserve_u32(w);
+    uint32_t start = w->size;
+    if(!rewrite_body(&body, w, global_index)) {
+      return false;
+    }
+    patch_u32(w, size_offset, w->size - start);
+    r->p += body_size;
+  }
+
+  return !r->failed;
+}
+
+/**
+ * Counts the imported globals. Returns false if the import section is malformed.
+ */
+static bool count_imported_globals(Reader r, uint32_t *globals)
+{
+  *globals = 0;
+  uint32_t count = read_u32(&r);
+
+  for(uint32_t i = 0; i < count && !r.failed; i++) {
+    skip_bytes(&r, read_u32(&r));  // Module name.
+    skip_bytes(&r, read_u32(&r));  // Field name.
+
+    switch(read_byte(&r)) {
+      case WASM_IMPORT_FUNC:
+        skip_leb(&r);
+        break;
+      case WASM_IMPORT_TABLE:
+        read_byte(&r);
+        // Fall through to the limits.
+      case WASM_IMPORT_MEMORY:
+        if(read_byte(&r) & 1) {
+          skip_leb(&r);
+        }
+        skip_leb(&r);
+        break;
+      case WASM_IMPORT_GLOBAL:
+        read_byte(&r);
+        read_byte(&r);
+        (*globals)++;
+        break;
+      default:
+        r.failed = true;
+        break;
+    }
+  }
+
+  return !r.failed;
+}
+
+/**
+ * Writes a global section holding the existing globals (if any), then the
+ * interrupt global.
+ */
+static void write_global_section(Writer *w, uint32_t count, const uint8_t *globals, uint32_t length)
+{
+  // (global (mut i32) (i32.const 0))
+  const uint8_t global[] = { 0x7f, 0x01, 0x41, 0x00, 0x0b };
+
+  write_byte(w, WASM_SECTION_GLOBAL);
+  uint32_t size_offset = reserve_u32(w);
+  uint32_t start = w->size;
+  write_u32(w, count + 1);
+  write_bytes(w, globals, length);
+  write_bytes(w, global, sizeof(global));
+  patch_u32(w, size_offset, w->size - start);
+}
+
+int eea_interrupt_checks_add(const uint8_t *module, uint32_t size,
+  uint8_t *output, uint32_t *output_size, uint32_t *global_index)
+{
+  if(size < 8 || memcmp(module, "\0asm", 4) != 0) {
+    return 1;
+  }
+
+  Reader r = { module + 8, module + size, false };
+  Writer w = { output, 0 };
+  write_bytes(&w, module, 8);
+
+  uint32_t imported_globals = 0;
+  uint32_t index = 0;
+  bool global_written = false;
+
+  while(r.p < r.end) {
+    uint8_t id = read_byte(&r);
+    uint32_t section_size = read_u32(&r);
+    if(r.failed || section_size > (uint32_t)(r.end - r.p)) {
+      return 1;
+    }
+
+    const uint8_t *header = r.p;
+    Reader section = { r.p, r.p + section_size, false };
+    r.p += section_size;
+
+    // The global section comes after imports, functions, tables, memories
+    // and tags, and before everything else.
+    bool after_globals = id == 7 || id == 8 || id == 9 || id == 10 || id == 11 || id == 12;
+    if(!global_written && (id == WASM_SECTION_GLOBAL || after_globals)) {
+      uint32_t count = 0;
+      if(id == WASM_SECTION_GLOBAL) {
+        count = read_u32(&section);
+        if(section.failed) {
+          return 1;
+        }
+      }
+
+      index = imported_globals + count;
+      write_global_section(&w, count, section.p, id == WASM_SECTION_GLOBAL ? section.end - section.p : 0);
+      global_written = true;
+
+      if(id == WASM_SECTION_GLOBAL) {
+        continue;
+      }
+    }
+
+    if(id == WASM_SECTION_IMPORT && !count_imported_globals(section, &imported_globals)) {
+      return 1;
+    }
+
+    if(id == WASM_SECTION_CODE) {
+      write_byte(&w, id);
+      uint32_t size_offset = reserve_u32(&w);
+      uint32_t start = w.size;
+      if(!rewrite_code(&section, &w, index)) {
+        return 1;
+      }
+      patch_u32(&w, size_offset, w.size - start);
+      continue;
+    }
+
+    // Everything else, including custom sections, is copied unchanged.
+    write_byte(&w, id);
+    write_u32(&w, section_size);
+    write_bytes(&w, header, section_size);
+  }
+
+  if(!global_written) {
+    index = imported_globals;
+    write_global_section(&w, 0, NULL, 0);
+  }
+
+  *output_size = w.size;
+  *global_index = index;
+  return 0;
+}
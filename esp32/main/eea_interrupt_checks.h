@@ -0,0 +1,36 @@
+#ifndef EEA_INTERRUPT_CHECKS_H
+#define EEA_INTERRUPT_CHECKS_H
+
+#include <stdint.h>
+
+/**
+ * Rewrites a WASM module so that code which never calls a function can
+ * still be interrupted on an interpreter without its own interrupt check
+ * on branches.
+ *
+ * A mutable i32 global, initialized to 0, is appended to the module's
+ * globals, and this check is inserted at the start of every function body
+ * and every loop body:
+ *
+ *   (if (global.get $interrupt) (then unreachable))
+ *
+ * Setting the global to 1 makes the running call trap at its next loop
+ * iteration or call. Nothing is renumbered: the global is added after the
+ * existing ones, and the checks are self-contained blocks, so branch
+ * depths and function, type and global indices stay the same. Only code
+ * offsets (e.g. in backtraces) move.
+ *
+ * output: where the rewritten module is written, or NULL to only compute
+ *   output_size.
+ * output_size: the size of the rewritten module.
+ * global_index: the index of the added global, counting imported globals.
+ *
+ * Returns:
+ *  0 if the module was rewritten (or measured).
+ *  1 if the module is malformed or uses an instruction that isn't decoded
+ *    here (e.g. SIMD). output is left incomplete.
+ */
+int eea_interrupt_checks_add(const uint8_t *module, uint32_t size,
+  uint8_t *output, uint32_t *output_size, uint32_t *global_index);
+
+#endif
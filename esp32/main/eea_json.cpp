@@ -0,0 +1,584 @@
+/**
+ * Native JSON field extraction. See eea_json.h.
+ */
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "eea_json.h"
+#include "eea_bindings.h"
+#include "eea_memory.h"
+
+static const char *TAG = "EEA_JSON";
+
+/**
+ * Single-pass recursive descent parser that appends a token for every
+ * value, and every object key, in document order.
+ */
+struct EEA_Json_Parser
+{
+  const char *json;
+  uint32_t length;
+  uint32_t pos;
+  EEA_Json_Token *tokens;
+  uint32_t num_tokens;
+
+  // -1 for invalid JSON, -2 for a limit.
+  int32_t error;
+
+  void skip_whitespace()
+  {
+    while(pos < length && (json[pos] == ' ' || json[pos] == '\t' || json[pos] == '\n' || json[pos] == '\r')) {
+      pos++;
+    }
+  }
+
+  EEA_Json_Token *add(EEA_Json_Type type, uint32_t start)
+  {
+    if(num_tokens >= EEA_JSON_MAX_TOKENS) {
+      error = -2;
+      return NULL;
+    }
+    EEA_Json_Token *token = &(tokens[num_tokens++]);
+    token->type = type;
+    token->start = start;
+    token->end = start;
+    token->next = num_tokens;
+    return token;
+  }
+
+  bool parse_string()
+  {
+    EEA_Json_Token *token = add(EEA_JSON_STRING, pos + 1);
+    if(token == NULL) {
+      return false;
+    }
+
+    for(pos++; pos < length; pos++) {
+      char c = json[pos];
+      if(c == '"') {
+        token->end = pos++;
+        return true;
+      }
+      if((unsigned char)c < 0x20) {
+        break;
+      }
+      if(c == '\\') {
+        pos++;
+      }
+    }
+
+    error = -1;
+    return false;
+  }
+
+  bool parse_number()
+  {
+    EEA_Json_Token *token = add(EEA_JSON_NUMBER, pos);
+    if(token == NULL) {
+      return false;
+    }
+
+    if(json[pos] == '-') {
+      pos++;
+    }
+    uint32_t digits = pos;
+    while(pos < length && strchr("0123456789.eE+-", json[pos]) != NULL) {
+      pos++;
+    }
+    if(pos == digits || json[digits] < '0' || json[digits] > '9') {
+      error = -1;
+      return false;
+    }
+
+    token->end = pos;
+    return true;
+  }
+
+  bool parse_literal(EEA_Json_Type type, const char *literal)
+  {
+    uint32_t literal_length = strlen(literal);
+    if(pos + literal_length > length || memcmp(json + pos, literal, literal_length) != 0) {
+      error = -1;
+      return false;
+    }
+
+    EEA_Json_Token *token = add(type, pos);
+    if(token == NULL) {
+      return false;
+    }
+    pos += literal_length;
+    token->end = pos;
+    return true;
+  }
+
+  /**
+   * Parses the members of an object or the elements of an array.
+   */
+  bool parse_container(EEA_Json_Type type, uint32_t depth)
+  {
+    if(depth >= EEA_JSON_MAX_DEPTH) {
+      error = -2;
+      return false;
+    }
+
+    uint32_t index = num_tokens;
+    if(add(type, pos) == NULL) {
+      return false;
+    }
+
+    char close = type == EEA_JSON_OBJECT ? '}' : ']';
+    pos++;
+    skip_whitespace();
+
+    if(pos < length && json[pos] == close) {
+      pos++;
+    } else {
+      while(true) {
+        if(type == EEA_JSON_OBJECT) {
+          if(pos >= length || json[pos] != '"' || !parse_string()) {
+            error = error == 0 ? -1 : error;
+            return false;
+          }
+          skip_whitespace();
+          if(pos >= length || json[pos] != ':') {
+            error = -1;
+            return false;
+          }
+          pos++;
+        }
+
+        if(!parse_value(depth + 1)) {
+          return false;
+        }
+
+        skip_whitespace();
+        if(pos < length && json[pos] == ',') {
+          pos++;
+          skip_whitespace();
+        } else if(pos < length && json[pos] == close) {
+          pos++;
+          break;
+        } else {
+          error = -1;
+          return false;
+        }
+      }
+    }
+
+    tokens[index].end = pos;
+    tokens[index].next = num_tokens;
+    return true;
+  }
+
+  bool parse_value(uint32_t depth)
+  {
+    skip_whitespace();
+    if(pos >= length) {
+      error = -1;
+      return false;
+    }
+
+    switch(json[pos]) {
+      case '{':
+        return parse_container(EEA_JSON_OBJECT, depth);
+      case '[':
+        return parse_container(EEA_JSON_ARRAY, depth);
+      case '"':
+        return parse_string();
+      case 't':
+        return parse_literal(EEA_JSON_TRUE, "true");
+      case 'f':
+        return parse_literal(EEA_JSON_FALSE, "false");
+      case 'n':
+        return parse_literal(EEA_JSON_NULL, "null");
+      default:
+        return parse_number();
+    }
+  }
+};
+
+EEA_Json::~EEA_Json()
+{
+  eea_free(this->payload);
+  eea_free(this->tokens);
+}
+
+int32_t EEA_Json::parse(const char *json, uint32_t length)
+{
+  this->num_tokens = 0;
+
+  if(this->payload == NULL || this->tokens == NULL || length >= EEA_PAYLOAD_SIZE_BYTES) {
+    return -2;
+  }
+
+  // Terminated, so numbers can be converted with strtod.
+  memcpy(this->payload, json, length);
+  this->payload[length] = '\0';
+
+  EEA_Json_Parser parser = { this->payload, length, 0, this->tokens, 0, 0 };
+  if(parser.parse_value(0)) {
+    parser.skip_whitespace();
+    if(parser.pos != length) {
+      parser.error = -1;
+    }
+  }
+
+  if(parser.error != 0) {
+    ESP_LOGD(TAG, "Parse failed at byte %u: %d", parser.pos, parser.error);
+    return parser.error;
+  }
+
+  this->num_tokens = parser.num_tokens;
+  return this->num_tokens;
+}
+
+const EEA_Json_Token *EEA_Json::find(const char *path, uint32_t path_length)
+{
+  if(this->num_tokens == 0) {
+    return NULL;
+  }
+
+  uint32_t index = 0;
+  uint32_t p = 0;
+  while(p < path_length) {
+    EEA_Json_Token *token = &(this->tokens[index]);
+
+    if(path[p] == '.') {
+      p++;
+      continue;
+    }
+
+    if(path[p] == '[') {
+      uint32_t element = 0;
+      for(p++; p < path_length && path[p] >= '0' && path[p] <= '9'; p++) {
+        element = element * 10 + (path[p] - '0');
+      }
+      if(p >= path_length || path[p] != ']' || token->type != EEA_JSON_ARRAY) {
+        return NULL;
+      }
+      p++;
+
+      uint32_t i = index + 1;
+      for(; element > 0 && i < token->next; element--) {
+        i = this->tokens[i].next;
+      }
+      if(i >= token->next) {
+        return NULL;
+      }
+      index = i;
+    } else {
+      uint32_t key_start = p;
+      while(p < path_length && path[p] != '.' && path[p] != '[') {
+        p++;
+      }
+      uint32_t key_length = p - key_start;
+      if(token->type != EEA_JSON_OBJECT) {
+        return NULL;
+      }
+
+      // Members are key tokens, each followed by its value.
+      uint32_t i = index + 1;
+      while(i < token->next) {
+        EEA_Json_Token *key = &(this->tokens[i]);
+        if(key->end - key->start == key_length &&
+            memcmp(this->payload + key->start, path + key_start, key_length) == 0) {
+          break;
+        }
+        i = this->tokens[i + 1].next;
+      }
+      if(i >= token->next) {
+        return NULL;
+      }
+      index = i + 1;
+    }
+  }
+
+  return &(this->tokens[index]);
+}
+
+uint32_t EEA_Json::count(const EEA_Json_Token *token)
+{
+  uint32_t index = token - this->tokens;
+  uint32_t members = 0;
+
+  for(uint32_t i = index + 1; i < token->next; members++) {
+    if(token->type == EEA_JSON_OBJECT) {
+      i++;
+    }
+    i = this->tokens[i].next;
+  }
+  return members;
+}
+
+double EEA_Json::number(const EEA_Json_Token *token)
+{
+  return strtod(this->payload + token->start, NULL);
+}
+
+/**
+ * The value of the four hex digits at p, or -1 if they aren't hex.
+ */
+static int32_t hex4(const char *p)
+{
+  int32_t value = 0;
+  for(int i = 0; i < 4; i++) {
+    char c = p[i];
+    int32_t digit = (c >= '0' && c <= '9') ? c - '0' :
+      (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+      (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+    if(digit < 0) {
+      return -1;
+    }
+    value = (value << 4) | digit;
+  }
+  return value;
+}
+
+uint32_t EEA_Json::text(const EEA_Json_Token *token, char *dst, uint32_t size)
+{
+  const char *src = this->payload + token->start;
+  uint32_t length = token->end - token->start;
+
+  if(token->type != EEA_JSON_STRING) {
+    memcpy(dst, src, std::min(length, size));
+    return length;
+  }
+
+  // Bytes past size are counted but not written.
+  uint32_t n = 0;
+  char utf8[4];
+  for(uint32_t i = 0; i < length; i++) {
+    uint32_t utf8_length = 1;
+    utf8[0] = src[i];
+
+    if(src[i] == '\\' && i + 1 < length) {
+      char c = src[++i];
+      switch(c) {
+        case 'b': utf8[0] = '\b'; break;
+        case 'f': utf8[0] = '\f'; break;
+        case 'n': utf8[0] = '\n'; break;
+        case 'r': utf8[0] = '\r'; break;
+        case 't': utf8[0] = '\t'; break;
+        case 'u': {
+          int32_t code = i + 4 < length ? hex4(src + i + 1) : -1;
+          if(code < 0) {
+            // Not a valid escape. Copied as it is.
+            utf8[0] = '\\';
+            utf8[1] = c;
+            utf8_length = 2;
+            break;
+          }
+          i += 4;
+
+          // A surrogate pair is two escapes.
+          if(code >= 0xD800 && code <= 0xDBFF && i + 6 < length && src[i + 1] == '\\' && src[i + 2] == 'u') {
+            int32_t low = hex4(src + i + 3);
+            if(low >= 0xDC00 && low <= 0xDFFF) {
+              code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+              i += 6;
+            }
+          }
+
+          if(code < 0x80) {
+            utf8[0] = code;
+          } else if(code < 0x800) {
+            utf8[0] = 0xC0 | (code >> 6);
+            utf8[1] = 0x80 | (code & 0x3F);
+            utf8_length = 2;
+          } else if(code < 0x10000) {
+            utf8[0] = 0xE0 | (code >> 12);
+            utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+            utf8[2] = 0x80 | (code & 0x3F);
+            utf8_length = 3;
+          } else {
+            utf8[0] = 0xF0 | (code >> 18);
+            utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+            utf8[2] = 0x80 | ((code >> 6) & 0x3F);
+            utf8[3] = 0x80 | (code & 0x3F);
+            utf8_length = 4;
+          }
+          break;
+        }
+        default:
+          // \", \\ and \/ stand for themselves.
+          utf8[0] = c;
+          break;
+      }
+    }
+
+    for(uint32_t j = 0; j < utf8_length; j++, n++) {
+      if(n < size) {
+        dst[n] = utf8[j];
+      }
+    }
+  }
+  return n;
+}
+
+/**
+ * Parses a JSON payload. Fields of the most recently parsed payload
+ * are then read with the eea_fn_json_get_* functions.
+ * Inputs:
+ *   json (String): the payload.
+ *   length (Int32): the length of the payload.
+ *
+ * Returns the number of values in the payload, -1 if it isn't valid JSON,
+ * or -2 if it exceeds the parser's limits.
+ */
+static int32_t eea_fn_json_parse(EEA_Host_Context ctx, EEA_Span<char> json)
+{
+  EEA_Json *eea_json = (EEA_Json*)ctx.userdata;
+  return eea_json->parse(json.data, json.count);
+}
+
+/**
+ * Gets the type of a field.
+ * Inputs:
+ *   path (String): the field path, e.g. "payload.setpoints[2]".
+ *   path_length (Int32): the length of the path.
+ *
+ * Returns the type, or -1 if the field doesn't exist.
+ *   EEA_JSON_OBJECT = 0
+ *   EEA_JSON_ARRAY = 1
+ *   EEA_JSON_STRING = 2
+ *   EEA_JSON_NUMBER = 3
+ *   EEA_JSON_TRUE = 4
+ *   EEA_JSON_FALSE = 5
+ *   EEA_JSON_NULL = 6
+ */
+static int32_t eea_fn_json_get_type(EEA_Host_Context ctx, EEA_Span<char> path)
+{
+  EEA_Json *eea_json = (EEA_Json*)ctx.userdata;
+  const EEA_Json_Token *token = eea_json->find(path.data, path.count);
+  return token == NULL ? -1 : token->type;
+}
+
+/**
+ * Gets a number field.
+ * Inputs:
+ *   path (String): the field path.
+ *   path_length (Int32): the length of the path.
+ *
+ * Outputs:
+ *   value (Float64): the number.
+ *
+ * Returns 0 for success, 1 if the field doesn't exist, 2 if it isn't a number.
+ */
+static int32_t eea_fn_json_get_number(EEA_Host_Context ctx, EEA_Span<char> path, EEA_Out<double> value)
+{
+  EEA_Json *eea_json = (EEA_Json*)ctx.userdata;
+  const EEA_Json_Token *token = eea_json->find(path.data, path.count);
+  if(token == NULL) {
+    return 1;
+  }
+  if(token->type != EEA_JSON_NUMBER) {
+    return 2;
+  }
+
+  double number = eea_json->number(token);
+  value.set(number);
+  return 0;
+}
+
+/**
+ * Gets a boolean field.
+ * Inputs:
+ *   path (String): the field path.
+ *   path_length (Int32): the length of the path.
+ *
+ * Outputs:
+ *   value (Int32): 1 for true, 0 for false.
+ *
+ * Returns 0 for success, 1 if the field doesn't exist, 2 if it isn't a boolean.
+ */
+static int32_t eea_fn_json_get_bool(EEA_Host_Context ctx, EEA_Span<char> path, EEA_Out<int32_t> value)
+{
+  EEA_Json *eea_json = (EEA_Json*)ctx.userdata;
+  const EEA_Json_Token *token = eea_json->find(path.data, path.count);
+  if(token == NULL) {
+    return 1;
+  }
+  if(token->type != EEA_JSON_TRUE && token->type != EEA_JSON_FALSE) {
+    return 2;
+  }
+
+  int32_t boolean = token->type == EEA_JSON_TRUE;
+  value.set(boolean);
+  return 0;
+}
+
+/**
+ * Copies a field into a buffer. Strings are copied without the quotes,
+ * with escape sequences decoded (\uXXXX escapes as UTF-8). Other types are
+ * copied as the field's JSON text. The buffer is not null-terminated.
+ * Inputs:
+ *   path (String): the field path.
+ *   path_length (Int32): the length of the path.
+ *   dst (String): where to copy the field.
+ *   dst_size (Int32): the size of the buffer.
+ *
+ * Returns the length of the field, or -1 if the field doesn't exist. If the
+ * length is larger than dst_size, only the first dst_size bytes were copied.
+ */
+static int32_t eea_fn_json_get_string(EEA_Host_Context ctx, EEA_Span<char> path, EEA_Span<char> dst)
+{
+  EEA_Json *eea_json = (EEA_Json*)ctx.userdata;
+  const EEA_Json_Token *token = eea_json->find(path.data, path.count);
+  if(token == NULL) {
+    return -1;
+  }
+
+  return eea_json->text(token, dst.data, dst.count);
+}
+
+/**
+ * Gets the number of members of an object or elements of an array.
+ * Inputs:
+ *   path (String): the field path.
+ *   path_length (Int32): the length of the path.
+ *
+ * Outputs:
+ *   value (Int32): the count.
+ *
+ * Returns 0 for success, 1 if the field doesn't exist, 2 if it isn't an
+ * object or array.
+ */
+static int32_t eea_fn_json_get_count(EEA_Host_Context ctx, EEA_Span<char> path, EEA_Out<uint32_t> value)
+{
+  EEA_Json *eea_json = (EEA_Json*)ctx.userdata;
+  const EEA_Json_Token *token = eea_json->find(path.data, path.count);
+  if(token == NULL) {
+    return 1;
+  }
+  if(token->type != EEA_JSON_OBJECT && token->type != EEA_JSON_ARRAY) {
+    return 2;
+  }
+
+  uint32_t count = eea_json->count(token);
+  value.set(count);
+  return 0;
+}
+
+static const EEA_Host_Function eea_json_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_json_parse),
+  EEA_HOST_FUNCTION(eea_fn_json_get_type),
+  EEA_HOST_FUNCTION(eea_fn_json_get_number),
+  EEA_HOST_FUNCTION(eea_fn_json_get_bool),
+  EEA_HOST_FUNCTION(eea_fn_json_get_string),
+  EEA_HOST_FUNCTION(eea_fn_json_get_count)
+};
+
+EEA_Json::EEA_Json(EEA_Engine *engine)
+{
+  this->payload = (char*)eea_malloc(EEA_MEM_API, EEA_PAYLOAD_SIZE_BYTES, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->tokens = (EEA_Json_Token*)eea_malloc(EEA_MEM_API, EEA_JSON_MAX_TOKENS * sizeof(EEA_Json_Token), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->num_tokens = 0;
+
+  engine->add_host_functions("env", eea_json_functions,
+    sizeof(eea_json_functions) / sizeof(eea_json_functions[0]), this);
+}
@@ -0,0 +1,89 @@
+#ifndef EEA_JSON_H
+#define EEA_JSON_H
+
+#include <stdint.h>
+
+#include "eea_config.h"
+#include "eea_engine.h"
+
+/**
+ * Types of parsed JSON values.
+ */
+enum EEA_Json_Type {
+  EEA_JSON_OBJECT = 0,
+  EEA_JSON_ARRAY = 1,
+  EEA_JSON_STRING = 2,
+  EEA_JSON_NUMBER = 3,
+  EEA_JSON_TRUE = 4,
+  EEA_JSON_FALSE = 5,
+  EEA_JSON_NULL = 6
+};
+
+/**
+ * One value (or object key) in the parsed document. Offsets are into the
+ * parsed payload. Strings span their contents, without the quotes.
+ */
+struct EEA_Json_Token {
+  uint8_t type;
+  uint32_t start;
+  uint32_t end;
+
+  // Index of the token after this value and everything inside it.
+  uint16_t next;
+};
+
+/**
+ * Native JSON field extraction for workflows, exposed as registered
+ * functions (see eea_json.cpp). A payload is parsed once, in a single
+ * pass that indexes every value, and fields are then fetched by path
+ * (e.g. "payload.setpoints[2]" or "data.mode") without parsing again.
+ *
+ * The payload is copied when it is parsed, so the index stays valid
+ * while the bundle reuses its buffer. The last parsed payload is kept
+ * until the next parse.
+ */
+class EEA_Json {
+  public:
+    EEA_Json(EEA_Engine *engine);
+    ~EEA_Json();
+
+    /**
+     * Parses and indexes a payload.
+     * Returns the number of tokens, -1 if the payload isn't valid JSON, or
+     * -2 if it is larger than EEA_PAYLOAD_SIZE_BYTES or has more than
+     * EEA_JSON_MAX_TOKENS values or EEA_JSON_MAX_DEPTH levels of nesting.
+     */
+    int32_t parse(const char *json, uint32_t length);
+
+    /**
+     * Finds the token at a path. Object keys are separated by '.', and
+     * array elements are selected with [index].
+     * Returns NULL if the path doesn't exist.
+     */
+    const EEA_Json_Token *find(const char *path, uint32_t path_length);
+
+    /**
+     * The number of members or elements of an object or array token.
+     */
+    uint32_t count(const EEA_Json_Token *token);
+
+    /**
+     * The value of a number token.
+     */
+    double number(const EEA_Json_Token *token);
+
+    /**
+     * Copies a token's value into dst, writing at most size bytes. String
+     * tokens are unescaped, with \uXXXX escapes written as UTF-8. Other tokens
+     * are copied as their JSON text. Returns the full length of the value,
+     * which is larger than size if it didn't fit.
+     */
+    uint32_t text(const EEA_Json_Token *token, char *dst, uint32_t size);
+
+  private:
+    char *payload;
+    EEA_Json_Token *tokens;
+    uint32_t num_tokens;
+};
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * Per-stage message latency histograms. See eea_latency.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "eea_latency.h"
+#include "eea_config.h"
+#include "eea_memory.h"
+#include "eea_queue_msg.h"
+
+// Bucket i counts durations from 2^(i-1) to 2^i - 1 us (bucket 0 is 0 us).
+// The last bucket also counts anything longer (about 16 s).
+#define EEA_LATENCY_BUCKETS 25
+
+static const char *TAG = "EEA_LATENCY";
+
+static const char *stage_names[EEA_LATENCY_STAGE_COUNT] = {
+  "queue",
+  "dispatch",
+  "handler",
+  "outbound",
+  "endToEnd",
+  "loopJitter"
+};
+
+struct EEA_Latency_Histogram
+{
+  uint32_t buckets[EEA_LATENCY_BUCKETS];
+  uint32_t count;
+  int64_t max;
+};
+
+static EEA_Latency_Histogram histograms[EEA_LATENCY_STAGE_COUNT];
+
+void eea_latency_record(EEA_Latency_Stage stage, int64_t us)
+{
+  if(us < 0) {
+    us = 0;
+  }
+
+  uint32_t bucket = 0;
+  while(bucket < EEA_LATENCY_BUCKETS - 1 && (us >> bucket) > 0) {
+    bucket++;
+  }
+
+  EEA_Latency_Histogram *histogram = &(histograms[stage]);
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  if(us > histogram->max) {
+    histogram->max = us;
+  }
+}
+
+/**
+ * The upper bound of the bucket holding the given percentile.
+ */
+static int64_t percentile(const EEA_Latency_Histogram *histogram, uint32_t percent)
+{
+  uint32_t target = (histogram->count * percent + 99) / 100;
+  uint32_t seen = 0;
+  for(uint32_t i = 0; i < EEA_LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if(seen >= target) {
+      return i == 0 ? 0 : (1LL << i) - 1;
+    }
+  }
+  return histogram->max;
+}
+
+void eea_latency_report(QueueHandle_t xQueueMQTT)
+{
+  // Copied first, since the MQTT and runtime tasks keep recording.
+  EEA_Latency_Histogram snapshot[EEA_LATENCY_STAGE_COUNT];
+  memcpy(snapshot, histograms, sizeof(snapshot));
+  memset(histograms, 0, sizeof(histograms));
+
+  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(msg == NULL) {
+    return;
+  }
+
+  uint32_t size = EEA_PAYLOAD_SIZE_BYTES;
+  int length = snprintf(msg->payload, size, "{");
+
+  for(int stage = 0; stage < EEA_LATENCY_STAGE_COUNT; stage++) {
+    EEA_Latency_Histogram *histogram = &(snapshot[stage]);
+    if(histogram->count == 0) {
+      continue;
+    }
+
+    int64_t p50 = percentile(histogram, 50);
+    int64_t p99 = percentile(histogram, 99);
+    ESP_LOGI(TAG, "%-10s %u samples, p50 <= %lld us, p99 <= %lld us, max %lld us.",
+      stage_names[stage], histogram->count, p50, p99, histogram->max);
+
+    length += snprintf(msg->payload + length, size - length,
+      "%s\"%s\":{\"count\":%u,\"p50Us\":%lld,\"p99Us\":%lld,\"maxUs\":%lld,\"buckets\":[",
+      length > 1 ? "," : "", stage_names[stage], histogram->count, p50, p99, histogram->max);
+    for(uint32_t i = 0; i < EEA_LATENCY_BUCKETS; i++) {
+      length += snprintf(msg->payload + length, size - length, "%s%u", i > 0 ? "," : "", histogram->buckets[i]);
+    }
+    length += snprintf(msg->payload + length, size - length, "]}");
+  }
+  length += snprintf(msg->payload + length, size - length, "}");
+
+  if(length > 2) {
+    msg->topic_length = snprintf(msg->topic, EEA_TOPIC_SIZE_BYTES, EEA_LATENCY_TOPIC, LOSANT_DEVICE_ID);
+    msg->payload_length = length;
+    msg->qos = 0;
+    msg->received_at = 0;
+    msg->queued_at = 0;
+    xQueueSend(xQueueMQTT, msg, 0);
+  }
+
+  eea_free(msg);
+}
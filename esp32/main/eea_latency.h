@@ -0,0 +1,36 @@
+#ifndef EEA_LATENCY_H
+#define EEA_LATENCY_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define EEA_LATENCY_TOPIC "losant/%s/fromAgent/latency"
+
+/**
+ * Message handling stages, timed with esp_timer_get_time().
+ */
+enum EEA_Latency_Stage {
+  EEA_LATENCY_QUEUE,       // MQTT_EVENT_DATA to dequeue in the runtime task.
+  EEA_LATENCY_DISPATCH,    // Dequeue to eea_message_received entry.
+  EEA_LATENCY_HANDLER,     // eea_message_received entry to return.
+  EEA_LATENCY_OUTBOUND,    // eea_send_message to esp_mqtt_client_publish.
+  EEA_LATENCY_END_TO_END,  // MQTT_EVENT_DATA to the publish of a message its handler sent.
+  EEA_LATENCY_LOOP_JITTER, // Change in the period between eea_loop calls.
+  EEA_LATENCY_STAGE_COUNT
+};
+
+/**
+ * Adds a duration in microseconds to a stage's histogram. Histogram
+ * buckets are powers of two. Each stage is recorded from one task.
+ */
+void eea_latency_record(EEA_Latency_Stage stage, int64_t us);
+
+/**
+ * Logs count, p50, p99 and max for every stage, publishes the histograms
+ * to EEA_LATENCY_TOPIC, and starts new histograms.
+ */
+void eea_latency_report(QueueHandle_t xQueueMQTT);
+
+#endif
@@ -0,0 +1,280 @@
+/**
+ * Hardware PWM outputs and fades. See eea_ledc.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_ledc.h"
+#include "eea_bindings.h"
+#include "eea_memory.h"
+#include "eea_queue_msg.h"
+
+static const char *TAG = "EEA_LEDC";
+
+/**
+ * LEDC fade end callback, from the LEDC interrupt.
+ */
+static IRAM_ATTR bool eea_ledc_fade_end(const ledc_cb_param_t *param, void *user_arg)
+{
+  EEA_Ledc *ledc = (EEA_Ledc*)user_arg;
+  BaseType_t woken = pdFALSE;
+
+  if(param->event == LEDC_FADE_END_EVT) {
+    uint8_t channel = param->channel;
+    xQueueSendFromISR(ledc->xQueueFadeEnd, &channel, &woken);
+  }
+  return woken == pdTRUE;
+}
+
+esp_err_t EEA_Ledc::timer_config(uint32_t timer, uint32_t frequency_hz, uint32_t resolution_bits)
+{
+  if(timer >= LEDC_TIMER_MAX || resolution_bits == 0 || resolution_bits >= LEDC_TIMER_BIT_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  ledc_timer_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.speed_mode = LEDC_LOW_SPEED_MODE;
+  config.duty_resolution = (ledc_timer_bit_t)resolution_bits;
+  config.timer_num = (ledc_timer_t)timer;
+  config.freq_hz = frequency_hz;
+  config.clk_cfg = LEDC_AUTO_CLK;
+
+  return ledc_timer_config(&config);
+}
+
+esp_err_t EEA_Ledc::channel_config(uint32_t channel, uint32_t timer, int32_t pin)
+{
+  if(channel >= LEDC_CHANNEL_MAX || timer >= LEDC_TIMER_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if(!this->fade_installed) {
+    esp_err_t result = ledc_fade_func_install(0);
+    if(result != ESP_OK) {
+      return result;
+    }
+    this->fade_installed = true;
+  }
+
+  ledc_channel_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.gpio_num = pin;
+  config.speed_mode = LEDC_LOW_SPEED_MODE;
+  config.channel = (ledc_channel_t)channel;
+  config.intr_type = LEDC_INTR_DISABLE;
+  config.timer_sel = (ledc_timer_t)timer;
+  config.duty = 0;
+
+  esp_err_t result = ledc_channel_config(&config);
+  if(result != ESP_OK) {
+    return result;
+  }
+
+  this->channels[channel].fading = false;
+  this->channels[channel].cycles = 0;
+
+  ledc_cbs_t callbacks = { eea_ledc_fade_end };
+  return ledc_cb_register(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, &callbacks, this);
+}
+
+esp_err_t EEA_Ledc::set_duty(uint32_t channel, uint32_t duty)
+{
+  if(channel >= LEDC_CHANNEL_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  // The end of an interrupted fade is not reported.
+  this->channels[channel].fading = false;
+  this->channels[channel].cycles = 0;
+
+  esp_err_t result = ledc_set_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, duty);
+  if(result != ESP_OK) {
+    return result;
+  }
+  return ledc_update_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel);
+}
+
+esp_err_t EEA_Ledc::fade(uint32_t channel, uint32_t duty, uint32_t duration_ms, int32_t cycles)
+{
+  if(channel >= LEDC_CHANNEL_MAX || !this->fade_installed) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  EEA_Ledc_Channel *state = &(this->channels[channel]);
+  state->start_duty = ledc_get_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel);
+  state->target_duty = duty;
+  state->duration_ms = duration_ms;
+  state->cycles = cycles;
+  state->toward_target = true;
+
+  esp_err_t result = this->start_fade(channel);
+  state->fading = result == ESP_OK;
+  return result;
+}
+
+esp_err_t EEA_Ledc::start_fade(uint32_t channel)
+{
+  EEA_Ledc_Channel *state = &(this->channels[channel]);
+  uint32_t duty = state->toward_target ? state->target_duty : state->start_duty;
+
+  esp_err_t result = ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, duty, state->duration_ms);
+  if(result != ESP_OK) {
+    return result;
+  }
+  return ledc_fade_start(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, LEDC_FADE_NO_WAIT);
+}
+
+void EEA_Ledc::release()
+{
+  for(uint32_t i = 0; i < LEDC_CHANNEL_MAX; i++) {
+    this->channels[i].fading = false;
+    this->channels[i].cycles = 0;
+  }
+}
+
+void EEA_Ledc::update()
+{
+  uint8_t channel;
+  while(xQueueReceive(this->xQueueFadeEnd, &channel, 0) == pdPASS) {
+    if(channel >= LEDC_CHANNEL_MAX || !this->channels[channel].fading) {
+      continue;
+    }
+
+    // Patterns fade to the target and back. A cycle ends back at the start.
+    EEA_Ledc_Channel *state = &(this->channels[channel]);
+    if(state->cycles != 0) {
+      if(!state->toward_target && state->cycles > 0) {
+        state->cycles--;
+      }
+      if(state->cycles != 0) {
+        state->toward_target = !state->toward_target;
+        if(this->start_fade(channel) == ESP_OK) {
+          continue;
+        }
+        ESP_LOGI(TAG, "Failed to continue the fade pattern on channel %u.", channel);
+      }
+    }
+
+    state->fading = false;
+    this->send_event(channel);
+  }
+}
+
+void EEA_Ledc::send_event(uint32_t channel)
+{
+  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(msg == NULL) {
+    return;
+  }
+
+  msg->topic_length = snprintf(msg->topic, EEA_TOPIC_SIZE_BYTES, EEA_LEDC_EVENT_TOPIC, LOSANT_DEVICE_ID);
+  msg->payload_length = snprintf(msg->payload, EEA_PAYLOAD_SIZE_BYTES, "{\"channel\":%u,\"duty\":%u}",
+    channel, ledc_get_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel));
+  msg->qos = 0;
+  msg->received_at = esp_timer_get_time();
+  msg->queued_at = 0;
+
+  if(xQueueSend(this->xQueueEEA, msg, 0) != pdPASS) {
+    ESP_LOGI(TAG, "Message queue full. Fade end on channel %u lost.", channel);
+  }
+  eea_free(msg);
+}
+
+/**
+ * Wraps the ESP IDF ledc_timer_config function.
+ * Configures one of the four low speed LEDC timers, whose frequency and
+ * duty resolution are shared by the channels attached to it. Timers at a
+ * few Hz blink their channels in hardware.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/ledc.html#_CPPv417ledc_timer_configPK19ledc_timer_config_t
+ * Inputs:
+ *   timer (Int32): the timer, 0 to 3.
+ *   frequency_hz (Int32): the PWM frequency.
+ *   resolution_bits (Int32): the duty resolution. Duties range from 0 to 2^resolution_bits.
+ *
+ * Returns the result of ledc_timer_config(). ESP_OK (0) for success.
+ */
+static int32_t eea_fn_ledc_timer_config(EEA_Host_Context ctx, uint32_t timer, uint32_t frequency_hz, uint32_t resolution_bits)
+{
+  EEA_Ledc *ledc = (EEA_Ledc*)ctx.userdata;
+  return ledc->timer_config(timer, frequency_hz, resolution_bits);
+}
+
+/**
+ * Wraps the ESP IDF ledc_channel_config function.
+ * Attaches a pin to one of the eight low speed LEDC channels, with a duty of 0.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/ledc.html#_CPPv419ledc_channel_configPK21ledc_channel_config_t
+ * Inputs:
+ *   channel (Int32): the channel, 0 to 7.
+ *   timer (Int32): the timer that drives the channel.
+ *   pin (Int32): the output pin.
+ *
+ * Returns the result of ledc_channel_config(). ESP_OK (0) for success.
+ */
+static int32_t eea_fn_ledc_channel_config(EEA_Host_Context ctx, uint32_t channel, uint32_t timer, int32_t pin)
+{
+  EEA_Ledc *ledc = (EEA_Ledc*)ctx.userdata;
+  return ledc->channel_config(channel, timer, pin);
+}
+
+/**
+ * Wraps the ESP IDF ledc_set_duty and ledc_update_duty functions.
+ * Sets a channel's duty cycle, ending any fade pattern.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/ledc.html#_CPPv413ledc_set_duty11ledc_mode_t14ledc_channel_t8uint32_t
+ * Inputs:
+ *   channel (Int32): the channel.
+ *   duty (Int32): the duty, 0 to 2^resolution_bits of the channel's timer.
+ *
+ * Returns ESP_OK (0) for success.
+ */
+static int32_t eea_fn_ledc_set_duty(EEA_Host_Context ctx, uint32_t channel, uint32_t duty)
+{
+  EEA_Ledc *ledc = (EEA_Ledc*)ctx.userdata;
+  return ledc->set_duty(channel, duty);
+}
+
+/**
+ * Wraps the ESP IDF ledc_set_fade_with_time and ledc_fade_start functions.
+ * Starts a hardware fade from the current duty. With cycles, the channel
+ * then fades back and forth between the two duties, e.g. to breathe.
+ * A message is sent to EEA_LEDC_EVENT_TOPIC when the fade completes.
+ * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/peripherals/ledc.html#_CPPv423ledc_set_fade_with_time11ledc_mode_t14ledc_channel_t8uint32_ti
+ * Inputs:
+ *   channel (Int32): the channel.
+ *   duty (Int32): the target duty.
+ *   duration_ms (Int32): the length of the fade.
+ *   cycles (Int32): 0 for a single fade, the number of times to fade to the
+ *     target and back, or -1 to repeat until the next fade or duty on the channel.
+ *
+ * Returns ESP_OK (0) for success.
+ */
+static int32_t eea_fn_ledc_fade(EEA_Host_Context ctx, uint32_t channel, uint32_t duty, uint32_t duration_ms, int32_t cycles)
+{
+  EEA_Ledc *ledc = (EEA_Ledc*)ctx.userdata;
+  return ledc->fade(channel, duty, duration_ms, cycles);
+}
+
+static const EEA_Host_Function eea_ledc_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_ledc_timer_config),
+  EEA_HOST_FUNCTION(eea_fn_ledc_channel_config),
+  EEA_HOST_FUNCTION(eea_fn_ledc_set_duty),
+  EEA_HOST_FUNCTION(eea_fn_ledc_fade)
+};
+
+EEA_Ledc::EEA_Ledc(QueueHandle_t xQueueEEA)
+{
+  this->xQueueEEA = xQueueEEA;
+  this->xQueueFadeEnd = xQueueCreate(LEDC_CHANNEL_MAX * 2, sizeof(uint8_t));
+  this->fade_installed = false;
+  memset(this->channels, 0, sizeof(this->channels));
+}
+
+void EEA_Ledc::add_host_functions(EEA_Engine *engine)
+{
+  engine->add_host_functions("env", eea_ledc_functions,
+    sizeof(eea_ledc_functions) / sizeof(eea_ledc_functions[0]), this);
+}
@@ -0,0 +1,92 @@
+#ifndef EEA_LEDC_H
+#define EEA_LEDC_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/ledc.h"
+
+#include "eea_config.h"
+#include "eea_engine.h"
+
+#define EEA_LEDC_EVENT_TOPIC "losant/%s/toAgent/ledc"
+
+/**
+ * A channel's fade or fade pattern.
+ */
+struct EEA_Ledc_Channel {
+  bool fading;
+  bool toward_target;
+  uint32_t start_duty;
+  uint32_t target_duty;
+  uint32_t duration_ms;
+
+  // Cycles left in a fade pattern. 0 for a single fade, -1 to repeat forever.
+  int32_t cycles;
+};
+
+/**
+ * Hardware PWM outputs for workflows, exposed as registered functions (see
+ * eea_ledc.cpp). Duty cycles, blinking (a timer at a low frequency) and
+ * fades run on the LEDC peripheral, so outputs don't have to be toggled
+ * from eea_loop.
+ *
+ * When a fade or fade pattern completes, the bundle receives a message on
+ * EEA_LEDC_EVENT_TOPIC with the channel and its final duty:
+ *
+ *   {"channel":0,"duty":8191}
+ *
+ * Fade ends are signalled from the LEDC interrupt, and turned into messages
+ * (or the next fade of a pattern) by update() on the runtime task.
+ * Channels are low speed mode channels. Owned by the runtime, since the
+ * peripheral's state outlives bundles.
+ */
+class EEA_Ledc {
+  public:
+    EEA_Ledc(QueueHandle_t xQueueEEA);
+
+    /**
+     * Links the LEDC registered functions to a bundle's engine.
+     */
+    void add_host_functions(EEA_Engine *engine);
+
+    esp_err_t timer_config(uint32_t timer, uint32_t frequency_hz, uint32_t resolution_bits);
+    esp_err_t channel_config(uint32_t channel, uint32_t timer, int32_t pin);
+
+    /**
+     * Sets a duty cycle, ending any fade pattern on the channel.
+     */
+    esp_err_t set_duty(uint32_t channel, uint32_t duty);
+
+    /**
+     * Fades from the current duty to duty over duration_ms. With cycles,
+     * the channel then fades back and forth between the two that many
+     * times, or forever for -1.
+     */
+    esp_err_t fade(uint32_t channel, uint32_t duty, uint32_t duration_ms, int32_t cycles);
+
+    /**
+     * Stops delivering fade events and ends fade patterns, when the bundle
+     * that started them is unloaded. Fades in progress run to their end.
+     */
+    void release();
+
+    /**
+     * Handles fade ends signalled since the last call.
+     */
+    void update();
+
+    // Channel numbers of completed fades, from the LEDC interrupt.
+    QueueHandle_t xQueueFadeEnd;
+
+  private:
+    esp_err_t start_fade(uint32_t channel);
+    void send_event(uint32_t channel);
+
+    QueueHandle_t xQueueEEA;
+    EEA_Ledc_Channel channels[LEDC_CHANNEL_MAX];
+    bool fade_installed;
+};
+
+#endif
@@ -0,0 +1,68 @@
+/**
+ * Local delivery of messages sent to the agent's own toAgent topics.
+ * See eea_loopback.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "eea_loopback.h"
+
+static const char *TAG = "EEA_LOOPBACK";
+
+EEA_Loopback::EEA_Loopback(QueueHandle_t xQueueEEA, EEA_Conflator *conflator)
+{
+  this->xQueueEEA = xQueueEEA;
+  this->conflator = conflator;
+  this->prefix_length = snprintf(this->prefix, sizeof(this->prefix), EEA_LOOPBACK_TOPIC, LOSANT_DEVICE_ID);
+  this->num_delivered = 0;
+  this->num_dropped = 0;
+}
+
+bool EEA_Loopback::matches(const char *topic, uint32_t topic_length)
+{
+#if EEA_LOOPBACK_ENABLED
+  if(topic_length <= this->prefix_length || memcmp(topic, this->prefix, this->prefix_length) != 0) {
+    return false;
+  }
+
+  // Same routing as the MQTT task. These never reach the bundle.
+  return strnstr(topic, "toAgent/config", topic_length) == NULL &&
+    strnstr(topic, "flows", topic_length) == NULL;
+#else
+  return false;
+#endif
+}
+
+bool EEA_Loopback::deliver(EEA_Queue_Msg *msg)
+{
+  int64_t now = esp_timer_get_time();
+
+  if(this->conflator->offer(msg->topic, msg->topic_length, msg->payload, msg->payload_length, now)) {
+    this->num_delivered++;
+    return true;
+  }
+
+  msg->qos = 0;
+  msg->received_at = now;
+  msg->queued_at = 0;
+  if(xQueueSend(this->xQueueEEA, msg, 0) != pdPASS) {
+    this->num_dropped++;
+    ESP_LOGI(TAG, "Message queue full. Local message on %s dropped.", msg->topic);
+    return false;
+  }
+
+  this->num_delivered++;
+  return true;
+}
+
+void EEA_Loopback::report()
+{
+  if(this->num_delivered == 0 && this->num_dropped == 0) {
+    return;
+  }
+  ESP_LOGI(TAG, "%u messages delivered locally, %u dropped.", this->num_delivered, this->num_dropped);
+}
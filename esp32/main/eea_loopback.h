@@ -0,0 +1,62 @@
+#ifndef EEA_LOOPBACK_H
+#define EEA_LOOPBACK_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "eea_config.h"
+#include "eea_queue_msg.h"
+#include "eea_conflate.h"
+
+#define EEA_LOOPBACK_TOPIC "losant/%s/toAgent/"
+
+/**
+ * Local delivery of messages a bundle sends to its own device's toAgent
+ * topics, which the agent is subscribed to.
+ *
+ * Instead of a round trip through the broker, eea_send_message hands these
+ * messages straight to the inbound path: state topics to the conflator,
+ * everything else to xQueueEEA, just as the MQTT task would. One workflow
+ * can then signal another on the same device in microseconds, and
+ * signalling keeps working while the device is offline.
+ *
+ * The toAgent topics the MQTT task handles itself (toAgent/config and
+ * bundle topics) aren't delivered locally. With EEA_LOOPBACK_PUBLISH,
+ * looped back messages are also published upstream.
+ *
+ * Owned by the runtime. Used by the runtime task.
+ */
+class EEA_Loopback {
+  public:
+    EEA_Loopback(QueueHandle_t xQueueEEA, EEA_Conflator *conflator);
+
+    /**
+     * Whether a message sent on topic is delivered locally.
+     */
+    bool matches(const char *topic, uint32_t topic_length);
+
+    /**
+     * Delivers msg to the inbound path, stamped as received now. msg is
+     * modified. Returns false if xQueueEEA was full and msg was dropped.
+     */
+    bool deliver(EEA_Queue_Msg *msg);
+
+    /**
+     * Logs the number of messages delivered locally and dropped.
+     */
+    void report();
+
+  private:
+    QueueHandle_t xQueueEEA;
+    EEA_Conflator *conflator;
+
+    char prefix[EEA_TOPIC_SIZE_BYTES];
+    uint32_t prefix_length;
+
+    uint32_t num_delivered;
+    uint32_t num_dropped;
+};
+
+#endif
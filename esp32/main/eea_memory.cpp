@@ -0,0 +1,162 @@
+/**
+ * Per-subsystem memory accounting. See eea_memory.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "soc/soc_memory_layout.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "eea_memory.h"
+
+#define EEA_MEMORY_MAX_TASKS 8
+
+// Written before every tagged allocation. 8 bytes keeps the caller's
+// pointer 8-byte aligned.
+#define EEA_MEMORY_MAGIC 0xEEA1
+
+struct EEA_Memory_Header
+{
+  uint32_t size;
+  uint16_t magic;
+  uint8_t tag;
+  uint8_t external;
+};
+
+struct EEA_Memory_Stats
+{
+  uint32_t live_bytes;
+  uint32_t peak_bytes;
+  uint32_t live_allocations;
+  uint32_t total_allocations;
+};
+
+struct EEA_Memory_Task
+{
+  TaskHandle_t handle;
+  uint32_t stack_size;
+};
+
+static const char *TAG = "EEA_MEMORY";
+
+static const char *tag_names[EEA_MEM_TAG_COUNT] = {
+  "runtime",
+  "api",
+  "mqtt",
+  "queue",
+  "wasm",
+  "aggregate"
+};
+
+// Indexed by [tag][external].
+static EEA_Memory_Stats stats[EEA_MEM_TAG_COUNT][2];
+static EEA_Memory_Task tasks[EEA_MEMORY_MAX_TASKS];
+static uint32_t task_count = 0;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void *eea_malloc(EEA_Memory_Tag tag, size_t size, uint32_t caps)
+{
+  EEA_Memory_Header *header = (EEA_Memory_Header*)heap_caps_malloc(sizeof(EEA_Memory_Header) + size, caps);
+  if(header == NULL) {
+    ESP_LOGI(TAG, "Failed to allocate %d bytes for %s.", size, tag_names[tag]);
+    return NULL;
+  }
+
+  header->size = size;
+  header->magic = EEA_MEMORY_MAGIC;
+  header->tag = tag;
+  header->external = esp_ptr_external_ram(header) ? 1 : 0;
+
+  portENTER_CRITICAL(&stats_lock);
+  EEA_Memory_Stats *s = &stats[tag][header->external];
+  s->live_bytes += size;
+  s->live_allocations++;
+  s->total_allocations++;
+  if(s->live_bytes > s->peak_bytes) {
+    s->peak_bytes = s->live_bytes;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+
+  return header + 1;
+}
+
+void eea_free(void *ptr)
+{
+  if(ptr == NULL) {
+    return;
+  }
+
+  EEA_Memory_Header *header = ((EEA_Memory_Header*)ptr) - 1;
+  if(header->magic != EEA_MEMORY_MAGIC) {
+    ESP_LOGE(TAG, "eea_free called on untagged memory %p.", ptr);
+    return;
+  }
+
+  portENTER_CRITICAL(&stats_lock);
+  EEA_Memory_Stats *s = &stats[header->tag][header->external];
+  s->live_bytes -= header->size;
+  s->live_allocations--;
+  portEXIT_CRITICAL(&stats_lock);
+
+  header->magic = 0;
+  heap_caps_free(header);
+}
+
+void eea_memory_register_task(TaskHandle_t task, uint32_t stack_size)
+{
+  portENTER_CRITICAL(&stats_lock);
+  if(task != NULL && task_count < EEA_MEMORY_MAX_TASKS) {
+    tasks[task_count].handle = task;
+    tasks[task_count].stack_size = stack_size;
+    task_count++;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+}
+
+uint32_t eea_memory_live_bytes()
+{
+  uint32_t live_bytes = 0;
+
+  portENTER_CRITICAL(&stats_lock);
+  for(int tag = 0; tag < EEA_MEM_TAG_COUNT; tag++) {
+    live_bytes += stats[tag][0].live_bytes + stats[tag][1].live_bytes;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+
+  return live_bytes;
+}
+
+void eea_memory_report()
+{
+  EEA_Memory_Stats snapshot[EEA_MEM_TAG_COUNT][2];
+
+  portENTER_CRITICAL(&stats_lock);
+  memcpy(snapshot, stats, sizeof(snapshot));
+  portEXIT_CRITICAL(&stats_lock);
+
+  ESP_LOGI(TAG, "Heap free: internal %d (min %d), SPIRAM %d (min %d).",
+    heap_caps_get_free_size(MALLOC_CAP_INTERNAL), heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+    heap_caps_get_free_size(MALLOC_CAP_SPIRAM), heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+
+  for(int tag = 0; tag < EEA_MEM_TAG_COUNT; tag++) {
+    for(int external = 0; external < 2; external++) {
+      EEA_Memory_Stats *s = &snapshot[tag][external];
+      if(s->total_allocations == 0) {
+        continue;
+      }
+      ESP_LOGI(TAG, "%-9s %-8s live %u bytes in %u allocations, peak %u bytes, %u allocations total.",
+        tag_names[tag], external ? "SPIRAM" : "internal",
+        s->live_bytes, s->live_allocations, s->peak_bytes, s->total_allocations);
+    }
+  }
+
+  for(uint32_t i = 0; i < task_count; i++) {
+    // On the ESP32, the high-water mark is the minimum free stack in bytes.
+    uint32_t free_min = uxTaskGetStackHighWaterMark(tasks[i].handle);
+    ESP_LOGI(TAG, "Task %-32s stack peak %u of %u bytes.",
+      pcTaskGetTaskName(tasks[i].handle), tasks[i].stack_size - free_min, tasks[i].stack_size);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef EEA_MEMORY_H
+#define EEA_MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/**
+ * The subsystem that owns an allocation.
+ */
+enum EEA_Memory_Tag {
+  EEA_MEM_RUNTIME,  // Runtime task stack, bundle buffers.
+  EEA_MEM_API,      // EEA API imports.
+  EEA_MEM_MQTT,     // MQTT task.
+  EEA_MEM_QUEUE,    // FreeRTOS queue storage and queue messages.
+  EEA_MEM_WASM,     // The wasm3 arena.
+  EEA_MEM_AGGREGATE, // Aggregation windows.
+  EEA_MEM_TAG_COUNT
+};
+
+/**
+ * Allocates memory with heap_caps_malloc and accounts for it under the tag.
+ * Memory must be released with eea_free.
+ */
+void *eea_malloc(EEA_Memory_Tag tag, size_t size, uint32_t caps);
+
+/**
+ * Releases memory allocated with eea_malloc. NULL is ignored.
+ */
+void eea_free(void *ptr);
+
+/**
+ * Adds a task to the stack high-water report.
+ * stack_size is in bytes, as passed to xTaskCreate.
+ */
+void eea_memory_register_task(TaskHandle_t task, uint32_t stack_size);
+
+/**
+ * The bytes currently allocated with eea_malloc, over every tag.
+ */
+uint32_t eea_memory_live_bytes();
+
+/**
+ * Logs live bytes, peak bytes and allocation counts for every tag,
+ * split by internal RAM and SPIRAM, and the stack high-water mark
+ * of every registered task.
+ */
+void eea_memory_report();
+
+#endif
\ No newline at end of file
@@ -6,20 +6,25 @@
  */
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "mqtt_client.h"
 
 #include "eea_mqtt.h"
 #include "eea_config.h"
+#include "eea_memory.h"
 #include "eea_queue_msg.h"
+#include "eea_settings.h"
+#include "eea_latency.h"
 
 #define EEA_MQTT_TASK_SIZE 16384
 #define EEA_MQTT_TASK_PRIORITY 4
 
-// The max payload size from the broker is 256KB.
-#define EEA_MQTT_IN_BUFFER_SIZE (1024 * 256)
-#define EEA_MQTT_OUT_BUFFER_SIZE (1024 * 32)
+// Messages queued by the broker for a persistent session are only
+// delivered for QoS 1 subscriptions.
+#define EEA_MQTT_SUBSCRIBE_QOS (EEA_MQTT_PERSISTENT_SESSION ? 1 : 0)
 
 static const char *TAG = "EEA_MQTT";
 
@@ -44,12 +49,120 @@ static void log_error_if_nonzero(const char *message, int error_code)
 static void queue_connect_message(bool connected, EEA_MQTT *eea_mqtt)
 {
   const char *topic = connected ? "#connect" : "#disconnect";
-  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_MQTT, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
   msg->topic_length = strlen(topic);
   strcpy(msg->topic, topic);
   msg->payload_length = 0;
+  msg->received_at = 0;
+  msg->queued_at = 0;
   xQueueSend(eea_mqtt->xQueueEEA, msg, 0);
-  free(msg);
+  eea_free(msg);
+}
+
+/**
+ * Handles a complete message from the broker. Agent settings are applied
+ * here, WASM bundles go in the flows queue, and everything else goes to
+ * the conflator or the regular message queue.
+ */
+static void handle_message(EEA_MQTT *eea_mqtt, const char *topic, int topic_len, const char *data, int data_len,
+  int64_t received_at)
+{
+  ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+
+  // Topics are not null-terminated from the client.
+  // Null terminate it for logging.
+  char topic_terminated[EEA_TOPIC_SIZE_BYTES];
+  int topic_log_len = topic_len < EEA_TOPIC_SIZE_BYTES ? topic_len : EEA_TOPIC_SIZE_BYTES - 1;
+  strncpy(topic_terminated, topic, topic_log_len);
+  topic_terminated[topic_log_len] = '\0';
+
+  ESP_LOGI(TAG, "Topic: %s", topic_terminated);
+  ESP_LOGI(TAG, "Payload length: %d", data_len);
+
+  if(strnstr(topic, "toAgent/config", topic_len) != NULL) {
+    // This handler runs on the MQTT client's task, whose stack is in
+    // internal RAM, so the settings can be written to NVS here.
+    if(eea_settings_update(data, data_len) == EEA_SETTING_APPLY_RESTART) {
+      ESP_LOGI(TAG, "Restarting to apply settings.");
+      esp_restart();
+    }
+  } else if(strnstr(topic, "flows", topic_len) != NULL) {
+    if(data_len > EEA_MAX_WASM_BUNDLE_SIZE) {
+      ESP_LOGI(TAG, "Dropped %d byte bundle. The limit is %d bytes.", data_len, EEA_MAX_WASM_BUNDLE_SIZE);
+      return;
+    }
+
+    // WASM bundles are pretty big (~150kb). Need to allocate this using SPIRAM.
+    EEA_Queue_Msg_Flow *msg = (EEA_Queue_Msg_Flow*)eea_malloc(EEA_MEM_MQTT, sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    memcpy(msg->bundle, data, data_len);
+    msg->bundle_size = data_len;
+    xQueueSend(eea_mqtt->xQueueFlows, msg, 0);
+    eea_free(msg);
+
+  } else if(topic_len >= EEA_TOPIC_SIZE_BYTES || data_len >= EEA_PAYLOAD_SIZE_BYTES) {
+    ESP_LOGI(TAG, "Dropped message with a %d byte topic and %d byte payload.", topic_len, data_len);
+  } else if(!eea_mqtt->conflator->offer(topic, topic_len, data, data_len, received_at)) {
+    // State topics are held by the conflator. Everything else is queued.
+    EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_MQTT, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    strncpy(msg->topic, topic, topic_len);
+    strncpy(msg->payload, data, data_len);
+    msg->topic_length = topic_len;
+    msg->payload_length = data_len;
+    msg->received_at = received_at;
+    msg->queued_at = 0;
+    if(xQueueSend(eea_mqtt->xQueueEEA, msg, 0) != pdPASS) {
+      eea_mqtt->conflator->dropped();
+    }
+    eea_free(msg);
+  }
+}
+
+/**
+ * Collects the fragments of a message larger than the client's buffer.
+ * The client delivers them in order, and the message is handled once the
+ * last one arrives. Messages that can't be reassembled are dropped.
+ */
+static void assemble_message(EEA_MQTT *eea_mqtt, esp_mqtt_event_handle_t event)
+{
+  EEA_MQTT_Assembly *assembly = &(eea_mqtt->assembly);
+
+  if(event->current_data_offset == 0) {
+    assembly->length = -1;
+    if(event->topic_len >= EEA_TOPIC_SIZE_BYTES || event->total_data_len > EEA_MAX_WASM_BUNDLE_SIZE) {
+      ESP_LOGI(TAG, "Dropped %d byte message. Too large to reassemble.", event->total_data_len);
+      return;
+    }
+
+    // Allocated on first use, and kept for the next large message.
+    if(assembly->data == NULL) {
+      assembly->data = (char*)eea_malloc(EEA_MEM_MQTT, EEA_MAX_WASM_BUNDLE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+      if(assembly->data == NULL) {
+        ESP_LOGI(TAG, "Dropped %d byte message. Failed to allocate reassembly buffer.", event->total_data_len);
+        return;
+      }
+    }
+
+    memcpy(assembly->topic, event->topic, event->topic_len);
+    assembly->topic_len = event->topic_len;
+    assembly->total = event->total_data_len;
+    assembly->length = 0;
+    assembly->received_at = esp_timer_get_time();
+  }
+
+  // The rest of a dropped message, or a fragment that doesn't follow on.
+  if(assembly->length != event->current_data_offset || assembly->length + event->data_len > assembly->total) {
+    assembly->length = -1;
+    return;
+  }
+
+  memcpy(assembly->data + assembly->length, event->data, event->data_len);
+  assembly->length += event->data_len;
+
+  if(assembly->length == assembly->total) {
+    handle_message(eea_mqtt, assembly->topic, assembly->topic_len, assembly->data, assembly->length,
+      assembly->received_at);
+    assembly->length = -1;
+  }
 }
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
@@ -62,26 +175,48 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
   EEA_MQTT *eea_mqtt = (EEA_MQTT*)event->user_context;
 
   switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+      eea_mqtt->connect_started_at = esp_timer_get_time();
+      break;
     case MQTT_EVENT_CONNECTED:
-      ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+      ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED, session_present=%d", event->session_present);
 
-      char topic[EEA_TOPIC_SIZE_BYTES];
-      sprintf(topic, "losant/%s/toAgent/#", LOSANT_DEVICE_ID);
-      msg_id = esp_mqtt_client_subscribe(client, topic, 0);
-      ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+      // Connect covers the TCP connection, TLS handshake and MQTT CONNECT.
+      // Reconnect also covers the wait before the client retried.
+      ESP_LOGI(TAG, "Connect took %lld ms.", (esp_timer_get_time() - eea_mqtt->connect_started_at) / 1000);
+      if(eea_mqtt->disconnected_at != 0) {
+        ESP_LOGI(TAG, "Reconnected %lld ms after disconnect.", (esp_timer_get_time() - eea_mqtt->disconnected_at) / 1000);
+        eea_mqtt->disconnected_at = 0;
+      }
+
+      // With a persistent session, the broker kept the subscriptions.
+      if(!EEA_MQTT_PERSISTENT_SESSION || !event->session_present) {
+        char topic[EEA_TOPIC_SIZE_BYTES];
+        sprintf(topic, "losant/%s/toAgent/#", LOSANT_DEVICE_ID);
+        msg_id = esp_mqtt_client_subscribe(client, topic, EEA_MQTT_SUBSCRIBE_QOS);
+        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
 
-      sprintf(topic, "losant/%s/command", LOSANT_DEVICE_ID);
-      msg_id = esp_mqtt_client_subscribe(client, topic, 0);
-      ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+        sprintf(topic, "losant/%s/command", LOSANT_DEVICE_ID);
+        msg_id = esp_mqtt_client_subscribe(client, topic, EEA_MQTT_SUBSCRIBE_QOS);
+        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+      }
 
       eea_mqtt->is_connected = true;
 
+      if(!eea_mqtt->has_connected) {
+        eea_mqtt->has_connected = true;
+        ESP_LOGI(TAG, "[BOOT] MQTT connected %lld ms after boot.", esp_timer_get_time() / 1000);
+      }
+
       queue_connect_message(true, eea_mqtt);
 
       break;
     case MQTT_EVENT_DISCONNECTED:
       ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
       eea_mqtt->is_connected = false;
+      if(eea_mqtt->disconnected_at == 0) {
+        eea_mqtt->disconnected_at = esp_timer_get_time();
+      }
       queue_connect_message(false, eea_mqtt);
       break;
     case MQTT_EVENT_SUBSCRIBED:
@@ -94,38 +229,13 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
       ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
       break;
     case MQTT_EVENT_DATA:
-      ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-
-      // Topics are not null-terminated from the client.
-      // Null terminate it for logging.
-      char topic_terminated[256];
-      strncpy(topic_terminated, event->topic, event->topic_len);
-      topic_terminated[event->topic_len] = '\0';
-
-      ESP_LOGI(TAG, "Topic: %s", topic_terminated);
-      ESP_LOGI(TAG, "Payload length: %d", event->data_len);
-
-      // If this is a new WASM bundle, put it in the 
-      // flows queue. Otherwise it goes in the regular
-      // message queue.
-      if(strnstr(event->topic, "flows", event->topic_len) != NULL) {
-        // WASM bundles are pretty big (~150kb). Need to allocate this using SPIRAM.
-        EEA_Queue_Msg_Flow *msg = (EEA_Queue_Msg_Flow*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-        memcpy(msg->bundle, event->data, event->data_len);
-        msg->bundle_size = event->data_len;
-        xQueueSend(eea_mqtt->xQueueFlows, msg, 0);
-        free(msg);
-
+      // Messages larger than the client's buffer (the mqttInBuffer setting)
+      // arrive in several events, and only the first one has the topic.
+      if(event->data_len == event->total_data_len) {
+        handle_message(eea_mqtt, event->topic, event->topic_len, event->data, event->data_len, esp_timer_get_time());
       } else {
-        EEA_Queue_Msg *msg = (EEA_Queue_Msg*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-        strncpy(msg->topic, event->topic, event->topic_len);
-        strncpy(msg->payload, event->data, event->data_len);
-        msg->topic_length = event->topic_len;
-        msg->payload_length = event->data_len;
-        xQueueSend(eea_mqtt->xQueueEEA, msg, 0);
-        free(msg);
+        assemble_message(eea_mqtt, event);
       }
-
       break;
     case MQTT_EVENT_ERROR:
       ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -154,41 +264,62 @@ void eea_mqtt_task(void *pvParameters)
     .username = LOSANT_ACCESS_KEY,
     .password = LOSANT_ACCESS_SECRET,
     .user_context = eea_mqtt,
-    .buffer_size = EEA_MQTT_IN_BUFFER_SIZE,
+    // The max payload size from the broker is 256KB.
+    .buffer_size = eea_setting(EEA_SETTING_MQTT_IN_BUFFER),
     .cert_pem = (const char *)root_ca_pem_start,
-    .out_buffer_size = EEA_MQTT_OUT_BUFFER_SIZE
+    .out_buffer_size = eea_setting(EEA_SETTING_MQTT_OUT_BUFFER)
   };
 
+  // Reconnects do a full TLS handshake. esp-mqtt doesn't take an esp-tls
+  // client session in IDF 4.4, so sessions aren't resumed.
+  mqtt_cfg.disable_clean_session = EEA_MQTT_PERSISTENT_SESSION;
+  mqtt_cfg.reconnect_timeout_ms = EEA_MQTT_RECONNECT_TIMEOUT_MS;
+
   esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
   esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, mqtt_event_handler, NULL);
   esp_mqtt_client_start(client);
 
   ESP_LOGI(TAG, "MQTT client started.");
 
-  const TickType_t xDelay = 50 / portTICK_PERIOD_MS;
   while(true) {
     if(eea_mqtt->is_connected) {
       if(uxQueueMessagesWaiting(eea_mqtt->xQueueMQTT) > 0) {
-        EEA_Queue_Msg *msg = (EEA_Queue_Msg*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_MQTT, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
         if(xQueueReceive(eea_mqtt->xQueueMQTT, msg, 0) == pdPASS) {
           ESP_LOGI(TAG, "Processing MQTT queue message.");
           ESP_LOGI(TAG, "Topic: %s", msg->topic);
           ESP_LOGI(TAG, "Payload: %s", msg->payload);
           esp_mqtt_client_publish(client, msg->topic, msg->payload, msg->payload_length, msg->qos, 0);
+
+          // Messages sent by a message handler are timed through to here.
+          int64_t published_at = esp_timer_get_time();
+          if(msg->queued_at != 0) {
+            eea_latency_record(EEA_LATENCY_OUTBOUND, published_at - msg->queued_at);
+          }
+          if(msg->received_at != 0) {
+            eea_latency_record(EEA_LATENCY_END_TO_END, published_at - msg->received_at);
+          }
         }
-        free(msg);
+        eea_free(msg);
       }
     }
-    vTaskDelay(xDelay);
+    vTaskDelay(eea_setting(EEA_SETTING_MQTT_LOOP_MS) / portTICK_PERIOD_MS);
   }
 }
 
-EEA_MQTT::EEA_MQTT(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows)
+EEA_MQTT::EEA_MQTT(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows, EEA_Conflator *conflator)
 {
   this->xQueueMQTT = xQueueMQTT;
   this->xQueueEEA = xQueueEEA;
   this->xQueueFlows = xQueueFlows;
+  this->conflator = conflator;
   this->is_connected = false;
+  this->has_connected = false;
+  this->connect_started_at = 0;
+  this->disconnected_at = 0;
+  this->assembly.data = NULL;
+  this->assembly.length = -1;
 
   xTaskCreate(eea_mqtt_task, "eea_mqtt_task", EEA_MQTT_TASK_SIZE, this, EEA_MQTT_TASK_PRIORITY, &(this->xHandle));
+  eea_memory_register_task(this->xHandle, EEA_MQTT_TASK_SIZE);
 }
\ No newline at end of file
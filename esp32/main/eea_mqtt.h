@@ -5,13 +5,41 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 
+#include "eea_conflate.h"
+#include "eea_config.h"
+
+/**
+ * A message from the broker being reassembled from MQTT_EVENT_DATA
+ * fragments. length is -1 when no message is being reassembled.
+ */
+struct EEA_MQTT_Assembly {
+  char topic[EEA_TOPIC_SIZE_BYTES];
+  int topic_len;
+  char *data;
+  int length;
+  int total;
+  int64_t received_at;
+};
+
 class EEA_MQTT {
   public:
-    EEA_MQTT(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows);
+    EEA_MQTT(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows, EEA_Conflator *conflator);
     QueueHandle_t xQueueMQTT;
     QueueHandle_t xQueueEEA;
     QueueHandle_t xQueueFlows;
+    EEA_Conflator *conflator;
     bool is_connected;
+
+    // Whether the first connection since boot has been made.
+    bool has_connected;
+
+    // For measuring connect and reconnect latency.
+    int64_t connect_started_at;
+    int64_t disconnected_at;
+
+    // Messages larger than the client's buffer (the mqttInBuffer setting),
+    // up to EEA_MAX_WASM_BUNDLE_SIZE.
+    EEA_MQTT_Assembly assembly;
   private:
     TaskHandle_t xHandle;
 };
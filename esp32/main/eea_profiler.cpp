@@ -0,0 +1,390 @@
+/**
+ * Sampling profiler for wasm functions. See eea_profiler.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/xtensa_context.h"
+
+#include "eea_profiler.h"
+#include "eea_config.h"
+#include "eea_memory.h"
+#include "eea_queue_msg.h"
+
+#define EEA_PROFILER_TASK_SIZE 3072
+#define EEA_PROFILER_TASK_PRIORITY 20
+
+// Pseudo-functions for samples taken outside of wasm code.
+#define EEA_PROFILER_IDLE ((IM3Function)1)
+#define EEA_PROFILER_HOST ((IM3Function)2)
+
+static const char *TAG = "EEA_PROFILER";
+
+/**
+ * Sampler task. Blocked until the profiler is started.
+ *
+ * pvParameters = *EEA_Profiler
+ */
+void eea_profiler_task(void *pvParameters)
+{
+  EEA_Profiler *profiler = (EEA_Profiler*)pvParameters;
+
+  const TickType_t xDelay = (EEA_PROFILER_PERIOD_MS / portTICK_PERIOD_MS) > 0 ? (EEA_PROFILER_PERIOD_MS / portTICK_PERIOD_MS) : 1;
+
+  while(true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while(profiler->active) {
+      vTaskDelay(xDelay);
+      if(profiler->active) {
+        int64_t start = esp_timer_get_time();
+        profiler->sample();
+        profiler->sampling_us += esp_timer_get_time() - start;
+      }
+    }
+  }
+}
+
+EEA_Profiler::EEA_Profiler(TaskHandle_t target, const uint8_t *stack_low, const uint8_t *stack_high,
+  BaseType_t core, QueueHandle_t xQueueMQTT)
+{
+  this->target = target;
+  this->stack_low = stack_low;
+  this->stack_high = stack_high;
+  this->xQueueMQTT = xQueueMQTT;
+  this->active = false;
+  this->table_busy = false;
+  this->num_functions = 0;
+  this->num_pages = 0;
+  this->code_low = 0;
+  this->code_high = 0;
+  this->code_lines = 0;
+  this->sample_count = 0;
+  this->skipped = 0;
+  this->sampling_us = 0;
+
+  this->functions = (Function_Start*)eea_malloc(EEA_MEM_RUNTIME, EEA_PROFILER_MAX_FUNCTIONS * sizeof(Function_Start), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->samples = (Sample*)eea_malloc(EEA_MEM_RUNTIME, EEA_PROFILER_MAX_SAMPLES * sizeof(Sample), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  xTaskCreatePinnedToCore(eea_profiler_task, "eea_profiler_task", EEA_PROFILER_TASK_SIZE,
+    this, EEA_PROFILER_TASK_PRIORITY, &(this->xTaskHandle), core);
+  eea_memory_register_task(this->xTaskHandle, EEA_PROFILER_TASK_SIZE);
+}
+
+void EEA_Profiler::start(uint32_t duration_ms)
+{
+  if(this->functions == NULL || this->samples == NULL) {
+    ESP_LOGI(TAG, "Profiler buffers were not allocated.");
+    return;
+  }
+
+  if(this->active) {
+    ESP_LOGI(TAG, "Profiler is already running.");
+    return;
+  }
+
+  ESP_LOGI(TAG, "Profiling for %u ms.", duration_ms);
+
+  this->duration_ms = duration_ms;
+  this->sample_count = 0;
+  this->skipped = 0;
+  this->sampling_us = 0;
+  this->num_functions = 0;
+  this->num_pages = 0;
+  this->code_low = 0;
+  this->code_high = 0;
+  this->code_lines = 0;
+  this->started_at = esp_timer_get_time();
+  this->active = true;
+
+  xTaskNotifyGive(this->xTaskHandle);
+}
+
+void EEA_Profiler::stop()
+{
+  this->active = false;
+}
+
+void EEA_Profiler::update(IM3Runtime runtime, IM3Module module)
+{
+  if(!this->active) {
+    return;
+  }
+
+  // wasm3 compiles functions the first time they are called, from any
+  // export, so the map is rebuilt whenever the compiled code has grown.
+  uint32_t lines = count_code_lines(runtime);
+  if(lines != this->code_lines) {
+    this->code_lines = lines;
+    refresh(runtime, module);
+  }
+
+  if(esp_timer_get_time() - this->started_at >= this->duration_ms * 1000LL) {
+    this->active = false;
+    report(module);
+  }
+}
+
+static int compare_function_starts(const void *a, const void *b)
+{
+  uintptr_t x = *(const uintptr_t*)a;
+  uintptr_t y = *(const uintptr_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+uint32_t EEA_Profiler::count_code_lines(IM3Runtime runtime)
+{
+  uint32_t lines = 0;
+  M3CodePage *lists[2] = { runtime->pagesOpen, runtime->pagesFull };
+  for(int l = 0; l < 2; l++) {
+    for(M3CodePage *page = lists[l]; page != NULL; page = page->info.next) {
+      lines += page->info.numLines;
+    }
+  }
+  return lines;
+}
+
+void EEA_Profiler::refresh(IM3Runtime runtime, IM3Module module)
+{
+  this->table_busy = true;
+
+  this->num_pages = 0;
+  this->code_low = UINTPTR_MAX;
+  this->code_high = 0;
+
+  M3CodePage *lists[2] = { runtime->pagesOpen, runtime->pagesFull };
+  for(int l = 0; l < 2; l++) {
+    for(M3CodePage *page = lists[l]; page != NULL && this->num_pages < EEA_PROFILER_MAX_PAGES; page = page->info.next) {
+      Page *range = &(this->pages[this->num_pages++]);
+      range->start = (uintptr_t)page->code;
+      range->end = (uintptr_t)(page->code + page->info.numLines);
+
+      if(range->start < this->code_low) this->code_low = range->start;
+      if(range->end > this->code_high) this->code_high = range->end;
+    }
+  }
+
+  this->num_functions = 0;
+  for(uint32_t i = 0; i < module->numFunctions && this->num_functions < EEA_PROFILER_MAX_FUNCTIONS; i++) {
+    if(module->functions[i].compiled != NULL) {
+      this->functions[this->num_functions].compiled = (uintptr_t)module->functions[i].compiled;
+      this->functions[this->num_functions].function = &(module->functions[i]);
+      this->num_functions++;
+    }
+  }
+
+  qsort(this->functions, this->num_functions, sizeof(Function_Start), compare_function_starts);
+
+  // Each function ends where the next one in its page starts. Functions
+  // in pages past EEA_PROFILER_MAX_PAGES are dropped.
+  uint32_t kept = 0;
+  for(uint32_t i = 0; i < this->num_functions; i++) {
+    int32_t page = find_page(this->functions[i].compiled);
+    if(page >= 0) {
+      this->functions[kept] = this->functions[i];
+      this->functions[kept].page = page;
+      this->functions[kept].end = this->pages[page].end;
+      if(kept > 0 && this->functions[kept - 1].page == (uint32_t)page) {
+        this->functions[kept - 1].end = this->functions[kept].compiled;
+      }
+      kept++;
+    }
+  }
+  this->num_functions = kept;
+
+  this->table_busy = false;
+}
+
+/**
+ * The index of the page containing value, or -1.
+ */
+int32_t EEA_Profiler::find_page(uintptr_t value)
+{
+  for(uint32_t i = 0; i < this->num_pages; i++) {
+    if(value >= this->pages[i].start && value < this->pages[i].end) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+IM3Function EEA_Profiler::lookup(uintptr_t value)
+{
+  if(value < this->code_low || value >= this->code_high) {
+    return NULL;
+  }
+
+  int32_t page = find_page(value);
+  if(page < 0) {
+    return NULL;
+  }
+
+  // The last function whose compiled code starts at or before value.
+  int32_t low = 0;
+  int32_t high = (int32_t)this->num_functions - 1;
+  Function_Start *found = NULL;
+  while(low <= high) {
+    int32_t mid = (low + high) / 2;
+    if(this->functions[mid].compiled <= value) {
+      found = &(this->functions[mid]);
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  // Code at the start of a page, before its first function, belongs to a
+  // function that spilled over from another page. Don't attribute it to
+  // the last function of an earlier page.
+  if(found == NULL || found->page != (uint32_t)page || value >= found->end) {
+    return NULL;
+  }
+  return found->function;
+}
+
+void EEA_Profiler::sample()
+{
+  if(this->table_busy) {
+    this->skipped++;
+    return;
+  }
+
+  IM3Function frames[EEA_PROFILER_MAX_DEPTH];
+  uint8_t depth = 0;
+
+  // The runtime task can't be running: this task has a higher priority on
+  // the same core. A ready task was preempted by an interrupt, which saved
+  // an exception frame at the top of its stack (the first TCB member).
+  // Tasks that yielded or blocked themselves save a frame with exit == 0.
+  XtExcFrame *frame = *(XtExcFrame**)this->target;
+
+  if(eTaskGetState(this->target) != eReady) {
+    frames[depth++] = EEA_PROFILER_IDLE;
+  } else if(frame->exit == 0) {
+    frames[depth++] = EEA_PROFILER_HOST;
+  } else {
+    // Innermost first: registers, then the stack towards its base.
+    const long *registers = &(frame->a2);
+    for(int i = 0; i < 14 && depth < EEA_PROFILER_MAX_DEPTH; i++) {
+      IM3Function function = lookup((uintptr_t)registers[i]);
+      if(function != NULL && (depth == 0 || frames[depth - 1] != function)) {
+        frames[depth++] = function;
+      }
+    }
+
+    const uint8_t *sp = (const uint8_t*)frame->a1;
+    if(sp >= this->stack_low && sp < this->stack_high) {
+      const uint8_t *end = sp + EEA_PROFILER_STACK_SCAN_BYTES;
+      if(end > this->stack_high) {
+        end = this->stack_high;
+      }
+
+      for(const uint32_t *word = (const uint32_t*)sp; (const uint8_t*)word < end && depth < EEA_PROFILER_MAX_DEPTH; word++) {
+        IM3Function function = lookup(*word);
+        if(function != NULL && (depth == 0 || frames[depth - 1] != function)) {
+          frames[depth++] = function;
+        }
+      }
+    }
+
+    if(depth == 0) {
+      frames[depth++] = EEA_PROFILER_HOST;
+    }
+  }
+
+  Sample *sample = &(this->samples[this->sample_count % EEA_PROFILER_MAX_SAMPLES]);
+  sample->depth = depth;
+  for(uint8_t i = 0; i < depth; i++) {
+    sample->frames[i] = frames[depth - 1 - i];
+  }
+  this->sample_count++;
+}
+
+int EEA_Profiler::compare_samples(const void *a, const void *b)
+{
+  const Sample *x = (const Sample*)a;
+  const Sample *y = (const Sample*)b;
+
+  for(uint8_t d = 0; d < x->depth && d < y->depth; d++) {
+    if(x->frames[d] != y->frames[d]) {
+      return (uintptr_t)x->frames[d] < (uintptr_t)y->frames[d] ? -1 : 1;
+    }
+  }
+  return (int)x->depth - (int)y->depth;
+}
+
+/**
+ * Appends the function's name to the folded stack line.
+ */
+static int append_frame(char *line, int length, int capacity, IM3Function function, IM3Module module)
+{
+  if(function == EEA_PROFILER_IDLE) {
+    return length + snprintf(line + length, capacity - length, "%s[idle]", length > 0 ? ";" : "");
+  }
+  if(function == EEA_PROFILER_HOST) {
+    return length + snprintf(line + length, capacity - length, "%s[host]", length > 0 ? ";" : "");
+  }
+
+  const char *name = m3_GetFunctionName(function);
+  if(name != NULL && strcmp(name, "<unnamed>") != 0) {
+    return length + snprintf(line + length, capacity - length, "%s%s", length > 0 ? ";" : "", name);
+  }
+  return length + snprintf(line + length, capacity - length, "%sfunc[%d]", length > 0 ? ";" : "", (int)(function - module->functions));
+}
+
+void EEA_Profiler::report(IM3Module module)
+{
+  uint32_t count = this->sample_count < EEA_PROFILER_MAX_SAMPLES ? this->sample_count : EEA_PROFILER_MAX_SAMPLES;
+
+  qsort(this->samples, count, sizeof(Sample), compare_samples);
+
+  int64_t elapsed = esp_timer_get_time() - this->started_at;
+  ESP_LOGI(TAG, "Profile: %u samples (%u kept, %u skipped), sampling took %lld us of %lld us.",
+    this->sample_count, count, this->skipped, this->sampling_us, elapsed);
+
+  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  msg->topic_length = snprintf(msg->topic, EEA_TOPIC_SIZE_BYTES, EEA_PROFILER_TOPIC, LOSANT_DEVICE_ID);
+  msg->payload_length = 0;
+  msg->qos = 0;
+  msg->received_at = 0;
+  msg->queued_at = 0;
+
+  char line[512];
+  uint32_t i = 0;
+  while(i < count) {
+    uint32_t run = 1;
+    while(i + run < count && compare_samples(&(this->samples[i]), &(this->samples[i + run])) == 0) {
+      run++;
+    }
+
+    int length = 0;
+    for(uint8_t d = 0; d < this->samples[i].depth && length < (int)sizeof(line) - 16; d++) {
+      length = append_frame(line, length, sizeof(line) - 16, this->samples[i].frames[d], module);
+    }
+    length += snprintf(line + length, sizeof(line) - length, " %u", run);
+
+    ESP_LOGI(TAG, "%s", line);
+
+    // Lines are batched into as few messages as fit.
+    if(msg->payload_length + length + 1 >= EEA_PAYLOAD_SIZE_BYTES) {
+      xQueueSend(this->xQueueMQTT, msg, 100 / portTICK_PERIOD_MS);
+      msg->payload_length = 0;
+    }
+    memcpy(msg->payload + msg->payload_length, line, length);
+    msg->payload_length += length;
+    msg->payload[msg->payload_length++] = '\n';
+    msg->payload[msg->payload_length] = '\0';
+
+    i += run;
+  }
+
+  if(msg->payload_length > 0) {
+    xQueueSend(this->xQueueMQTT, msg, 100 / portTICK_PERIOD_MS);
+  }
+
+  eea_free(msg);
+}
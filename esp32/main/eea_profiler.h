@@ -0,0 +1,128 @@
+#ifndef EEA_PROFILER_H
+#define EEA_PROFILER_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include <wasm3.h>
+#include <m3_env.h>
+
+#define EEA_PROFILER_PERIOD_MS 10
+#define EEA_PROFILER_MAX_SAMPLES 1024
+#define EEA_PROFILER_MAX_DEPTH 12
+#define EEA_PROFILER_MAX_FUNCTIONS 1024
+#define EEA_PROFILER_MAX_PAGES 32
+
+// Folded stacks are published to this topic when a profile completes.
+#define EEA_PROFILER_TOPIC "losant/%s/fromAgent/profile"
+
+// Bytes of the runtime task's stack searched for callers on each sample.
+#define EEA_PROFILER_STACK_SCAN_BYTES 4096
+
+/**
+ * Sampling profiler for the wasm functions run by the runtime task.
+ *
+ * A sampler task, pinned to the runtime task's core at a higher priority,
+ * wakes every EEA_PROFILER_PERIOD_MS. Since it runs on the same core, the
+ * runtime task is always suspended when a sample is taken, with its
+ * registers saved on its stack. Register values and stack words that
+ * point into wasm3's compiled code pages are mapped to the function whose
+ * compiled code starts at or before them in the same page, up to where the
+ * next function starts. The innermost hit is the running function and the
+ * stack hits approximate its callers. Code a function spilled into another
+ * page isn't attributed.
+ *
+ * The profiler is idle (the sampler task is blocked) until start() is
+ * called. Each sample reads at most 14 registers and
+ * EEA_PROFILER_STACK_SCAN_BYTES of stack. Samples are kept in a ring
+ * buffer of EEA_PROFILER_MAX_SAMPLES.
+ *
+ * Results are aggregated into folded stacks ("eea_loop;parse;add 12"),
+ * the input format of flamegraph.pl and speedscope.
+ */
+class EEA_Profiler {
+  public:
+    EEA_Profiler(TaskHandle_t target, const uint8_t *stack_low, const uint8_t *stack_high,
+      BaseType_t core, QueueHandle_t xQueueMQTT);
+
+    /**
+     * Starts sampling for duration_ms. Called from the runtime task.
+     */
+    void start(uint32_t duration_ms);
+
+    /**
+     * Called by the runtime task after each call into the bundle. Refreshes
+     * the map of compiled functions when wasm3 has compiled more code, and
+     * exports the profile to the console and MQTT once the duration has
+     * elapsed.
+     */
+    void update(IM3Runtime runtime, IM3Module module);
+
+    /**
+     * Stops sampling and discards the samples. Must be called before the
+     * profiled bundle is destroyed.
+     */
+    void stop();
+
+    bool active;
+
+  private:
+    struct Sample {
+      uint8_t depth;
+      IM3Function frames[EEA_PROFILER_MAX_DEPTH]; // Outermost first.
+    };
+
+    struct Function_Start {
+      uintptr_t compiled;
+      uintptr_t end;      // The next function's start, or the end of the page.
+      uint32_t page;      // Index into pages.
+      IM3Function function;
+    };
+
+    struct Page {
+      uintptr_t start;
+      uintptr_t end;
+    };
+
+    TaskHandle_t target;
+    const uint8_t *stack_low;
+    const uint8_t *stack_high;
+    QueueHandle_t xQueueMQTT;
+    TaskHandle_t xTaskHandle;
+
+    int64_t started_at;
+    uint32_t duration_ms;
+
+    // Lines of compiled code when the map was last refreshed.
+    uint32_t code_lines;
+
+    // Written by the runtime task, read by the sampler.
+    // The sampler skips a sample while table_busy is set.
+    volatile bool table_busy;
+    Function_Start *functions;
+    uint32_t num_functions;
+    Page pages[EEA_PROFILER_MAX_PAGES];
+    uint32_t num_pages;
+    uintptr_t code_low;
+    uintptr_t code_high;
+
+    Sample *samples;
+    volatile uint32_t sample_count;
+    uint32_t skipped;
+    int64_t sampling_us;
+
+    void refresh(IM3Runtime runtime, IM3Module module);
+    void sample();
+    uint32_t count_code_lines(IM3Runtime runtime);
+    int32_t find_page(uintptr_t value);
+    IM3Function lookup(uintptr_t value);
+    void report(IM3Module module);
+    static int compare_samples(const void *a, const void *b);
+
+    friend void eea_profiler_task(void *pvParameters);
+};
+
+#endif
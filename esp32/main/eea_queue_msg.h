@@ -15,6 +15,14 @@ struct EEA_Queue_Msg
   uint16_t topic_length;
   uint32_t payload_length;
   uint8_t qos;
+
+  // esp_timer_get_time() stamps for latency tracing (eea_latency.h).
+  // Inbound, when MQTT delivered the message. Outbound, when the inbound
+  // message whose handler sent it was delivered. 0 if not timed.
+  int64_t received_at;
+
+  // Outbound, when the message was queued. 0 if not timed.
+  int64_t queued_at;
 };
 
 /**
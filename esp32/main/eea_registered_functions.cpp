@@ -2,10 +2,9 @@
 #include "driver/gpio.h"
 #include "driver/adc.h"
 
+#include "eea_bindings.h"
 #include "eea_registered_functions.h"
 
-#include <wasm3.h>
-#include <m3_env.h>
 
 static const char *TAG = "ESP32_GPIO";
 
@@ -23,18 +22,9 @@ static const char *TAG = "ESP32_GPIO";
  * 
  * Returns the result of gpio_set_direction(). ESP_OK (0) for success.
  */
-m3ApiRawFunction(eea_fn_gpio_set_direction)
+static int32_t eea_fn_gpio_set_direction(int32_t pin, int32_t mode)
 {
-  ESP_LOGI(TAG, "eea_fn_gpio_set_direction");
-
-  m3ApiReturnType(int32_t)
-
-  m3ApiGetArg(int32_t, pin);
-  m3ApiGetArg(int32_t, mode);
-
-  int32_t result = gpio_set_direction((gpio_num_t)pin, gpio_mode_t(mode));
-
-  m3ApiReturn(result);
+  return gpio_set_direction((gpio_num_t)pin, gpio_mode_t(mode));
 }
 
 /**
@@ -47,17 +37,9 @@ m3ApiRawFunction(eea_fn_gpio_set_direction)
  * 
  * Returns the result of gpio_set_level(). ESP_OK (0) for success.
  */
-m3ApiRawFunction(eea_fn_gpio_set_level)
+static int32_t eea_fn_gpio_set_level(int32_t pin, int32_t level)
 {
-  ESP_LOGI(TAG, "eea_fn_gpio_set_level");
-  m3ApiReturnType(int32_t)
-
-  m3ApiGetArg(int32_t, pin);
-  m3ApiGetArg(int32_t, level);
-
-  int32_t result = gpio_set_level((gpio_num_t)pin, level);
-
-  m3ApiReturn(result);
+  return gpio_set_level((gpio_num_t)pin, level);
 }
 
 /**
@@ -72,18 +54,12 @@ m3ApiRawFunction(eea_fn_gpio_set_level)
  * 
  * Always returns 0.
  */
-m3ApiRawFunction(eea_fn_gpio_get_level)
+static int32_t eea_fn_gpio_get_level(int32_t pin, EEA_Out<int32_t> value)
 {
-  ESP_LOGI(TAG, "eea_fn_gpio_get_level");
-  m3ApiReturnType(int32_t)
-
-  m3ApiGetArg(int32_t, pin);
-  m3ApiGetArgMem(int32_t*, value);
-
   int32_t gpio_value = gpio_get_level((gpio_num_t)pin);
-  memcpy(value, &gpio_value, sizeof(gpio_value));
+  value.set(gpio_value);
 
-  m3ApiReturn(0);
+  return 0;
 }
 
 /**
@@ -100,17 +76,9 @@ m3ApiRawFunction(eea_fn_gpio_get_level)
  * 
  * Returns the result of gpio_set_level(). ESP_OK (0) for success.
  */
-m3ApiRawFunction(eea_fn_adc1_config_channel_atten)
+static int32_t eea_fn_adc1_config_channel_atten(int32_t channel, int32_t atten)
 {
-  ESP_LOGI(TAG, "eea_fn_adc1_config_channel_atten");
-  m3ApiReturnType(int32_t)
-
-  m3ApiGetArg(int32_t, channel);
-  m3ApiGetArg(int32_t, atten);
-
-  int32_t result = adc1_config_channel_atten((adc1_channel_t)channel, (adc_atten_t)atten);
-
-  m3ApiReturn(result);
+  return adc1_config_channel_atten((adc1_channel_t)channel, (adc_atten_t)atten);
 }
 
 /**
@@ -126,16 +94,9 @@ m3ApiRawFunction(eea_fn_adc1_config_channel_atten)
  * 
  * Returns the result of adc1_config_width(). ESP_OK (0) for success.
  */
-m3ApiRawFunction(eea_fn_adc1_config_width)
+static int32_t eea_fn_adc1_config_width(int32_t width)
 {
-  ESP_LOGI(TAG, "eea_fn_adc1_config_width");
-  m3ApiReturnType(int32_t)
-
-  m3ApiGetArg(int32_t, width);
-
-  int32_t result = adc1_config_width((adc_bits_width_t)width);
-
-  m3ApiReturn(result);
+  return adc1_config_width((adc_bits_width_t)width);
 }
 
 /**
@@ -150,29 +111,58 @@ m3ApiRawFunction(eea_fn_adc1_config_width)
  * 
  * Always returns 0.
  */
-m3ApiRawFunction(eea_fn_adc1_get_raw)
+static int32_t eea_fn_adc1_get_raw(int32_t channel, EEA_Out<int32_t> value)
 {
-  ESP_LOGI(TAG, "eea_fn_adc1_get_raw");
-  m3ApiReturnType(int32_t)
-
-  m3ApiGetArg(int32_t, channel);
-  m3ApiGetArgMem(int32_t*, value);
-
   int32_t adc_value = adc1_get_raw((adc1_channel_t )channel);
-  memcpy(value, &adc_value, sizeof(adc_value));
+  value.set(adc_value);
 
-  m3ApiReturn(0);
+  return 0;
 }
 
+static const EEA_Host_Function eea_registered_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_gpio_set_direction),
+  EEA_HOST_FUNCTION(eea_fn_gpio_set_level),
+  EEA_HOST_FUNCTION(eea_fn_gpio_get_level),
+  EEA_HOST_FUNCTION(eea_fn_adc1_config_channel_atten),
+  EEA_HOST_FUNCTION(eea_fn_adc1_config_width),
+  EEA_HOST_FUNCTION(eea_fn_adc1_get_raw)
+};
+
+EEA_Registered_Functions::EEA_Registered_Functions(EEA_Engine *engine, EEA_Ledc *ledc, EEA_Uart *uart, EEA_Bus *bus)
+{
+  engine->add_host_functions("env", eea_registered_functions,
+    sizeof(eea_registered_functions) / sizeof(eea_registered_functions[0]), NULL);
+
+  // Windowed aggregation functions (eea_aggregate.cpp).
+  this->aggregate = new EEA_Aggregate(engine);
+
+  // JSON field extraction functions (eea_json.cpp).
+  this->json = new EEA_Json(engine);
+
+  // Signal processing functions (eea_dsp.cpp).
+  this->dsp = new EEA_Dsp(engine);
+
+  // LEDC PWM and fade functions (eea_ledc.cpp). The LEDC state is owned
+  // by the runtime, since fades outlive the bundle that started them.
+  this->ledc = ledc;
+  ledc->add_host_functions(engine);
+
+  // Serial sensor functions (eea_uart.cpp). Records are received in the
+  // background by the runtime's UART task, whether or not a bundle is loaded.
+  this->uart = uart;
+  uart->add_host_functions(engine);
+
+  // SPI and I2C transaction functions (eea_bus.cpp). The buses are set up
+  // by the bundle and released when it is unloaded.
+  this->bus = bus;
+  bus->add_host_functions(engine);
+}
 
-EEA_Registered_Functions::EEA_Registered_Functions(IM3Module wasm_module)
+EEA_Registered_Functions::~EEA_Registered_Functions()
 {
-  const char* module_name = "env";
-
-  m3_LinkRawFunction(wasm_module, module_name, "eea_fn_gpio_set_direction", "i(ii)", &eea_fn_gpio_set_direction);
-  m3_LinkRawFunction(wasm_module, module_name, "eea_fn_gpio_set_level", "i(ii)", &eea_fn_gpio_set_level);
-  m3_LinkRawFunction(wasm_module, module_name, "eea_fn_gpio_get_level", "i(i*)", &eea_fn_gpio_get_level);
-  m3_LinkRawFunction(wasm_module, module_name, "eea_fn_adc1_config_channel_atten", "i(ii)", &eea_fn_adc1_config_channel_atten);
-  m3_LinkRawFunction(wasm_module, module_name, "eea_fn_adc1_config_width", "i(i)", &eea_fn_adc1_config_width);
-  m3_LinkRawFunction(wasm_module, module_name, "eea_fn_adc1_get_raw", "i(i*)", &eea_fn_adc1_get_raw);
+  delete this->aggregate;
+  delete this->json;
+  delete this->dsp;
+  this->ledc->release();
+  this->bus->release();
 }
\ No newline at end of file
@@ -4,12 +4,24 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 
-#include <wasm3.h>
-#include <m3_env.h>
+#include "eea_engine.h"
+#include "eea_aggregate.h"
+#include "eea_dsp.h"
+#include "eea_json.h"
+#include "eea_ledc.h"
+#include "eea_uart.h"
+#include "eea_bus.h"
 
 class EEA_Registered_Functions {
   public:
-    EEA_Registered_Functions(IM3Module wasm_module);
+    EEA_Registered_Functions(EEA_Engine *engine, EEA_Ledc *ledc, EEA_Uart *uart, EEA_Bus *bus);
+    ~EEA_Registered_Functions();
+    EEA_Aggregate *aggregate;
+    EEA_Json *json;
+    EEA_Dsp *dsp;
+    EEA_Ledc *ledc;
+    EEA_Uart *uart;
+    EEA_Bus *bus;
 };
 
 #endif
\ No newline at end of file
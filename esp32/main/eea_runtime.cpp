@@ -1,4 +1,7 @@
+#include <stddef.h>
+
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "freertos/FreeRTOS.h"
@@ -8,15 +11,31 @@
 #include "eea_runtime.h"
 #include "eea_api.h"
 #include "eea_registered_functions.h"
+#include "eea_latency.h"
+#include "eea_benchmark.h"
+#include "eea_bundle.h"
+#include "eea_memory.h"
 #include "eea_queue_msg.h"
+#include "eea_wasm_arena.h"
+#include "eea_snapshot.h"
+#include "eea_config.h"
+#include "eea_settings.h"
+#include "eea_profiler.h"
+#include "eea_engine.h"
+#include "eea_engine_wasm3.h"
 
-#include <wasm3.h>
-#include <m3_env.h>
+#include "cJSON.h"
 
-#define WASM_STACK_SLOTS    (256 * 1024)
 #define WASM_TASK_STACK     (768 * 1024)
+
 #define EEA_RUNTIME_TASK_PRIORITY 4
 
+// The runtime task is pinned so the profiler's sampler can share its core.
+#define EEA_RUNTIME_CORE 1
+
+// Profile length when a toAgent/profile message doesn't set durationMs.
+#define EEA_PROFILE_DEFAULT_DURATION_MS 10000
+
 #define EEA_RUNTIME_SAVE_BUNDLE_TASK_SIZE 4096
 #define EEA_RUNTIME_SAVE_BUNDLE_TASK_PRIORITY 4
 
@@ -24,6 +43,11 @@
 #define EEA_NVS_PARTITION "eea"
 #define EEA_NVS_NAMESPACE "EEA"
 #define EEA_NVS_KEY "eea_bundle"
+#define EEA_NVS_ID_KEY "eea_bundle_id"
+
+// Commands for the save bundle task (xQueueNVS).
+#define EEA_NVS_COMMAND_SAVE 1
+#define EEA_NVS_COMMAND_LOAD 2
 
 static const char *TAG = "EEA_RUNTIME";
 
@@ -34,9 +58,12 @@ static const char *TAG = "EEA_RUNTIME";
  * bundle_version: "nullVersion" if no bundle loaded
  *   otherwise the value from the BUNDLE_IDENTIFIER WASM global.
  * 
+ * accepts_delta: whether the next bundle may be sent as a delta against
+ *   bundle_version (see eea_bundle.h). False asks for a full bundle.
+ *
  * http://docs.losant.com/edge-compute/embedded-edge-agent/agent-api/#bundle-identifier
  */
-void send_hello_message(const char *bundle_version, QueueHandle_t xQueueMQTT)
+void send_hello_message(const char *bundle_version, QueueHandle_t xQueueMQTT, bool accepts_delta)
 {
   ESP_LOGI(TAG, "Sending hello message: %s", bundle_version);
 
@@ -51,27 +78,30 @@ void send_hello_message(const char *bundle_version, QueueHandle_t xQueueMQTT)
     "\"service\": \"embeddedWorkflowAgent\","
     "\"version\": \"1.0.0\","
     "\"bundle\": \"%s\","
+    "\"bundleDelta\": %s,"
     "\"compilerOptions\": {"
       "\"exportMemory\": true,"
       "\"traceLevel\": 2"
     "}"
-  "}", bundle_version);
+  "}", bundle_version, accepts_delta ? "true" : "false");
 
   ESP_LOGI(TAG, "Topic: %s", topic);
   ESP_LOGI(TAG, "Payload: %s", payload);
 
   // Allocate from PSRAM.
-  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 
   strcpy(msg->topic, topic);
   strcpy(msg->payload, payload);
   msg->topic_length = topic_length;
   msg->payload_length = payload_length;
   msg->qos = 0;
+  msg->received_at = 0;
+  msg->queued_at = 0;
 
   xQueueSend(xQueueMQTT, msg, 0);
 
-  free(msg);
+  eea_free(msg);
 }
 
 /**
@@ -82,6 +112,8 @@ void send_hello_message(const char *bundle_version, QueueHandle_t xQueueMQTT)
  * Returns:
  *  0 if bundle exists and successfully loaded.
  *  1 if no bundle was loaded.
+ *  2 if the bundle could not be queued because another bundle is already
+ *    waiting in xQueueFlows. That bundle replaces the running one instead.
  */
 int load_from_nvs(EEA_Runtime *eea_runtime)
 {
@@ -104,28 +136,40 @@ int load_from_nvs(EEA_Runtime *eea_runtime)
     return 1;
   }
 
-  if(required_size == 0) {
-    ESP_LOGI(TAG, "Bundle found in NVS, but size was 0.");
+  if(required_size == 0 || required_size > EEA_MAX_WASM_BUNDLE_SIZE) {
+    ESP_LOGI(TAG, "Bundle found in NVS, but size was %d.", required_size);
+    nvs_close(eea_nvs_handle);
     return 1;
   }
 
   // There is a bundle in NVS. Allocate message, read, and add to queue.
-  EEA_Queue_Msg_Flow *msg = (EEA_Queue_Msg_Flow*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  EEA_Queue_Msg_Flow *msg = (EEA_Queue_Msg_Flow*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 
   err = nvs_get_blob(eea_nvs_handle, EEA_NVS_KEY, msg->bundle, &required_size);
   if(err != ESP_OK) {
     ESP_LOGI(TAG, "Failed to read bundle from NVS. Error: 0x%04x", err);
     nvs_close(eea_nvs_handle);
-    free(msg);
+    eea_free(msg);
     return 1;
   }
 
-  ESP_LOGI(TAG, "Bundle loaded from NVS. Size: %d", required_size);
+  // The persisted bundle is the last one that ran without trapping.
+  size_t id_size = EEA_BUNDLE_ID_SIZE;
+  if(nvs_get_str(eea_nvs_handle, EEA_NVS_ID_KEY, eea_runtime->known_good_id, &id_size) != ESP_OK) {
+    eea_runtime->known_good_id[0] = '\0';
+  }
+
+  ESP_LOGI(TAG, "Bundle %s loaded from NVS. Size: %d", eea_runtime->known_good_id, required_size);
   msg->bundle_size = required_size;
-  xQueueSend(eea_runtime->xQueueFlows, msg, 0);
-  free(msg);
+  BaseType_t queued = xQueueSend(eea_runtime->xQueueFlows, msg, 0);
+  eea_free(msg);
 
   nvs_close(eea_nvs_handle);
+
+  if(queued != pdPASS) {
+    ESP_LOGI(TAG, "Failed to queue bundle %s from NVS. Another bundle is waiting to load.", eea_runtime->known_good_id);
+    return 2;
+  }
   return 0;
 }
 
@@ -136,6 +180,14 @@ void save_to_nvs(EEA_Runtime *eea_runtime) {
   
   ESP_LOGI(TAG, "Attempting to save wasm bundle to NVS...");
 
+  // A module rebuilt from a delta bundle can be larger than the bundles
+  // the flows queue carries, which is how the bundle is loaded back.
+  if(eea_runtime->bundle->bundle_size > EEA_MAX_WASM_BUNDLE_SIZE) {
+    ESP_LOGI(TAG, "Bundle %s is %u bytes, too large to save to NVS.",
+      eea_runtime->bundle_id, eea_runtime->bundle->bundle_size);
+    return;
+  }
+
   nvs_handle_t eea_nvs_handle;
   esp_err_t err;
 
@@ -168,6 +220,13 @@ void save_to_nvs(EEA_Runtime *eea_runtime) {
     return;
   }
 
+  err = nvs_set_str(eea_nvs_handle, EEA_NVS_ID_KEY, eea_runtime->bundle_id);
+  if(err != ESP_OK) {
+    ESP_LOGI(TAG, "Failed to save bundle id to NVS. Error: 0x%04x", err);
+    nvs_close(eea_nvs_handle);
+    return;
+  }
+
   err = nvs_commit(eea_nvs_handle);
   if(err != ESP_OK) {
     ESP_LOGI(TAG, "Failed to commit NVS. Error: 0x%04x", err);
@@ -175,118 +234,310 @@ void save_to_nvs(EEA_Runtime *eea_runtime) {
     return;
   }
 
-  ESP_LOGI(TAG, "Successfully saved bundle to NVS.");
+  strcpy(eea_runtime->known_good_id, eea_runtime->bundle_id);
+  ESP_LOGI(TAG, "Successfully saved bundle %s to NVS.", eea_runtime->bundle_id);
   nvs_close(eea_nvs_handle);
 }
 
 /**
- * Loads the WASM bundle from the provided buffer.
- */ 
-void load_wasm(EEA_Runtime *eea_runtime, char *bundle, uint32_t bundle_size)
+ * Points eea_runtime->wasm_bytes at the WASM module contained in
+ * eea_runtime->bundle. Compressed bundles are decompressed into the arena.
+ *
+ * Returns:
+ *  0 if the WASM module is ready to load.
+ *  1 if the bundle is not a supported format or failed to decompress.
+ */
+int prepare_wasm(EEA_Runtime *eea_runtime)
 {
-  M3Result result = m3Err_none;
-
-  eea_runtime->wasm_env = m3_NewEnvironment();
-  if(!eea_runtime->wasm_env) ESP_LOGI(TAG, "Error: NewEnvironment");
+  uint8_t *bundle = (uint8_t*)eea_runtime->bundle->bundle;
+  uint32_t bundle_size = eea_runtime->bundle->bundle_size;
+
+  switch(eea_bundle_format(bundle, bundle_size)) {
+    case EEA_BUNDLE_FORMAT_WASM:
+    case EEA_BUNDLE_FORMAT_AOT:
+      eea_runtime->wasm_bytes = bundle;
+      eea_runtime->wasm_size = bundle_size;
+      return 0;
+
+    case EEA_BUNDLE_FORMAT_ZLIB: {
+      // The decompressed size isn't known up front. Decompress into the
+      // largest supported module, then shrink the allocation in place to
+      // give the unused space back to the arena.
+      uint8_t *wasm = (uint8_t*)eea_runtime->wasm_arena->malloc(EEA_MAX_WASM_MODULE_SIZE);
+      if(wasm == NULL) {
+        ESP_LOGI(TAG, "Failed to allocate decompression buffer.");
+        return 1;
+      }
 
-  eea_runtime->wasm_runtime = m3_NewRuntime (eea_runtime->wasm_env, WASM_STACK_SLOTS, NULL);
-  if (!eea_runtime->wasm_runtime) ESP_LOGI(TAG, "Error: NewRuntime");
+      uint32_t wasm_size = 0;
+      int64_t start = esp_timer_get_time();
+      if(eea_bundle_decompress(bundle, bundle_size, wasm, EEA_MAX_WASM_MODULE_SIZE, &wasm_size) != 0 ||
+          wasm_size == 0) {
+        return 1;
+      }
+      int64_t elapsed = esp_timer_get_time() - start;
 
-  result = m3_ParseModule(eea_runtime->wasm_env, &(eea_runtime->wasm_module), (unsigned char*)bundle, bundle_size);
-  if (result) ESP_LOGI(TAG, "Error: ParseModule");
+      ESP_LOGI(TAG, "Decompressed bundle %u -> %u bytes in %lld us (%lld KB/s).",
+        bundle_size, wasm_size, elapsed, elapsed > 0 ? (wasm_size * 1000000LL / 1024) / elapsed : 0);
 
-  result = m3_LoadModule(eea_runtime->wasm_runtime, eea_runtime->wasm_module);
-  if (result) ESP_LOGI(TAG, "%s", result);
+      eea_runtime->wasm_bytes = (uint8_t*)eea_runtime->wasm_arena->realloc(wasm, wasm_size);
+      eea_runtime->wasm_size = wasm_size;
+      return 0;
+    }
 
-  ESP_LOGI(TAG, "Linking EEA API functions...");
+    default:
+      ESP_LOGI(TAG, "Unrecognized bundle format.");
+      return 1;
+  }
+}
 
-  eea_runtime->eea_api = new EEA_API(eea_runtime, eea_runtime->wasm_module, eea_runtime->xQueueMQTT);
-  eea_runtime->eea_registered_functions = new EEA_Registered_Functions(eea_runtime->wasm_module);
+/**
+ * The bundle arena size for the largest supported module. See eea_config.h.
+ */
+static size_t wasm_arena_size()
+{
+  return offsetof(EEA_Bundle_Slot, bundle) + EEA_MAX_WASM_BUNDLE_SIZE +
+    EEA_MAX_WASM_MODULE_SIZE * (2 + EEA_WASM_ARENA_CODE_FACTOR) +
+    EEA_WASM_ARENA_LINEAR_MEMORY +
+    eea_setting(EEA_SETTING_WASM_STACK_SLOTS);
+}
 
-  IM3Function eea_init;
-  IM3Function eea_config_set_trace_level;
-  IM3Function eea_config_set_storage_size;
-  IM3Function eea_config_set_storage_interval;
+/**
+ * Returns the running bundle's engine if it is wasm3, which the profiler
+ * and state snapshots require, otherwise NULL.
+ */
+static EEA_Engine_Wasm3 *wasm3_engine(EEA_Runtime *eea_runtime)
+{
+  if(eea_runtime->engine == NULL || eea_runtime->engine->kind != EEA_ENGINE_KIND_WASM3) {
+    return NULL;
+  }
+  return (EEA_Engine_Wasm3*)eea_runtime->engine;
+}
 
-  result = m3_FindFunction (&eea_init, eea_runtime->wasm_runtime, "eea_init");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_init find %s", result);
+/**
+ * Finds an exported function. function is NULL if it isn't exported.
+ */
+static void find_export(EEA_Runtime *eea_runtime, EEA_Engine_Function *function, const char *name)
+{
+  EEA_Engine_Result result = eea_runtime->engine->find(function, name);
+  if(result != NULL) {
+    ESP_LOGI(TAG, "%s find %s", name, result);
+    *function = NULL;
   }
-  
-  result = m3_FindFunction (&eea_runtime->eea_loop, eea_runtime->wasm_runtime, "eea_loop");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_loop find %s", result);
-      ESP_LOGI(TAG, "%s", eea_runtime->wasm_runtime->error_message);
+}
+
+/**
+ * Calls an optional configuration export with a single argument.
+ */
+static void call_config(EEA_Runtime *eea_runtime, const char *name, uint64_t value)
+{
+  EEA_Engine_Function function;
+  find_export(eea_runtime, &function, name);
+  if(function != NULL) {
+    eea_runtime->engine->call(function, value);
   }
+}
+
+/**
+ * Deletes the engine and the host function state linked into it.
+ */
+static void free_engine(EEA_Runtime *eea_runtime)
+{
+  delete eea_runtime->engine;
+  delete eea_runtime->eea_api;
+  delete eea_runtime->eea_registered_functions;
+
+  eea_runtime->engine = NULL;
+  eea_runtime->eea_api = NULL;
+  eea_runtime->eea_registered_functions = NULL;
+}
+
+/**
+ * Loads the WASM or AOT module from the provided buffer and calls eea_init.
+ * AOT modules run on WAMR. WASM modules run on wasm3, or on WAMR if
+ * EEA_WAMR_DEFAULT is set.
+ *
+ * restore_snapshot: whether to restore the state snapshot taken by the
+ *   same bundle (eea_snapshot.h).
+ *
+ * Returns:
+ *  0 if the module was loaded.
+ *  1 if the module could not be loaded. The engine is left for the
+ *    caller to free.
+ */
+int load_wasm(EEA_Runtime *eea_runtime, uint8_t *module, uint32_t module_size, bool restore_snapshot)
+{
+  EEA_Lifecycle_Timing *timing = &(eea_runtime->lifecycle);
+  memset(timing, 0, sizeof(EEA_Lifecycle_Timing));
+  int64_t start = esp_timer_get_time();
 
-  result = m3_FindFunction (&eea_runtime->eea_message_received, eea_runtime->wasm_runtime, "eea_message_received");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_message_received find %s", result);
-      ESP_LOGI(TAG, "%s", eea_runtime->wasm_runtime->error_message);
+  EEA_Engine_Kind kind = EEA_WAMR_DEFAULT ? EEA_ENGINE_KIND_WAMR : EEA_ENGINE_KIND_WASM3;
+  if(eea_bundle_format(module, module_size) == EEA_BUNDLE_FORMAT_AOT) {
+    kind = EEA_ENGINE_KIND_WAMR;
   }
 
-  result = m3_FindFunction (&eea_runtime->eea_set_connection_status, eea_runtime->wasm_runtime, "eea_set_connection_status");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_set_connection_status find %s", result);
-      ESP_LOGI(TAG, "%s", eea_runtime->wasm_runtime->error_message);
+  // The engine allocates from eea_runtime->wasm_arena through the eea_wasm_* hooks.
+  eea_runtime->engine = eea_engine_create(kind);
+  if(eea_runtime->engine == NULL) {
+    ESP_LOGI(TAG, "This bundle requires the WAMR engine (-DEEA_ENGINE_WAMR=ON).");
+    return 1;
   }
 
-  result = m3_FindFunction (&eea_config_set_trace_level, eea_runtime->wasm_runtime, "eea_config_set_trace_level");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_config_set_trace_level find %s", result);
-      ESP_LOGI(TAG, "%s", eea_runtime->wasm_runtime->error_message);
+  EEA_Engine *engine = eea_runtime->engine;
+  int64_t now = esp_timer_get_time();
+  timing->create_us = now - start;
+  start = now;
+
+  ESP_LOGI(TAG, "Linking EEA API functions...");
+
+  // Host functions are added first, since WAMR resolves imports on load.
+  eea_runtime->eea_api = new EEA_API(eea_runtime, engine, eea_runtime->xQueueMQTT);
+  if(eea_runtime->eea_api->send_buffer == NULL) {
+    return 1;
   }
+  eea_runtime->eea_registered_functions = new EEA_Registered_Functions(engine, eea_runtime->ledc, eea_runtime->uart,
+    eea_runtime->bus);
+
+  now = esp_timer_get_time();
+  timing->link_us = now - start;
 
-  result = m3_FindFunction (&eea_config_set_storage_size, eea_runtime->wasm_runtime, "eea_config_set_storage_size");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_config_set_storage_size find %s", result);
-      ESP_LOGI(TAG, "%s", eea_runtime->wasm_runtime->error_message);
+  ESP_LOGI(TAG, "Loading module with %s.", engine->name);
+
+  EEA_Engine_Result result = engine->load(module, module_size, eea_setting(EEA_SETTING_WASM_STACK_SLOTS));
+  timing->load = engine->load_timing;
+  if(result != NULL) {
+    ESP_LOGI(TAG, "Failed to load module: %s", result);
+    return 1;
   }
 
-  result = m3_FindFunction (&eea_config_set_storage_interval, eea_runtime->wasm_runtime, "eea_config_set_storage_interval");
-  if (result != m3Err_none) {
-      ESP_LOGI(TAG, "eea_config_set_storage_interval find %s", result);
-      ESP_LOGI(TAG, "%s", eea_runtime->wasm_runtime->error_message);
+  start = esp_timer_get_time();
+
+  EEA_Engine_Function eea_init;
+  find_export(eea_runtime, &eea_init, "eea_init");
+  find_export(eea_runtime, &eea_runtime->eea_loop, "eea_loop");
+  find_export(eea_runtime, &eea_runtime->eea_message_received, "eea_message_received");
+  find_export(eea_runtime, &eea_runtime->eea_set_connection_status, "eea_set_connection_status");
+
+  if(eea_init == NULL || eea_runtime->eea_loop == NULL ||
+      eea_runtime->eea_message_received == NULL || eea_runtime->eea_set_connection_status == NULL) {
+    return 1;
   }
 
-  m3_CallV(eea_config_set_storage_size, 4096);
-  m3_CallV(eea_config_set_storage_interval, 0);
-  m3_CallV(eea_config_set_trace_level, 1);
-  m3_CallV(eea_runtime->eea_set_connection_status, eea_runtime->connected);
+  now = esp_timer_get_time();
+  timing->find_us = now - start;
+  start = now;
+
+  // A reload requested for the previous bundle is covered by this load.
+  eea_settings_take_reload();
+  call_config(eea_runtime, "eea_config_set_storage_size", eea_setting(EEA_SETTING_STORAGE_SIZE));
+  call_config(eea_runtime, "eea_config_set_storage_interval", eea_setting(EEA_SETTING_STORAGE_INTERVAL));
+  eea_runtime->trace_level = eea_setting(EEA_SETTING_TRACE_LEVEL);
+  call_config(eea_runtime, "eea_config_set_trace_level", eea_runtime->trace_level);
+  engine->call(eea_runtime->eea_set_connection_status, eea_runtime->connected);
+
+  now = esp_timer_get_time();
+  timing->config_us = now - start;
+  start = now;
+
+  uint64_t eea_init_return_code = 0;
+  result = engine->call(eea_init, 0, NULL, &eea_init_return_code);
+  if(result != NULL) {
+    ESP_LOGI(TAG, "eea_init %s", result);
+    engine->print_backtrace();
+    return 1;
+  }
 
-  m3_CallV(eea_init);
+  now = esp_timer_get_time();
+  timing->init_us = now - start;
+  start = now;
 
-  uint8_t eea_init_return_code = 0;
-  m3_GetResultsV (eea_init, &eea_init_return_code);
-  ESP_LOGI(TAG, "eea_init result %d", eea_init_return_code);
+  ESP_LOGI(TAG, "eea_init result %d", (uint8_t)eea_init_return_code);
 
   // Extract the bundle ID and report a new Hello message.
-  IM3Global g_bundle_id = m3_FindGlobal(eea_runtime->wasm_module, "BUNDLE_IDENTIFIER");
-  IM3Global g_bundle_id_length = m3_FindGlobal(eea_runtime->wasm_module, "BUNDLE_IDENTIFIER_LENGTH");
+  uint64_t bundle_id_ptr = 0;
+  uint64_t bundle_id_length_ptr = 0;
+  engine->get_global("BUNDLE_IDENTIFIER", &bundle_id_ptr);
+  engine->get_global("BUNDLE_IDENTIFIER_LENGTH", &bundle_id_length_ptr);
 
-  M3TaggedValue bundle_id_value;
-  M3TaggedValue bundle_id_length_value;
+  uint32_t memory_size = 0;
+  char *mem = (char*)engine->memory(&memory_size);
 
-  m3_GetGlobal(g_bundle_id, &bundle_id_value);
-  m3_GetGlobal(g_bundle_id_length, &bundle_id_length_value);
+  uint8_t bundle_id_length = 0;
+  if(mem != NULL && bundle_id_length_ptr < memory_size) {
+    bundle_id_length = (uint8_t)mem[bundle_id_length_ptr];
+  }
+  if(bundle_id_length >= EEA_BUNDLE_ID_SIZE) {
+    bundle_id_length = EEA_BUNDLE_ID_SIZE - 1;
+  }
+  if(bundle_id_ptr + bundle_id_length > memory_size) {
+    bundle_id_length = 0;
+  }
 
-  int32_t bundle_id_ptr = bundle_id_value.value.i32;
-  int32_t bundle_id_length_ptr = bundle_id_length_value.value.i32;
+  memcpy(eea_runtime->bundle_id, &(mem[bundle_id_ptr]), bundle_id_length);
+  eea_runtime->bundle_id[bundle_id_length] = '\0';
 
-  uint32_t memory_size = 0;
-  char *mem = (char*)m3_GetMemory(eea_runtime->wasm_runtime, &memory_size, 0);
+  ESP_LOGI(TAG, "bundle_id: %s", eea_runtime->bundle_id);
 
-  int8_t bundle_id_length = (int8_t)mem[bundle_id_length_ptr];
+  // Continue from the state saved before the last restart, if it was
+  // saved by this bundle.
+  EEA_Engine_Wasm3 *wasm3 = wasm3_engine(eea_runtime);
+  if(restore_snapshot && eea_runtime->snapshot != NULL && wasm3 != NULL) {
+    eea_runtime->snapshot->restore(wasm3->runtime, wasm3->module, eea_runtime->bundle_id);
+  }
 
-  char bundle_id[bundle_id_length + 1];
-  memcpy(bundle_id, &(mem[bundle_id_ptr]), bundle_id_length);
-  bundle_id[bundle_id_length] = '\0';
+  send_hello_message(eea_runtime->bundle_id, eea_runtime->xQueueMQTT, true);
+  timing->hello_us = esp_timer_get_time() - start;
 
-  eea_runtime->bundle_id = bundle_id;
+  eea_runtime->wasm_arena->report("Bundle loaded");
+  return 0;
+}
 
-  ESP_LOGI(TAG, "bundle_id: %s", bundle_id);
+/**
+ * Rebuilds the full WASM module from the delta bundle in the staging slot
+ * and the module that is currently running. On success the staging slot
+ * holds the rebuilt module. On failure, a full bundle is requested and the
+ * current bundle keeps running.
+ *
+ * Returns:
+ *  0 if the staging slot now holds the rebuilt module.
+ *  1 if the delta could not be applied.
+ */
+int apply_delta(EEA_Runtime *eea_runtime)
+{
+  EEA_Bundle_Slot *staging = eea_runtime->staging;
+  uint32_t delta_size = staging->bundle_size;
+
+  // The rebuilt module is written over the staging slot, which holds up to
+  // EEA_MAX_WASM_MODULE_SIZE bytes, so the delta is moved out of the way
+  // first. Deltas are small compared to bundles.
+  uint8_t *delta = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, delta_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(delta == NULL) {
+    send_hello_message(eea_runtime->bundle != NULL ? eea_runtime->bundle_id : "nullVersion", eea_runtime->xQueueMQTT, false);
+    return 1;
+  }
+  memcpy(delta, staging->bundle, delta_size);
+
+  uint32_t wasm_size = 0;
+  int64_t start = esp_timer_get_time();
+  EEA_Bundle_Delta_Result result = eea_bundle_apply_delta(delta, delta_size,
+    eea_runtime->bundle != NULL ? eea_runtime->bundle_id : NULL,
+    eea_runtime->wasm_bytes, eea_runtime->wasm_size,
+    (uint8_t*)staging->bundle, EEA_MAX_WASM_MODULE_SIZE, &wasm_size);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  eea_free(delta);
+
+  if(result != EEA_BUNDLE_DELTA_OK) {
+    ESP_LOGI(TAG, "Delta bundle rejected (%d). Requesting full bundle.", result);
+    send_hello_message(eea_runtime->bundle != NULL ? eea_runtime->bundle_id : "nullVersion", eea_runtime->xQueueMQTT, false);
+    return 1;
+  }
 
-  send_hello_message(bundle_id, eea_runtime->xQueueMQTT);
+  ESP_LOGI(TAG, "Delta bundle applied: %u bytes transferred for a %u byte module (%u%%) in %lld us.",
+    delta_size, wasm_size, wasm_size > 0 ? (uint32_t)((delta_size * 100ULL) / wasm_size) : 0, elapsed);
+
+  staging->bundle_size = wasm_size;
+  return 0;
 }
 
 /**
@@ -295,123 +546,447 @@ void load_wasm(EEA_Runtime *eea_runtime, char *bundle, uint32_t bundle_size)
 void destroy_wasm(EEA_Runtime *eea_runtime)
 {
   if(eea_runtime->bundle != NULL) {
+    EEA_Lifecycle_Timing *timing = &(eea_runtime->lifecycle);
+    int64_t start = esp_timer_get_time();
+
+    // The profiler's function map points into the module.
+    eea_runtime->profiler->stop();
+
+    EEA_Engine_Function eea_shutdown;
+    if(eea_runtime->engine->find(&eea_shutdown, "eea_shutdown") == NULL) {
+      eea_runtime->engine->call(eea_shutdown);
+    }
+
+    int64_t now = esp_timer_get_time();
+    timing->shutdown_us = now - start;
+    start = now;
+
+    free_engine(eea_runtime);
+
+    now = esp_timer_get_time();
+    timing->free_us = now - start;
+    start = now;
+
+    // The bundle and everything the engine allocated for it live in the arena.
+    // Resetting it releases anything the frees above missed, so every
+    // deploy starts from an empty arena.
+    eea_runtime->wasm_arena->report("Bundle destroyed");
+    timing->arena_high_water = eea_runtime->wasm_arena->high_water();
+    timing->arena_residual = eea_runtime->wasm_arena->in_use();
+    eea_runtime->wasm_arena->reset();
+    eea_runtime->bundle = NULL;
+
+    timing->reset_us = esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "Bundle destroyed: shutdown %lld us, free %lld us, reset %lld us.",
+      timing->shutdown_us, timing->free_us, timing->reset_us);
+  }
+}
+
+/**
+ * Reports trap recovery to the device's state.
+ * https://docs.losant.com/mqtt/overview/#publishing-device-state
+ */
+void send_trap_report(EEA_Runtime *eea_runtime, int64_t recovery_us, uint32_t backoff_ms)
+{
+  EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  msg->topic_length = sprintf(msg->topic, "losant/%s/state", LOSANT_DEVICE_ID);
+  msg->payload_length = sprintf(msg->payload,
+  "{"
+    "\"data\": {"
+      "\"eeaTraps\": %u,"
+      "\"eeaConsecutiveTraps\": %u,"
+      "\"eeaRecoveryMs\": %lld,"
+      "\"eeaBackoffMs\": %u"
+    "}"
+  "}", eea_runtime->trap_count, eea_runtime->consecutive_traps, recovery_us / 1000, backoff_ms);
+  msg->qos = 0;
+  msg->received_at = 0;
+  msg->queued_at = 0;
+
+  ESP_LOGI(TAG, "Payload: %s", msg->payload);
+
+  xQueueSend(eea_runtime->xQueueMQTT, msg, 0);
+  eea_free(msg);
+}
 
-    IM3Function eea_shutdown;
-    m3_FindFunction (&eea_shutdown, eea_runtime->wasm_runtime, "eea_shutdown");
-    m3_CallV(eea_shutdown);
+/**
+ * Replaces the running bundle with the bundle in the staging slot.
+ *
+ * restore_snapshot: whether the bundle continues from its state snapshot.
+ *   Only a bundle loaded at startup or deployed restores its snapshot.
+ *
+ * Returns:
+ *  0 if the bundle was loaded.
+ *  1 if the bundle could not be loaded. No bundle is running.
+ */
+int start_bundle(EEA_Runtime *eea_runtime, bool restore_snapshot)
+{
+  // Destroy the previous wasm, if needed.
+  destroy_wasm(eea_runtime);
+
+  // Load up the new wasm. The bundle bytes are copied into the arena
+  // so they are released with the rest of the bundle.
+  eea_runtime->bundle = (EEA_Bundle_Slot*)eea_runtime->wasm_arena->malloc(
+    offsetof(EEA_Bundle_Slot, bundle) + eea_runtime->staging->bundle_size);
+  if(eea_runtime->bundle == NULL) {
+    ESP_LOGI(TAG, "Failed to allocate WASM bundle from the arena.");
+    return 1;
+  }
 
-    m3_FreeEnvironment(eea_runtime->wasm_env);
-    m3_FreeRuntime(eea_runtime->wasm_runtime);
+  memcpy(eea_runtime->bundle->bundle, eea_runtime->staging->bundle, eea_runtime->staging->bundle_size);
+  eea_runtime->bundle->bundle_size = eea_runtime->staging->bundle_size;
 
-    delete eea_runtime->eea_api;
-    delete eea_runtime->eea_registered_functions;
+  if(prepare_wasm(eea_runtime) != 0) {
+    eea_runtime->wasm_arena->reset();
+    eea_runtime->bundle = NULL;
+    return 1;
+  }
 
-    free(eea_runtime->bundle);
+  int64_t start = esp_timer_get_time();
+  if(load_wasm(eea_runtime, eea_runtime->wasm_bytes, eea_runtime->wasm_size, restore_snapshot) != 0) {
+    free_engine(eea_runtime);
+    eea_runtime->wasm_arena->reset();
     eea_runtime->bundle = NULL;
+    return 1;
+  }
+  EEA_Lifecycle_Timing *timing = &(eea_runtime->lifecycle);
+  ESP_LOGI(TAG, "Bundle loaded in %lld us: create %lld, link %lld, setup %lld, parse %lld, instantiate %lld, "
+    "import %lld, find %lld, config %lld, eea_init %lld, hello %lld.",
+    esp_timer_get_time() - start, timing->create_us, timing->link_us, timing->load.setup_us,
+    timing->load.parse_us, timing->load.instantiate_us, timing->load.link_us, timing->find_us,
+    timing->config_us, timing->init_us, timing->hello_us);
+
+  eea_runtime->loaded_at = esp_timer_get_time();
+  eea_runtime->stable = false;
+  return 0;
+}
+
+/**
+ * Reinstantiates the running bundle from its bytes. They are copied out of
+ * the arena into the staging slot before the arena is reset. The bundle
+ * starts from eea_init, without its state snapshot.
+ *
+ * Returns:
+ *  0 if the bundle was loaded.
+ *  1 if the bundle could not be loaded. No bundle is running.
+ */
+int restart_bundle(EEA_Runtime *eea_runtime)
+{
+  memcpy(eea_runtime->staging->bundle, eea_runtime->bundle->bundle, eea_runtime->bundle->bundle_size);
+  eea_runtime->staging->bundle_size = eea_runtime->bundle->bundle_size;
+
+  if(start_bundle(eea_runtime, false) != 0) {
+    send_hello_message("nullVersion", eea_runtime->xQueueMQTT, true);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Called when the running bundle traps. The module is reinstantiated from
+ * the resident bundle bytes after an exponential backoff. After
+ * EEA_TRAP_FALLBACK_THRESHOLD consecutive traps, the last bundle that ran
+ * for EEA_BUNDLE_STABLE_MS is loaded from NVS instead.
+ */
+void handle_trap(EEA_Runtime *eea_runtime, EEA_Engine_Result result)
+{
+  ESP_LOGI(TAG, "Bundle %s trapped: %s", eea_runtime->bundle_id, result);
+  eea_runtime->engine->print_backtrace();
+
+  eea_runtime->trap_count++;
+  eea_runtime->consecutive_traps++;
+  eea_runtime->trapped_at = esp_timer_get_time();
+
+  // The state captured before the trap may be what caused it.
+  if(eea_runtime->snapshot != NULL) {
+    eea_runtime->snapshot->invalidate();
+  }
+
+  if(eea_runtime->consecutive_traps >= EEA_TRAP_FALLBACK_THRESHOLD &&
+      eea_runtime->known_good_id[0] != '\0' &&
+      strcmp(eea_runtime->known_good_id, eea_runtime->bundle_id) != 0) {
+    ESP_LOGI(TAG, "%u consecutive traps. Falling back to bundle %s.",
+      eea_runtime->consecutive_traps, eea_runtime->known_good_id);
+
+    // The fallback bundle arrives through xQueueFlows. If the save task is
+    // still busy with a previous command, the bundle is restarted as usual
+    // and the fallback is attempted again on its next trap.
+    uint8_t command = EEA_NVS_COMMAND_LOAD;
+    if(xQueueSend(eea_runtime->xQueueNVS, &command, 0) == pdPASS) {
+      destroy_wasm(eea_runtime);
+      eea_runtime->consecutive_traps = 0;
+      return;
+    }
+    ESP_LOGI(TAG, "Failed to request bundle %s from NVS. Retrying after the next trap.", eea_runtime->known_good_id);
+  }
+
+  uint32_t shift = eea_runtime->consecutive_traps - 1;
+  uint32_t backoff_ms = shift < 16 ? EEA_TRAP_BACKOFF_MS << shift : EEA_TRAP_BACKOFF_MAX_MS;
+  if(backoff_ms > EEA_TRAP_BACKOFF_MAX_MS) {
+    backoff_ms = EEA_TRAP_BACKOFF_MAX_MS;
+  }
+
+  ESP_LOGI(TAG, "Restarting bundle in %u ms (trap %u, %u consecutive).",
+    backoff_ms, eea_runtime->trap_count, eea_runtime->consecutive_traps);
+
+  eea_runtime->backoff_ms = backoff_ms;
+  eea_runtime->restart_at = eea_runtime->trapped_at + (backoff_ms * 1000LL);
+}
+
+/**
+ * Whether the bundle can be called into.
+ */
+static bool bundle_running(EEA_Runtime *eea_runtime)
+{
+  return eea_runtime->bundle != NULL && eea_runtime->restart_at == 0;
+}
+
+/**
+ * Lets the profiler map functions wasm3 compiled during the last call into
+ * the bundle. Only wasm3 bundles are profiled.
+ */
+static void update_profiler(EEA_Runtime *eea_runtime)
+{
+  EEA_Engine_Wasm3 *wasm3 = wasm3_engine(eea_runtime);
+  if(wasm3 != NULL) {
+    eea_runtime->profiler->update(wasm3->runtime, wasm3->module);
+  }
+}
+
+/**
+ * Starts the profiler from a toAgent/profile message.
+ * Payload: {"durationMs": 10000}
+ */
+void start_profile(EEA_Runtime *eea_runtime, EEA_Queue_Msg *msg)
+{
+  if(!bundle_running(eea_runtime)) {
+    ESP_LOGI(TAG, "No bundle to profile.");
+    return;
+  }
+
+  if(wasm3_engine(eea_runtime) == NULL) {
+    ESP_LOGI(TAG, "Profiling requires the wasm3 engine.");
+    return;
   }
+
+  uint32_t duration_ms = EEA_PROFILE_DEFAULT_DURATION_MS;
+
+  cJSON *root = cJSON_ParseWithLength(msg->payload, msg->payload_length);
+  if(root != NULL) {
+    cJSON *duration = cJSON_GetObjectItemCaseSensitive(root, "durationMs");
+    if(cJSON_IsNumber(duration) && duration->valueint > 0) {
+      duration_ms = duration->valueint;
+    }
+    cJSON_Delete(root);
+  }
+
+  eea_runtime->profiler->start(duration_ms);
 }
 
 /**
  * Main EEA Runtime task function.
  * pvParameters = *EEA_Runtime
- */ 
+ */
 void eea_runtime_task(void *pvParameters)
 {
   EEA_Runtime *eea_runtime = (EEA_Runtime*)pvParameters;
   
-  M3Result result = m3Err_none;
+  EEA_Engine_Result result = NULL;
+
+  bool first_loop = true;
+  int64_t last_loop_at = 0;
+  int64_t last_loop_period = 0;
+  int64_t last_snapshot = esp_timer_get_time();
+
+#if EEA_BENCHMARK_ENABLED
+  // The benchmark announces each bundle it loads, which fills the MQTT
+  // queue. Those messages are dropped. The bundle that actually runs next
+  // is announced when it loads, or as none here.
+  eea_benchmark_lifecycle(eea_runtime);
+  xQueueReset(eea_runtime->xQueueMQTT);
+  if(uxQueueMessagesWaiting(eea_runtime->xQueueFlows) == 0) {
+    send_hello_message("nullVersion", eea_runtime->xQueueMQTT, true);
+  }
+#endif
 
-  const TickType_t xDelay = 50 / portTICK_PERIOD_MS;
   while(true) {
 
-    if(eea_runtime->bundle != NULL) {
-      result = m3_CallV(eea_runtime->eea_loop, (uint64_t)(esp_timer_get_time() / 1000));
+    if(bundle_running(eea_runtime)) {
+      eea_runtime->budget->budget_ms = eea_setting(EEA_SETTING_EXECUTION_BUDGET_MS);
+      int64_t loop_at = esp_timer_get_time();
+      uint64_t now_ms = loop_at / 1000;
+      result = eea_runtime->budget->call(eea_runtime->engine, eea_runtime->eea_loop, 1, &now_ms);
+
+      // Jitter is the change in the period between eea_loop calls.
+      if(last_loop_at != 0) {
+        int64_t period = loop_at - last_loop_at;
+        if(last_loop_period != 0) {
+          eea_latency_record(EEA_LATENCY_LOOP_JITTER, period > last_loop_period ?
+            period - last_loop_period : last_loop_period - period);
+        }
+        last_loop_period = period;
+      }
+      last_loop_at = loop_at;
+
+      if(first_loop) {
+        first_loop = false;
+        ESP_LOGI(TAG, "[BOOT] First eea_loop %lld ms after boot.", esp_timer_get_time() / 1000);
+      }
+
+      if(result != NULL) {
+        handle_trap(eea_runtime, result);
+      }
+
+      // Between eea_loop calls no wasm code is running, so memory
+      // and globals are consistent.
+      EEA_Engine_Wasm3 *wasm3 = wasm3_engine(eea_runtime);
+      if(result == NULL && eea_runtime->snapshot != NULL && wasm3 != NULL &&
+          esp_timer_get_time() - last_snapshot >= EEA_SNAPSHOT_INTERVAL_MS * 1000LL) {
+        last_snapshot = esp_timer_get_time();
+        eea_runtime->snapshot->capture(wasm3->runtime, wasm3->module, eea_runtime->bundle_id);
+      }
+
+      if(result == NULL) {
+        update_profiler(eea_runtime);
+      }
+
+      // A bundle that has run this long without trapping becomes the
+      // fallback bundle, and is persisted if it isn't already.
+      // Compressed bundles are saved compressed.
+      if(result == NULL && !eea_runtime->stable &&
+          esp_timer_get_time() - eea_runtime->loaded_at >= EEA_BUNDLE_STABLE_MS * 1000LL) {
+        eea_runtime->stable = true;
+        eea_runtime->consecutive_traps = 0;
+        if(strcmp(eea_runtime->known_good_id, eea_runtime->bundle_id) != 0) {
+          uint8_t command = EEA_NVS_COMMAND_SAVE;
+          xQueueSend(eea_runtime->xQueueNVS, &command, 0);
+        }
+      }
     }
 
-    if(result != m3Err_none) {
-      ESP_LOGI(TAG, "%s", result);
-      break;
+    // Reinstantiate a trapped bundle once its backoff has elapsed. The
+    // bundle's bytes are copied out of the arena before it is reset.
+    if(eea_runtime->restart_at != 0 && esp_timer_get_time() >= eea_runtime->restart_at) {
+      eea_runtime->restart_at = 0;
+
+      int64_t start = esp_timer_get_time();
+      if(restart_bundle(eea_runtime) == 0) {
+        send_trap_report(eea_runtime, esp_timer_get_time() - start, eea_runtime->backoff_ms);
+      }
+      eea_runtime->trapped_at = 0;
     }
 
-    // Check to see if there is a new WASM bundle to load.
-    if(uxQueueMessagesWaiting(eea_runtime->xQueueFlows) > 0) {
-      // Destroy the previous wasm, if needed.
-      destroy_wasm(eea_runtime);
+    // The trace level applies to the running bundle without a reload.
+    if(bundle_running(eea_runtime) && eea_runtime->trace_level != eea_setting(EEA_SETTING_TRACE_LEVEL)) {
+      eea_runtime->trace_level = eea_setting(EEA_SETTING_TRACE_LEVEL);
+      ESP_LOGI(TAG, "Trace level set to %d.", eea_runtime->trace_level);
+      call_config(eea_runtime, "eea_config_set_trace_level", eea_runtime->trace_level);
+    }
+    eea_runtime->trace->update(eea_runtime->connected);
+    eea_runtime->ledc->update();
 
-      // Load up the new wasm.
-      eea_runtime->bundle = (EEA_Queue_Msg_Flow*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-      if(xQueueReceive(eea_runtime->xQueueFlows, eea_runtime->bundle, 0) == pdPASS) {
-        ESP_LOGI(TAG, "Processing new WASM bundle.");
-        load_wasm(eea_runtime, eea_runtime->bundle->bundle, eea_runtime->bundle->bundle_size);
+    // Settings that are read when a bundle loads have changed.
+    if(bundle_running(eea_runtime) && eea_settings_take_reload()) {
+      ESP_LOGI(TAG, "Reloading bundle to apply settings.");
+      restart_bundle(eea_runtime);
+    }
 
-        // Queue the bundle for saving.
-        xQueueSend(eea_runtime->xQueueNVS, eea_runtime->bundle_id, 0);
+    // Check to see if there is a new WASM bundle to load.
+    // Bundles are received into the staging slot, so the running bundle
+    // is still intact when a delta against it is applied.
+    if(uxQueueMessagesWaiting(eea_runtime->xQueueFlows) > 0 &&
+        xQueueReceive(eea_runtime->xQueueFlows, &(eea_runtime->staging->flow), 0) == pdPASS) {
+      ESP_LOGI(TAG, "Processing new WASM bundle.");
+      eea_runtime->staging->bundle_size = eea_runtime->staging->flow.bundle_size;
+
+      bool is_delta = eea_bundle_format((uint8_t*)eea_runtime->staging->bundle,
+        eea_runtime->staging->bundle_size) == EEA_BUNDLE_FORMAT_DELTA;
+
+      if(!is_delta || apply_delta(eea_runtime) == 0) {
+        // A new bundle replaces a trapped one, and is not subject to its backoff.
+        eea_runtime->restart_at = 0;
+
+        if(start_bundle(eea_runtime, true) != 0) {
+          send_hello_message("nullVersion", eea_runtime->xQueueMQTT, true);
+        } else if(eea_runtime->trapped_at != 0) {
+          // This was the fallback bundle.
+          send_trap_report(eea_runtime, esp_timer_get_time() - eea_runtime->trapped_at, 0);
+          eea_runtime->trapped_at = 0;
+        }
       }
     }
 
-    // Check for messages to send to the EEA.
-    if(uxQueueMessagesWaiting(eea_runtime->xQueueEEA) > 0) {
-      EEA_Queue_Msg *msg = (EEA_Queue_Msg*)malloc(sizeof(EEA_Queue_Msg));
-      if(xQueueReceive(eea_runtime->xQueueEEA, msg, 0) == pdPASS) {
+    // Check for messages to send to the EEA. The latest value of each
+    // state topic is delivered ahead of queued messages.
+    if(eea_runtime->conflator->pending() || uxQueueMessagesWaiting(eea_runtime->xQueueEEA) > 0) {
+      EEA_Queue_Msg *msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+      if(eea_runtime->conflator->take(msg) || xQueueReceive(eea_runtime->xQueueEEA, msg, 0) == pdPASS) {
         
         ESP_LOGI(TAG, "Processing message from EEA queue.");
 
+        int64_t dequeued_at = esp_timer_get_time();
+        if(msg->received_at != 0) {
+          eea_latency_record(EEA_LATENCY_QUEUE, dequeued_at - msg->received_at);
+        }
+
         // Check for #connect or #disconnect messages.
         // These should not be forwarded to the EEA. They are intercepted and used
         // to invoke eea_set_connection_status.
+        EEA_Engine_Result call_result = NULL;
+        uint64_t args[2];
         if(strnstr(msg->topic, "#connect", msg->topic_length) != NULL) {
           eea_runtime->connected = true;
-          if(eea_runtime->bundle != NULL) {
-            m3_CallV(eea_runtime->eea_set_connection_status, true);
+          if(bundle_running(eea_runtime)) {
+            args[0] = 1;
+            call_result = eea_runtime->budget->call(eea_runtime->engine, eea_runtime->eea_set_connection_status, 1, args);
           }
         } else if(strnstr(msg->topic, "#disconnect", msg->topic_length) != NULL) {
           eea_runtime->connected = false;
-          if(eea_runtime->bundle != NULL) {
-            m3_CallV(eea_runtime->eea_set_connection_status, false);
+          if(bundle_running(eea_runtime)) {
+            args[0] = 0;
+            call_result = eea_runtime->budget->call(eea_runtime->engine, eea_runtime->eea_set_connection_status, 1, args);
           }
+        } else if(strnstr(msg->topic, "toAgent/profile", msg->topic_length) != NULL) {
+          start_profile(eea_runtime, msg);
         } else {
-          if(eea_runtime->bundle != NULL) {
+          if(bundle_running(eea_runtime)) {
             memcpy(eea_runtime->message_buffer_topic, msg->topic, msg->topic_length);
             memcpy(eea_runtime->message_buffer_payload, msg->payload, msg->payload_length);
-            m3_CallV(eea_runtime->eea_message_received, msg->topic_length, msg->payload_length);
+            args[0] = msg->topic_length;
+            args[1] = msg->payload_length;
+
+            // Messages the handler sends are correlated with this message.
+            int64_t entered_at = esp_timer_get_time();
+            eea_runtime->handling_received_at = msg->received_at;
+            call_result = eea_runtime->budget->call(eea_runtime->engine, eea_runtime->eea_message_received, 2, args);
+            eea_runtime->handling_received_at = 0;
+
+            eea_latency_record(EEA_LATENCY_DISPATCH, entered_at - dequeued_at);
+            eea_latency_record(EEA_LATENCY_HANDLER, esp_timer_get_time() - entered_at);
           }
         }
+
+        // A handler that traps or runs over budget leaves the module in
+        // an unknown state, so it is restarted like a trapped eea_loop.
+        if(call_result != NULL) {
+          handle_trap(eea_runtime, call_result);
+        } else if(bundle_running(eea_runtime)) {
+          update_profiler(eea_runtime);
+        }
       }
-      free(msg);
+      eea_free(msg);
     }
 
-    vTaskDelay(xDelay);
-  }
-
-  // This code gets hit if an eea_loop iteration fails.
-  // Most commonly caused by an exception in the WASM.
-  // To help with debugging, this code prints a stacktrace
-  // and then restarts the board.
-  IM3BacktraceInfo info = m3_GetBacktrace(eea_runtime->wasm_runtime);
-
-  if (info) {
-    ESP_LOGI(TAG, "==== wasm backtrace:");
-
-    int frameCount = 0;
-    IM3BacktraceFrame curr = info->frames;
-    while (curr)
-    {
-      ESP_LOGI(TAG, "\n  %d: 0x%06x - %s!%s",
-        frameCount, curr->moduleOffset,
-        m3_GetModuleName (m3_GetFunctionModule(curr->function)),
-        m3_GetFunctionName (curr->function));
-      curr = curr->next;
-      frameCount++;
-    }
+    vTaskDelay(eea_setting(EEA_SETTING_RUNTIME_LOOP_MS) / portTICK_PERIOD_MS);
   }
-
-  esp_restart();
 }
 
 /**
- * Task that saves wasm bundles to NVS.
+ * Task that saves wasm bundles to NVS, and loads the persisted
+ * bundle when the running bundle keeps trapping.
  * Due to limitation in ESP, NVS operations can't be done on tasks in SPIRAM.
- * This task is in main memory and receives messages via queue.
+ * This task is in main memory and receives commands via queue.
  * 
  * pvParameters = *EEA_Runtime
  */
@@ -422,13 +997,17 @@ void eea_save_bundle_task(void *pvParameters)
   const TickType_t xDelay = 100 / portTICK_PERIOD_MS;
 
   while(true) {
-    // Check to see if there is a new WASM bundle to load.
+    // Check to see if there is a command to process.
     if(uxQueueMessagesWaiting(eea_runtime->xQueueNVS) > 0) {
 
-      // The queue message is the bundle ID.
-      char bundle_id[128];
-      if(xQueueReceive(eea_runtime->xQueueNVS, bundle_id, 0) == pdPASS) {
-        save_to_nvs(eea_runtime);
+      uint8_t command;
+      if(xQueueReceive(eea_runtime->xQueueNVS, &command, 0) == pdPASS) {
+        if(command == EEA_NVS_COMMAND_SAVE) {
+          save_to_nvs(eea_runtime);
+        } else if(command == EEA_NVS_COMMAND_LOAD && load_from_nvs(eea_runtime) == 1) {
+          // No bundle is running. Ask the broker for one.
+          send_hello_message("nullVersion", eea_runtime->xQueueMQTT, true);
+        }
       }
     }
 
@@ -436,40 +1015,68 @@ void eea_save_bundle_task(void *pvParameters)
   }
 }
 
-EEA_Runtime::EEA_Runtime(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows)
+EEA_Runtime::EEA_Runtime(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows, EEA_Conflator *conflator)
 {
   this->xQueueMQTT = xQueueMQTT;
   this->xQueueEEA= xQueueEEA;
   this->xQueueFlows = xQueueFlows;
+  this->conflator = conflator;
 
   // Create a queue for persisting wasm bundles. Due to limitation in ESP, flash (nvs) operations
   // cannot be performed from tasks in SPIRAM. We need a task in main memory, which the
   // runtime task (eea_runtime_task) can communicate with via this queue.
-  // This queue holds bundle ID strings.
-  this->xQueueNVS = xQueueCreate(1, 128);
+  // This queue holds EEA_NVS_COMMAND_* values.
+  this->xQueueNVS = xQueueCreate(1, sizeof(uint8_t));
+
+  // Incoming bundles are received here before they replace the running bundle.
+  this->staging = (EEA_Bundle_Slot*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Bundle_Slot), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 
   // Create the wasm bundle persisting task.
   xTaskCreate(eea_save_bundle_task, "eea_runtime_save_bundle_task",
-    EEA_RUNTIME_SAVE_BUNDLE_TASK_SIZE, this, EEA_RUNTIME_SAVE_BUNDLE_TASK_SIZE, &(this->xSaveBundleTaskHandle));
+    EEA_RUNTIME_SAVE_BUNDLE_TASK_SIZE, this, EEA_RUNTIME_SAVE_BUNDLE_TASK_PRIORITY, &(this->xSaveBundleTaskHandle));
 
   // WASM bundles can be pretty big. Allocating a bunch of memory (~512kb)
   // from SPIRAM for the runtime task.
-  this->xStack = (StackType_t*)heap_caps_malloc(WASM_TASK_STACK * sizeof(StackType_t),
+  this->xStack = (StackType_t*)eea_malloc(EEA_MEM_RUNTIME, WASM_TASK_STACK * sizeof(StackType_t),
     MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 
+  this->engine = NULL;
   this->eea_api = NULL;
   this->eea_registered_functions = NULL;
 
-  xTaskCreateStatic(eea_runtime_task, "eea_runtime_task", 
+  this->budget = new EEA_Budget(eea_setting(EEA_SETTING_EXECUTION_BUDGET_MS));
+  this->trace = new EEA_Trace(this->xQueueMQTT);
+  this->ledc = new EEA_Ledc(this->xQueueEEA);
+  this->uart = new EEA_Uart();
+  this->bus = new EEA_Bus();
+  this->loopback = new EEA_Loopback(this->xQueueEEA, this->conflator);
+
+#if EEA_SNAPSHOT_ENABLED
+  this->snapshot = new EEA_Snapshot();
+#endif
+
+  // Route all engine allocations to a dedicated PSRAM arena.
+  this->wasm_arena = new EEA_Wasm_Arena(wasm_arena_size());
+  eea_wasm_arena_activate(this->wasm_arena);
+
+  // The handle of a statically created task is its task buffer, so the
+  // profiler exists before the runtime task first runs.
+  this->profiler = new EEA_Profiler((TaskHandle_t)&(this->xTaskBuffer),
+    (uint8_t*)xStack, (uint8_t*)(xStack + WASM_TASK_STACK), EEA_RUNTIME_CORE, this->xQueueMQTT);
+
+  this->xTaskHandle = xTaskCreateStaticPinnedToCore(eea_runtime_task, "eea_runtime_task",
     WASM_TASK_STACK, this, EEA_RUNTIME_TASK_PRIORITY,
-    xStack, &(this->xTaskBuffer));
+    xStack, &(this->xTaskBuffer), EEA_RUNTIME_CORE);
+
+  eea_memory_register_task(this->xSaveBundleTaskHandle, EEA_RUNTIME_SAVE_BUNDLE_TASK_SIZE);
+  eea_memory_register_task(this->xTaskHandle, WASM_TASK_STACK * sizeof(StackType_t));
 
   // Attempt to load a wasm bundle from NVS.
   // If no bundle was found, report "nullVersion" in the Hello Message.
   // If a bundle was found, the function queues bundle in xQueueFlows.
   // Since this function (EEA_Runtime) is called from the main task, 
   // flash (nvs) operations can be done here.
-  if(load_from_nvs(this) != 0) {
-    send_hello_message("nullVersion", this->xQueueMQTT);
+  if(load_from_nvs(this) == 1) {
+    send_hello_message("nullVersion", this->xQueueMQTT, true);
   }
 }
\ No newline at end of file
@@ -8,42 +8,146 @@
 #include "eea_api.h"
 #include "eea_registered_functions.h"
 #include "eea_queue_msg.h"
+#include "eea_wasm_arena.h"
+#include "eea_snapshot.h"
+#include "eea_budget.h"
+#include "eea_profiler.h"
+#include "eea_engine.h"
+#include "eea_conflate.h"
+#include "eea_trace.h"
+#include "eea_ledc.h"
+#include "eea_uart.h"
+#include "eea_bus.h"
+#include "eea_loopback.h"
 
-#include <wasm3.h>
-#include <m3_env.h>
+// Bundle identifiers are at most this long, including the terminator.
+#define EEA_BUNDLE_ID_SIZE 128
+
+/**
+ * A bundle as received from xQueueFlows, or the module rebuilt from a
+ * delta bundle, which can be larger than any bundle that is sent
+ * (EEA_MAX_WASM_MODULE_SIZE). The running bundle's copy in the arena is
+ * only allocated up to the end of its bytes.
+ */
+struct EEA_Bundle_Slot {
+  uint32_t bundle_size;
+  union {
+    // Bundles are received into the slot with xQueueReceive. The bytes
+    // start at the same address as bundle.
+    EEA_Queue_Msg_Flow flow;
+    char bundle[EEA_MAX_WASM_MODULE_SIZE];
+  };
+};
+
+/**
+ * Time spent in each phase of the last bundle load (load_wasm) and
+ * teardown (destroy_wasm), in microseconds.
+ */
+struct EEA_Lifecycle_Timing {
+  int64_t create_us;    // eea_engine_create.
+  int64_t link_us;      // EEA_API and EEA_Registered_Functions tables.
+  EEA_Engine_Load_Timing load;
+  int64_t find_us;      // The four required exports. wasm3 compiles them here.
+  int64_t config_us;    // The eea_config_* exports and eea_set_connection_status.
+  int64_t init_us;      // eea_init, and the functions wasm3 compiles for it.
+  int64_t hello_us;     // Bundle ID, snapshot restore and hello message.
+
+  int64_t shutdown_us;  // eea_shutdown.
+  int64_t free_us;      // The engine and host function state.
+  int64_t reset_us;     // The arena reset.
+
+  // Arena bytes used at once while the bundle was loaded, and left in use
+  // after the engine was deleted (released by the reset).
+  uint32_t arena_high_water;
+  uint32_t arena_residual;
+};
 
 class EEA_Runtime {
   public:
-    EEA_Runtime(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows);
+    EEA_Runtime(QueueHandle_t xQueueMQTT, QueueHandle_t xQueueEEA, QueueHandle_t xQueueFlows, EEA_Conflator *conflator);
     QueueHandle_t xQueueEEA;
     QueueHandle_t xQueueMQTT;
     QueueHandle_t xQueueFlows;
     QueueHandle_t xQueueNVS;
+    EEA_Conflator *conflator;
     EEA_API *eea_api;
     EEA_Registered_Functions *eea_registered_functions;
+    EEA_Wasm_Arena *wasm_arena;
+    EEA_Snapshot *snapshot = NULL;
+    EEA_Budget *budget;
+    EEA_Profiler *profiler;
+    EEA_Trace *trace;
+    EEA_Ledc *ledc;
+    EEA_Uart *uart;
+    EEA_Bus *bus;
+    EEA_Loopback *loopback;
+
+    // The trace level last passed to the bundle's eea_config_set_trace_level.
+    int32_t trace_level = -1;
+
+    // The engine running the bundle. NULL if no bundle is loaded.
+    EEA_Engine *engine;
+    EEA_Engine_Function eea_loop;
+    EEA_Engine_Function eea_message_received;
+    EEA_Engine_Function eea_set_connection_status;
 
-    IM3Function eea_loop;
-    IM3Function eea_message_received;
-    IM3Function eea_set_connection_status;
-    IM3Environment wasm_env;
-    IM3Runtime wasm_runtime;
-    IM3Module wasm_module;
+    EEA_Bundle_Slot *bundle = NULL;
 
-    EEA_Queue_Msg_Flow *bundle = NULL;
+    // Receives new bundles from xQueueFlows. Delta bundles are
+    // rebuilt here before they are loaded.
+    EEA_Bundle_Slot *staging = NULL;
+
+    // The WASM module in bundle. Points into bundle for uncompressed
+    // bundles, or at the decompressed copy in the arena.
+    uint8_t *wasm_bytes = NULL;
+    uint32_t wasm_size = 0;
 
     char *message_buffer_topic;
     uint16_t message_buffer_topic_length;
     char *message_buffer_payload;
     uint32_t message_buffer_payload_length;
 
-    char *bundle_id;
+    char bundle_id[EEA_BUNDLE_ID_SIZE];
     bool connected = false;
 
+    // While eea_message_received runs, the received_at stamp of the
+    // message it is handling (see eea_latency.h). 0 otherwise.
+    int64_t handling_received_at = 0;
+
+    // The bundle persisted in NVS, which is loaded after repeated traps.
+    char known_good_id[EEA_BUNDLE_ID_SIZE] = "";
+
+    // Trap recovery. A bundle is stable once it has run for
+    // EEA_BUNDLE_STABLE_MS without trapping.
+    uint32_t trap_count = 0;
+    uint32_t consecutive_traps = 0;
+    uint32_t backoff_ms = 0;
+    int64_t trapped_at = 0;
+    int64_t restart_at = 0;
+    int64_t loaded_at = 0;
+    bool stable = false;
+
+    // Phase timing of the last bundle load and teardown.
+    EEA_Lifecycle_Timing lifecycle;
+
   private:
     StaticTask_t xTaskBuffer;
     StaticQueue_t xStaticQueueNVS;
     StackType_t *xStack;
+    TaskHandle_t xTaskHandle;
     TaskHandle_t xSaveBundleTaskHandle;
 };
 
+/**
+ * Loads the bundle in the runtime's staging slot, replacing the running
+ * bundle. If restore_snapshot is set, the bundle continues from its state
+ * snapshot. Returns 0 on success.
+ */
+int start_bundle(EEA_Runtime *eea_runtime, bool restore_snapshot);
+
+/**
+ * Stops and frees the running bundle, if any.
+ */
+void destroy_wasm(EEA_Runtime *eea_runtime);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,162 @@
+/**
+ * Runtime-tunable agent parameters. See eea_settings.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "cJSON.h"
+
+#include "eea_config.h"
+#include "eea_settings.h"
+
+// Settings live in the default NVS partition, since the "eea"
+// partition is erased each time a bundle is saved.
+#define EEA_SETTINGS_NAMESPACE "eea_settings"
+
+static const char *TAG = "EEA_SETTINGS";
+
+struct EEA_Setting_Definition
+{
+  const char *name;     // JSON name.
+  const char *nvs_key;  // At most 15 characters.
+  int32_t default_value;
+  int32_t min;
+  int32_t max;
+  EEA_Setting_Apply apply;
+};
+
+// In EEA_Setting_Id order.
+static const EEA_Setting_Definition definitions[EEA_SETTING_COUNT] = {
+  { "runtimeLoopMs",     "rt_loop_ms",   50,                      1,    1000,      EEA_SETTING_APPLY_LIVE },
+  { "mqttLoopMs",        "mqtt_loop_ms", 50,                      1,    1000,      EEA_SETTING_APPLY_LIVE },
+  { "executionBudgetMs", "budget_ms",    EEA_EXECUTION_BUDGET_MS, 0,    60000,     EEA_SETTING_APPLY_LIVE },
+  { "memoryReportMs",    "mem_report",   EEA_MEMORY_REPORT_INTERVAL_MS, 0, 86400000, EEA_SETTING_APPLY_LIVE },
+  { "traceLevel",        "trace_level",  1,                       0,    2,         EEA_SETTING_APPLY_LIVE },
+  { "storageSize",       "storage_size", 4096,                    0,    65536,     EEA_SETTING_APPLY_RELOAD },
+  { "storageInterval",   "storage_int",  0,                       0,    86400000,  EEA_SETTING_APPLY_RELOAD },
+  { "wasmStackSlots",    "wasm_stack",   256 * 1024,              16 * 1024, 512 * 1024, EEA_SETTING_APPLY_RESTART },
+  { "queueLength",       "queue_len",    EEA_QUEUE_LENGTH,        1,    EEA_QUEUE_LENGTH_MAX, EEA_SETTING_APPLY_RESTART },
+  { "mqttInBuffer",      "mqtt_in_buf",  256 * 1024,              4096, 256 * 1024, EEA_SETTING_APPLY_RESTART },
+  { "mqttOutBuffer",     "mqtt_out_buf", 32 * 1024,               1024, 64 * 1024, EEA_SETTING_APPLY_RESTART },
+};
+
+static volatile int32_t values[EEA_SETTING_COUNT];
+static volatile bool reload_pending = false;
+
+void eea_settings_init()
+{
+  for(int i = 0; i < EEA_SETTING_COUNT; i++) {
+    values[i] = definitions[i].default_value;
+  }
+
+  nvs_handle_t handle;
+  if(nvs_open(EEA_SETTINGS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    ESP_LOGI(TAG, "No persisted settings. Using defaults.");
+    return;
+  }
+
+  for(int i = 0; i < EEA_SETTING_COUNT; i++) {
+    int32_t value;
+    if(nvs_get_i32(handle, definitions[i].nvs_key, &value) != ESP_OK) {
+      continue;
+    }
+
+    if(value < definitions[i].min || value > definitions[i].max) {
+      ESP_LOGI(TAG, "Persisted %s of %d is out of range. Using %d.", definitions[i].name, value, definitions[i].default_value);
+      continue;
+    }
+
+    values[i] = value;
+    ESP_LOGI(TAG, "%s: %d", definitions[i].name, value);
+  }
+
+  nvs_close(handle);
+}
+
+int32_t eea_setting(EEA_Setting_Id id)
+{
+  return values[id];
+}
+
+EEA_Setting_Apply eea_settings_update(const char *json, size_t length)
+{
+  cJSON *root = cJSON_ParseWithLength(json, length);
+  if(root == NULL || !cJSON_IsObject(root)) {
+    ESP_LOGI(TAG, "Settings payload is not a JSON object.");
+    cJSON_Delete(root);
+    return EEA_SETTING_APPLY_NONE;
+  }
+
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open(EEA_SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+  if(err != ESP_OK) {
+    ESP_LOGI(TAG, "Failed to open NVS storage. Error: 0x%04x", err);
+    cJSON_Delete(root);
+    return EEA_SETTING_APPLY_NONE;
+  }
+
+  EEA_Setting_Apply apply = EEA_SETTING_APPLY_NONE;
+
+  cJSON *item;
+  cJSON_ArrayForEach(item, root) {
+    int id = 0;
+    while(id < EEA_SETTING_COUNT && strcmp(definitions[id].name, item->string) != 0) {
+      id++;
+    }
+
+    if(id == EEA_SETTING_COUNT || !cJSON_IsNumber(item)) {
+      ESP_LOGI(TAG, "Ignoring unknown setting %s.", item->string);
+      continue;
+    }
+
+    const EEA_Setting_Definition *definition = &definitions[id];
+    if(item->valuedouble < definition->min || item->valuedouble > definition->max) {
+      ESP_LOGI(TAG, "Ignoring %s: must be between %d and %d.", definition->name, definition->min, definition->max);
+      continue;
+    }
+
+    int32_t value = (int32_t)item->valuedouble;
+    if(value == values[id]) {
+      continue;
+    }
+
+    err = nvs_set_i32(handle, definition->nvs_key, value);
+    if(err != ESP_OK) {
+      ESP_LOGI(TAG, "Failed to save %s. Error: 0x%04x", definition->name, err);
+      continue;
+    }
+
+    ESP_LOGI(TAG, "%s: %d -> %d", definition->name, values[id], value);
+    values[id] = value;
+
+    if(definition->apply > apply) {
+      apply = definition->apply;
+    }
+  }
+
+  err = nvs_commit(handle);
+  if(err != ESP_OK) {
+    ESP_LOGI(TAG, "Failed to commit NVS. Error: 0x%04x", err);
+  }
+
+  nvs_close(handle);
+  cJSON_Delete(root);
+
+  if(apply == EEA_SETTING_APPLY_RELOAD) {
+    reload_pending = true;
+  }
+
+  return apply;
+}
+
+bool eea_settings_take_reload()
+{
+  if(!reload_pending) {
+    return false;
+  }
+  reload_pending = false;
+  return true;
+}
@@ -0,0 +1,67 @@
+#ifndef EEA_SETTINGS_H
+#define EEA_SETTINGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Agent parameters that can be changed without reflashing.
+ *
+ * Each setting has a compile-time default (eea_config.h and friends), a
+ * valid range, and is persisted in the default NVS partition when changed
+ * over the toAgent/config topic. The JSON payload is an object of setting
+ * names and integer values, e.g. {"runtimeLoopMs": 20, "traceLevel": 2}.
+ *
+ * Settings apply:
+ *   live     - read each time they are used.
+ *   reload   - when the bundle is next loaded. The running bundle is
+ *              reloaded when one changes.
+ *   restart  - at startup. The device restarts when one changes.
+ */
+enum EEA_Setting_Id {
+  EEA_SETTING_RUNTIME_LOOP_MS,
+  EEA_SETTING_MQTT_LOOP_MS,
+  EEA_SETTING_EXECUTION_BUDGET_MS,
+  EEA_SETTING_MEMORY_REPORT_MS,
+  EEA_SETTING_TRACE_LEVEL,
+  EEA_SETTING_STORAGE_SIZE,
+  EEA_SETTING_STORAGE_INTERVAL,
+  EEA_SETTING_WASM_STACK_SLOTS,
+  EEA_SETTING_QUEUE_LENGTH,
+  EEA_SETTING_MQTT_IN_BUFFER,
+  EEA_SETTING_MQTT_OUT_BUFFER,
+  EEA_SETTING_COUNT
+};
+
+enum EEA_Setting_Apply {
+  EEA_SETTING_APPLY_NONE,
+  EEA_SETTING_APPLY_LIVE,
+  EEA_SETTING_APPLY_RELOAD,
+  EEA_SETTING_APPLY_RESTART
+};
+
+/**
+ * Loads persisted settings. Call once after nvs_flash_init,
+ * before any other module reads a setting.
+ */
+void eea_settings_init();
+
+/**
+ * The current value of a setting.
+ */
+int32_t eea_setting(EEA_Setting_Id id);
+
+/**
+ * Validates and persists the settings in a toAgent/config payload.
+ * Settings that are unknown or out of range are ignored.
+ * Returns the strongest apply level of the settings that changed.
+ * Must be called from a task with an internal RAM stack.
+ */
+EEA_Setting_Apply eea_settings_update(const char *json, size_t length);
+
+/**
+ * Returns true once after a reload setting has changed.
+ */
+bool eea_settings_take_reload();
+
+#endif
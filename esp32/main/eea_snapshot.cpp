@@ -0,0 +1,502 @@
+/**
+ * Linear memory snapshots. See eea_snapshot.h.
+ */
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+
+#include "eea_snapshot.h"
+#include "eea_runtime.h"
+#include "eea_memory.h"
+
+#define EEA_SNAPSHOT_TASK_SIZE 4096
+#define EEA_SNAPSHOT_TASK_PRIORITY 3
+
+#define EEA_SNAPSHOT_MAGIC 0x53414545 // "EEAS"
+#define EEA_SNAPSHOT_VERSION 2
+
+#define EEA_SNAPSHOT_SLOTS_PER_SECTOR (EEA_SNAPSHOT_PAGE_SIZE / EEA_SNAPSHOT_HEADER_SLOT_SIZE)
+#define EEA_SNAPSHOT_HEADER_SLOTS (EEA_SNAPSHOT_HEADER_SECTORS * EEA_SNAPSHOT_SLOTS_PER_SECTOR)
+
+// Pool sectors are numbered in a byte.
+#define EEA_SNAPSHOT_MAX_POOL_SECTORS 256
+
+#define EEA_SNAPSHOT_COMMAND_WRITE 1
+#define EEA_SNAPSHOT_COMMAND_RESTORE 2
+#define EEA_SNAPSHOT_COMMAND_INVALIDATE 3
+
+static const char *TAG = "EEA_SNAPSHOT";
+
+struct EEA_Snapshot_Header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;      // The newest valid header is the snapshot.
+  uint32_t crc;           // Of the header, with crc set to 0.
+  char bundle_id[EEA_BUNDLE_ID_SIZE];
+  uint32_t memory_size;   // 0 once the snapshot is discarded.
+  uint32_t num_globals;
+  uint32_t next_sector;   // The pool sector the next page write starts from.
+  uint64_t globals[EEA_SNAPSHOT_MAX_GLOBALS];
+  uint32_t page_crcs[EEA_SNAPSHOT_MAX_PAGES];
+  uint8_t page_sectors[EEA_SNAPSHOT_MAX_PAGES];   // The pool sector holding each page.
+};
+
+static_assert(sizeof(EEA_Snapshot_Header) <= EEA_SNAPSHOT_HEADER_SLOT_SIZE, "Snapshot header must fit in a header slot.");
+static_assert(EEA_SNAPSHOT_PAGE_SIZE % EEA_SNAPSHOT_HEADER_SLOT_SIZE == 0, "Header slots must divide a sector.");
+
+/**
+ * The number of mutable globals in the module, which are saved with
+ * linear memory.
+ */
+static uint32_t count_mutable_globals(IM3Module module)
+{
+  uint32_t num_globals = 0;
+  for(uint32_t i = 0; i < module->numGlobals; i++) {
+    if(module->globals[i].isMutable) {
+      num_globals++;
+    }
+  }
+  return num_globals;
+}
+
+/**
+ * Task that performs the snapshot's flash operations.
+ * Due to limitation in ESP, flash operations can't be done on tasks in SPIRAM.
+ *
+ * pvParameters = *EEA_Snapshot
+ */
+void eea_snapshot_task(void *pvParameters)
+{
+  EEA_Snapshot *snapshot = (EEA_Snapshot*)pvParameters;
+
+  // Captures wait until the page map of the snapshot in flash is known.
+  snapshot->scan();
+  snapshot->busy = false;
+
+  uint8_t command;
+  while(true) {
+    if(xQueueReceive(snapshot->xQueueCommands, &command, portMAX_DELAY) != pdPASS) {
+      continue;
+    }
+
+    if(command == EEA_SNAPSHOT_COMMAND_WRITE) {
+      int64_t start = esp_timer_get_time();
+      if(!snapshot->write_to_flash()) {
+        // The flash contents are unknown, so the next capture writes every page.
+        snapshot->crcs_valid = false;
+      }
+      snapshot->last_write_us = esp_timer_get_time() - start;
+
+      ESP_LOGI(TAG, "Snapshot of %u pages written in %lld us.",
+        snapshot->last_dirty_pages, snapshot->last_write_us);
+
+      snapshot->busy = false;
+    } else if(command == EEA_SNAPSHOT_COMMAND_RESTORE) {
+      snapshot->restore_result = snapshot->read_from_flash();
+      xSemaphoreGive(snapshot->xRestoreDone);
+    } else if(command == EEA_SNAPSHOT_COMMAND_INVALIDATE) {
+      // A newer header without memory or a bundle replaces the snapshot.
+      // The next capture writes every page.
+      EEA_Snapshot_Header *header = snapshot->header;
+      header->bundle_id[0] = '\0';
+      header->memory_size = 0;
+      header->num_globals = 0;
+      if(snapshot->write_header()) {
+        snapshot->committed_pages = 0;
+        ESP_LOGI(TAG, "Snapshot discarded.");
+      } else {
+        ESP_LOGI(TAG, "Failed to discard snapshot.");
+      }
+      snapshot->crcs_valid = false;
+      snapshot->invalidating = false;
+    }
+  }
+}
+
+EEA_Snapshot::EEA_Snapshot()
+{
+  this->available = false;
+  this->last_dirty_pages = 0;
+  this->last_capture_us = 0;
+  this->last_write_us = 0;
+  this->captures_skipped = 0;
+  this->crcs_valid = false;
+  this->busy = false;
+  this->invalidating = false;
+  this->unsupported = false;
+  this->committed_pages = 0;
+  this->next_slot = 0;
+  this->restore_target = NULL;
+  this->restore_memory_size = 0;
+  this->restore_bundle_id = NULL;
+  this->restore_num_globals = 0;
+  this->restore_result = false;
+  memset(this->dirty, 0, sizeof(this->dirty));
+
+  this->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, EEA_SNAPSHOT_PARTITION);
+  if(this->partition == NULL) {
+    ESP_LOGI(TAG, "No %s partition. Snapshots are disabled.", EEA_SNAPSHOT_PARTITION);
+    return;
+  }
+
+  // Every page may change between writes, and the pages of the snapshot
+  // in flash can't be overwritten until a newer header is written, so the
+  // pool holds two copies of linear memory.
+  uint32_t sectors = this->partition->size / EEA_SNAPSHOT_PAGE_SIZE;
+  this->pool_sectors = sectors > EEA_SNAPSHOT_HEADER_SECTORS ? sectors - EEA_SNAPSHOT_HEADER_SECTORS : 0;
+  if(this->pool_sectors > EEA_SNAPSHOT_MAX_POOL_SECTORS) {
+    this->pool_sectors = EEA_SNAPSHOT_MAX_POOL_SECTORS;
+  }
+  this->max_pages = this->pool_sectors / 2;
+  if(this->max_pages > EEA_SNAPSHOT_MAX_PAGES) {
+    this->max_pages = EEA_SNAPSHOT_MAX_PAGES;
+  }
+  if(this->max_pages == 0) {
+    ESP_LOGI(TAG, "The %s partition is too small. Snapshots are disabled.", EEA_SNAPSHOT_PARTITION);
+    return;
+  }
+
+  this->header = (EEA_Snapshot_Header*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Snapshot_Header), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->scratch = (EEA_Snapshot_Header*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Snapshot_Header), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->pages = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, this->max_pages * EEA_SNAPSHOT_PAGE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(this->header == NULL || this->scratch == NULL || this->pages == NULL) {
+    ESP_LOGI(TAG, "Failed to allocate snapshot buffers.");
+    return;
+  }
+  memset(this->header, 0, sizeof(EEA_Snapshot_Header));
+
+  // Until the task has scanned the partition.
+  this->busy = true;
+
+  // A write and an invalidate can be pending at once.
+  this->xQueueCommands = xQueueCreate(2, sizeof(uint8_t));
+  this->xRestoreDone = xSemaphoreCreateBinary();
+
+  xTaskCreate(eea_snapshot_task, "eea_snapshot_task",
+    EEA_SNAPSHOT_TASK_SIZE, this, EEA_SNAPSHOT_TASK_PRIORITY, &(this->xTaskHandle));
+  eea_memory_register_task(this->xTaskHandle, EEA_SNAPSHOT_TASK_SIZE);
+
+  this->available = true;
+}
+
+void EEA_Snapshot::capture(IM3Runtime runtime, IM3Module module, const char *bundle_id)
+{
+  if(!this->available) {
+    return;
+  }
+
+  // The previous capture is still being written. The next interval picks
+  // up everything that changed in the meantime.
+  if(this->busy || this->invalidating) {
+    this->captures_skipped++;
+    return;
+  }
+
+  int64_t start = esp_timer_get_time();
+
+  uint32_t memory_size = 0;
+  uint8_t *memory = m3_GetMemory(runtime, &memory_size, 0);
+  uint32_t num_pages = memory_size / EEA_SNAPSHOT_PAGE_SIZE;
+  uint32_t num_globals = count_mutable_globals(module);
+
+  if(!this->supported(memory, memory_size, num_globals)) {
+    return;
+  }
+
+  uint32_t g = 0;
+  for(uint32_t i = 0; i < module->numGlobals; i++) {
+    if(module->globals[i].isMutable) {
+      this->header->globals[g++] = module->globals[i].i64Value;
+    }
+  }
+
+  bool same_layout = this->crcs_valid && this->header->memory_size == memory_size;
+
+  uint32_t dirty_pages = 0;
+  for(uint32_t i = 0; i < num_pages; i++) {
+    uint8_t *page = memory + (i * EEA_SNAPSHOT_PAGE_SIZE);
+    uint32_t crc = esp_rom_crc32_le(0, page, EEA_SNAPSHOT_PAGE_SIZE);
+
+    this->dirty[i] = !same_layout || crc != this->header->page_crcs[i];
+    if(this->dirty[i]) {
+      memcpy(this->pages + (i * EEA_SNAPSHOT_PAGE_SIZE), page, EEA_SNAPSHOT_PAGE_SIZE);
+      this->header->page_crcs[i] = crc;
+      dirty_pages++;
+    }
+  }
+
+  bool same_bundle = strncmp(this->header->bundle_id, bundle_id, EEA_BUNDLE_ID_SIZE) == 0;
+
+  this->header->magic = EEA_SNAPSHOT_MAGIC;
+  this->header->version = EEA_SNAPSHOT_VERSION;
+  strncpy(this->header->bundle_id, bundle_id, EEA_BUNDLE_ID_SIZE - 1);
+  this->header->bundle_id[EEA_BUNDLE_ID_SIZE - 1] = '\0';
+  this->header->memory_size = memory_size;
+  this->header->num_globals = num_globals;
+  this->crcs_valid = true;
+
+  this->last_capture_us = esp_timer_get_time() - start;
+  this->last_dirty_pages = dirty_pages;
+
+  // Globals change on nearly every loop. Only write when memory changed
+  // too, or the snapshot belongs to a different bundle.
+  if(dirty_pages == 0 && same_bundle) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Snapshot captured: %u of %u pages changed in %lld us.",
+    dirty_pages, num_pages, this->last_capture_us);
+
+  this->busy = true;
+  uint8_t command = EEA_SNAPSHOT_COMMAND_WRITE;
+  xQueueSend(this->xQueueCommands, &command, 0);
+}
+
+bool EEA_Snapshot::restore(IM3Runtime runtime, IM3Module module, const char *bundle_id)
+{
+  if(!this->available) {
+    return false;
+  }
+
+  int64_t start = esp_timer_get_time();
+
+  uint32_t num_globals = count_mutable_globals(module);
+  this->restore_target = m3_GetMemory(runtime, &(this->restore_memory_size), 0);
+  if(!this->supported(this->restore_target, this->restore_memory_size, num_globals)) {
+    return false;
+  }
+
+  this->restore_bundle_id = bundle_id;
+  this->restore_num_globals = num_globals;
+
+  // Flash can't be read from the runtime task, whose stack is in SPIRAM.
+  uint8_t command = EEA_SNAPSHOT_COMMAND_RESTORE;
+  xQueueSend(this->xQueueCommands, &command, portMAX_DELAY);
+  xSemaphoreTake(this->xRestoreDone, portMAX_DELAY);
+
+  if(!this->restore_result) {
+    return false;
+  }
+
+  memcpy(this->restore_target, this->pages, this->restore_memory_size);
+
+  uint32_t g = 0;
+  for(uint32_t i = 0; i < module->numGlobals; i++) {
+    if(module->globals[i].isMutable) {
+      module->globals[i].i64Value = this->header->globals[g++];
+    }
+  }
+
+  ESP_LOGI(TAG, "Snapshot restored: %u bytes of memory and %u globals in %lld us.",
+    this->restore_memory_size, num_globals, esp_timer_get_time() - start);
+
+  return true;
+}
+
+bool EEA_Snapshot::supported(uint8_t *memory, uint32_t memory_size, uint32_t num_globals)
+{
+  bool fits = memory != NULL && memory_size / EEA_SNAPSHOT_PAGE_SIZE <= this->max_pages &&
+    num_globals <= EEA_SNAPSHOT_MAX_GLOBALS;
+
+  // Logged once for each run of unsupported bundles.
+  if(!fits && !this->unsupported) {
+    ESP_LOGI(TAG, "Bundle has %u bytes of memory and %u mutable globals. Snapshots hold at most %u bytes "
+      "and %u globals, so this bundle is not snapshotted.",
+      memory_size, num_globals, this->max_pages * EEA_SNAPSHOT_PAGE_SIZE, EEA_SNAPSHOT_MAX_GLOBALS);
+  }
+  this->unsupported = !fits;
+  return fits;
+}
+
+void EEA_Snapshot::invalidate()
+{
+  if(!this->available) {
+    return;
+  }
+
+  // Queued behind a write in progress, so that write can't bring the
+  // snapshot back.
+  this->invalidating = true;
+  uint8_t command = EEA_SNAPSHOT_COMMAND_INVALIDATE;
+  xQueueSend(this->xQueueCommands, &command, portMAX_DELAY);
+}
+
+bool EEA_Snapshot::header_valid(EEA_Snapshot_Header *header)
+{
+  if(header->magic != EEA_SNAPSHOT_MAGIC || header->version != EEA_SNAPSHOT_VERSION ||
+      header->memory_size / EEA_SNAPSHOT_PAGE_SIZE > this->max_pages ||
+      header->num_globals > EEA_SNAPSHOT_MAX_GLOBALS || header->next_sector >= this->pool_sectors) {
+    return false;
+  }
+
+  // Detects a header whose write was interrupted.
+  uint32_t crc = header->crc;
+  header->crc = 0;
+  bool valid = esp_rom_crc32_le(0, (uint8_t*)header, sizeof(EEA_Snapshot_Header)) == crc;
+  header->crc = crc;
+  if(!valid) {
+    return false;
+  }
+
+  for(uint32_t i = 0; i < header->memory_size / EEA_SNAPSHOT_PAGE_SIZE; i++) {
+    if(header->page_sectors[i] >= this->pool_sectors) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool EEA_Snapshot::scan()
+{
+  bool found = false;
+  uint32_t latest = 0;
+
+  for(uint32_t slot = 0; slot < EEA_SNAPSHOT_HEADER_SLOTS; slot++) {
+    if(esp_partition_read(this->partition, slot * EEA_SNAPSHOT_HEADER_SLOT_SIZE,
+        this->scratch, sizeof(EEA_Snapshot_Header)) != ESP_OK || !this->header_valid(this->scratch)) {
+      continue;
+    }
+
+    // Sequence numbers are compared by difference, so they can wrap.
+    if(!found || (int32_t)(this->scratch->sequence - this->header->sequence) > 0) {
+      memcpy(this->header, this->scratch, sizeof(EEA_Snapshot_Header));
+      latest = slot;
+      found = true;
+    }
+  }
+
+  if(!found) {
+    memset(this->header, 0, sizeof(EEA_Snapshot_Header));
+    this->committed_pages = 0;
+    this->next_slot = 0;
+    this->crcs_valid = false;
+    return false;
+  }
+
+  // The header and page CRCs now describe the flash contents, so the next
+  // capture is incremental even if this snapshot is not restored.
+  this->header->bundle_id[EEA_BUNDLE_ID_SIZE - 1] = '\0';
+  this->committed_pages = this->header->memory_size / EEA_SNAPSHOT_PAGE_SIZE;
+  this->crcs_valid = true;
+
+  // A write after the newest header may have been interrupted, leaving
+  // the rest of its sector unerased. Writes resume in the next sector.
+  uint32_t sector = latest / EEA_SNAPSHOT_SLOTS_PER_SECTOR;
+  this->next_slot = ((sector + 1) % EEA_SNAPSHOT_HEADER_SECTORS) * EEA_SNAPSHOT_SLOTS_PER_SECTOR;
+  return true;
+}
+
+bool EEA_Snapshot::write_header()
+{
+  uint32_t slot = this->next_slot;
+  this->next_slot = (slot + 1) % EEA_SNAPSHOT_HEADER_SLOTS;
+
+  // Starting a sector erases the older headers in it. The newest header
+  // is in the previous sector.
+  if(slot % EEA_SNAPSHOT_SLOTS_PER_SECTOR == 0 &&
+      esp_partition_erase_range(this->partition, slot * EEA_SNAPSHOT_HEADER_SLOT_SIZE, EEA_SNAPSHOT_PAGE_SIZE) != ESP_OK) {
+    return false;
+  }
+
+  this->header->magic = EEA_SNAPSHOT_MAGIC;
+  this->header->version = EEA_SNAPSHOT_VERSION;
+  this->header->sequence++;
+  this->header->crc = 0;
+  this->header->crc = esp_rom_crc32_le(0, (uint8_t*)this->header, sizeof(EEA_Snapshot_Header));
+
+  if(esp_partition_write(this->partition, slot * EEA_SNAPSHOT_HEADER_SLOT_SIZE,
+      this->header, sizeof(EEA_Snapshot_Header)) != ESP_OK) {
+    ESP_LOGI(TAG, "Failed to write snapshot header.");
+    return false;
+  }
+  return true;
+}
+
+bool EEA_Snapshot::write_to_flash()
+{
+  // The snapshot in flash stays valid until the new header is written, so
+  // its sectors can't be reused for the changed pages.
+  uint8_t committed[EEA_SNAPSHOT_MAX_PAGES];
+  memcpy(committed, this->header->page_sectors, sizeof(committed));
+
+  bool in_use[EEA_SNAPSHOT_MAX_POOL_SECTORS];
+  memset(in_use, 0, sizeof(in_use));
+  for(uint32_t i = 0; i < this->committed_pages; i++) {
+    in_use[committed[i]] = true;
+  }
+
+  // Changed pages go to the free sectors in turn, so erases are spread
+  // over the pool rather than repeated on the sectors of busy pages.
+  uint32_t sector = this->header->next_sector;
+  uint32_t num_pages = this->header->memory_size / EEA_SNAPSHOT_PAGE_SIZE;
+  for(uint32_t i = 0; i < num_pages; i++) {
+    if(!this->dirty[i]) {
+      continue;
+    }
+
+    uint32_t searched = 0;
+    while(in_use[sector] && searched < this->pool_sectors) {
+      sector = (sector + 1) % this->pool_sectors;
+      searched++;
+    }
+
+    size_t offset = (EEA_SNAPSHOT_HEADER_SECTORS + sector) * EEA_SNAPSHOT_PAGE_SIZE;
+    if(in_use[sector] ||
+        esp_partition_erase_range(this->partition, offset, EEA_SNAPSHOT_PAGE_SIZE) != ESP_OK ||
+        esp_partition_write(this->partition, offset, this->pages + (i * EEA_SNAPSHOT_PAGE_SIZE), EEA_SNAPSHOT_PAGE_SIZE) != ESP_OK) {
+      ESP_LOGI(TAG, "Failed to write snapshot page %u.", i);
+      memcpy(this->header->page_sectors, committed, sizeof(committed));
+      return false;
+    }
+
+    in_use[sector] = true;
+    this->header->page_sectors[i] = sector;
+    sector = (sector + 1) % this->pool_sectors;
+  }
+
+  this->header->next_sector = sector;
+  if(!this->write_header()) {
+    memcpy(this->header->page_sectors, committed, sizeof(committed));
+    return false;
+  }
+
+  this->committed_pages = num_pages;
+  return true;
+}
+
+bool EEA_Snapshot::read_from_flash()
+{
+  if(!this->scan() || this->header->memory_size == 0) {
+    ESP_LOGI(TAG, "No snapshot found.");
+    return false;
+  }
+
+  if(this->restore_target == NULL ||
+      strncmp(this->header->bundle_id, this->restore_bundle_id, EEA_BUNDLE_ID_SIZE) != 0 ||
+      this->header->memory_size != this->restore_memory_size ||
+      this->header->num_globals != this->restore_num_globals) {
+    ESP_LOGI(TAG, "Snapshot is from bundle %s (%u bytes, %u globals). Not restoring.",
+      this->header->bundle_id, this->header->memory_size, this->header->num_globals);
+    return false;
+  }
+
+  // Pages are read into the capture buffer, so a failed read leaves
+  // linear memory untouched.
+  for(uint32_t i = 0; i < this->committed_pages; i++) {
+    uint8_t *page = this->pages + (i * EEA_SNAPSHOT_PAGE_SIZE);
+    size_t offset = (EEA_SNAPSHOT_HEADER_SECTORS + this->header->page_sectors[i]) * EEA_SNAPSHOT_PAGE_SIZE;
+    if(esp_partition_read(this->partition, offset, page, EEA_SNAPSHOT_PAGE_SIZE) != ESP_OK ||
+        esp_rom_crc32_le(0, page, EEA_SNAPSHOT_PAGE_SIZE) != this->header->page_crcs[i]) {
+      ESP_LOGI(TAG, "Failed to read snapshot page %u.", i);
+      this->crcs_valid = false;
+      return false;
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,135 @@
+#ifndef EEA_SNAPSHOT_H
+#define EEA_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+
+#include <wasm3.h>
+#include <m3_env.h>
+
+#define EEA_SNAPSHOT_PARTITION "eea_snap"
+#define EEA_SNAPSHOT_PAGE_SIZE 4096
+#define EEA_SNAPSHOT_MAX_PAGES 64
+#define EEA_SNAPSHOT_MAX_GLOBALS 64
+#define EEA_SNAPSHOT_HEADER_SECTORS 8
+#define EEA_SNAPSHOT_HEADER_SLOT_SIZE 1024
+
+struct EEA_Snapshot_Header;
+
+/**
+ * Persists a bundle's linear memory and mutable globals to the "eea_snap"
+ * flash partition, so workflow state survives a restart.
+ *
+ * capture() is called by the runtime task between eea_loop calls. It
+ * compares a CRC of each 4kb page with the CRC of the page in flash and
+ * copies only the changed pages. The copy is written to flash by a task
+ * with an internal RAM stack, so the runtime is not blocked by flash
+ * erases and writes.
+ *
+ * The partition is written log-structured, so no sector is erased on every
+ * write. EEA_SNAPSHOT_HEADER_SECTORS sectors at the start form a ring of
+ * 1kb header slots (bundle id, memory size, globals, page CRCs, and the
+ * sector holding each page). The rest is a pool of page sectors. A write
+ * puts each changed page in the next sector that the current header
+ * doesn't use, and then writes a header with a higher sequence number to
+ * the next slot. The newest header with a valid CRC is the snapshot, so an
+ * interrupted write leaves the previous snapshot in place.
+ */
+class EEA_Snapshot {
+  public:
+    EEA_Snapshot();
+
+    /**
+     * Captures the runtime's state if the previous capture has been written.
+     * Must be called from the runtime task at an eea_loop boundary.
+     */
+    void capture(IM3Runtime runtime, IM3Module module, const char *bundle_id);
+
+    /**
+     * Restores the snapshot into the runtime if it was taken from the same
+     * bundle with the same memory size. Blocks until flash has been read.
+     * Returns true if the state was restored. Must be called from the
+     * runtime task after eea_init.
+     */
+    bool restore(IM3Runtime runtime, IM3Module module, const char *bundle_id);
+
+    /**
+     * Discards the snapshot in flash, so it is never restored. Called when
+     * the bundle traps, since the captured state may be what made it trap.
+     * Capturing continues from the restarted bundle.
+     */
+    void invalidate();
+
+    // False if the partition is missing.
+    bool available;
+
+    // Statistics for the most recent capture and write.
+    uint32_t last_dirty_pages;
+    int64_t last_capture_us;
+    int64_t last_write_us;
+    uint32_t captures_skipped;
+
+  private:
+    const esp_partition_t *partition;
+    uint32_t pool_sectors;
+    uint32_t max_pages;
+
+    // Pages in the snapshot in flash, whose sectors are in use.
+    uint32_t committed_pages;
+
+    // The header slot the next header is written to.
+    uint32_t next_slot;
+
+    // The header as it is (or will be) in flash. The page CRCs describe the
+    // flash contents, which is what capture() compares against.
+    EEA_Snapshot_Header *header;
+    bool crcs_valid;
+
+    // Headers are read into this while the partition is scanned.
+    EEA_Snapshot_Header *scratch;
+
+    // Changed pages, at their offsets in linear memory.
+    uint8_t *pages;
+    bool dirty[EEA_SNAPSHOT_MAX_PAGES];
+
+    // Parameters and result of a restore, handed to the snapshot task.
+    uint8_t *restore_target;
+    uint32_t restore_memory_size;
+    const char *restore_bundle_id;
+    uint32_t restore_num_globals;
+    bool restore_result;
+
+    QueueHandle_t xQueueCommands;
+    SemaphoreHandle_t xRestoreDone;
+    TaskHandle_t xTaskHandle;
+    volatile bool busy;
+    volatile bool invalidating;
+
+    // Whether the last bundle checked was too large to snapshot.
+    bool unsupported;
+
+    /**
+     * Whether a bundle's memory and globals fit in a snapshot. Logs
+     * when they don't.
+     */
+    bool supported(uint8_t *memory, uint32_t memory_size, uint32_t num_globals);
+
+    /**
+     * Loads the newest valid header into header. Returns false if the
+     * partition holds no snapshot.
+     */
+    bool scan();
+    bool header_valid(EEA_Snapshot_Header *header);
+    bool write_header();
+    bool write_to_flash();
+    bool read_from_flash();
+
+    friend void eea_snapshot_task(void *pvParameters);
+};
+
+#endif
@@ -0,0 +1,221 @@
+/**
+ * Batched upload of eea_trace output. See eea_trace.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "eea_trace.h"
+#include "eea_memory.h"
+#include "eea_settings.h"
+
+static const char *TAG = "EEA_TRACE";
+
+// Each line in the ring is a header followed by the message bytes.
+// A header with length EEA_TRACE_WRAP means the next line is at the
+// start of the ring.
+struct EEA_Trace_Header
+{
+  uint32_t uptime_ms;
+  uint16_t length;
+  uint8_t level;
+};
+
+#define EEA_TRACE_HEADER_SIZE sizeof(EEA_Trace_Header)
+#define EEA_TRACE_WRAP 0xFFFF
+
+/**
+ * Writes a JSON string body (without quotes) for message. Returns the
+ * number of bytes written, or 0 if it doesn't fit in size bytes.
+ */
+static uint32_t json_escape(char *out, uint32_t size, const char *message, uint16_t length)
+{
+  uint32_t written = 0;
+
+  for(uint16_t i = 0; i < length; i++) {
+    unsigned char c = message[i];
+    char escaped[7];
+    uint32_t n;
+
+    if(c == '"' || c == '\\') {
+      escaped[0] = '\\';
+      escaped[1] = c;
+      n = 2;
+    } else if(c < 0x20) {
+      n = snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+    } else {
+      escaped[0] = c;
+      n = 1;
+    }
+
+    if(written + n >= size) {
+      return 0;
+    }
+    memcpy(out + written, escaped, n);
+    written += n;
+  }
+
+  return written;
+}
+
+EEA_Trace::EEA_Trace(QueueHandle_t xQueueMQTT)
+{
+  this->xQueueMQTT = xQueueMQTT;
+  this->msg = (EEA_Queue_Msg*)eea_malloc(EEA_MEM_RUNTIME, sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->ring = (uint8_t*)eea_malloc(EEA_MEM_RUNTIME, EEA_TRACE_BUFFER_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  this->head = 0;
+  this->tail = 0;
+  this->used = 0;
+  this->dropped = 0;
+  this->last_flush = 0;
+}
+
+void EEA_Trace::append(const char *message, uint32_t length, uint32_t level)
+{
+  if((int32_t)level > eea_setting(EEA_SETTING_TRACE_LEVEL)) {
+    return;
+  }
+
+#if EEA_TRACE_CONSOLE
+  ESP_LOGI(TAG, "%.*s", (int)length, message);
+#endif
+
+  if(this->ring == NULL) {
+    return;
+  }
+
+  if(length > EEA_TRACE_MAX_LINE) {
+    length = EEA_TRACE_MAX_LINE;
+  }
+
+  // Lines are contiguous. A line that doesn't fit before the end of the
+  // ring starts over at the beginning, and the space it skips is used.
+  if(this->used == 0) {
+    this->head = 0;
+    this->tail = 0;
+  }
+  uint32_t size = EEA_TRACE_HEADER_SIZE + length;
+  uint32_t skip = EEA_TRACE_BUFFER_SIZE - this->head < size ? EEA_TRACE_BUFFER_SIZE - this->head : 0;
+
+  if(this->used + skip + size > EEA_TRACE_BUFFER_SIZE) {
+    this->dropped++;
+    return;
+  }
+
+  if(skip > 0) {
+    if(skip >= EEA_TRACE_HEADER_SIZE) {
+      EEA_Trace_Header wrap = { 0, EEA_TRACE_WRAP, 0 };
+      memcpy(this->ring + this->head, &wrap, EEA_TRACE_HEADER_SIZE);
+    }
+    this->used += skip;
+    this->head = 0;
+  }
+
+  EEA_Trace_Header header = { (uint32_t)(esp_timer_get_time() / 1000), (uint16_t)length, (uint8_t)level };
+  memcpy(this->ring + this->head, &header, EEA_TRACE_HEADER_SIZE);
+  memcpy(this->ring + this->head + EEA_TRACE_HEADER_SIZE, message, length);
+  this->head = (this->head + size) % EEA_TRACE_BUFFER_SIZE;
+  this->used += size;
+}
+
+/**
+ * Reads the oldest line without removing it.
+ * Returns false if the ring is empty.
+ */
+bool EEA_Trace::read(uint32_t *uptime_ms, uint8_t *level, const char **message, uint16_t *length)
+{
+  if(this->used == 0) {
+    return false;
+  }
+
+  EEA_Trace_Header header;
+  uint32_t remaining = EEA_TRACE_BUFFER_SIZE - this->tail;
+  if(remaining >= EEA_TRACE_HEADER_SIZE) {
+    memcpy(&header, this->ring + this->tail, EEA_TRACE_HEADER_SIZE);
+  }
+
+  if(remaining < EEA_TRACE_HEADER_SIZE || header.length == EEA_TRACE_WRAP) {
+    this->used -= remaining;
+    this->tail = 0;
+    memcpy(&header, this->ring, EEA_TRACE_HEADER_SIZE);
+  }
+
+  *uptime_ms = header.uptime_ms;
+  *level = header.level;
+  *message = (const char*)(this->ring + this->tail + EEA_TRACE_HEADER_SIZE);
+  *length = header.length;
+  return true;
+}
+
+/**
+ * Removes the line returned by the last read.
+ */
+void EEA_Trace::consume()
+{
+  EEA_Trace_Header header;
+  memcpy(&header, this->ring + this->tail, EEA_TRACE_HEADER_SIZE);
+
+  uint32_t size = EEA_TRACE_HEADER_SIZE + header.length;
+  this->tail = (this->tail + size) % EEA_TRACE_BUFFER_SIZE;
+  this->used -= size;
+}
+
+void EEA_Trace::update(bool connected)
+{
+  if(!connected || this->msg == NULL || (this->used == 0 && this->dropped == 0) ||
+      esp_timer_get_time() - this->last_flush < EEA_TRACE_FLUSH_INTERVAL_MS * 1000LL) {
+    return;
+  }
+  this->last_flush = esp_timer_get_time();
+
+  char *payload = this->msg->payload;
+  uint32_t size = EEA_PAYLOAD_SIZE_BYTES;
+  uint32_t length = snprintf(payload, size, "{\"dropped\":%u,\"lines\":[", this->dropped);
+  this->dropped = 0;
+
+  // Leaves room for the closing "]}".
+  uint32_t lines = 0;
+  uint32_t uptime_ms;
+  uint8_t level;
+  const char *message;
+  uint16_t message_length;
+  while(this->read(&uptime_ms, &level, &message, &message_length)) {
+    char prefix[64];
+    uint32_t prefix_length = snprintf(prefix, sizeof(prefix), "%s{\"uptimeMs\":%u,\"level\":%u,\"message\":\"",
+      lines > 0 ? "," : "", uptime_ms, level);
+
+    if(length + prefix_length + 3 + 2 >= size) {
+      break;
+    }
+    uint32_t escaped = json_escape(payload + length + prefix_length, size - length - prefix_length - 3 - 2,
+      message, message_length);
+    if(escaped == 0 && message_length > 0) {
+      break;
+    }
+
+    memcpy(payload + length, prefix, prefix_length);
+    length += prefix_length + escaped;
+    memcpy(payload + length, "\"}", 2);
+    length += 2;
+
+    this->consume();
+    lines++;
+  }
+
+  memcpy(payload + length, "]}", 3);
+  length += 2;
+
+  this->msg->topic_length = snprintf(this->msg->topic, EEA_TOPIC_SIZE_BYTES, EEA_TRACE_TOPIC, LOSANT_DEVICE_ID);
+  this->msg->payload_length = length;
+  this->msg->qos = 0;
+  this->msg->received_at = 0;
+  this->msg->queued_at = 0;
+
+  if(xQueueSend(this->xQueueMQTT, this->msg, 0) != pdPASS) {
+    ESP_LOGI(TAG, "MQTT queue full. %u trace lines lost.", lines);
+  }
+}
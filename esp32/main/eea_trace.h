@@ -0,0 +1,61 @@
+#ifndef EEA_TRACE_H
+#define EEA_TRACE_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "eea_config.h"
+#include "eea_queue_msg.h"
+
+#define EEA_TRACE_TOPIC "losant/%s/fromAgent/debug"
+
+/**
+ * Collects eea_trace output and uploads it in batches.
+ *
+ * Lines are copied into a fixed PSRAM ring of EEA_TRACE_BUFFER_SIZE bytes,
+ * without allocating. Every EEA_TRACE_FLUSH_INTERVAL_MS, while connected,
+ * the buffered lines are published to EEA_TRACE_TOPIC as one JSON message:
+ *
+ *   {"dropped":0,"lines":[{"uptimeMs":1234,"level":1,"message":"..."}]}
+ *
+ * A batch is at most one MQTT payload, and lines that don't fit wait for
+ * the next batch, which caps the upload rate. Lines that arrive while the
+ * ring is full are dropped and counted in the next batch. Lines longer
+ * than EEA_TRACE_MAX_LINE bytes are truncated.
+ *
+ * Lines above the traceLevel setting are discarded on arrival.
+ * Used only from the runtime task.
+ */
+class EEA_Trace {
+  public:
+    EEA_Trace(QueueHandle_t xQueueMQTT);
+
+    /**
+     * Buffers a trace line.
+     */
+    void append(const char *message, uint32_t length, uint32_t level);
+
+    /**
+     * Publishes a batch if the flush interval has elapsed.
+     */
+    void update(bool connected);
+
+  private:
+    bool read(uint32_t *uptime_ms, uint8_t *level, const char **message, uint16_t *length);
+    void consume();
+
+    QueueHandle_t xQueueMQTT;
+    EEA_Queue_Msg *msg;
+
+    uint8_t *ring;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t used;
+
+    uint32_t dropped;
+    int64_t last_flush;
+};
+
+#endif
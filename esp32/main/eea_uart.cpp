@@ -0,0 +1,399 @@
+/**
+ * Serial sensor ingestion. See eea_uart.h.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "driver/uart.h"
+
+#include "eea_uart.h"
+#include "eea_bindings.h"
+#include "eea_memory.h"
+
+#define EEA_UART_TASK_SIZE 4096
+#define EEA_UART_TASK_PRIORITY 5
+#define EEA_UART_CORE 0
+#define EEA_UART_EVENT_QUEUE_LENGTH 16
+#define EEA_UART_CHUNK_SIZE 1024
+
+#define EEA_UART_SLOTS (EEA_UART_RECORDS + 1)
+
+static const char *TAG = "EEA_UART";
+
+void EEA_Uart::receive(const uint8_t *data, uint32_t length)
+{
+  if(this->records == NULL) {
+    return;
+  }
+
+  while(length > 0) {
+    EEA_Uart_Record *record = &(this->records[this->head]);
+
+    if(EEA_UART_FRAMING == EEA_UART_FRAMING_NEWLINE) {
+      const uint8_t *newline = (const uint8_t*)memchr(data, '\n', length);
+      uint32_t span = newline == NULL ? length : newline - data;
+
+      // The rest of an oversized record is skipped up to its newline.
+      if(!this->skipping) {
+        if(record->length + span > EEA_UART_MAX_RECORD) {
+          this->framing_errors++;
+          this->skipping = true;
+          record->length = 0;
+        } else {
+          memcpy(record->data + record->length, data, span);
+          record->length += span;
+        }
+      }
+
+      if(newline == NULL) {
+        return;
+      }
+      data += span + 1;
+      length -= span + 1;
+
+      if(this->skipping) {
+        this->skipping = false;
+        continue;
+      }
+      if(record->length > 0 && record->data[record->length - 1] == '\r') {
+        record->length--;
+      }
+      if(record->length > 0) {
+        this->publish();
+      }
+    } else {
+      if(this->header_length < 2) {
+        this->header[this->header_length++] = *data;
+        data++;
+        length--;
+
+        if(this->header_length == 2) {
+          this->expected = (this->header[0] << 8) | this->header[1];
+          record->length = 0;
+
+          // An impossible length means the stream is out of sync. The
+          // header is slid along by a byte until a plausible one is found.
+          if(this->expected == 0 || this->expected > EEA_UART_MAX_RECORD) {
+            this->framing_errors++;
+            this->header[0] = this->header[1];
+            this->header_length = 1;
+          }
+        }
+        continue;
+      }
+
+      uint32_t span = std::min(length, this->expected - record->length);
+      memcpy(record->data + record->length, data, span);
+      record->length += span;
+      data += span;
+      length -= span;
+
+      if(record->length == this->expected) {
+        this->header_length = 0;
+        this->publish();
+      }
+    }
+  }
+}
+
+/**
+ * Makes the assembled record readable, dropping the oldest unread record
+ * if the ring is full, and starts the next one.
+ */
+void EEA_Uart::publish()
+{
+  this->records[this->head].received_at = esp_timer_get_time();
+
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  if(this->pending == EEA_UART_RECORDS) {
+    this->tail = (this->tail + 1) % EEA_UART_SLOTS;
+    this->pending--;
+    this->dropped++;
+  }
+  this->pending++;
+  this->head = (this->head + 1) % EEA_UART_SLOTS;
+  xSemaphoreGive(this->lock);
+
+  this->records[this->head].length = 0;
+}
+
+void EEA_Uart::discard()
+{
+  if(this->records != NULL) {
+    this->records[this->head].length = 0;
+  }
+  this->header_length = 0;
+  this->skipping = EEA_UART_FRAMING == EEA_UART_FRAMING_NEWLINE;
+}
+
+void EEA_Uart::overrun()
+{
+  this->overruns++;
+  this->discard();
+}
+
+void EEA_Uart::line_error()
+{
+  this->framing_errors++;
+  this->discard();
+}
+
+int32_t EEA_Uart::read(uint8_t *buffer, uint32_t buffer_size, uint32_t *length, bool latest)
+{
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  if(this->pending == 0) {
+    xSemaphoreGive(this->lock);
+    *length = 0;
+    return 1;
+  }
+
+  uint32_t slot = latest ? (this->head + EEA_UART_SLOTS - 1) % EEA_UART_SLOTS : this->tail;
+  EEA_Uart_Record *record = &(this->records[slot]);
+  *length = record->length;
+  if(record->length > buffer_size) {
+    xSemaphoreGive(this->lock);
+    return 2;
+  }
+
+  memcpy(buffer, record->data, record->length);
+  if(latest) {
+    this->tail = this->head;
+    this->pending = 0;
+  } else {
+    this->tail = (this->tail + 1) % EEA_UART_SLOTS;
+    this->pending--;
+  }
+  xSemaphoreGive(this->lock);
+  return 0;
+}
+
+int32_t EEA_Uart::read_batch(uint8_t *buffer, uint32_t buffer_size, uint32_t *length)
+{
+  int32_t count = 0;
+  uint32_t used = 0;
+
+  xSemaphoreTake(this->lock, portMAX_DELAY);
+  while(this->pending > 0) {
+    EEA_Uart_Record *record = &(this->records[this->tail]);
+    if(used + sizeof(uint32_t) + record->length > buffer_size) {
+      break;
+    }
+
+    memcpy(buffer + used, &(record->length), sizeof(uint32_t));
+    memcpy(buffer + used + sizeof(uint32_t), record->data, record->length);
+    used += sizeof(uint32_t) + record->length;
+    count++;
+
+    this->tail = (this->tail + 1) % EEA_UART_SLOTS;
+    this->pending--;
+  }
+  xSemaphoreGive(this->lock);
+
+  *length = used;
+  return count;
+}
+
+void EEA_Uart::report()
+{
+  if(this->records == NULL) {
+    return;
+  }
+  ESP_LOGI(TAG, "%u records pending, %u overruns, %u framing errors, %u records dropped.",
+    this->pending, this->overruns, this->framing_errors, this->dropped);
+}
+
+#if EEA_UART_ENABLED
+/**
+ * Reads the UART as the driver signals data, and frames it into records.
+ */
+static void eea_uart_task(void *pvParameters)
+{
+  EEA_Uart *uart = (EEA_Uart*)pvParameters;
+  uint8_t chunk[EEA_UART_CHUNK_SIZE];
+  uart_event_t event;
+
+  while(true) {
+    if(xQueueReceive(uart->xQueueUart, &event, portMAX_DELAY) != pdPASS) {
+      continue;
+    }
+
+    switch(event.type) {
+      case UART_DATA: {
+        size_t buffered = 0;
+        uart_get_buffered_data_len(EEA_UART_PORT, &buffered);
+        while(buffered > 0) {
+          int read = uart_read_bytes(EEA_UART_PORT, chunk, std::min(buffered, sizeof(chunk)), 0);
+          if(read <= 0) {
+            break;
+          }
+          uart->receive(chunk, read);
+          buffered -= read;
+        }
+        break;
+      }
+      case UART_FIFO_OVF:
+      case UART_BUFFER_FULL:
+        // Bytes were lost, so the record in progress can't be trusted.
+        uart_flush_input(EEA_UART_PORT);
+        xQueueReset(uart->xQueueUart);
+        uart->overrun();
+        break;
+      case UART_FRAME_ERR:
+      case UART_PARITY_ERR:
+        uart->line_error();
+        break;
+      default:
+        break;
+    }
+  }
+}
+#endif
+
+/**
+ * Copies the oldest unread record from the serial sensor.
+ * Inputs:
+ *   buffer (Byte array): where to copy the record.
+ *   buffer_size (Int32): the size of the buffer.
+ *
+ * Outputs:
+ *   length (Int32): the length of the record.
+ *
+ * Returns 0 for success, 1 if there is no unread record, or 2 if the
+ * record is larger than the buffer (the record is kept).
+ */
+static int32_t eea_fn_uart_read(EEA_Host_Context ctx, EEA_Span<uint8_t> buffer, EEA_Out<uint32_t> length)
+{
+  EEA_Uart *uart = (EEA_Uart*)ctx.userdata;
+  uint32_t record_length = 0;
+  int32_t result = uart->read((uint8_t*)buffer.data, buffer.count, &record_length, false);
+  length.set(record_length);
+  return result;
+}
+
+/**
+ * Copies the newest record from the serial sensor, and discards every
+ * older unread record.
+ * Inputs:
+ *   buffer (Byte array): where to copy the record.
+ *   buffer_size (Int32): the size of the buffer.
+ *
+ * Outputs:
+ *   length (Int32): the length of the record.
+ *
+ * Returns 0 for success, 1 if there is no unread record, or 2 if the
+ * record is larger than the buffer (the records are kept).
+ */
+static int32_t eea_fn_uart_read_latest(EEA_Host_Context ctx, EEA_Span<uint8_t> buffer, EEA_Out<uint32_t> length)
+{
+  EEA_Uart *uart = (EEA_Uart*)ctx.userdata;
+  uint32_t record_length = 0;
+  int32_t result = uart->read((uint8_t*)buffer.data, buffer.count, &record_length, true);
+  length.set(record_length);
+  return result;
+}
+
+/**
+ * Copies as many unread records as fit, oldest first. Each record is
+ * preceded by its length (Int32).
+ * Inputs:
+ *   buffer (Byte array): where to copy the records.
+ *   buffer_size (Int32): the size of the buffer.
+ *
+ * Outputs:
+ *   length (Int32): the number of bytes copied.
+ *
+ * Returns the number of records copied.
+ */
+static int32_t eea_fn_uart_read_batch(EEA_Host_Context ctx, EEA_Span<uint8_t> buffer, EEA_Out<uint32_t> length)
+{
+  EEA_Uart *uart = (EEA_Uart*)ctx.userdata;
+  uint32_t batch_length = 0;
+  int32_t count = uart->read_batch((uint8_t*)buffer.data, buffer.count, &batch_length);
+  length.set(batch_length);
+  return count;
+}
+
+/**
+ * Gets the serial sensor's counters.
+ * Outputs:
+ *   pending (Int32): the number of unread records.
+ *   overruns (Int32): the number of times received bytes were lost.
+ *   framing_errors (Int32): the number of line errors and invalid or oversized records.
+ *   dropped (Int32): the number of records replaced before they were read.
+ *
+ * Always returns 0.
+ */
+static int32_t eea_fn_uart_stats(EEA_Host_Context ctx, EEA_Out<uint32_t> pending,
+  EEA_Out<uint32_t> overruns, EEA_Out<uint32_t> framing_errors, EEA_Out<uint32_t> dropped)
+{
+  EEA_Uart *uart = (EEA_Uart*)ctx.userdata;
+  pending.set(uart->pending);
+  overruns.set(uart->overruns);
+  framing_errors.set(uart->framing_errors);
+  dropped.set(uart->dropped);
+  return 0;
+}
+
+static const EEA_Host_Function eea_uart_functions[] = {
+  EEA_HOST_FUNCTION(eea_fn_uart_read),
+  EEA_HOST_FUNCTION(eea_fn_uart_read_latest),
+  EEA_HOST_FUNCTION(eea_fn_uart_read_batch),
+  EEA_HOST_FUNCTION(eea_fn_uart_stats)
+};
+
+EEA_Uart::EEA_Uart()
+{
+  this->pending = 0;
+  this->overruns = 0;
+  this->framing_errors = 0;
+  this->dropped = 0;
+  this->xQueueUart = NULL;
+  this->lock = xSemaphoreCreateMutex();
+  this->records = NULL;
+  this->head = 0;
+  this->tail = 0;
+  this->expected = 0;
+  this->header_length = 0;
+  this->skipping = false;
+
+#if EEA_UART_ENABLED
+  this->records = (EEA_Uart_Record*)eea_malloc(EEA_MEM_QUEUE, EEA_UART_SLOTS * sizeof(EEA_Uart_Record),
+    MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(this->records == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate the record ring.");
+    return;
+  }
+  this->records[0].length = 0;
+
+  uart_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.baud_rate = EEA_UART_BAUD_RATE;
+  config.data_bits = UART_DATA_8_BITS;
+  config.parity = UART_PARITY_DISABLE;
+  config.stop_bits = UART_STOP_BITS_1;
+  config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+  config.source_clk = UART_SCLK_APB;
+
+  ESP_ERROR_CHECK(uart_driver_install(EEA_UART_PORT, EEA_UART_RX_BUFFER_SIZE, 0,
+    EEA_UART_EVENT_QUEUE_LENGTH, &(this->xQueueUart), 0));
+  ESP_ERROR_CHECK(uart_param_config(EEA_UART_PORT, &config));
+  ESP_ERROR_CHECK(uart_set_pin(EEA_UART_PORT, EEA_UART_TX_PIN, EEA_UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+
+  TaskHandle_t task;
+  xTaskCreatePinnedToCore(eea_uart_task, "eea_uart_task", EEA_UART_TASK_SIZE, this,
+    EEA_UART_TASK_PRIORITY, &task, EEA_UART_CORE);
+  eea_memory_register_task(task, EEA_UART_TASK_SIZE);
+
+  ESP_LOGI(TAG, "Reading records from UART %d at %d baud.", EEA_UART_PORT, EEA_UART_BAUD_RATE);
+#endif
+}
+
+void EEA_Uart::add_host_functions(EEA_Engine *engine)
+{
+  engine->add_host_functions("env", eea_uart_functions,
+    sizeof(eea_uart_functions) / sizeof(eea_uart_functions[0]), this);
+}
@@ -0,0 +1,114 @@
+#ifndef EEA_UART_H
+#define EEA_UART_H
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "eea_config.h"
+#include "eea_engine.h"
+
+/**
+ * How records are delimited on the serial line.
+ */
+enum EEA_Uart_Framing {
+  EEA_UART_FRAMING_NEWLINE = 0,  // Records end with '\n'. A '\r' before it is removed.
+  EEA_UART_FRAMING_LENGTH = 1    // Each record is preceded by its length, 16-bit big-endian.
+};
+
+/**
+ * One received record.
+ */
+struct EEA_Uart_Record {
+  uint32_t length;
+  int64_t received_at;
+  uint8_t data[EEA_UART_MAX_RECORD];
+};
+
+/**
+ * Background ingestion of records from a serial sensor.
+ *
+ * When EEA_UART_ENABLED is set, a task reads EEA_UART_PORT through the UART
+ * driver's interrupt-filled ring buffer, splits the bytes into records
+ * (EEA_UART_FRAMING) and keeps the latest EEA_UART_RECORDS of them in
+ * PSRAM. Workflows copy records into their memory with the UART registered
+ * functions (see eea_uart.cpp), instead of polling the serial line from WASM.
+ *
+ * Records are assembled directly in a spare slot of the ring, which is
+ * published once complete. When the ring is full, the oldest unread record
+ * is dropped. Driver overruns, line and framing errors (including records
+ * longer than EEA_UART_MAX_RECORD) and dropped records are counted.
+ *
+ * Received on the UART task and read by the runtime task.
+ */
+class EEA_Uart {
+  public:
+    EEA_Uart();
+
+    /**
+     * Links the UART registered functions to a bundle's engine.
+     */
+    void add_host_functions(EEA_Engine *engine);
+
+    /**
+     * Splits received bytes into records.
+     */
+    void receive(const uint8_t *data, uint32_t length);
+
+    /**
+     * Counts lost bytes or a line error, and discards the record in progress.
+     */
+    void overrun();
+    void line_error();
+
+    /**
+     * Copies the oldest unread record into buffer and releases it. With
+     * latest, the newest record is copied instead and every unread record
+     * is released. Returns 0 on success, 1 if there is no record, or 2 if
+     * the record is larger than buffer_size (length is still set, and the
+     * record is kept).
+     */
+    int32_t read(uint8_t *buffer, uint32_t buffer_size, uint32_t *length, bool latest);
+
+    /**
+     * Copies as many unread records as fit into buffer, oldest first, each
+     * preceded by its 32-bit little-endian length, and releases them.
+     * Returns the number of records copied.
+     */
+    int32_t read_batch(uint8_t *buffer, uint32_t buffer_size, uint32_t *length);
+
+    /**
+     * Logs the counters.
+     */
+    void report();
+
+    uint32_t pending;
+    uint32_t overruns;
+    uint32_t framing_errors;
+    uint32_t dropped;
+
+    // Event queue of the UART driver.
+    QueueHandle_t xQueueUart;
+
+  private:
+    void publish();
+    void discard();
+
+    SemaphoreHandle_t lock;
+
+    // EEA_UART_RECORDS + 1 slots. Unread records are the pending slots
+    // from tail. The slot after them, head, is being assembled.
+    EEA_Uart_Record *records;
+    uint32_t head;
+    uint32_t tail;
+
+    // Framing state of the record being assembled.
+    uint32_t expected;
+    uint8_t header[2];
+    uint8_t header_length;
+    bool skipping;
+};
+
+#endif
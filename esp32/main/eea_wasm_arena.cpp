@@ -0,0 +1,170 @@
+/**
+ * PSRAM arena for wasm3 allocations. See eea_wasm_arena.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "eea_memory.h"
+#include "eea_wasm_arena.h"
+
+static const char *TAG = "EEA_WASM_ARENA";
+
+static EEA_Wasm_Arena *active_arena = NULL;
+
+EEA_Wasm_Arena::EEA_Wasm_Arena(size_t size)
+{
+  this->size = size;
+  this->reset_count = 0;
+  this->heap = NULL;
+
+  // One allocation for the lifetime of the device.
+  this->memory = (uint8_t*)eea_malloc(EEA_MEM_WASM, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if(this->memory == NULL) {
+    ESP_LOGI(TAG, "Failed to allocate %d byte arena.", size);
+    return;
+  }
+
+  reset();
+  this->reset_count = 0;
+}
+
+void *EEA_Wasm_Arena::malloc(size_t size)
+{
+  if(this->heap == NULL) {
+    return NULL;
+  }
+  return multi_heap_malloc(this->heap, size);
+}
+
+void *EEA_Wasm_Arena::calloc(size_t count, size_t size)
+{
+  size_t total = count * size;
+  if(size != 0 && total / size != count) {
+    return NULL;
+  }
+
+  void *ptr = this->malloc(total);
+  if(ptr != NULL) {
+    memset(ptr, 0, total);
+  }
+  return ptr;
+}
+
+void *EEA_Wasm_Arena::realloc(void *ptr, size_t size)
+{
+  if(this->heap == NULL) {
+    return NULL;
+  }
+  return multi_heap_realloc(this->heap, ptr, size);
+}
+
+void EEA_Wasm_Arena::free(void *ptr)
+{
+  if(this->heap != NULL) {
+    multi_heap_free(this->heap, ptr);
+  }
+}
+
+bool EEA_Wasm_Arena::contains(void *ptr)
+{
+  return this->memory != NULL &&
+    (uint8_t*)ptr >= this->memory && (uint8_t*)ptr < this->memory + this->size;
+}
+
+void EEA_Wasm_Arena::reset()
+{
+  if(this->memory == NULL) {
+    return;
+  }
+
+  // Registering the block again discards all of its allocations.
+  this->heap = multi_heap_register(this->memory, this->size);
+  this->free_after_reset = multi_heap_free_size(this->heap);
+  this->reset_count++;
+}
+
+size_t EEA_Wasm_Arena::in_use()
+{
+  if(this->heap == NULL) {
+    return 0;
+  }
+  return this->free_after_reset - multi_heap_free_size(this->heap);
+}
+
+size_t EEA_Wasm_Arena::high_water()
+{
+  if(this->heap == NULL) {
+    return 0;
+  }
+  return this->free_after_reset - multi_heap_minimum_free_size(this->heap);
+}
+
+void EEA_Wasm_Arena::report(const char *label)
+{
+  if(this->heap == NULL) {
+    return;
+  }
+
+  // The largest block in the arena itself, not in the general PSRAM heap.
+  multi_heap_info_t info;
+  multi_heap_get_info(this->heap, &info);
+
+  ESP_LOGI(TAG, "%s (deploy %u): in use %d, high-water %d, largest free block %d of %d bytes.",
+    label, this->reset_count,
+    this->in_use(),
+    this->high_water(),
+    info.largest_free_block,
+    this->size);
+}
+
+void eea_wasm_arena_activate(EEA_Wasm_Arena *arena)
+{
+  active_arena = arena;
+}
+
+/**
+ * Allocation hooks used by wasm3. Pointers are routed by address, so memory
+ * allocated before an arena was activated is still freed correctly.
+ */
+extern "C" void *eea_wasm_malloc(size_t size)
+{
+  if(active_arena != NULL) {
+    return active_arena->malloc(size);
+  }
+  return ::malloc(size);
+}
+
+extern "C" void *eea_wasm_calloc(size_t count, size_t size)
+{
+  if(active_arena != NULL) {
+    return active_arena->calloc(count, size);
+  }
+  return ::calloc(count, size);
+}
+
+extern "C" void *eea_wasm_realloc(void *ptr, size_t size)
+{
+  if(ptr == NULL) {
+    return eea_wasm_malloc(size);
+  }
+  if(active_arena != NULL && active_arena->contains(ptr)) {
+    return active_arena->realloc(ptr, size);
+  }
+  return ::realloc(ptr, size);
+}
+
+extern "C" void eea_wasm_free(void *ptr)
+{
+  if(ptr == NULL) {
+    return;
+  }
+  if(active_arena != NULL && active_arena->contains(ptr)) {
+    active_arena->free(ptr);
+    return;
+  }
+  ::free(ptr);
+}
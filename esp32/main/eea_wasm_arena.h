@@ -0,0 +1,76 @@
+#ifndef EEA_WASM_ARENA_H
+#define EEA_WASM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "multi_heap.h"
+
+/**
+ * A fixed block of PSRAM that backs every allocation made for a wasm bundle:
+ * the bundle bytes, the wasm3 environment, runtime, parsed module, compiled
+ * code and linear memory.
+ *
+ * wasm3 is built with its calloc/malloc/realloc/free calls routed to the
+ * eea_wasm_* hooks below (see main/CMakeLists.txt), which allocate from the
+ * active arena. Resetting the arena releases everything in one step, so the
+ * general heap is never fragmented by bundle deploys and every deploy starts
+ * from the same empty arena.
+ */
+class EEA_Wasm_Arena {
+  public:
+    EEA_Wasm_Arena(size_t size);
+
+    void *malloc(size_t size);
+    void *calloc(size_t count, size_t size);
+    void *realloc(void *ptr, size_t size);
+    void free(void *ptr);
+
+    /**
+     * Returns true if ptr was allocated from this arena.
+     */
+    bool contains(void *ptr);
+
+    /**
+     * Releases every allocation made from the arena.
+     */
+    void reset();
+
+    /**
+     * The bytes in use.
+     */
+    size_t in_use();
+
+    /**
+     * The most bytes in use at once since the last reset.
+     */
+    size_t high_water();
+
+    /**
+     * Logs the arena usage and high-water mark.
+     */
+    void report(const char *label);
+
+    size_t size;
+    uint32_t reset_count;
+
+  private:
+    uint8_t *memory;
+    multi_heap_handle_t heap;
+    size_t free_after_reset;
+};
+
+/**
+ * Makes the arena the target of the wasm3 allocation hooks.
+ * NULL routes wasm3 allocations back to the general heap.
+ */
+void eea_wasm_arena_activate(EEA_Wasm_Arena *arena);
+
+extern "C" {
+  void *eea_wasm_malloc(size_t size);
+  void *eea_wasm_calloc(size_t count, size_t size);
+  void *eea_wasm_realloc(void *ptr, size_t size);
+  void eea_wasm_free(void *ptr);
+}
+
+#endif
\ No newline at end of file
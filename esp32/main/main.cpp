@@ -9,11 +9,19 @@
 #include "esp_system.h"
 #include "esp_spi_flash.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "protocol_examples_common.h"
 
+#include "eea_config.h"
+#include "eea_memory.h"
 #include "eea_queue_msg.h"
 #include "eea_runtime.h"
 #include "eea_mqtt.h"
+#include "eea_conflate.h"
+#include "eea_latency.h"
+#include "eea_benchmark.h"
+#include "eea_settings.h"
 
 #define GPIO_OUTPUT_IO_RED 32
 #define GPIO_OUTPUT_IO_GREEN 12
@@ -29,35 +37,51 @@ extern "C" void app_main(void)
 
   ESP_ERROR_CHECK(nvs_flash_init());
   ESP_ERROR_CHECK(nvs_flash_init_partition("eea")); // Used to persist WASM bundles.
+  eea_settings_init();
   ESP_ERROR_CHECK(esp_netif_init());
   ESP_ERROR_CHECK(esp_event_loop_create_default());
 
-  // Connect to WiFi.
-  // The simple example_connect() function does not handle timeouts, does not
-  // gracefully handle various error conditions, and is only suited for use in examples.
-  // When developing real applications, this helper function needs to be replaced with
-  // full Wi-Fi / Ethernet connection handling code.
-  // Details: https://github.com/espressif/esp-idf/tree/master/examples/protocols
-  ESP_ERROR_CHECK(example_connect());
+#if EEA_BENCHMARK_ENABLED
+  eea_benchmark_run();
+#endif
 
   // Create the queues so the MQTT task can communicate with the EEA task.
   // Allocating queue memory from SPIRAM. The normal MQTT message queues
-  // will hold 10 messages. The flows queue will hold 1 (since those are very large).
+  // hold queueLength messages (10 by default, see eea_settings.h). If
+  // PSRAM can't hold that many, the default length is used instead.
+  // The flows queue will hold 1 (since those are very large).
   ESP_LOGI(TAG, "Creating FreeRTOS queues.");
   StaticQueue_t xStaticQueueMQTT;
   StaticQueue_t xStaticQueueEEA;
   StaticQueue_t xStaticQueueFlows;
 
-  uint8_t *mqtt_queue_buffer = (uint8_t*)heap_caps_malloc(10 * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-  uint8_t *eea_queue_buffer = (uint8_t*)heap_caps_malloc(10 * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-  uint8_t *flows_queue_buffer = (uint8_t*)heap_caps_malloc(1 * sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  uint32_t queue_length = eea_setting(EEA_SETTING_QUEUE_LENGTH);
+  uint8_t *mqtt_queue_buffer = (uint8_t*)eea_malloc(EEA_MEM_QUEUE, queue_length * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  uint8_t *eea_queue_buffer = (uint8_t*)eea_malloc(EEA_MEM_QUEUE, queue_length * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  if((mqtt_queue_buffer == NULL || eea_queue_buffer == NULL) && queue_length > EEA_QUEUE_LENGTH) {
+    ESP_LOGE(TAG, "Failed to allocate queues of %u messages. Using %u.", queue_length, EEA_QUEUE_LENGTH);
+    eea_free(mqtt_queue_buffer);
+    eea_free(eea_queue_buffer);
+    queue_length = EEA_QUEUE_LENGTH;
+    mqtt_queue_buffer = (uint8_t*)eea_malloc(EEA_MEM_QUEUE, queue_length * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    eea_queue_buffer = (uint8_t*)eea_malloc(EEA_MEM_QUEUE, queue_length * sizeof(EEA_Queue_Msg), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+
+  uint8_t *flows_queue_buffer = (uint8_t*)eea_malloc(EEA_MEM_QUEUE, 1 * sizeof(EEA_Queue_Msg_Flow), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  // xQueueCreateStatic asserts on a NULL buffer. Nothing can run without the queues.
+  if(mqtt_queue_buffer == NULL || eea_queue_buffer == NULL || flows_queue_buffer == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate queue memory.");
+    ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+  }
 
   QueueHandle_t xQueueMQTT;
   QueueHandle_t xQueueEEA;
   QueueHandle_t xQueueFlows;
 
-  xQueueMQTT = xQueueCreateStatic(10, sizeof(EEA_Queue_Msg), mqtt_queue_buffer, &xStaticQueueMQTT);
-  xQueueEEA = xQueueCreateStatic(10, sizeof(EEA_Queue_Msg), eea_queue_buffer, &xStaticQueueEEA);
+  xQueueMQTT = xQueueCreateStatic(queue_length, sizeof(EEA_Queue_Msg), mqtt_queue_buffer, &xStaticQueueMQTT);
+  xQueueEEA = xQueueCreateStatic(queue_length, sizeof(EEA_Queue_Msg), eea_queue_buffer, &xStaticQueueEEA);
   xQueueFlows = xQueueCreateStatic(1, sizeof(EEA_Queue_Msg_Flow), flows_queue_buffer, &xStaticQueueFlows);
 
   if( xQueueMQTT == NULL || xQueueEEA == NULL || xQueueFlows == NULL)
@@ -65,14 +89,55 @@ extern "C" void app_main(void)
     ESP_LOGI(TAG, "Failed to create queues.");
   }
 
+  // The runtime starts before the network so the persisted bundle runs
+  // offline. It sees eea_set_connection_status(false) until MQTT connects,
+  // and messages it sends wait in xQueueMQTT until then.
   ESP_LOGI(TAG, "Initializing EEA Runtime.");
-  EEA_Runtime eea_runtime(xQueueMQTT, xQueueEEA, xQueueFlows);
+  EEA_Conflator conflator;
+  EEA_Runtime eea_runtime(xQueueMQTT, xQueueEEA, xQueueFlows, &conflator);
+
+  // Connect to WiFi.
+  // The simple example_connect() function does not handle timeouts, does not
+  // gracefully handle various error conditions, and is only suited for use in examples.
+  // When developing real applications, this helper function needs to be replaced with
+  // full Wi-Fi / Ethernet connection handling code.
+  // Details: https://github.com/espressif/esp-idf/tree/master/examples/protocols
+  // This blocks until an IP address is obtained, while the bundle keeps running.
+  esp_err_t err = example_connect();
+  if(err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to connect to the network: %s", esp_err_to_name(err));
+  } else {
+    ESP_LOGI(TAG, "[BOOT] Network connected %lld ms after boot.", esp_timer_get_time() / 1000);
+  }
 
   ESP_LOGI(TAG, "Initializing EEA MQTT.");
-  EEA_MQTT eea_mqtt(xQueueMQTT, xQueueEEA, xQueueFlows);
+  EEA_MQTT eea_mqtt(xQueueMQTT, xQueueEEA, xQueueFlows, &conflator);
+
+  eea_memory_register_task(xTaskGetCurrentTaskHandle(), CONFIG_ESP_MAIN_TASK_STACK_SIZE);
+
+  // Headroom left for the buffers bundles and registered functions allocate.
+  ESP_LOGI(TAG, "[BOOT] PSRAM: %u of %u bytes free after startup (largest block %u). Bundle arena: %u bytes.",
+    heap_caps_get_free_size(MALLOC_CAP_SPIRAM), heap_caps_get_total_size(MALLOC_CAP_SPIRAM),
+    heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM), eea_runtime.wasm_arena->size);
+
+  // Periodically report memory usage so buffer and stack sizes
+  // can be tuned from measurements.
+  int64_t last_memory_report = 0;
 
   const TickType_t xDelay = 100 / portTICK_PERIOD_MS;
   while(true) {
+    int32_t report_interval_ms = eea_setting(EEA_SETTING_MEMORY_REPORT_MS);
+    if(report_interval_ms > 0 &&
+        esp_timer_get_time() - last_memory_report >= report_interval_ms * 1000LL) {
+      last_memory_report = esp_timer_get_time();
+      eea_memory_report();
+      eea_runtime.wasm_arena->report("Arena");
+      eea_runtime.budget->report();
+      conflator.report();
+      eea_runtime.uart->report();
+      eea_runtime.loopback->report();
+      eea_latency_report(xQueueMQTT);
+    }
     vTaskDelay(xDelay);
   }
 }
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Creates a CA and a server certificate for the local test broker.
+# The server certificate is issued for the host name or IP address given
+# as the first argument, which must match EEA_BROKER_URL.
+#
+#   ./make_certs.sh 192.168.1.10
+#   cp certs/ca.pem ../main/root_ca.pem
+set -e
+
+HOST=${1:?usage: make_certs.sh <broker host or ip>}
+
+mkdir -p certs data
+cd certs
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+  -subj "/CN=EEA Test CA" -keyout ca.key -out ca.pem
+
+case "$HOST" in
+  *[!0-9.]*) SAN="DNS:$HOST" ;;
+  *) SAN="IP:$HOST" ;;
+esac
+
+openssl req -newkey rsa:2048 -nodes -subj "/CN=$HOST" \
+  -keyout server.key -out server.csr
+printf "subjectAltName=%s\n" "$SAN" > server.ext
+openssl x509 -req -in server.csr -CA ca.pem -CAkey ca.key -CAcreateserial \
+  -days 365 -extfile server.ext -out server.pem
+
+rm server.csr server.ext
+echo "Run: mosquitto -c mosquitto.conf (from $(dirname "$(pwd)"))"
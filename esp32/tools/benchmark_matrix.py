@@ -0,0 +1,130 @@
+#!/usr/bin/env python
+"""
+Builds the firmware once for each wasm3 build variant (optimization level,
+IRAM or flash placement, backtrace recording) and reports the wasm3 code
+size of each. With a serial port, each build is also flashed and the
+benchmark suite (main/eea_benchmark*.cpp) is run on the device.
+
+  python benchmark_matrix.py [-p /dev/ttyUSB0] [--only O3-iram-bt ...]
+
+Run from the esp32 directory with the ESP-IDF environment exported.
+Builds go to build_bench/<variant>. Results are printed as a markdown table.
+"""
+
+import argparse
+import itertools
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+OPTIMIZATIONS = ['-O2', '-O3', '-Os']
+PLACEMENTS = [('iram', 'ON'), ('flash', 'OFF')]
+BACKTRACES = [('bt', 'ON'), ('nobt', 'OFF')]
+
+# Benchmark log lines and the columns they fill.
+PATTERNS = [
+    ('instructions/s', re.compile(r'Compute kernel \(wasm3\): .* (\d+) instructions/s')),
+    ('JSON scan us', re.compile(r'JSON payload of .* \(wasm3\): WASM (\d+) us')),
+    ('eea-api load us', re.compile(r'Lifecycle eea-api \(\d+ bytes, wasm3, \d+ cycles\): load (\d+) us')),
+    ('hello-world load us', re.compile(r'Lifecycle hello-world \(\d+ bytes, wasm3, \d+ cycles\): load (\d+) us')),
+    ('eea_loop ns', re.compile(r'hello-world eea_loop \(wasm3\): .* (\d+) ns/call')),
+]
+
+BENCHMARK_TIMEOUT_S = 120
+
+
+def variants():
+    for opt, (placement, iram), (bt, backtraces) in itertools.product(OPTIMIZATIONS, PLACEMENTS, BACKTRACES):
+        name = '%s-%s-%s' % (opt.lstrip('-'), placement, bt)
+        defines = [
+            '-DEEA_BENCHMARK=ON',
+            '-DEEA_WASM3_OPTIMIZATION=%s' % opt,
+            '-DEEA_WASM3_IN_IRAM=%s' % iram,
+            '-DEEA_WASM3_BACKTRACES=%s' % backtraces,
+        ]
+        yield name, defines
+
+
+def build(name, defines):
+    build_dir = os.path.join('build_bench', name)
+    subprocess.check_call(['idf.py', '-B', build_dir] + defines + ['build'])
+    return build_dir
+
+
+def wasm3_size(build_dir):
+    """
+    Returns the IRAM and flash bytes used by libm3.a.
+    """
+    size_tool = os.path.join(os.environ['IDF_PATH'], 'tools', 'idf_size.py')
+    output = subprocess.check_output([sys.executable, size_tool, '--archives', '--json',
+                                      os.path.join(build_dir, 'hello_world.map')])
+    sections = json.loads(output).get('libm3.a', {})
+
+    iram = sum(size for section, size in sections.items() if 'iram' in section)
+    flash = sum(size for section, size in sections.items() if 'flash' in section)
+    return iram, flash
+
+
+def run_benchmarks(build_dir, port):
+    """
+    Flashes the build and collects the benchmark results from the console.
+    """
+    import serial
+
+    subprocess.check_call(['idf.py', '-B', build_dir, '-p', port, 'flash'])
+
+    results = {}
+    deadline = time.time() + BENCHMARK_TIMEOUT_S
+    with serial.Serial(port, 115200, timeout=1) as console:
+        # Reset the board so the benchmarks are captured from the start.
+        console.setDTR(False)
+        console.setRTS(True)
+        time.sleep(0.1)
+        console.setRTS(False)
+
+        while time.time() < deadline:
+            line = console.readline().decode('utf-8', 'replace')
+            for column, pattern in PATTERNS:
+                match = pattern.search(line)
+                if match:
+                    results[column] = match.group(1)
+            # The lifecycle benchmark runs last, from the runtime task.
+            if 'Bundle lifecycle benchmark complete.' in line:
+                break
+
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('-p', '--port', help='serial port of the board; sizes only if omitted')
+    parser.add_argument('--only', nargs='*', help='variants to run, e.g. O3-iram-bt')
+    args = parser.parse_args()
+
+    columns = ['variant', 'IRAM bytes', 'flash bytes']
+    if args.port:
+        columns += [column for column, _ in PATTERNS]
+
+    rows = []
+    for name, defines in variants():
+        if args.only and name not in args.only:
+            continue
+
+        build_dir = build(name, defines)
+        iram, flash = wasm3_size(build_dir)
+        row = {'variant': name, 'IRAM bytes': str(iram), 'flash bytes': str(flash)}
+        if args.port:
+            row.update(run_benchmarks(build_dir, args.port))
+        rows.append(row)
+
+    print('| ' + ' | '.join(columns) + ' |')
+    print('|' + '---|' * len(columns))
+    for row in rows:
+        print('| ' + ' | '.join(row.get(column, '-') for column in columns) + ' |')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+"""
+Creates a delta bundle (see main/eea_bundle.h) that rebuilds target.wasm
+from base.wasm, the bundle currently running on the device.
+
+  python make_delta.py <base bundle id> base.wasm target.wasm > target.eead
+
+Both modules must be uncompressed WASM. Matching is done on 32 byte
+blocks of the base, which finds the unchanged functions and data
+segments in a redeployed bundle.
+"""
+
+import hashlib
+import struct
+import sys
+
+BLOCK_SIZE = 32
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+
+def make_delta(base_id, base, target):
+    base_id = base_id.encode('utf-8')
+    if len(base_id) > 127:
+        raise ValueError('bundle id is too long')
+
+    out = bytearray(b'EEAD')
+    out += struct.pack('<BB', 1, len(base_id))
+    out += base_id
+    out += struct.pack('<I', len(target))
+    out += hashlib.sha256(target).digest()
+
+    blocks = {}
+    for offset in range(0, len(base) - BLOCK_SIZE + 1):
+        blocks.setdefault(base[offset:offset + BLOCK_SIZE], offset)
+
+    pending = bytearray()
+    i = 0
+    while i < len(target):
+        offset = blocks.get(bytes(target[i:i + BLOCK_SIZE]))
+        if offset is None:
+            pending.append(target[i])
+            i += 1
+            continue
+
+        length = BLOCK_SIZE
+        while (i + length < len(target) and offset + length < len(base)
+               and target[i + length] == base[offset + length]):
+            length += 1
+
+        if pending:
+            out += struct.pack('<BI', OP_INSERT, len(pending)) + pending
+            pending = bytearray()
+        out += struct.pack('<BII', OP_COPY, offset, length)
+        i += length
+
+    if pending:
+        out += struct.pack('<BI', OP_INSERT, len(pending)) + pending
+
+    return bytes(out)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 4:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+
+    with open(sys.argv[2], 'rb') as f:
+        base = f.read()
+    with open(sys.argv[3], 'rb') as f:
+        target = f.read()
+
+    delta = make_delta(sys.argv[1], base, target)
+    sys.stderr.write('%d byte delta for a %d byte bundle\n' % (len(delta), len(target)))
+    sys.stdout.buffer.write(delta) if hasattr(sys.stdout, 'buffer') else sys.stdout.write(delta)
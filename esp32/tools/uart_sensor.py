@@ -0,0 +1,70 @@
+#!/usr/bin/env python
+"""
+Simulates a serial sensor for the UART ingestion in main/eea_uart.h.
+Writes records of comma-separated samples to a serial port, framed the
+way EEA_UART_FRAMING expects.
+
+  python uart_sensor.py /dev/ttyUSB0 --framing newline --size 4096 --rate 20
+
+With "pty" as the port, a pseudo-terminal is opened instead and its name
+is printed, so the framing can be exercised on a host (e.g. with
+`cat <name>`). Serial ports require pyserial.
+"""
+
+import argparse
+import os
+import random
+import struct
+import sys
+import time
+
+
+def make_record(size):
+    samples = []
+    length = 0
+    while length < size:
+        sample = str(random.randint(-2048, 2047))
+        samples.append(sample)
+        length += len(sample) + 1
+    return ','.join(samples).encode('ascii')[:size]
+
+
+def frame(record, framing):
+    if framing == 'newline':
+        return record + b'\r\n'
+    if len(record) > 0xffff:
+        raise ValueError('record is too long')
+    return struct.pack('>H', len(record)) + record
+
+
+def open_port(port, baud):
+    if port == 'pty':
+        master, slave = os.openpty()
+        sys.stderr.write('Writing to %s\n' % os.ttyname(slave))
+        return lambda data: os.write(master, data)
+
+    import serial
+    connection = serial.Serial(port, baud)
+    return connection.write
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulates a serial sensor.')
+    parser.add_argument('port', help='serial port, or "pty"')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--framing', choices=['newline', 'length'], default='newline')
+    parser.add_argument('--size', type=int, default=256, help='record size in bytes')
+    parser.add_argument('--rate', type=float, default=10, help='records per second')
+    parser.add_argument('--count', type=int, default=0, help='records to send, 0 for no limit')
+    args = parser.parse_args()
+
+    write = open_port(args.port, args.baud)
+    sent = 0
+    while args.count == 0 or sent < args.count:
+        write(frame(make_record(args.size), args.framing))
+        sent += 1
+        time.sleep(1.0 / args.rate)
+
+
+if __name__ == '__main__':
+    main()